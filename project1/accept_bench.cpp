@@ -0,0 +1,105 @@
+/*
+** accept_bench.cpp -- connection rate benchmark for the grep server
+**
+** Every client thread opens a connection, sends an empty request (which the
+** server closes right away) and waits for the close, as fast as it can.
+** Compare "./server 1" with "./server N" to see accept throughput scale with cores.
+** With GREP_FILE, one more thread keeps the server grepping that log (a path on the
+** server) all along, to see whether a long grep holds up the connections.
+*/
+
+#include "common.cpp"
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#define SERVER_PORT "8200"
+
+static const char* bench_host;
+static const char* bench_grep_file;
+static volatile bool bench_running = true;
+
+struct bench_result {
+  long long connections;
+  long long failures;
+};
+
+void* connect_loop(void* arg) {
+  bench_result* result = (bench_result*) arg;
+  char buf[64];
+  while (bench_running) {
+    int fd = connect_to_host(bench_host, SERVER_PORT);
+    if (fd == -1) {
+      ++result->failures;
+      continue;
+    }
+    shutdown(fd, SHUT_WR);
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    close(fd);
+    ++result->connections;
+  }
+  return NULL;
+}
+
+// send one grep request after another, count the complete responses
+void* grep_loop(void* arg) {
+  bench_result* result = (bench_result*) arg;
+  string request = string("grep e ") + bench_grep_file;
+  char buf[4096];
+  while (bench_running) {
+    int fd = connect_to_host(bench_host, SERVER_PORT);
+    if (fd == -1) {
+      ++result->failures;
+      continue;
+    }
+    write_all_to_socket(fd, request.c_str(), request.size());
+    shutdown(fd, SHUT_WR);
+    while (read(fd, buf, sizeof(buf)) > 0) {}
+    close(fd);
+    ++result->connections;
+  }
+  return NULL;
+}
+
+// ./accept_bench [HOST] [THREADS] [SECONDS] [GREP_FILE]
+int main(int argc, char *argv[]) {
+  bench_host = argc > 1 ? argv[1] : "127.0.0.1";
+  int threads = argc > 2 ? atoi(argv[2]) : 8;
+  int seconds = argc > 3 ? atoi(argv[3]) : 5;
+  bench_grep_file = argc > 4 ? argv[4] : NULL;
+  if (threads <= 0 || seconds <= 0) {
+    fprintf(stderr, "usage: ./accept_bench [HOST] [THREADS] [SECONDS] [GREP_FILE]\n");
+    exit(1);
+  }
+
+  vector<pthread_t> tids(threads);
+  vector<bench_result> results(threads);
+  pthread_t grep_tid;
+  bench_result grep_result = {0, 0};
+  long long start_us = now_us();
+  if (bench_grep_file != NULL)
+    pthread_create(&grep_tid, NULL, grep_loop, &grep_result);
+  for (int i = 0; i < threads; ++i)
+    pthread_create(&tids[i], NULL, connect_loop, &results[i]);
+
+  sleep(seconds);
+  bench_running = false;
+
+  long long connections = 0, failures = 0;
+  for (int i = 0; i < threads; ++i) {
+    pthread_join(tids[i], NULL);
+    connections += results[i].connections;
+    failures += results[i].failures;
+  }
+  double elapsed = (now_us() - start_us) / 1e6;
+  if (bench_grep_file != NULL)
+    pthread_join(grep_tid, NULL);
+
+  printf("%d client threads, %.1f s: %lld connections (%.0f/s), %lld failed connects\n",
+    threads, elapsed, connections, connections / elapsed, failures);
+  if (bench_grep_file != NULL)
+    printf("meanwhile %lld greps of %s\n", grep_result.connections, bench_grep_file);
+  return 0;
+}
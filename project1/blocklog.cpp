@@ -0,0 +1,169 @@
+/*
+** blocklog.cpp -- seekable block-compressed log files
+**
+** A ".blk" log is a sequence of independently deflated blocks followed by an
+** offset index and a fixed size footer:
+**
+**   [block 0][block 1]...[block n-1]
+**   [index: n * { u64 offset, u32 compressed length, u32 raw length }]
+**   [footer: u64 index offset, u32 block count, "BLK1"]
+**
+** All integers are little endian. Blocks are cut at line boundaries, so every
+** block can be decompressed and grepped on its own.
+*/
+
+#include <zlib.h>
+#include <vector>
+
+using std::vector;
+
+#define BLOCK_LOG_SUFFIX ".blk"
+#define BLOCK_LOG_MAGIC "BLK1"
+#define BLOCK_LOG_BLOCK_SIZE (1 << 20)   // raw bytes per block
+#define BLOCK_INDEX_ENTRY_SIZE 16
+#define BLOCK_FOOTER_SIZE 16
+
+struct block_index_entry {
+  uint64_t offset;            // file offset of the compressed block
+  uint32_t compressed_len;
+  uint32_t raw_len;
+};
+
+void put_u32(char* p, uint32_t v) {
+  for (int i = 0; i < 4; ++i)
+    p[i] = (char) ((v >> (8 * i)) & 0xff);
+}
+
+void put_u64(char* p, uint64_t v) {
+  for (int i = 0; i < 8; ++i)
+    p[i] = (char) ((v >> (8 * i)) & 0xff);
+}
+
+uint32_t get_u32(const char* p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; --i)
+    v = (v << 8) | (unsigned char) p[i];
+  return v;
+}
+
+uint64_t get_u64(const char* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i)
+    v = (v << 8) | (unsigned char) p[i];
+  return v;
+}
+
+// read exactly count bytes at offset, return false on short read or error
+bool pread_all(int fd, char* buffer, size_t count, off_t offset) {
+  size_t done = 0;
+  while (done < count) {
+    ssize_t ret = pread(fd, buffer + done, count - done, offset + done);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    done += ret;
+  }
+  return true;
+}
+
+// load the block index of an opened ".blk" file
+// return false if the file is not a valid block log
+bool read_block_index(int fd, vector<block_index_entry>& index) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < BLOCK_FOOTER_SIZE)
+    return false;
+
+  char footer[BLOCK_FOOTER_SIZE];
+  if (!pread_all(fd, footer, BLOCK_FOOTER_SIZE, st.st_size - BLOCK_FOOTER_SIZE))
+    return false;
+  if (memcmp(footer + 12, BLOCK_LOG_MAGIC, 4) != 0)
+    return false;
+
+  uint64_t index_offset = get_u64(footer);
+  uint32_t block_count = get_u32(footer + 8);
+  if (index_offset + (uint64_t) block_count * BLOCK_INDEX_ENTRY_SIZE + BLOCK_FOOTER_SIZE != (uint64_t) st.st_size)
+    return false;
+
+  vector<char> raw(block_count * BLOCK_INDEX_ENTRY_SIZE);
+  if (block_count > 0 && !pread_all(fd, raw.data(), raw.size(), index_offset))
+    return false;
+
+  index.resize(block_count);
+  for (uint32_t i = 0; i < block_count; ++i) {
+    const char* p = raw.data() + i * BLOCK_INDEX_ENTRY_SIZE;
+    index[i].offset = get_u64(p);
+    index[i].compressed_len = get_u32(p + 8);
+    index[i].raw_len = get_u32(p + 12);
+  }
+  return true;
+}
+
+// read and inflate one block into `out`, return false on error
+bool decompress_block(int fd, const block_index_entry& entry, vector<char>& compressed, vector<char>& out) {
+  compressed.resize(entry.compressed_len);
+  out.resize(entry.raw_len);
+  if (!pread_all(fd, compressed.data(), entry.compressed_len, entry.offset))
+    return false;
+
+  uLongf out_len = entry.raw_len;
+  if (uncompress((Bytef*) out.data(), &out_len, (const Bytef*) compressed.data(), entry.compressed_len) != Z_OK)
+    return false;
+  return out_len == entry.raw_len;
+}
+
+// compress the plain log `in` into the block log `out`, cutting blocks at line ends
+// return number of blocks written, -1 on error
+int write_block_log(FILE* in, FILE* out, size_t block_size) {
+  vector<block_index_entry> index;
+  vector<char> raw(block_size);
+  vector<char> compressed(compressBound(block_size));
+  size_t carry = 0;     // bytes of an unfinished line kept for the next block
+  uint64_t offset = 0;
+
+  while (1) {
+    size_t len = carry + fread(raw.data() + carry, 1, block_size - carry, in);
+    if (len == 0)
+      break;
+
+    // cut after the last newline unless the block holds a single huge line or the file ended
+    size_t cut = len;
+    if (len == block_size) {
+      for (size_t i = len; i > 0; --i) {
+        if (raw[i - 1] == '\n') {
+          cut = i;
+          break;
+        }
+      }
+    }
+
+    uLongf compressed_len = compressed.size();
+    if (compress2((Bytef*) compressed.data(), &compressed_len, (const Bytef*) raw.data(), cut, Z_DEFAULT_COMPRESSION) != Z_OK)
+      return -1;
+    if (fwrite(compressed.data(), 1, compressed_len, out) != compressed_len)
+      return -1;
+
+    index.push_back({offset, (uint32_t) compressed_len, (uint32_t) cut});
+    offset += compressed_len;
+
+    carry = len - cut;
+    memmove(raw.data(), raw.data() + cut, carry);
+  }
+
+  char entry[BLOCK_INDEX_ENTRY_SIZE];
+  for (const block_index_entry& e : index) {
+    put_u64(entry, e.offset);
+    put_u32(entry + 8, e.compressed_len);
+    put_u32(entry + 12, e.raw_len);
+    fwrite(entry, 1, BLOCK_INDEX_ENTRY_SIZE, out);
+  }
+
+  char footer[BLOCK_FOOTER_SIZE];
+  put_u64(footer, offset);
+  put_u32(footer + 8, index.size());
+  memcpy(footer + 12, BLOCK_LOG_MAGIC, 4);
+  if (fwrite(footer, 1, BLOCK_FOOTER_SIZE, out) != BLOCK_FOOTER_SIZE)
+    return -1;
+
+  return index.size();
+}
@@ -11,11 +11,13 @@
 using std::string;
 
 
-// ./client grep [OPTIONS] PATTERN
+// ./client [--timing] grep [OPTIONS] PATTERN
+// ./client [--timing] correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN
 int main(int argc, char *argv[])
 {
 	if (argc < 3) {
-    fprintf(stderr, "Usage: ./client grep [OPTIONS] PATTERN\n");
+    fprintf(stderr, "Usage: ./client [--timing] grep [OPTIONS] PATTERN\n");
+    fprintf(stderr, "       ./client [--timing] correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN\n");
 		fprintf(stderr, "Use '\\' to escape quotation marks\n");
 		fprintf(stderr, "For example: ./client grep \\'^Hello\\'\n");
     exit(1);
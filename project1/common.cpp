@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <sys/file.h>
 #include <time.h>
+#include <sys/stat.h>
 
 
 // connect to a server on port
@@ -136,3 +137,10 @@ ssize_t write_all_to_socket(int socket, const char *buffer, ssize_t count) {
 
   return count;
 }
+
+// microseconds on a monotonic clock, used to time the spans of a query
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
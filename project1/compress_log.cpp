@@ -0,0 +1,40 @@
+/* 
+** compress_log.cpp -- convert a plain log into a block log the server can grep
+*/
+
+#include "common.cpp"
+#include "blocklog.cpp"
+#include <string>
+
+using std::string;
+
+
+// ./compress_log LOGFILE, writes LOGFILE.blk
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: ./compress_log LOGFILE\n");
+    exit(1);
+  }
+
+  FILE* in = fopen(argv[1], "r");
+  if (in == NULL) {
+    perror(argv[1]); exit(1);
+  }
+
+  string out_path = string(argv[1]) + BLOCK_LOG_SUFFIX;
+  FILE* out = fopen(out_path.c_str(), "w");
+  if (out == NULL) {
+    perror(out_path.c_str()); exit(1);
+  }
+
+  int blocks = write_block_log(in, out, BLOCK_LOG_BLOCK_SIZE);
+  fclose(in);
+  if (fclose(out) != 0 || blocks < 0) {
+    fprintf(stderr, "failed to write %s\n", out_path.c_str());
+    unlink(out_path.c_str());
+    exit(1);
+  }
+
+  fprintf(stderr, "wrote %d blocks to %s\n", blocks, out_path.c_str());
+  return 0;
+}
@@ -3,9 +3,12 @@
 */
 
 #include "common.cpp"
+#include "correlate.cpp"
 #include <string>
 #include <vector>
 #include <utility>
+#include <functional>
+#include <ctime>
 
 using std::string;
 using std::vector;
@@ -13,6 +16,7 @@ using std::pair;
 
 #define COORDINATOR_PORT "8000"
 #define SERVER_PORT "8200"
+#define SERVER_ERROR "ERROR "   // first line of a server that could not run the request
 #define MAX_CLIENTS 50
 #define HOST_FILE_VECTOR vector<pair<string, string>>({ \
   pair<string, string>("172.22.94.58", "vm1.log"), \
@@ -27,10 +31,38 @@ using std::pair;
   pair<string, string>("172.22.94.61", "vm10.log") \
 }) // TODO: CHANGE THIS TO YOUR VM ADDRESSES!
 
-// we define the first line from the server to be line count + \n
-// this function return { line_count, string length }
+#define SLOW_QUERY_THRESHOLD_MS 1000   // default threshold of the slow query log, change with -s
+#define SLOW_QUERY_LOG "slow_query.log"
+#define TIMING_OPTION "--timing "       // client prefix asking for the timing table
+#define CORRELATE_COMMAND "correlate "   // "correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN"
+
+// consumer of the payload of one server, i.e. the bytes between the first line and the trailer
+typedef std::function<void(const char*, ssize_t)> payload_sink;
+
+// time spent on one server for one query, all in microseconds
+// the first group is measured by the coordinator, the second is reported by the server (-1 if missing)
+struct server_span {
+  string host;
+  bool ok;
+  int lines;
+  ssize_t bytes_relayed;
+  long long connect_us;     // connect to the server
+  long long wait_us;        // from sending the request to the first chunk of the response
+  long long relay_us;       // from the first chunk to the end of the response
+  long long total_us;
+  long long queue_us;       // server: accept to handler start
+  long long scan_us;        // server: grep run time
+  long long send_us;        // server: writing the output to the socket
+  long long bytes_scanned;  // server: size of the log file
+  long long bytes_matched;  // server: size of the grep output
+};
+
+// we define the first line from the server to be "line_count payload_length\n",
+// or "ERROR reason\n" if it could not run the request
+// this function return { line_count, string length }, and set `payload_len` to the number
+// of bytes between the first line and the trailer (-1 if the server did not send it)
 // assume str valid
-pair<int, int> parse_first_line(char* str) {
+pair<int, int> parse_first_line(char* str, long long* payload_len) {
   char* ptr = str;
   int len = 0;
   while (*ptr != '\n') {
@@ -39,17 +71,242 @@ pair<int, int> parse_first_line(char* str) {
   }
   *ptr = '\0';
   pair<int, int> res = {atoi(str), len};
+  char* space = strchr(str, ' ');
+  *payload_len = space ? atoll(space + 1) : -1;
   *ptr = '\n';
   return res;
 }
 
-// expecting "grep [OPTIONS] PATTERN" from client
+// query one server with `command` (optional header lines and "grep [OPTIONS] PATTERN")
+// on log file `p.second`, pass its output to `sink`, return the timing of each step
+// errors are reported to the client
+server_span query_server(int client_fd, const pair<string, string>& p, const string& command, const payload_sink& sink) {
+  server_span span = {};
+  span.host = p.first;
+  span.queue_us = span.scan_us = span.send_us = span.bytes_scanned = span.bytes_matched = -1;
+  long long start_us = now_us();
+
+  // connect to server
+  int serverfd = connect_to_host(p.first.c_str(), SERVER_PORT);
+  span.connect_us = now_us() - start_us;
+
+  if (serverfd == -1) {
+    string message = "Failed to connect to server " + p.first + "\n";
+    write_all_to_socket(client_fd, message.c_str(), message.size());
+    span.total_us = now_us() - start_us;
+    return span;
+  }
+
+  fprintf(stderr, "connecting to %s\n", p.first.c_str());
+
+  // ask the server for its timing trailer
+  string cmd = "TRACE\n" + command + " " + p.second;
+
+  // send request to server
+  if (write_all_to_socket(serverfd, cmd.c_str(), cmd.size()) == -1) {
+    string message = "Failed to send message to server " + p.first + "\n";
+    write_all_to_socket(client_fd, message.c_str(), message.size());
+    shutdown(serverfd, SHUT_RDWR);
+    close(serverfd);
+    span.total_us = now_us() - start_us;
+    return span;
+  }
+
+  shutdown(serverfd, SHUT_WR);
+  long long sent_us = now_us();
+  long long first_chunk_us = sent_us;
+
+  // read from server
+  char response[4096] = {0};
+  ssize_t read_ret;
+  ssize_t total_read = 0, total_relayed = 0;
+  int is_first_line = 1;
+  long long payload_left = -1;    // bytes of grep output still to relay, -1 to relay everything
+  string trailer;
+  while ((read_ret = read_all_from_socket(serverfd, response, 4096)) != 0) {
+    if (read_ret == -1) {
+      const char* message = "Incomplete response from server\n";
+      write_all_to_socket(client_fd, message, strlen(message));
+      break;
+    }
+    total_read += read_ret;
+
+    char* data = response;
+    ssize_t len = read_ret;
+    if (is_first_line) {
+      first_chunk_us = now_us();
+      pair<int, int> parsed_result = parse_first_line(response, &payload_left);
+      span.lines = parsed_result.first;
+      span.ok = true;
+      if (strncmp(response, SERVER_ERROR, strlen(SERVER_ERROR)) == 0) {
+        // nothing to relay, pass the reason on to the client
+        string message = "Server " + p.first + ": " + string(response + strlen(SERVER_ERROR),
+          parsed_result.second - strlen(SERVER_ERROR)) + "\n";
+        write_all_to_socket(client_fd, message.c_str(), message.size());
+        span.lines = 0;
+        span.ok = false;
+        payload_left = 0;
+      }
+      is_first_line = 0;
+      data += parsed_result.second + 1;
+      len -= parsed_result.second + 1;
+    }
+
+    // hand the output over, keep whatever follows it as the trailer
+    ssize_t relay_len = (payload_left < 0 || payload_left > len) ? len : payload_left;
+    sink(data, relay_len);
+    total_relayed += relay_len;
+    if (payload_left >= 0)
+      payload_left -= relay_len;
+    trailer.append(data + relay_len, len - relay_len);
+  }
+
+  long long end_us = now_us();
+  span.wait_us = first_chunk_us - sent_us;
+  span.relay_us = end_us - first_chunk_us;
+  span.total_us = end_us - start_us;
+  span.bytes_relayed = total_relayed;
+
+  // TRACE queue_us scan_us send_us bytes_scanned bytes_matched\n
+  sscanf(trailer.c_str(), "TRACE %lld %lld %lld %lld %lld",
+    &span.queue_us, &span.scan_us, &span.send_us, &span.bytes_scanned, &span.bytes_matched);
+
+  fprintf(stderr, "read %zd bytes from server\n", total_read);
+  fprintf(stderr, "relayed %zd bytes of output\n", total_relayed);
+
+  shutdown(serverfd, SHUT_RD);
+  close(serverfd);
+  return span;
+}
+
+// format microseconds as milliseconds, "-" if missing
+string ms_string(long long us) {
+  if (us < 0)
+    return "-";
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.1f", us / 1000.0);
+  return string(buf);
+}
+
+// per-server timing table appended to the response when the client asks for it
+string timing_table(const vector<server_span>& spans, long long query_us) {
+  char line[256];
+  string table = "===== Query timing (ms) =====\n";
+  snprintf(line, sizeof(line), "%-16s %8s %8s %8s %8s | %8s %8s %8s %12s %12s\n",
+    "host", "connect", "wait", "relay", "total", "queue", "scan", "send", "scanned(B)", "matched(B)");
+  table += line;
+  for (const server_span& span : spans) {
+    snprintf(line, sizeof(line), "%-16s %8s %8s %8s %8s | %8s %8s %8s %12lld %12lld\n",
+      span.host.c_str(), ms_string(span.connect_us).c_str(),
+      span.ok ? ms_string(span.wait_us).c_str() : "-", span.ok ? ms_string(span.relay_us).c_str() : "-",
+      ms_string(span.total_us).c_str(), ms_string(span.queue_us).c_str(), ms_string(span.scan_us).c_str(),
+      ms_string(span.send_us).c_str(), span.bytes_scanned, span.bytes_matched);
+    table += line;
+  }
+  table += "Query total: " + ms_string(query_us) + " ms\n";
+  return table;
+}
+
+// append one line per slow query: time, total, request and the spans of each server
+void log_slow_query(const char* request, const vector<server_span>& spans, long long query_us) {
+  FILE* log = fopen(SLOW_QUERY_LOG, "a");
+  if (log == NULL)
+    return;
+
+  std::time_t t = std::time(NULL);
+  char time_str[32] = {0};
+  std::strftime(time_str, sizeof(time_str), "%Y/%m/%d %H:%M:%S", std::localtime(&t));
+
+  fprintf(log, "%s total=%sms request=[%s]", time_str, ms_string(query_us).c_str(), request);
+  for (const server_span& span : spans) {
+    // host:connect/wait/relay/scan
+    fprintf(log, " %s:%s/%s/%s/%s", span.host.c_str(), ms_string(span.connect_us).c_str(),
+      ms_string(span.wait_us).c_str(), ms_string(span.relay_us).c_str(), ms_string(span.scan_us).c_str());
+  }
+  fprintf(log, "\n");
+  fclose(log);
+}
+
+// query every server with `grep_request`, relay the output to the client
+// return total line count
+int run_grep_query(int client_fd, const char* grep_request, vector<server_span>& spans) {
+  // add source file option to the grep command before sending to server
+  string command = string(grep_request).substr(0, 5) + "-H " + (grep_request + 5);
+  payload_sink to_client = [client_fd](const char* data, ssize_t len) {
+    write_all_to_socket(client_fd, data, len);
+  };
+
+  int total_lines = 0;
+  for (const pair<string, string>& p : HOST_FILE_VECTOR) {
+    spans.push_back(query_server(client_fd, p, command, to_client));
+    total_lines += spans.back().lines;
+  }
+  return total_lines;
+}
+
+// "correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN"
+// every server sends its matching lines as records keyed by word FIELD, hash partitioned
+// group the records of all servers by key, one spilled partition at a time,
+// and send the keys found on at least MIN_HOSTS hosts to the client
+// return number of such keys, -1 on a malformed request or if the records could not be spilled
+int run_correlate_query(int client_fd, const char* request, vector<server_span>& spans) {
+  int field = 0, min_hosts = 0, consumed = 0;
+  sscanf(request + strlen(CORRELATE_COMMAND), "%d %d %n", &field, &min_hosts, &consumed);
+  const char* grep_request = request + strlen(CORRELATE_COMMAND) + consumed;
+  if (field <= 0 || min_hosts <= 0 || consumed == 0 || strncmp(grep_request, "grep ", 5) != 0) {
+    const char* message = "usage: correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN\n";
+    write_all_to_socket(client_fd, message, strlen(message));
+    return -1;
+  }
+
+  // no file name prefix, the key is a field of the log line itself
+  string command = "CORRELATE " + std::to_string(field) + " " + std::to_string(CORRELATE_PARTITIONS) + "\n"
+    + string(grep_request).substr(0, 5) + "-h " + (grep_request + 5);
+
+  vector<pair<string, string>> hosts = HOST_FILE_VECTOR;
+  correlate_spill spill;
+  if (!spill_open(spill, CORRELATE_PARTITIONS)) {
+    const char* message = "Failed to create the spill files of the correlation\n";
+    write_all_to_socket(client_fd, message, strlen(message));
+    return -1;
+  }
+  payload_sink to_spill = [&spill](const char* data, ssize_t len) {
+    spill_records(spill, data, len);
+  };
+
+  for (int i = 0; i < (int) hosts.size(); ++i) {
+    spill.host = i;
+    spill.pending.clear();
+    spans.push_back(query_server(client_fd, hosts[i], command, to_spill));
+  }
+
+  int keys = 0;
+  for (FILE* f : spill.partitions) {
+    fflush(f);
+    int partition_keys = group_partition(f, 0, min_hosts, hosts, client_fd);
+    if (partition_keys < 0) {
+      const char* message = "Failed to split an oversized partition of the correlation\n";
+      write_all_to_socket(client_fd, message, strlen(message));
+      keys = -1;
+      break;
+    }
+    keys += partition_keys;
+  }
+  spill_close(spill);
+  return keys;
+}
+
+// expecting "[--timing ]grep [OPTIONS] PATTERN"
+// or "[--timing ]correlate FIELD MIN_HOSTS grep [OPTIONS] PATTERN" from client
 int main(int argc, char *argv[])
 {
-	if (argc != 1) {
-    fprintf(stderr, "usage: ./coordinator\n");
+  long long slow_query_ms = SLOW_QUERY_THRESHOLD_MS;
+  if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+    slow_query_ms = atoll(argv[2]);
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: ./coordinator [-s SLOW_QUERY_MS]\n");
     exit(1);
-	}
+  }
 
   int coordinatorSocket = setup_server(COORDINATOR_PORT, MAX_CLIENTS);
 
@@ -57,75 +314,37 @@ int main(int argc, char *argv[])
     struct sockaddr_storage clientaddr;
     socklen_t clientaddrsize = sizeof(clientaddr);
     int client_fd = accept(coordinatorSocket, (struct sockaddr *) &clientaddr, &clientaddrsize);
+    long long query_start_us = now_us();
 
     // listen to client request
     char request[4096] = {0};
     read_all_from_socket(client_fd, request, 4096);  // assume 4096 big enough
     shutdown(client_fd, SHUT_RD);
 
-    // for every request connection, query all server VMs
-    int total_lines = 0;
-    for (const pair<string, string>& p : HOST_FILE_VECTOR) {
-      // connect to server
-      int serverfd = connect_to_host(p.first.c_str(), SERVER_PORT);
-
-      if (serverfd == -1) {
-        string message = "Failed to connect to server " + p.first + "\n";
-        write_all_to_socket(client_fd, message.c_str(), message.size());
-        continue;
-      }
-
-      fprintf(stderr, "connecting to %s\n", p.first.c_str());
-
-      // add source file option to the grep command before sending to server
-      string request_with_line_num = string(request).substr(0, 5) + "-H " + (request + 5);
-      string cmd = request_with_line_num + " " + p.second;
+    bool want_timing = strncmp(request, TIMING_OPTION, strlen(TIMING_OPTION)) == 0;
+    char* grep_request = want_timing ? request + strlen(TIMING_OPTION) : request;
 
-      // send request to server
-      if (write_all_to_socket(serverfd, cmd.c_str(), cmd.size()) == -1) {
-        string message = "Failed to send message to server " + p.first + "\n";
-        write_all_to_socket(client_fd, message.c_str(), message.size());
-        shutdown(serverfd, SHUT_RDWR);
-        close(serverfd);
-        continue;
-      }
-
-      shutdown(serverfd, SHUT_WR);
-
-      // read from server
-      char response[4096] = {0};
-      ssize_t read_ret;
-      ssize_t total_read = 0, total_send = 0;
-      int is_first_line = 1;
-      while ((read_ret = read_all_from_socket(serverfd, response, 4096)) != 0) {
-        if (read_ret == -1) {
-          const char* message = "Incomplete response from server\n";
-          write_all_to_socket(client_fd, message, strlen(message));
-          break;
-        }
-        // send back to client
-        if (is_first_line) {
-          pair<int, int> parsed_result = parse_first_line(response);
-          total_lines += parsed_result.first;
-          is_first_line = 0;
-          total_send += write_all_to_socket(
-            client_fd, response + parsed_result.second + 1, read_ret - parsed_result.second - 1
-          );
-        } else {
-          total_send += write_all_to_socket(client_fd, response, read_ret);
-        }
-        total_read += read_ret;
+    // for every request connection, query all server VMs
+    vector<server_span> spans;
+    if (strncmp(grep_request, CORRELATE_COMMAND, strlen(CORRELATE_COMMAND)) == 0) {
+      int keys = run_correlate_query(client_fd, grep_request, spans);
+      if (keys >= 0) {
+        string msg = "Total correlated keys: " + std::to_string(keys) + "\n";
+        write_all_to_socket(client_fd, msg.c_str(), msg.size());
       }
-
-      fprintf(stderr, "read %zd bytes from server\n", total_read);
-      fprintf(stderr, "sent %zd bytes to client\n", total_send);
-
-      shutdown(serverfd, SHUT_RD);
-      close(serverfd);
+    } else {
+      int total_lines = run_grep_query(client_fd, grep_request, spans);
+      string msg = "Total line count: " + std::to_string(total_lines) + "\n";
+      write_all_to_socket(client_fd, msg.c_str(), msg.size());
     }
 
-    string msg = "Total line count: " + std::to_string(total_lines) + "\n";
-    write_all_to_socket(client_fd, msg.c_str(), msg.size());
+    long long query_us = now_us() - query_start_us;
+    if (want_timing) {
+      string table = timing_table(spans, query_us);
+      write_all_to_socket(client_fd, table.c_str(), table.size());
+    }
+    if (query_us >= slow_query_ms * 1000)
+      log_slow_query(grep_request, spans, query_us);
 
     // finish all querying for one client, clean up
     shutdown(client_fd, SHUT_WR);
@@ -134,4 +353,3 @@ int main(int argc, char *argv[])
 
 	return 0;
 }
-
@@ -0,0 +1,206 @@
+/*
+** correlate.cpp -- cross-log correlation by a shared key
+**
+** Servers turn every matching line into a "partition\tkey\tline\n" record,
+** where key is a whitespace separated field of the line and partition is a
+** hash of the key. The coordinator spills the records of all servers to one
+** file per partition, then groups each partition on its own, so only one
+** partition has to fit in memory at a time.
+*/
+
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::map;
+
+#define CORRELATE_PARTITIONS 64
+#define CORRELATE_MEMORY_LIMIT (64 << 20)   // bytes of one partition grouped in memory
+#define CORRELATE_MAX_DEPTH 3               // times an oversized partition is split again
+
+// FNV-1a, the same on every machine so that all servers agree on partitions
+uint64_t hash_key(const string& key, uint64_t seed) {
+  uint64_t h = 14695981039346656037ULL ^ seed;
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// the `field`-th (1-indexed) whitespace separated word of `line`, "" if the line is shorter
+string key_field(const string& line, int field) {
+  size_t pos = 0;
+  for (int i = 1; ; ++i) {
+    pos = line.find_first_not_of(" \t", pos);
+    if (pos == string::npos)
+      return "";
+    size_t end = line.find_first_of(" \t", pos);
+    if (i == field)
+      return line.substr(pos, end == string::npos ? string::npos : end - pos);
+    if (end == string::npos)
+      return "";
+    pos = end;
+  }
+}
+
+// server side: turn grep output in `in` into records in `out`, return number of records
+int write_correlate_records(FILE* in, FILE* out, int field, int partitions) {
+  int records = 0;
+  char* line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, in)) != -1) {
+    string s = string(line, len);
+    if (!s.empty() && s.back() == '\n')
+      s.pop_back();
+
+    string key = key_field(s, field);
+    if (key.empty())
+      continue;
+
+    fprintf(out, "%d\t%s\t%s\n", (int) (hash_key(key, 0) % partitions), key.c_str(), s.c_str());
+    ++records;
+  }
+  free(line);
+  return records;
+}
+
+// coordinator side: spill files of one correlation query
+struct correlate_spill {
+  vector<FILE*> partitions;
+  string pending;         // incomplete record at the end of the last chunk
+  int host;               // index of the host the records come from
+};
+
+void spill_close(correlate_spill& spill) {
+  for (FILE* f : spill.partitions)
+    fclose(f);
+  spill.partitions.clear();
+}
+
+// return false if the spill files could not be created
+bool spill_open(correlate_spill& spill, int partitions) {
+  for (int i = 0; i < partitions; ++i) {
+    FILE* f = tmpfile();
+    if (f == NULL) {
+      spill_close(spill);
+      return false;
+    }
+    spill.partitions.push_back(f);
+  }
+  return true;
+}
+
+// consume a chunk of records from one server, spill complete ones as "host\tkey\tline\n"
+void spill_records(correlate_spill& spill, const char* data, ssize_t len) {
+  spill.pending.append(data, len);
+  size_t start = 0, newline;
+  while ((newline = spill.pending.find('\n', start)) != string::npos) {
+    // partition\tkey\tline
+    size_t tab = spill.pending.find('\t', start);
+    if (tab != string::npos && tab < newline) {
+      size_t partition = atoi(spill.pending.c_str() + start) % spill.partitions.size();
+      FILE* f = spill.partitions[partition];
+      fprintf(f, "%d\t", spill.host);
+      fwrite(spill.pending.data() + tab + 1, 1, newline - tab, f);
+    }
+    start = newline + 1;
+  }
+  spill.pending.erase(0, start);
+}
+
+// lines of one key, grouped by host
+struct key_group {
+  uint64_t hosts;   // bitmask of host indices
+  vector<pair<int, string>> lines;
+};
+
+// split an oversized spill file into `partitions` files with a different hash seed
+// return no files if they could not be created
+vector<FILE*> split_partition(FILE* f, int partitions, uint64_t seed) {
+  vector<FILE*> parts;
+  for (int i = 0; i < partitions; ++i) {
+    FILE* part = tmpfile();
+    if (part == NULL) {
+      for (FILE* p : parts)
+        fclose(p);
+      return vector<FILE*>();
+    }
+    parts.push_back(part);
+  }
+
+  char* line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) != -1) {
+    // host\tkey\tline
+    char* key = strchr(line, '\t');
+    char* key_end = key ? strchr(key + 1, '\t') : NULL;
+    if (key_end == NULL)
+      continue;
+    string k = string(key + 1, key_end - key - 1);
+    fwrite(line, 1, len, parts[hash_key(k, seed) % partitions]);
+  }
+  free(line);
+  return parts;
+}
+
+// group one spilled partition by key and write keys seen on at least `min_hosts` hosts to `client_fd`
+// return number of keys written, -1 if the partition could not be split
+int group_partition(FILE* f, int depth, int min_hosts, const vector<pair<string, string>>& hosts, int client_fd) {
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+
+  if (size > CORRELATE_MEMORY_LIMIT && depth < CORRELATE_MAX_DEPTH) {
+    int keys = 0;
+    vector<FILE*> parts = split_partition(f, CORRELATE_PARTITIONS, depth + 1);
+    if (parts.empty())
+      return -1;
+    for (FILE* part : parts) {
+      int part_keys = keys < 0 ? -1 : group_partition(part, depth + 1, min_hosts, hosts, client_fd);
+      keys = part_keys < 0 ? -1 : keys + part_keys;
+      fclose(part);
+    }
+    return keys;
+  }
+
+  map<string, key_group> groups;
+  char* line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while ((len = getline(&line, &cap, f)) != -1) {
+    // host\tkey\tline\n
+    char* key = strchr(line, '\t');
+    char* key_end = key ? strchr(key + 1, '\t') : NULL;
+    if (key_end == NULL)
+      continue;
+    int host = atoi(line);
+    key_group& g = groups[string(key + 1, key_end - key - 1)];
+    g.hosts |= 1ULL << (host % 64);
+    g.lines.push_back({host, string(key_end + 1, line + len - key_end - 1)});
+  }
+  free(line);
+
+  int keys = 0;
+  for (auto& kv : groups) {
+    int host_count = __builtin_popcountll(kv.second.hosts);
+    if (host_count < min_hosts)
+      continue;
+    ++keys;
+
+    string msg = "===== " + kv.first + " (" + std::to_string(host_count) + " hosts) =====\n";
+    std::stable_sort(kv.second.lines.begin(), kv.second.lines.end(),
+      [](const pair<int, string>& a, const pair<int, string>& b) { return a.first < b.first; });
+    for (const pair<int, string>& l : kv.second.lines)
+      msg += hosts[l.first].second + ":" + l.second;
+    write_all_to_socket(client_fd, msg.c_str(), msg.size());
+  }
+  return keys;
+}
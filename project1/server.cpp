@@ -3,12 +3,79 @@
 */
 
 #include "common.cpp"
+#include "blocklog.cpp"
+#include "correlate.cpp"
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/epoll.h>
 #include <string>
+#include <deque>
+#include <map>
 
 using std::string;
+using std::map;
 
 #define MAX_CLIENTS 50
 #define SERVER_PORT "8200"
+#define DECOMPRESS_WINDOW_PER_THREAD 2    // blocks in flight per decompression thread
+#define GREP_THREADS_PER_CORE 2           // grep threads per core, a request mostly waits on grep and the disk
+#define REQUEST_SIZE 4096
+#define MAX_EVENTS 64
+#define SERVER_ERROR "ERROR "   // first line of the response when the request could not run
+
+
+// one block of a block log waiting for a decompression thread
+struct decompress_job {
+  int fd;
+  block_index_entry entry;
+  vector<char> data;        // decompressed block
+  bool done;
+  bool ok;
+};
+
+static int decompress_thread_count;
+static std::deque<decompress_job*> decompress_queue;
+static pthread_mutex_t decompress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decompress_cv = PTHREAD_COND_INITIALIZER;   // a job was queued
+static pthread_cond_t decompress_done_cv = PTHREAD_COND_INITIALIZER;  // a job finished
+
+// accepted connection whose request is still being read, or waiting for a grep thread
+struct client_conn {
+  int fd;
+  long long accepted_us;    // when accept() returned, to measure queue wait
+  size_t len;
+  char request[REQUEST_SIZE + 1];
+};
+
+// parsed index of a block log, reused while the file is unchanged
+struct cached_block_index {
+  time_t mtime;
+  off_t size;
+  vector<block_index_entry> index;
+};
+
+// complete requests waiting for a grep thread
+static std::deque<client_conn*> request_queue;
+static pthread_mutex_t request_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t request_cv = PTHREAD_COND_INITIALIZER;
+
+// one acceptor/event loop per core, with its own listening socket on SERVER_PORT
+// it only accepts and reads requests, a complete request goes to the grep threads
+// so a long grep never holds up the connections of its core
+struct worker {
+  int id;
+  int listen_fd;
+  int epoll_fd;
+  map<int, client_conn*> conns;                     // connections still sending their request
+};
+
+// thread running one request at a time, everything a request needs is owned by its grep thread
+struct grep_thread {
+  int id;
+  string output_path;                               // grep output of the request being handled
+  map<string, cached_block_index> index_cache;      // block log path -> index
+};
 
 
 int file_line_count(FILE* f) {
@@ -23,57 +90,383 @@ int file_line_count(FILE* f) {
   return lines;
 }
 
+// thread pool shared by all queries, inflate queued blocks
+void* decompress_worker(void*) {
+  vector<char> compressed;    // scratch buffer owned by this thread
+  while (1) {
+    pthread_mutex_lock(&decompress_lock);
+    while (decompress_queue.empty())
+      pthread_cond_wait(&decompress_cv, &decompress_lock);
+    decompress_job* job = decompress_queue.front();
+    decompress_queue.pop_front();
+    pthread_mutex_unlock(&decompress_lock);
+
+    bool ok = decompress_block(job->fd, job->entry, compressed, job->data);
+
+    pthread_mutex_lock(&decompress_lock);
+    job->ok = ok;
+    job->done = true;
+    pthread_cond_broadcast(&decompress_done_cv);
+    pthread_mutex_unlock(&decompress_lock);
+  }
+  return NULL;
+}
+
+void start_decompress_pool() {
+  decompress_thread_count = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  for (int i = 0; i < decompress_thread_count; ++i) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, decompress_worker, NULL);
+    pthread_detach(tid);
+  }
+}
+
+// index of the opened block log `path`, from the grep thread's cache when the file is unchanged
+// return NULL if the block log is invalid
+const vector<block_index_entry>* block_index(grep_thread* g, const string& path, int fd) {
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    return NULL;
+
+  map<string, cached_block_index>::iterator it = g->index_cache.find(path);
+  if (it != g->index_cache.end() && it->second.mtime == st.st_mtime && it->second.size == st.st_size)
+    return &it->second.index;
+
+  cached_block_index& cached = g->index_cache[path];
+  cached.mtime = st.st_mtime;
+  cached.size = st.st_size;
+  cached.index.clear();
+  if (!read_block_index(fd, cached.index)) {
+    g->index_cache.erase(path);
+    return NULL;
+  }
+  return &cached.index;
+}
+
+// run `grep_cmd` on the block log at `path`, feeding the blocks to its stdin in order
+// while the pool decompresses the following ones
+// return number of decompressed bytes scanned, -1 if the block log is invalid or grep could not start
+long long grep_block_log(grep_thread* g, const string& grep_cmd, const string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  const vector<block_index_entry>* index_ptr = fd == -1 ? NULL : block_index(g, path, fd);
+  if (index_ptr == NULL) {
+    fprintf(stderr, "invalid block log %s\n", path.c_str());
+    if (fd != -1)
+      close(fd);
+    return -1;
+  }
+  const vector<block_index_entry>& index = *index_ptr;
+
+  FILE* grep_in = popen(grep_cmd.c_str(), "w");
+  if (grep_in == NULL) {
+    fprintf(stderr, "cannot start grep on %s: %s\n", path.c_str(), strerror(errno));
+    close(fd);
+    return -1;
+  }
+  size_t window = decompress_thread_count * DECOMPRESS_WINDOW_PER_THREAD;
+  vector<decompress_job> jobs(window);
+  size_t submitted = 0, consumed = 0;
+  long long scanned = 0;
+  bool ok = true;
+
+  while (consumed < index.size()) {
+    // keep the window full
+    pthread_mutex_lock(&decompress_lock);
+    while (submitted < index.size() && submitted < consumed + window) {
+      decompress_job* job = &jobs[submitted % window];
+      job->fd = fd;
+      job->entry = index[submitted++];
+      job->done = false;
+      decompress_queue.push_back(job);
+      pthread_cond_signal(&decompress_cv);
+    }
+
+    // blocks must reach grep in file order
+    decompress_job* job = &jobs[consumed % window];
+    while (!job->done)
+      pthread_cond_wait(&decompress_done_cv, &decompress_lock);
+    pthread_mutex_unlock(&decompress_lock);
+    ++consumed;
+
+    if (!job->ok || fwrite(job->data.data(), 1, job->data.size(), grep_in) != job->data.size()) {
+      // corrupted block, or grep stopped reading (e.g. -m or -q)
+      ok = job->ok;
+      break;
+    }
+    scanned += job->data.size();
+  }
+
+  // wait for the blocks still owned by the pool before releasing them
+  pthread_mutex_lock(&decompress_lock);
+  for (; consumed < submitted; ++consumed) {
+    while (!jobs[consumed % window].done)
+      pthread_cond_wait(&decompress_done_cv, &decompress_lock);
+  }
+  pthread_mutex_unlock(&decompress_lock);
+
+  if (!ok)
+    fprintf(stderr, "corrupted block in %s\n", path.c_str());
+
+  pclose(grep_in);
+  close(fd);
+  return scanned;
+}
+
+// the log file named by the last word of `cmd`
+string log_filename(const string& cmd) {
+  size_t end = cmd.find_last_not_of(' ');
+  if (end == string::npos)
+    return "";
+  size_t begin = cmd.find_last_of(' ', end);
+  return cmd.substr(begin == string::npos ? 0 : begin + 1, end - (begin == string::npos ? 0 : begin + 1) + 1);
+}
+
+// run the grep command, its output goes to the grep thread's output file
+// if the plain log is missing but a block log exists, grep the decompressed blocks instead
+// return number of log bytes scanned, -1 if the block log could not be grepped
+long long run_grep(grep_thread* g, const char* cmd) {
+  string command = string(cmd);
+  string filename = log_filename(command);
+  string block_path = filename + BLOCK_LOG_SUFFIX;
+
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0 && stat(block_path.c_str(), &st) == 0) {
+    // grep reads stdin, the label keeps the log file name in its output
+    string grep_cmd = command.substr(0, command.find_last_not_of(' ') + 1 - filename.size())
+      + " --label=" + filename + " - > " + g->output_path;
+    return grep_block_log(g, grep_cmd, block_path);
+  }
+
+  system((command + " > " + g->output_path).c_str());
+  return stat(filename.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// answer the request with an error line instead of an output, and drop the grep thread's output file
+void send_error(grep_thread* g, int client_fd, const string& reason) {
+  string msg = string(SERVER_ERROR) + reason + "\n";
+  write_all_to_socket(client_fd, msg.c_str(), msg.size());
+  unlink(g->output_path.c_str());
+  shutdown(client_fd, SHUT_WR);
+  fprintf(stderr, "[grep %d] %s", g->id, msg.c_str());
+}
+
 // expecting "grep [OPTIONS] PATTERN FILENAME" from coordinator, FILENAME not optional
+// the command may be prefixed with "TRACE\n" to ask for a timing trailer,
+// then with "CORRELATE FIELD PARTITIONS\n" to get key records instead of the grep output
 // run grep command on the log file on the local machine
 // write the result back to the client
-void* handle_client(void *fd_ptr) {
-  pthread_detach( pthread_self() ); // pthread_join not needed
-  int client_fd = *(int *) fd_ptr;
-  free(fd_ptr); fd_ptr = NULL;
+void handle_request(grep_thread* g, client_conn* conn) {
+  long long start_us = now_us();
+  int client_fd = conn->fd;
+  char* request = conn->request;
+  request[conn->len] = '\0';
 
-  char cmd[4096] = {0};
-  read_all_from_socket(client_fd, cmd, 4096);   // FIXME: assume that 4096 is big enough
+  // strip the trace flag and the correlation header, the rest is the grep command
+  bool trace = strncmp(request, "TRACE\n", 6) == 0;
+  char* cmd = trace ? request + 6 : request;
 
-  fprintf(stderr, "executing command [ %s ]...\n", cmd);
+  int field = 0, partitions = 0;
+  if (strncmp(cmd, "CORRELATE ", 10) == 0 && strchr(cmd, '\n') != NULL) {
+    sscanf(cmd + 10, "%d %d", &field, &partitions);
+    cmd = strchr(cmd, '\n') + 1;
+  }
+  bool correlate = field > 0 && partitions > 0;
+
+  fprintf(stderr, "[grep %d] executing command [ %s ]...\n", g->id, cmd);
 
   shutdown(client_fd, SHUT_RD);
 
-  // run grep on the log file and output to `temp_output`
-  int fd_copy = dup(1);                   // copy stdout
-  close(1);                               // close stdout
-  FILE* f = fopen("temp_output", "w+");   // open a temporary file to save output
+  // execute command along with line count for the match, output to the grep thread's file
+  long long scan_start_us = now_us();
+  long long bytes_scanned = run_grep(g, cmd);
+  long long scan_us = now_us() - scan_start_us;
 
-  // execute command along with line count for the match
-  system(cmd);
+  // tell the coordinator why instead of answering with an empty output
+  if (bytes_scanned < 0) {
+    send_error(g, client_fd, "cannot grep " + log_filename(cmd));
+    return;
+  }
 
-  rewind(f);
+  FILE* f = fopen(g->output_path.c_str(), "r");
+  if (f == NULL)
+    f = tmpfile();    // grep could not even start, send an empty output
+  if (f == NULL) {
+    send_error(g, client_fd, "cannot open the grep output");
+    return;
+  }
 
-  string lc = std::to_string(file_line_count(f));
+  struct stat st;
+  fstat(fileno(f), &st);
+  long long matched_bytes = st.st_size;
 
-  // use the first line to tell coordinator the line count
-  string msg1 = lc + "\n";
+  // the payload is either the grep output or its key records
+  FILE* payload = f;
+  string lc, msg2;
+  if (correlate) {
+    payload = tmpfile();
+    if (payload == NULL) {
+      fclose(f);
+      send_error(g, client_fd, "cannot create the correlation records");
+      return;
+    }
+    lc = std::to_string(write_correlate_records(f, payload, field, partitions));
+    fflush(payload);
+    rewind(payload);
+    fstat(fileno(payload), &st);
+  } else {
+    lc = std::to_string(file_line_count(f));
+    msg2 = "File line count: " + lc + "\n";
+  }
+
+  // use the first line to tell coordinator the line count and the payload length,
+  // so that it can tell the payload apart from the trailer
+  string msg1 = lc + " " + std::to_string(st.st_size + msg2.size()) + "\n";
   write_all_to_socket(client_fd, msg1.c_str(), msg1.size());
 
   // send the output to client
+  long long send_start_us = now_us();
   char buffer[4096] = {0};
   ssize_t count;
   ssize_t all_count = 0;
-  while ((count = read(fileno(f), buffer, 4096)) != 0) {
+  while ((count = read(fileno(payload), buffer, 4096)) > 0) {
     all_count += write_all_to_socket(client_fd, buffer, count);
   }
+  if (payload != f)
+    fclose(payload);
 
-  string msg2 = "File line count: " + lc + "\n";
   write_all_to_socket(client_fd, msg2.c_str(), msg2.size());
+  long long send_us = now_us() - send_start_us;
+
+  // TRACE queue_us scan_us send_us bytes_scanned bytes_matched\n
+  string msg3;
+  if (trace) {
+    msg3 = "TRACE " + std::to_string(start_us - conn->accepted_us) + " " + std::to_string(scan_us) + " "
+      + std::to_string(send_us) + " " + std::to_string(bytes_scanned) + " " + std::to_string(matched_bytes) + "\n";
+    write_all_to_socket(client_fd, msg3.c_str(), msg3.size());
+  }
 
-  shutdown(client_fd, SHUT_WR);
   fclose(f);
-  dup2(fd_copy, 1);       // copy stdout back
-  unlink("temp_output");
-  
-  close(client_fd);
+  unlink(g->output_path.c_str());
+  shutdown(client_fd, SHUT_WR);
 
-  fprintf(stderr, "Sent %zd bytes to the coordinator\n", all_count + msg1.size() + msg2.size());
+  fprintf(stderr, "[grep %d] Sent %zd bytes to the coordinator (queue %lld us, scan %lld us, send %lld us)\n",
+    g->id, all_count + msg1.size() + msg2.size() + msg3.size(), start_us - conn->accepted_us, scan_us, send_us);
+}
+
+void set_nonblocking(int fd, bool nonblocking) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK));
+}
+
+void close_conn(worker* w, client_conn* conn) {
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  close(conn->fd);
+  w->conns.erase(conn->fd);
+  free(conn);
+}
+
+// accept every pending connection on the worker's listening socket
+void accept_clients(worker* w) {
+  while (1) {
+    int client_fd = accept(w->listen_fd, NULL, NULL);
+    if (client_fd == -1)
+      return;   // EAGAIN: drained, or the kernel gave the connection to another worker
+
+    client_conn* conn = (client_conn*) malloc(sizeof(client_conn));
+    conn->fd = client_fd;
+    conn->accepted_us = now_us();
+    conn->len = 0;
+    set_nonblocking(client_fd, true);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = client_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev);
+    w->conns[client_fd] = conn;
+  }
+}
+
+// run the requests the event loops hand over, one at a time
+void* grep_loop(void* arg) {
+  grep_thread* g = (grep_thread*) arg;
+  while (1) {
+    pthread_mutex_lock(&request_lock);
+    while (request_queue.empty())
+      pthread_cond_wait(&request_cv, &request_lock);
+    client_conn* conn = request_queue.front();
+    request_queue.pop_front();
+    pthread_mutex_unlock(&request_lock);
 
+    handle_request(g, conn);
+    close(conn->fd);
+    free(conn);
+  }
+  return NULL;
+}
+
+void start_grep_threads() {
+  int count = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)) * GREP_THREADS_PER_CORE;
+  for (int i = 0; i < count; ++i) {
+    grep_thread* g = new grep_thread();
+    g->id = i;
+    g->output_path = "temp_output_" + std::to_string(getpid()) + "_" + std::to_string(i);
+    pthread_t tid;
+    pthread_create(&tid, NULL, grep_loop, g);
+    pthread_detach(tid);
+  }
+}
+
+// read what the coordinator sent so far, queue the request once it shut down its write side
+void read_request(worker* w, client_conn* conn) {
+  while (conn->len < REQUEST_SIZE) {
+    ssize_t ret = read(conn->fd, conn->request + conn->len, REQUEST_SIZE - conn->len);
+    if (ret == -1 && errno == EINTR)
+      continue;
+    if (ret == -1 && errno == EAGAIN)
+      return;   // wait for more
+    if (ret <= 0)
+      break;    // end of request (or error)
+    conn->len += ret;
+  }
+
+  // an empty request is just a connection probe
+  if (conn->len == 0) {
+    close_conn(w, conn);
+    return;
+  }
+
+  // the grep thread owns the connection from here on
+  epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+  w->conns.erase(conn->fd);
+  set_nonblocking(conn->fd, false);
+  pthread_mutex_lock(&request_lock);
+  request_queue.push_back(conn);
+  pthread_cond_signal(&request_cv);
+  pthread_mutex_unlock(&request_lock);
+}
+
+// acceptor/event loop of one worker, pinned to core `id`
+void* worker_loop(void* arg) {
+  worker* w = (worker*) arg;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->id % std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)), &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (1) {
+    int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, -1);
+    for (int i = 0; i < n; ++i) {
+      if (events[i].data.fd == w->listen_fd) {
+        accept_clients(w);
+        continue;
+      }
+      map<int, client_conn*>::iterator it = w->conns.find(events[i].data.fd);
+      if (it != w->conns.end())
+        read_request(w, it->second);
+    }
+  }
   return NULL;
 }
 
@@ -82,23 +475,38 @@ void* handle_client(void *fd_ptr) {
 // expecting "grep [OPTIONS] PATTERN FILENAME" from the coordinator
 // response with exactly the grep output string
 int main(int argc, char **argv) {
-  if (argc != 1) {
-    fprintf(stderr, "usage: ./server\n");
+  int worker_count = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  if (argc == 2 && atoi(argv[1]) > 0) {
+    worker_count = atoi(argv[1]);
+  } else if (argc != 1) {
+    fprintf(stderr, "usage: ./server [WORKERS]\n");
     exit(1);
   }
 
-  int serverSocket = setup_server(SERVER_PORT, MAX_CLIENTS);
+  signal(SIGPIPE, SIG_IGN);   // grep may exit before reading all blocks, clients may hang up
+  start_decompress_pool();
+  start_grep_threads();
 
-  while (1) {
-    struct sockaddr_storage clientaddr;
-    socklen_t clientaddrsize = sizeof(clientaddr);
-    int client_fd = accept(serverSocket, (struct sockaddr *) &clientaddr, &clientaddrsize);
+  // every worker binds its own SO_REUSEPORT socket, the kernel spreads connections across them
+  vector<pthread_t> threads(worker_count);
+  for (int i = 0; i < worker_count; ++i) {
+    worker* w = new worker();
+    w->id = i;
+    w->listen_fd = setup_server(SERVER_PORT, MAX_CLIENTS);
+    w->epoll_fd = epoll_create1(0);
+    set_nonblocking(w->listen_fd, true);
 
-    int* fd = (int*) malloc(sizeof(int));
-    *fd = client_fd;
-    pthread_t tid;
-    pthread_create(&tid, NULL, handle_client, fd);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = w->listen_fd;
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->listen_fd, &ev);
+
+    pthread_create(&threads[i], NULL, worker_loop, w);
   }
-  
+
+  fprintf(stderr, "listening on port %s with %d workers\n", SERVER_PORT, worker_count);
+  for (pthread_t tid : threads)
+    pthread_join(tid, NULL);
+
   return 0;
 }
@@ -0,0 +1,149 @@
+/*
+** bench.cpp -- microbenchmark of membership UPDATE handling
+**
+** Compares the old text UPDATE ("ip,ctime,ACTION\n" per member, timestamps
+** compared with get_time + mktime) against the binary UPDATE of membership.cpp.
+** Every round encodes the sender's list, then decodes and merges it into the
+** receiver's list, as in the steady state where heartbeats moved but no status
+** changed, so every entry is compared. It also prints the size of a full list
+** next to the largest SWIM PING with piggybacked changes.
+*/
+
+#include "common.cpp"
+#include "swim.cpp"
+
+#include <tuple>
+#include <sstream>
+#include <iomanip>
+
+using std::tuple;
+
+#define BUFSIZE SWIM_BUFSIZE
+
+long long now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// ===== old text format, copied from the previous process.cpp =====
+
+actions string_to_actions(const char* action) {
+  if (strcmp(action, "JOIN") == 0)
+    return JOIN;
+  else if (strcmp(action, "LEAVE") == 0)
+    return LEAVE;
+  else
+    return FAILED;
+}
+
+string legacy_encode(const vector<tuple<string, string, actions>>& list) {
+  string msg = "UPDATE\n";
+  for (auto& tup : list)
+    msg += (std::get<0>(tup) + "," + std::get<1>(tup) + "," + actions_to_string(std::get<2>(tup)) + "\n");
+  return msg;
+}
+
+vector<tuple<string, string, actions>> legacy_decode(const char* buf) {
+  vector<tuple<string, string, actions>> received;
+  string s = string(buf + 7);
+  size_t pos = 0;
+  while ((pos = s.find("\n")) != string::npos) {
+    string tmp = s.substr(0, pos);
+    char line[tmp.size() + 1];
+    strcpy(line, tmp.c_str());
+    char* comma1 = strchr(line, ',');
+    *comma1 = '\0';
+    char* comma2 = strchr(comma1 + 1, ',');
+    *comma2 = '\0';
+    received.push_back({string(line), string(comma1 + 1), string_to_actions(comma2 + 1)});
+    s.erase(0, pos + 1);
+  }
+  return received;
+}
+
+int legacy_merge(vector<tuple<string, string, actions>>& list, const vector<tuple<string, string, actions>>& received) {
+  int changes = 0;
+  for (size_t i = 0; i < std::min(received.size(), list.size()); ++i) {
+    if (std::get<1>(received[i]) == std::get<1>(list[i]))
+      continue;
+
+    struct std::tm tm1 = {0}, tm2 = {0};
+    std::istringstream ss1(std::get<1>(received[i]));
+    std::istringstream ss2(std::get<1>(list[i]));
+    ss1 >> std::get_time(&tm1, "%a %b %d %H:%M:%S %Y");
+    ss2 >> std::get_time(&tm2, "%a %b %d %H:%M:%S %Y");
+    if (mktime(&tm1) > mktime(&tm2) && std::get<2>(received[i]) != std::get<2>(list[i])) {
+      list[i] = received[i];
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+// ./bench [MEMBERS] [ROUNDS]
+int main(int argc, char *argv[]) {
+  size_t members = argc > 1 ? atoi(argv[1]) : 20;
+  int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+  if (members == 0 || rounds <= 0) {
+    fprintf(stderr, "usage: ./bench [MEMBERS] [ROUNDS]\n");
+    exit(1);
+  }
+  uint64_t now = now_ms();
+
+  // old format
+  vector<tuple<string, string, actions>> legacy_sender, legacy_receiver;
+  for (size_t i = 0; i < members; ++i) {
+    string ip = "172.22." + std::to_string(94 + i / 250) + "." + std::to_string(1 + i % 250);
+    legacy_sender.push_back({ip, heartbeat_to_string(now + 5000), JOIN});
+    legacy_receiver.push_back({ip, heartbeat_to_string(now), JOIN});
+  }
+  size_t legacy_bytes = legacy_encode(legacy_sender).size();
+
+  long long start = now_us();
+  for (int r = 0; r < rounds; ++r) {
+    string msg = legacy_encode(legacy_sender);
+    legacy_merge(legacy_receiver, legacy_decode(msg.c_str()));
+  }
+  double legacy_s = (now_us() - start) / 1e6;
+
+  // binary format
+  vector<member_entry> sender;
+  member_table receiver;
+  for (size_t i = 0; i < members; ++i) {
+    member_entry e;
+    e.addr = inet_addr(std::get<0>(legacy_sender[i]).c_str());
+    e.incarnation = 0;
+    e.status = JOIN;
+    e.heartbeat = now + 5000;
+    sender.push_back(e);
+    e.heartbeat = now;
+    member_add(receiver, e);
+  }
+  vector<char> buf(UPDATE_PREFIX_SIZE + members * ENTRY_WIRE_SIZE);
+  vector<member_entry> received(members), changes(members);
+  uint8_t flags;
+  uint64_t version = 0;
+
+  start = now_us();
+  for (int r = 0; r < rounds; ++r) {
+    size_t len = encode_update(0, sender.data(), members, buf.data(), buf.size());
+    int n = decode_update(buf.data(), len, &flags, received.data(), members);
+    merge_update(receiver, received.data(), n, 0, now, version, changes.data());
+  }
+  double binary_s = (now_us() - start) / 1e6;
+
+  printf("%zu members, %d rounds (encode + decode + merge)\n", members, rounds);
+  printf("text:   %6zu bytes/msg %s  %10.0f msgs/s\n", legacy_bytes,
+    legacy_bytes > BUFSIZE ? "(over BUFSIZE)" : "              ", rounds / legacy_s);
+  printf("binary: %6zu bytes/msg %s  %10.0f msgs/s\n", buf.size(),
+    members > MAX_UPDATE_ENTRIES ? "(over BUFSIZE)" : "              ", rounds / binary_s);
+  printf("speedup %.1fx, %.1fx smaller\n", legacy_s / binary_s, (double) legacy_bytes / buf.size());
+
+  // bytes per protocol period: full list vs a PING carrying the most piggybacked changes
+  size_t full_msgs = (members + MAX_UPDATE_ENTRIES - 1) / MAX_UPDATE_ENTRIES;
+  size_t full_bytes = full_msgs * UPDATE_PREFIX_SIZE + members * ENTRY_WIRE_SIZE;
+  printf("full list %zu bytes in %zu datagrams, SWIM PING at most %d bytes\n", full_bytes, full_msgs,
+    PING_HEADER_SIZE + 4 + 2 + MAX_PIGGYBACK_ENTRIES * ENTRY_WIRE_SIZE);
+  return 0;
+}
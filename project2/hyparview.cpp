@@ -0,0 +1,540 @@
+/*
+** hyparview.cpp -- partial view membership (HyParView) for clusters too big for full lists
+**
+** Instead of the whole list, a member keeps a small active view (symmetric
+** neighbors it probes and floods broadcasts over) and a larger passive view
+** (backup addresses). A JOIN is spread by random walks (FORWARD_JOIN) that end
+** in active views and leave the joiner in passive views on the way. An active
+** neighbor that stops answering PINGs is replaced by a passive member that
+** accepts a NEIGHBOR request, and every `shuffle_interval_ms` a random walk
+** (SHUFFLE) swaps samples of passive views so they keep pointing at live members.
+**
+** Memory and traffic per member depend on the view sizes, not on the cluster
+** size. The full list is only built on demand: hpv_collect floods a request over
+** the active views and every member answers it directly (HERE).
+**
+** Like swim_node, an hpv_node does no I/O and reads no clock: messages go out
+** through `send`, incoming ones are handed to hpv_receive, and its probe,
+** shuffle and NEIGHBOR timers are on a timer_wheel the caller advances.
+**
+** Include after swim.cpp.
+*/
+
+#include <deque>
+#include <set>
+#include <unordered_set>
+
+#define HPV_JOIN_HEADER "HJOIN\n"
+#define HPV_FORWARD_JOIN_HEADER "HFWD\n"
+#define HPV_NEIGHBOR_HEADER "HNEIGH\n"
+#define HPV_NEIGHBOR_OK_HEADER "HNOK\n"
+#define HPV_NEIGHBOR_NO_HEADER "HNNO\n"
+#define HPV_DISCONNECT_HEADER "HDISC\n"
+#define HPV_SHUFFLE_HEADER "HSHUF\n"
+#define HPV_SHUFFLE_REPLY_HEADER "HSHUFR\n"
+#define HPV_PING_HEADER "HPING\n"
+#define HPV_ACK_HEADER "HACK\n"
+#define HPV_BROADCAST_HEADER "HCAST\n"
+#define HPV_HERE_HEADER "HHERE\n"
+#define HPV_BUFSIZE 1024
+#define HPV_SHUFFLE_MAX (HPV_BUFSIZE - sizeof(HPV_SHUFFLE_HEADER))     // largest SHUFFLE body we forward
+#define HPV_SHUFFLE_ADDRS ((HPV_SHUFFLE_MAX - 7) / 4)                 // addresses that fit in a SHUFFLE or its reply
+#define HPV_SEEN_MAX 8192             // broadcasts remembered to drop duplicates
+#define HPV_KIND_DATA 0               // broadcast for the caller
+#define HPV_KIND_COLLECT 1            // broadcast asking every member to answer HERE
+
+struct hpv_config {
+  int active_size = 5;                // about log10(n) + 1 for thousands of members
+  int passive_size = 30;
+  int active_walk = 6;                // hops of a FORWARD_JOIN
+  int passive_walk = 3;               // hops left when a FORWARD_JOIN also puts the joiner in a passive view
+  int shuffle_active = 3;             // active members in a SHUFFLE sample
+  int shuffle_passive = 4;            // passive members in a SHUFFLE sample
+  int shuffle_walk = 6;               // hops of a SHUFFLE
+  uint64_t shuffle_interval_ms = 5000;
+  uint64_t probe_interval_ms = 1000;  // active neighbors are PINGed this often
+  int probe_misses = 2;               // unanswered PINGs in a row before a neighbor is dropped
+  uint64_t neighbor_timeout_ms = 500; // a NEIGHBOR request without answer counts as refused
+};
+
+// (origin, broadcast payload, length)
+typedef std::function<void(uint32_t, const char*, size_t)> hpv_deliver_fn;
+
+struct hpv_node {
+  uint32_t self;
+  uint32_t contact;                           // joined through, joined again through if we end up alone
+  hpv_config config;
+  vector<uint32_t> active;
+  vector<uint32_t> passive;
+  std::unordered_map<uint32_t, int> misses;   // unanswered PINGs per active neighbor
+  vector<uint32_t> shuffle_sent;              // what our last SHUFFLE (or its reply) gave away, evicted first
+
+  uint32_t neighbor_pending;                  // passive member asked to become active, 0 if none
+  uint64_t neighbor_timer;
+  uint64_t probe_timer;
+  uint64_t shuffle_timer;
+  timer_wheel* timers;
+
+  uint32_t next_id;                           // of our broadcasts
+  std::unordered_set<uint64_t> seen;          // origin << 32 | id
+  std::deque<uint64_t> seen_order;
+
+  uint32_t collect_id;                        // our last hpv_collect, 0 if none
+  std::set<uint32_t> collected;               // members that answered it
+
+  uint64_t rng;
+  swim_send_fn send;
+  hpv_deliver_fn deliver;
+};
+
+uint64_t hpv_random(hpv_node* node) {
+  // xorshift64
+  node->rng ^= node->rng << 13;
+  node->rng ^= node->rng >> 7;
+  node->rng ^= node->rng << 17;
+  return node->rng;
+}
+
+bool hpv_contains(const vector<uint32_t>& view, uint32_t addr) {
+  return std::find(view.begin(), view.end(), addr) != view.end();
+}
+
+void hpv_erase(vector<uint32_t>& view, uint32_t addr) {
+  view.erase(std::remove(view.begin(), view.end(), addr), view.end());
+}
+
+// random member of `view` other than `exclude`, 0 if there is none
+uint32_t hpv_pick(hpv_node* node, const vector<uint32_t>& view, uint32_t exclude) {
+  vector<uint32_t> candidates;
+  for (uint32_t addr : view) {
+    if (addr != exclude)
+      candidates.push_back(addr);
+  }
+  return candidates.empty() ? 0 : candidates[hpv_random(node) % candidates.size()];
+}
+
+// up to `k` random members of `view`
+vector<uint32_t> hpv_sample(hpv_node* node, const vector<uint32_t>& view, int k) {
+  vector<uint32_t> sample = view;
+  size_t n = std::min(sample.size(), (size_t) std::max(k, 0));
+  for (size_t i = 0; i < n; ++i)
+    std::swap(sample[i], sample[i + hpv_random(node) % (sample.size() - i)]);
+  sample.resize(n);
+  return sample;
+}
+
+void hpv_send(hpv_node* node, uint32_t to, const char* header, const char* body, size_t body_len) {
+  char msg[HPV_BUFSIZE];
+  size_t header_len = strlen(header);
+  if (header_len + body_len > HPV_BUFSIZE)
+    return;
+  memcpy(msg, header, header_len);
+  memcpy(msg + header_len, body, body_len);
+  node->send(to, msg, header_len + body_len);
+}
+
+void hpv_add_passive(hpv_node* node, uint32_t addr) {
+  if (addr == node->self || hpv_contains(node->active, addr) || hpv_contains(node->passive, addr))
+    return;
+  if ((int) node->passive.size() >= node->config.passive_size) {
+    // make room, preferably with an address we just handed out in a shuffle
+    uint32_t victim = 0;
+    for (uint32_t sent : node->shuffle_sent) {
+      if (hpv_contains(node->passive, sent)) {
+        victim = sent;
+        break;
+      }
+    }
+    if (victim == 0)
+      victim = hpv_pick(node, node->passive, 0);
+    hpv_erase(node->passive, victim);
+  }
+  node->passive.push_back(addr);
+}
+
+// `addr` leaves the active view, into the passive one unless it failed
+void hpv_drop_active(hpv_node* node, uint32_t addr, bool to_passive) {
+  if (!hpv_contains(node->active, addr))
+    return;
+  hpv_erase(node->active, addr);
+  node->misses.erase(addr);
+  if (to_passive)
+    hpv_add_passive(node, addr);
+}
+
+void hpv_add_active(hpv_node* node, uint32_t addr) {
+  if (addr == node->self || hpv_contains(node->active, addr))
+    return;
+  if ((int) node->active.size() >= node->config.active_size) {
+    // full: a random neighbor makes room and is told so
+    uint32_t victim = hpv_pick(node, node->active, 0);
+    hpv_send(node, victim, HPV_DISCONNECT_HEADER, NULL, 0);
+    hpv_drop_active(node, victim, true);
+  }
+  hpv_erase(node->passive, addr);
+  node->active.push_back(addr);
+  node->misses[addr] = 0;
+}
+
+// =========================
+// HNEIGH\n
+// [u8 high priority]
+// =========================
+// ask a passive member to become active, high priority if we have no neighbor left
+void hpv_repair(hpv_node* node, uint64_t now) {
+  if (node->neighbor_pending != 0 || (int) node->active.size() >= node->config.active_size)
+    return;
+  uint32_t addr = hpv_pick(node, node->passive, 0);
+  if (addr == 0)
+    return;
+  char high = node->active.empty() ? 1 : 0;
+  hpv_send(node, addr, HPV_NEIGHBOR_HEADER, &high, 1);
+  node->neighbor_pending = addr;
+  node->neighbor_timer = timer_add(node->timers, now + node->config.neighbor_timeout_ms, [node, addr](uint64_t now) {
+    // no answer, it is probably gone
+    node->neighbor_timer = 0;
+    if (node->neighbor_pending != addr)
+      return;
+    node->neighbor_pending = 0;
+    hpv_erase(node->passive, addr);
+    hpv_repair(node, now);
+  });
+}
+
+// the answer to our NEIGHBOR request came, or it will not
+void hpv_neighbor_done(hpv_node* node) {
+  node->neighbor_pending = 0;
+  if (node->neighbor_timer != 0) {
+    timer_cancel(node->timers, node->neighbor_timer);
+    node->neighbor_timer = 0;
+  }
+}
+
+// an active neighbor failed: forget it and find a replacement
+void hpv_neighbor_failed(hpv_node* node, uint32_t addr, uint64_t now) {
+  hpv_drop_active(node, addr, false);
+  hpv_repair(node, now);
+}
+
+// PING every active neighbor, dropping those that missed too many
+void hpv_probe(hpv_node* node, uint64_t now) {
+  vector<uint32_t> neighbors = node->active;
+  for (uint32_t addr : neighbors) {
+    if (node->misses[addr] >= node->config.probe_misses) {
+      hpv_neighbor_failed(node, addr, now);
+      continue;
+    }
+    ++node->misses[addr];
+    hpv_send(node, addr, HPV_PING_HEADER, NULL, 0);
+  }
+  hpv_repair(node, now);
+  if ((int) node->active.size() < node->config.active_size && node->passive.empty() && node->contact != 0) {
+    // the JOIN or its walks were lost, or everyone we knew is gone: we may be cut off with a few others
+    hpv_add_active(node, node->contact);
+    hpv_send(node, node->contact, HPV_JOIN_HEADER, NULL, 0);
+  }
+
+  node->probe_timer = timer_add(node->timers, now + node->config.probe_interval_ms,
+    [node](uint64_t now) { hpv_probe(node, now); });
+}
+
+// =========================
+// HSHUF\n
+// [u32 origin][u8 hops left]
+// [u16 n][n * u32 addr]
+// =========================
+size_t hpv_encode_addrs(char* p, const vector<uint32_t>& addrs) {
+  uint16_t n = htons((uint16_t) addrs.size());
+  memcpy(p, &n, 2);
+  memcpy(p + 2, addrs.data(), addrs.size() * 4);
+  return 2 + addrs.size() * 4;
+}
+
+// decode the list at `p`, empty if it does not fit in `len`
+vector<uint32_t> hpv_decode_addrs(const char* p, size_t len) {
+  vector<uint32_t> addrs;
+  if (len < 2)
+    return addrs;
+  uint16_t n;
+  memcpy(&n, p, 2);
+  n = ntohs(n);
+  if (2 + (size_t) n * 4 > len)
+    return addrs;
+  addrs.resize(n);
+  memcpy(addrs.data(), p + 2, (size_t) n * 4);
+  return addrs;
+}
+
+// take what a SHUFFLE brought into the passive view
+void hpv_integrate(hpv_node* node, const vector<uint32_t>& addrs) {
+  for (uint32_t addr : addrs)
+    hpv_add_passive(node, addr);
+}
+
+void hpv_shuffle(hpv_node* node, uint64_t now) {
+  uint32_t to = hpv_pick(node, node->active, 0);
+  if (to != 0) {
+    vector<uint32_t> sample = hpv_sample(node, node->active, node->config.shuffle_active);
+    vector<uint32_t> passive = hpv_sample(node, node->passive, node->config.shuffle_passive);
+    sample.insert(sample.end(), passive.begin(), passive.end());
+    if (sample.size() > HPV_SHUFFLE_ADDRS - 1)
+      sample.resize(HPV_SHUFFLE_ADDRS - 1);   // room for ourselves
+    node->shuffle_sent = sample;
+    sample.push_back(node->self);
+
+    char body[HPV_BUFSIZE];
+    memcpy(body, &node->self, 4);
+    body[4] = (char) node->config.shuffle_walk;
+    size_t len = 5 + hpv_encode_addrs(body + 5, sample);
+    hpv_send(node, to, HPV_SHUFFLE_HEADER, body, len);
+  }
+
+  node->shuffle_timer = timer_add(node->timers, now + node->config.shuffle_interval_ms,
+    [node](uint64_t now) { hpv_shuffle(node, now); });
+}
+
+// =========================
+// HCAST\n
+// [u32 origin][u32 id][u8 kind]
+// [payload]
+// =========================
+// flood a broadcast to every active neighbor but `from`, false if we had seen it already
+bool hpv_flood(hpv_node* node, uint32_t from, const char* body, size_t len) {
+  uint32_t origin, id;
+  memcpy(&origin, body, 4);
+  id = get_u32(body + 4);
+  uint64_t key = ((uint64_t) origin << 32) | id;
+  if (!node->seen.insert(key).second)
+    return false;
+  node->seen_order.push_back(key);
+  if (node->seen_order.size() > HPV_SEEN_MAX) {
+    node->seen.erase(node->seen_order.front());
+    node->seen_order.pop_front();
+  }
+
+  for (uint32_t addr : node->active) {
+    if (addr != from)
+      hpv_send(node, addr, HPV_BROADCAST_HEADER, body, len);
+  }
+  return true;
+}
+
+void hpv_init(hpv_node* node, uint32_t self, const hpv_config& config, timer_wheel* timers, uint64_t seed,
+              swim_send_fn send, hpv_deliver_fn deliver) {
+  node->self = self;
+  node->contact = 0;
+  node->config = config;
+  node->active.clear();
+  node->passive.clear();
+  node->misses.clear();
+  node->shuffle_sent.clear();
+  node->neighbor_pending = 0;
+  node->neighbor_timer = 0;
+  node->probe_timer = 0;
+  node->shuffle_timer = 0;
+  node->timers = timers;
+  node->next_id = 0;
+  node->seen.clear();
+  node->seen_order.clear();
+  node->collect_id = 0;
+  node->collected.clear();
+  node->rng = seed ? seed : 88172645463325252ULL;
+  node->send = send;
+  node->deliver = deliver;
+}
+
+// start probing and shuffling, then join through `contact` (0 to start a new group)
+void hpv_start(hpv_node* node, uint32_t contact, uint64_t now) {
+  node->probe_timer = timer_add(node->timers, now + node->config.probe_interval_ms,
+    [node](uint64_t now) { hpv_probe(node, now); });
+  node->shuffle_timer = timer_add(node->timers, now + node->config.shuffle_interval_ms,
+    [node](uint64_t now) { hpv_shuffle(node, now); });
+  if (contact != 0 && contact != node->self) {
+    node->contact = contact;
+    hpv_add_active(node, contact);
+    hpv_send(node, contact, HPV_JOIN_HEADER, NULL, 0);
+  }
+}
+
+// cancel every timer of `node`
+void hpv_stop(hpv_node* node) {
+  timer_cancel(node->timers, node->probe_timer);
+  timer_cancel(node->timers, node->shuffle_timer);
+  timer_cancel(node->timers, node->neighbor_timer);
+  node->probe_timer = node->shuffle_timer = node->neighbor_timer = 0;
+}
+
+// leave: tell every active neighbor, which replace us from their passive views
+void hpv_leave(hpv_node* node) {
+  for (uint32_t addr : node->active)
+    hpv_send(node, addr, HPV_DISCONNECT_HEADER, NULL, 0);
+  hpv_stop(node);
+}
+
+// send `data` to every member, return its id
+uint32_t hpv_broadcast(hpv_node* node, uint8_t kind, const char* data, size_t len) {
+  char body[HPV_BUFSIZE];
+  if (len + 9 > HPV_BUFSIZE - sizeof(HPV_BROADCAST_HEADER))
+    return 0;
+  uint32_t id = ++node->next_id;
+  memcpy(body, &node->self, 4);
+  put_u32(body + 4, id);
+  body[8] = (char) kind;
+  memcpy(body + 9, data, len);
+  hpv_flood(node, 0, body, len + 9);
+  return id;
+}
+
+/**
+ * Ask every member for its address, they answer into `collected`: the full list on demand
+ */
+void hpv_collect(hpv_node* node) {
+  node->collected.clear();
+  node->collected.insert(node->self);
+  node->collect_id = hpv_broadcast(node, HPV_KIND_COLLECT, NULL, 0);
+}
+
+/**
+ * Handle one message from `from`, return false if it is not a HyParView message
+ */
+bool hpv_receive(hpv_node* node, uint32_t from, const char* buf, size_t len, uint64_t now) {
+  if (len == 0 || buf[0] != 'H')
+    return false;
+  const char* newline = (const char*) memchr(buf, '\n', len);
+  if (newline == NULL)
+    return false;
+  size_t header_len = newline - buf + 1;
+  string header(buf, header_len);
+  const char* body = buf + header_len;
+  size_t body_len = len - header_len;
+
+  if (header == HPV_PING_HEADER) {
+    // a neighbor that is not in our active view (its DISCONNECT or our NEIGHBOR_OK was lost)
+    // is told to drop us, so broadcasts never go one way only
+    if (hpv_contains(node->active, from))
+      hpv_send(node, from, HPV_ACK_HEADER, NULL, 0);
+    else
+      hpv_send(node, from, HPV_DISCONNECT_HEADER, NULL, 0);
+
+  } else if (header == HPV_ACK_HEADER) {
+    if (hpv_contains(node->active, from))
+      node->misses[from] = 0;
+
+  } else if (header == HPV_JOIN_HEADER) {
+    // take the joiner and send random walks to place it in other views too
+    hpv_add_active(node, from);
+    char walk[5];
+    memcpy(walk, &from, 4);
+    walk[4] = (char) node->config.active_walk;
+    for (uint32_t addr : node->active) {
+      if (addr != from)
+        hpv_send(node, addr, HPV_FORWARD_JOIN_HEADER, walk, 5);
+    }
+
+  } else if (header == HPV_FORWARD_JOIN_HEADER && body_len >= 5) {
+    // =========================
+    // HFWD\n
+    // [u32 joiner][u8 hops left]
+    // =========================
+    uint32_t joiner;
+    memcpy(&joiner, body, 4);
+    int hops = (uint8_t) body[4];
+    if (joiner == node->self)
+      return true;
+    if (hops <= 0 || node->active.size() <= 1) {
+      char high = 1;
+      hpv_add_active(node, joiner);
+      hpv_send(node, joiner, HPV_NEIGHBOR_HEADER, &high, 1);
+    } else {
+      if (hops == node->config.passive_walk)
+        hpv_add_passive(node, joiner);
+      uint32_t next = hpv_pick(node, node->active, from);
+      char walk[5];
+      memcpy(walk, &joiner, 4);
+      walk[4] = (char) (hops - 1);
+      hpv_send(node, next, HPV_FORWARD_JOIN_HEADER, walk, 5);
+    }
+
+  } else if (header == HPV_NEIGHBOR_HEADER && body_len >= 1) {
+    bool high = body[0] != 0;
+    if (high || (int) node->active.size() < node->config.active_size) {
+      hpv_add_active(node, from);
+      hpv_send(node, from, HPV_NEIGHBOR_OK_HEADER, NULL, 0);
+    } else {
+      hpv_send(node, from, HPV_NEIGHBOR_NO_HEADER, NULL, 0);
+    }
+
+  } else if (header == HPV_NEIGHBOR_OK_HEADER) {
+    hpv_add_active(node, from);
+    if (node->neighbor_pending == from) {
+      hpv_neighbor_done(node);
+      hpv_repair(node, now);
+    }
+
+  } else if (header == HPV_NEIGHBOR_NO_HEADER) {
+    if (node->neighbor_pending == from) {
+      hpv_neighbor_done(node);
+      hpv_repair(node, now);
+    }
+
+  } else if (header == HPV_DISCONNECT_HEADER) {
+    hpv_drop_active(node, from, true);
+    hpv_repair(node, now);
+
+  } else if (header == HPV_SHUFFLE_HEADER && body_len >= 5) {
+    // a walk longer than we could forward is not one we sent, drop it rather than copy it
+    if (body_len > HPV_SHUFFLE_MAX)
+      return true;
+    uint32_t origin;
+    memcpy(&origin, body, 4);
+    int hops = (uint8_t) body[4] - 1;
+    vector<uint32_t> sample = hpv_decode_addrs(body + 5, body_len - 5);
+    uint32_t next = hpv_pick(node, node->active, from);
+    if (hops > 0 && next != 0 && next != origin) {
+      char walk[HPV_BUFSIZE];
+      memcpy(walk, body, body_len);
+      walk[4] = (char) hops;
+      hpv_send(node, next, HPV_SHUFFLE_HEADER, walk, body_len);
+    } else if (origin != node->self) {
+      // =========================
+      // HSHUFR\n
+      // [u16 n][n * u32 addr]
+      // =========================
+      int k = (int) std::min(sample.size(), (size_t) HPV_SHUFFLE_ADDRS);
+      vector<uint32_t> reply = hpv_sample(node, node->passive, k);
+      char out[HPV_BUFSIZE];
+      size_t out_len = hpv_encode_addrs(out, reply);
+      hpv_send(node, origin, HPV_SHUFFLE_REPLY_HEADER, out, out_len);
+      node->shuffle_sent = reply;
+      hpv_integrate(node, sample);
+    }
+
+  } else if (header == HPV_SHUFFLE_REPLY_HEADER) {
+    hpv_integrate(node, hpv_decode_addrs(body, body_len));
+
+  } else if (header == HPV_BROADCAST_HEADER && body_len >= 9) {
+    if (!hpv_flood(node, from, body, body_len))
+      return true;
+    uint32_t origin;
+    memcpy(&origin, body, 4);
+    if (body[8] == HPV_KIND_COLLECT) {
+      // =========================
+      // HHERE\n
+      // [u32 collect id]
+      // =========================
+      hpv_send(node, origin, HPV_HERE_HEADER, body + 4, 4);
+    } else if (node->deliver) {
+      node->deliver(origin, body + 9, body_len - 9);
+    }
+
+  } else if (header == HPV_HERE_HEADER && body_len >= 4) {
+    if (node->collect_id != 0 && get_u32(body) == node->collect_id)
+      node->collected.insert(from);
+
+  } else {
+    // one of our headers with a body too short for it is dropped here, anything else is not ours
+    return header == HPV_FORWARD_JOIN_HEADER || header == HPV_NEIGHBOR_HEADER || header == HPV_SHUFFLE_HEADER ||
+      header == HPV_BROADCAST_HEADER || header == HPV_HERE_HEADER;
+  }
+  return true;
+}
@@ -3,8 +3,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
-#include <sys/types.h> 
+#include <fcntl.h>
+#include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
@@ -13,18 +15,40 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <map>
 #include <chrono>
 #include <ctime>
 
 #include "common.cpp"
+#include "membership.cpp"
 
 #define INTRODUCER_PORT "8888"
 #define COMMUNICATION_PORT 8080
 #define INTRODUCER_IP "172.22.94.58" // TODO: CHANGE THIS TO YOUR VM ADDRESS
 #define MAX_CLIENTS 50
+#define JOIN_BATCH_MS 50          // joins arriving this close together are announced together
+#define JOIN_REPLY_TIMEOUT_MS 500 // resend the batch if the member on this VM does not answer
+#define JOIN_ATTEMPTS 4
+#define JOIN_REPLY_MAX 65536      // the snapshot is one datagram
+#define MAX_EVENTS 64
 
 using std::chrono::system_clock;
 using std::string;
+using std::map;
+
+// a process waiting for its join response, then for it to CONFIRM
+struct joiner {
+  string ip;
+  bool answered;
+};
+
+static map<int, joiner> joiners;    // by TCP socket
+static vector<int> batch;           // sockets of joiners not announced yet
+static vector<int> in_flight;       // sockets of joiners in the JOIN we wait a reply for
+static uint64_t batch_deadline;     // when `batch` goes out, 0 if empty
+static uint64_t reply_deadline;     // when to resend `in_flight`, 0 if nothing in flight
+static int attempts;
+static uint32_t join_seq;           // numbers the JOINs so a late reply is not taken for the next batch
 
 // get sockaddr, IPv4 or IPv6:
 void *get_in_addr(struct sockaddr *sa)
@@ -36,7 +60,152 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr);
 }
 
+// milliseconds on a clock that does not jump
+uint64_t monotonic_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void drop_joiner(int epoll_fd, int fd) {
+  epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  joiners.erase(fd);
+  batch.erase(std::remove(batch.begin(), batch.end(), fd), batch.end());
+  in_flight.erase(std::remove(in_flight.begin(), in_flight.end(), fd), in_flight.end());
+}
+
+// ===========================
+// [ip]\n
+// [time]\n
+// [snapshot length]\n
+// [snapshot: entries as in membership.cpp]
+// ===========================
+void answer_joiner(int epoll_fd, int fd, const char* snapshot, size_t len) {
+  // get timestamp where the process has joined
+  std::time_t t = system_clock::to_time_t(system_clock::now());
+  string time_str = std::ctime(&t); // this includes a '\n' at the end
+
+  string header = joiners[fd].ip + "\n" + time_str + std::to_string(len) + "\n";
+  if (write_all_to_socket(fd, header.c_str(), header.size()) != (ssize_t) header.size() ||
+      write_all_to_socket(fd, snapshot, len) != (ssize_t) len) {
+    drop_joiner(epoll_fd, fd);
+    return;
+  }
+  joiners[fd].answered = true;
+}
+
+// ===========================
+// JOIN\n
+// [reply port]\n
+// [sequence number]\n
+// [ip]\n
+// ...
+// ===========================
+// announce every joiner in `in_flight` to the member on this VM in one datagram
+void send_join(int udp_fd) {
+  struct sockaddr_in local;
+  socklen_t local_len = sizeof(local);
+  getsockname(udp_fd, (struct sockaddr *) &local, &local_len);
+
+  string message = "JOIN\n" + std::to_string(ntohs(local.sin_port)) + "\n" + std::to_string(join_seq) + "\n";
+  for (int fd : in_flight)
+    message += joiners[fd].ip + "\n";
+
+  struct sockaddr_in servaddr;
+  memset(&servaddr, 0, sizeof(servaddr));
+  servaddr.sin_family = AF_INET;
+  servaddr.sin_port = htons(COMMUNICATION_PORT);
+  servaddr.sin_addr.s_addr = inet_addr(INTRODUCER_IP);
+  sendto(udp_fd, message.c_str(), message.size(), 0, (const struct sockaddr *) &servaddr, sizeof(servaddr));
+
+  ++attempts;
+  reply_deadline = monotonic_ms() + JOIN_REPLY_TIMEOUT_MS;
+}
+
+// move the waiting batch in flight if nothing else is
+void flush_batch(int udp_fd) {
+  if (batch.empty())
+    batch_deadline = 0;
+  if (!in_flight.empty() || batch.empty())
+    return;
+  in_flight.swap(batch);
+  batch_deadline = 0;
+  attempts = 0;
+  ++join_seq;
+  send_join(udp_fd);
+}
+
+void accept_joiner(int epoll_fd, int introducer_socket) {
+  struct sockaddr_storage clientaddr;
+  socklen_t clientaddrsize = sizeof(clientaddr);
+  int client_fd = accept(introducer_socket, (struct sockaddr *) &clientaddr, &clientaddrsize);
+  if (client_fd < 0)
+    return;
+
+  char s[INET_ADDRSTRLEN] = {0};
+  inet_ntop(clientaddr.ss_family, get_in_addr((struct sockaddr *) &clientaddr), s, sizeof(s));
+  fprintf(stderr, "introducer: got connection from %s\n", s);
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = client_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+  joiners[client_fd] = {string(s), false};
+
+  // the member on this VM is joining itself and not listening yet, it starts the group alone
+  if (inet_addr(s) == inet_addr(INTRODUCER_IP)) {
+    answer_joiner(epoll_fd, client_fd, NULL, 0);
+    return;
+  }
+
+  batch.push_back(client_fd);
+  if (batch_deadline == 0)
+    batch_deadline = monotonic_ms() + JOIN_BATCH_MS;
+}
+
+// ===========================
+// JOINED\n
+// [u32 sequence number]
+// [snapshot]
+// ===========================
+// the member on this VM added the batch in flight and sent its list, pass it on to the joiners
+void receive_snapshot(int epoll_fd, int udp_fd) {
+  static char buf[JOIN_REPLY_MAX];
+  ssize_t len = recv(udp_fd, buf, sizeof(buf), 0);
+  if (len < 11 || memcmp(buf, "JOINED\n", 7) != 0 || get_u32(buf + 7) != join_seq || reply_deadline == 0)
+    return;
 
+  vector<int> answered;
+  answered.swap(in_flight);
+  for (int fd : answered)
+    answer_joiner(epoll_fd, fd, buf + 11, len - 11);
+  fprintf(stderr, "introducer: %zu joined\n", answered.size());
+  reply_deadline = 0;
+  flush_batch(udp_fd);
+}
+
+// the batch in flight got no answer in time, resend it or give up on it
+void reply_timeout(int epoll_fd, int udp_fd) {
+  if (attempts < JOIN_ATTEMPTS) {
+    send_join(udp_fd);
+    return;
+  }
+  fprintf(stderr, "introducer: no answer from %s, dropping %zu joiners\n", INTRODUCER_IP, in_flight.size());
+  vector<int> dropped = in_flight;
+  for (int fd : dropped)
+    drop_joiner(epoll_fd, fd);
+  reply_deadline = 0;
+  flush_batch(udp_fd);
+}
+
+/**
+ * Joins are handled concurrently: every connection is answered with the joiner's IP and a
+ * snapshot of the whole membership list, so the joiner starts with a full view. Joins that
+ * arrive within JOIN_BATCH_MS are announced to the member on this VM in one JOIN datagram,
+ * and so disseminated by its gossip together.
+ */
 int main(int argc, char **argv) {
   if (argc != 1) {
     fprintf(stderr, "Usage: ./introducer");
@@ -44,45 +213,58 @@ int main(int argc, char **argv) {
   }
 
   int introducer_socket = setup_server(INTRODUCER_PORT, MAX_CLIENTS); // TCP connection
-  int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // UPD introducer connection
+  int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);  // UPD introducer connection
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = 0;
+  if (bind(udp_fd, (struct sockaddr *) &local, sizeof(local)) < 0)
+    error("ERROR on binding");
+
+  int epoll_fd = epoll_create1(0);
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = introducer_socket;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, introducer_socket, &event);
+  event.data.fd = udp_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, udp_fd, &event);
 
+  fprintf(stderr, "waiting for new processes to join...\n");
   while (1) {
-    fprintf(stderr, "waiting for new process to join...\n");
-
-    struct sockaddr_storage clientaddr;
-    socklen_t clientaddrsize = sizeof(clientaddr);
-    int client_fd = accept(introducer_socket, (struct sockaddr *) &clientaddr, &clientaddrsize);
-
-    char s[INET_ADDRSTRLEN] = {0};
-    inet_ntop(clientaddr.ss_family, get_in_addr((struct sockaddr *) &clientaddr), s, sizeof(s));
-    fprintf(stderr, "introducer: got connection from %s\n", s);
-
-    // get timestamp where the process has joined
-    std::time_t t = system_clock::to_time_t(system_clock::now());
-    string time_str = std::ctime(&t); // this includes a '\n' at the end
-    time_str.pop_back();
-    // std::cerr << time_str << std::endl;
-
-    // send the ip address of new process and current time to process 1
-    string message = s + string("\n") + time_str;
-    send(client_fd, message.c_str(), message.size(), 0);
-
-    // wait for confirmation from the new process
-    char buf[10] = {0};
-    recv(client_fd, buf, 10, 0);
-    fprintf(stderr, "client confirmation: %s\n", buf);
-
-    close(client_fd);
-
-    // send UDP broadcast of JOIN message to the machine introducer is on
-    struct sockaddr_in servaddr;
-    memset(&servaddr, 0, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(COMMUNICATION_PORT);
-    servaddr.sin_addr.s_addr = inet_addr(INTRODUCER_IP);
-
-    string join_broadcast = "JOIN\n" + message + "\n";
-    sendto(sockfd, join_broadcast.c_str(), join_broadcast.size(), 0, (const struct sockaddr *) &servaddr, sizeof(servaddr));
+    uint64_t now = monotonic_ms();
+    uint64_t next = 0;
+    if (batch_deadline != 0 && in_flight.empty())
+      next = batch_deadline;
+    if (reply_deadline != 0 && (next == 0 || reply_deadline < next))
+      next = reply_deadline;
+    int timeout = next == 0 ? -1 : (next > now ? next - now : 0);
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == introducer_socket) {
+        accept_joiner(epoll_fd, introducer_socket);
+      } else if (fd == udp_fd) {
+        receive_snapshot(epoll_fd, udp_fd);
+      } else if (joiners.count(fd)) {
+        // wait for confirmation from the new process, or it went away
+        char buf[10] = {0};
+        ssize_t len = recv(fd, buf, sizeof(buf) - 1, 0);
+        if (len > 0)
+          fprintf(stderr, "client confirmation: %s\n", buf);
+        if (len <= 0 || joiners[fd].answered)
+          drop_joiner(epoll_fd, fd);
+      }
+    }
+
+    now = monotonic_ms();
+    if (reply_deadline != 0 && now >= reply_deadline)
+      reply_timeout(epoll_fd, udp_fd);
+    if (batch_deadline != 0 && now >= batch_deadline)
+      flush_batch(udp_fd);
   }
 
   return 0;
@@ -0,0 +1,95 @@
+/*
+** log_bench.cpp -- cost of logging for the threads that log
+**
+** WRITERS threads each log LINES membership lines as fast as they can, either
+** with a write() under a mutex (the old vm.log path) or through async_log.cpp.
+** Reports lines/s, how long a single log call keeps its caller, and how many
+** lines the ring dropped.
+*/
+
+#include "common.cpp"
+#include "membership.cpp"
+#include "async_log.cpp"
+
+#define BENCH_LOG "log_bench.log"
+
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sync_fd;
+static async_log* log_ring;
+static bool use_ring;
+static int lines_per_writer;
+
+struct writer_result {
+  vector<uint64_t> call_ns;
+};
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void* writer_loop(void* arg) {
+  writer_result* result = (writer_result*) arg;
+  result->call_ns.reserve(lines_per_writer);
+  for (int i = 0; i < lines_per_writer; ++i) {
+    string line = actions_to_string(i % 2 ? JOIN : FAILED) + " " + addr_to_string(htonl(0x0a000000 + i % 250 + 1)) + " " + std::to_string(i) + "\n";
+    uint64_t start = now_ns();
+    if (use_ring) {
+      async_log_write(log_ring, line.c_str(), line.size());
+    } else {
+      pthread_mutex_lock(&file_lock);
+      write(sync_fd, line.c_str(), line.size());
+      pthread_mutex_unlock(&file_lock);
+    }
+    result->call_ns.push_back(now_ns() - start);
+  }
+  return NULL;
+}
+
+// ./log_bench [WRITERS] [LINES]
+int main(int argc, char *argv[]) {
+  int writers = argc > 1 ? atoi(argv[1]) : 4;
+  lines_per_writer = argc > 2 ? atoi(argv[2]) : 200000;
+  if (writers <= 0 || lines_per_writer <= 0) {
+    fprintf(stderr, "usage: ./log_bench [WRITERS] [LINES]\n");
+    exit(1);
+  }
+
+  printf("%d writers, %d lines each\n", writers, lines_per_writer);
+  printf("%-6s %12s %10s %10s %10s %10s\n", "mode", "lines/s", "p50 ns", "p99 ns", "max ns", "dropped");
+  for (bool ring : {false, true}) {
+    use_ring = ring;
+    if (ring)
+      log_ring = async_log_open(BENCH_LOG);
+    else
+      sync_fd = open(BENCH_LOG, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    vector<pthread_t> tids(writers);
+    vector<writer_result> results(writers);
+    uint64_t start = now_ns();
+    for (int i = 0; i < writers; ++i)
+      pthread_create(&tids[i], NULL, writer_loop, &results[i]);
+    for (int i = 0; i < writers; ++i)
+      pthread_join(tids[i], NULL);
+    double seconds = (now_ns() - start) / 1e9;
+
+    uint64_t dropped = 0;
+    if (ring) {
+      dropped = async_log_dropped(log_ring);
+      async_log_close(log_ring);
+    } else {
+      close(sync_fd);
+    }
+
+    vector<uint64_t> all;
+    for (const writer_result& r : results)
+      all.insert(all.end(), r.call_ns.begin(), r.call_ns.end());
+    std::sort(all.begin(), all.end());
+    printf("%-6s %12.0f %10llu %10llu %10llu %10llu\n", ring ? "ring" : "sync", all.size() / seconds,
+      (unsigned long long) all[all.size() / 2], (unsigned long long) all[all.size() * 99 / 100],
+      (unsigned long long) all.back(), (unsigned long long) dropped);
+  }
+  unlink(BENCH_LOG);
+  return 0;
+}
@@ -0,0 +1,159 @@
+/*
+** lookup_bench.cpp -- membership lookups under reader contention
+**
+** READERS threads look up random members as fast as they can while one writer
+** changes a random member every millisecond, as the protocol thread does. Three
+** ways to share the list are compared:
+**   scan      list_lock around a linear scan of a vector (the old membership_list)
+**   hash      list_lock around the addr -> slot index of member_table
+**   snapshot  no lock, the index of the current RCU snapshot (snapshot.cpp)
+*/
+
+#include "common.cpp"
+#include "membership.cpp"
+#include "snapshot.cpp"
+
+#define WRITE_INTERVAL_US 1000
+
+static volatile bool bench_running;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<member_entry> scan_list;
+static member_table hash_table;
+static int members;
+
+enum bench_mode { SCAN, HASH, SNAPSHOT };
+
+struct reader_result {
+  bench_mode mode;
+  long long lookups;
+  long long found;
+};
+
+uint32_t bench_addr(int i) {
+  return htonl(0x0a000000 + i + 1);
+}
+
+void* reader_loop(void* arg) {
+  reader_result* result = (reader_result*) arg;
+  uint64_t rng = (uint64_t) arg | 1;
+  while (bench_running) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    uint32_t addr = bench_addr(rng % members);
+    bool alive = false;
+
+    if (result->mode == SCAN) {
+      pthread_mutex_lock(&list_lock);
+      for (size_t i = 0; i < scan_list.size(); ++i) {
+        if (scan_list[i].addr == addr) {
+          alive = scan_list[i].status == JOIN;
+          break;
+        }
+      }
+      pthread_mutex_unlock(&list_lock);
+    } else if (result->mode == HASH) {
+      pthread_mutex_lock(&list_lock);
+      int slot = member_slot(hash_table, addr);
+      alive = slot >= 0 && hash_table.entries[slot].status == JOIN;
+      pthread_mutex_unlock(&list_lock);
+    } else {
+      const member_snapshot* snapshot = snapshot_read_lock();
+      int slot = member_slot(snapshot->members, addr);
+      alive = slot >= 0 && snapshot->members.entries[slot].status == JOIN;
+      snapshot_read_unlock();
+    }
+
+    ++result->lookups;
+    result->found += alive;
+  }
+  return NULL;
+}
+
+// flip the status of a random member every WRITE_INTERVAL_US, return number of writes
+long long writer_loop(bench_mode mode) {
+  long long writes = 0;
+  uint64_t rng = 12345;
+  while (bench_running) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    int i = rng % members;
+
+    if (mode == SCAN) {
+      pthread_mutex_lock(&list_lock);
+      scan_list[i].status = scan_list[i].status == JOIN ? SUSPECT : JOIN;
+      pthread_mutex_unlock(&list_lock);
+    } else if (mode == HASH) {
+      pthread_mutex_lock(&list_lock);
+      member_entry& e = hash_table.entries[member_slot(hash_table, bench_addr(i))];
+      e.status = e.status == JOIN ? SUSPECT : JOIN;
+      pthread_mutex_unlock(&list_lock);
+    } else {
+      // the writer owns hash_table here, readers only see published copies
+      member_entry& e = hash_table.entries[member_slot(hash_table, bench_addr(i))];
+      e.status = e.status == JOIN ? SUSPECT : JOIN;
+      member_snapshot* snapshot = new member_snapshot();
+      snapshot->members = hash_table;
+      snapshot->version = ++writes;
+      snapshot_publish(snapshot);
+      usleep(WRITE_INTERVAL_US);
+      continue;
+    }
+    ++writes;
+    usleep(WRITE_INTERVAL_US);
+  }
+  return writes;
+}
+
+// ./lookup_bench [MEMBERS] [READERS] [SECONDS]
+int main(int argc, char *argv[]) {
+  members = argc > 1 ? atoi(argv[1]) : 5000;
+  int readers = argc > 2 ? atoi(argv[2]) : 8;
+  int seconds = argc > 3 ? atoi(argv[3]) : 3;
+  if (members <= 0 || readers <= 0 || readers >= SNAPSHOT_MAX_READERS || seconds <= 0) {
+    fprintf(stderr, "usage: ./lookup_bench [MEMBERS] [READERS < %d] [SECONDS]\n", SNAPSHOT_MAX_READERS);
+    exit(1);
+  }
+
+  for (int i = 0; i < members; ++i) {
+    member_entry e;
+    e.addr = bench_addr(i);
+    e.heartbeat = now_ms();
+    e.incarnation = 0;
+    e.status = JOIN;
+    e.version = 0;
+    scan_list.push_back(e);
+    member_add(hash_table, e);
+  }
+
+  printf("%d members, %d reader threads, one write every %d us, %d s per mode\n", members, readers, WRITE_INTERVAL_US, seconds);
+  const char* names[] = {"scan", "hash", "snapshot"};
+  for (bench_mode mode : {SCAN, HASH, SNAPSHOT}) {
+    bench_running = true;
+    vector<pthread_t> tids(readers);
+    vector<reader_result> results(readers);
+    for (int i = 0; i < readers; ++i) {
+      results[i] = {mode, 0, 0};
+      pthread_create(&tids[i], NULL, reader_loop, &results[i]);
+    }
+
+    long long writes = 0;
+    pthread_t alarm_tid;
+    pthread_create(&alarm_tid, NULL, [](void* arg) -> void* {
+      sleep(*(int*) arg);
+      bench_running = false;
+      return NULL;
+    }, &seconds);
+    writes = writer_loop(mode);
+    pthread_join(alarm_tid, NULL);
+
+    long long lookups = 0;
+    for (int i = 0; i < readers; ++i) {
+      pthread_join(tids[i], NULL);
+      lookups += results[i].lookups;
+    }
+    printf("%-9s %12.0f lookups/s %8.0f writes/s\n", names[mode], (double) lookups / seconds, (double) writes / seconds);
+  }
+  return 0;
+}
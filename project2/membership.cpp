@@ -0,0 +1,237 @@
+/*
+** membership.cpp -- compact membership list entries and their binary encoding
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <ctime>
+
+using std::string;
+using std::vector;
+
+#define UPDATE_HEADER "UPDATE\n"
+#define UPDATE_HEADER_SIZE 7
+#define UPDATE_PREFIX_SIZE (UPDATE_HEADER_SIZE + 3)    // header, flags and entry count
+#define UPDATE_REPLY 1          // UPDATE flag: answer to a push, do not answer again
+#define UPDATE_GOSSIP 2         // UPDATE flag: recent changes only, not the whole list
+#define ENTRY_WIRE_SIZE 16      // bytes of one entry in a message
+
+enum actions { LEAVE, JOIN, FAILED, SUSPECT };
+
+// one member of the list, 16 bytes on the wire
+struct member_entry {
+  uint64_t heartbeat;             // milliseconds since epoch when the status was last observed
+  uint32_t addr;                  // IPv4 address, network byte order
+  uint32_t incarnation : 30;      // bumped by the member itself to refute a SUSPECT or FAILED report
+  uint32_t status : 2;            // actions
+  uint64_t version;               // local only: list version of the last change to this entry
+};
+
+// milliseconds since epoch
+uint64_t now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+string addr_to_string(uint32_t addr) {
+  char buf[INET_ADDRSTRLEN] = {0};
+  inet_ntop(AF_INET, &addr, buf, sizeof(buf));
+  return string(buf);
+}
+
+string actions_to_string(actions act) {
+  if (act == JOIN)
+    return "JOIN";
+  else if (act == LEAVE)
+    return "LEAVE";
+  else if (act == SUSPECT)
+    return "SUSPECT";
+  else  // FAILED
+    return "FAILED";
+}
+
+// heartbeat as a human readable local time, only used for logs and debugging
+string heartbeat_to_string(uint64_t heartbeat) {
+  std::time_t t = heartbeat / 1000;
+  char buf[32] = {0};
+  std::strftime(buf, sizeof(buf), "%a %b %d %H:%M:%S %Y", std::localtime(&t));
+  return string(buf);
+}
+
+// within one incarnation: JOIN < SUSPECT < FAILED, LEAVE
+int status_rank(uint32_t status) {
+  if (status == JOIN)
+    return 0;
+  else if (status == SUSPECT)
+    return 1;
+  else
+    return 2;
+}
+
+// true if `a` should replace `b`, both about the same member
+// a higher incarnation always wins, within one incarnation the worse status wins
+bool entry_overrides(const member_entry& a, const member_entry& b) {
+  if (a.incarnation != b.incarnation)
+    return a.incarnation > b.incarnation;
+  return status_rank(a.status) > status_rank(b.status);
+}
+
+void put_u32(char* p, uint32_t v) {
+  v = htonl(v);
+  memcpy(p, &v, 4);
+}
+
+uint32_t get_u32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+}
+
+void put_u64(char* p, uint64_t v) {
+  put_u32(p, (uint32_t) (v >> 32));
+  put_u32(p + 4, (uint32_t) v);
+}
+
+uint64_t get_u64(const char* p) {
+  return ((uint64_t) get_u32(p) << 32) | get_u32(p + 4);
+}
+
+// ==============================
+// [u16 entry count]
+// [count * 16 byte entries]
+// entry: u32 addr, u32 incarnation << 2 | status, u64 heartbeat, network byte order
+// ==============================
+// encode `n` entries at `p`, return bytes written
+size_t encode_entries(char* p, const member_entry* entries, size_t n) {
+  uint16_t count = htons((uint16_t) n);
+  memcpy(p, &count, 2);
+  p += 2;
+  for (size_t i = 0; i < n; ++i, p += ENTRY_WIRE_SIZE) {
+    memcpy(p, &entries[i].addr, 4);
+    put_u32(p + 4, ((uint32_t) entries[i].incarnation << 2) | entries[i].status);
+    put_u64(p + 8, entries[i].heartbeat);
+  }
+  return 2 + n * ENTRY_WIRE_SIZE;
+}
+
+// decode entries from the `len` bytes at `p` into at most `max` entries
+// return number of entries, -1 if malformed
+int decode_entries(const char* p, size_t len, member_entry* out, size_t max) {
+  if (len < 2)
+    return -1;
+  uint16_t count;
+  memcpy(&count, p, 2);
+  count = ntohs(count);
+  if (count > max || 2 + (size_t) count * ENTRY_WIRE_SIZE > len)
+    return -1;
+
+  p += 2;
+  for (int i = 0; i < count; ++i, p += ENTRY_WIRE_SIZE) {
+    memcpy(&out[i].addr, p, 4);
+    uint32_t inc_status = get_u32(p + 4);
+    out[i].incarnation = inc_status >> 2;
+    out[i].status = inc_status & 3;
+    out[i].heartbeat = get_u64(p + 8);
+    out[i].version = 0;
+  }
+  return count;
+}
+
+// ==============================
+// UPDATE\n
+// [u8 flags]
+// [entries]
+// ==============================
+// encode `n` entries into `buf`, return message length or 0 if `buf` is too small
+size_t encode_update(uint8_t flags, const member_entry* entries, size_t n, char* buf, size_t buflen) {
+  size_t len = UPDATE_PREFIX_SIZE + n * ENTRY_WIRE_SIZE;
+  if (len > buflen || n > 0xffff)
+    return 0;
+
+  memcpy(buf, UPDATE_HEADER, UPDATE_HEADER_SIZE);
+  buf[UPDATE_HEADER_SIZE] = (char) flags;
+  encode_entries(buf + UPDATE_HEADER_SIZE + 1, entries, n);
+  return len;
+}
+
+// decode an UPDATE message of `len` bytes into at most `max` entries
+// return number of entries, -1 if the message is malformed
+int decode_update(const char* buf, size_t len, uint8_t* flags, member_entry* out, size_t max) {
+  if (len < UPDATE_PREFIX_SIZE || memcmp(buf, UPDATE_HEADER, UPDATE_HEADER_SIZE) != 0)
+    return -1;
+
+  *flags = (uint8_t) buf[UPDATE_HEADER_SIZE];
+  return decode_entries(buf + UPDATE_HEADER_SIZE + 1, len - UPDATE_HEADER_SIZE - 1, out, max);
+}
+
+// the membership list in join order, a member keeps its slot forever
+struct member_table {
+  vector<member_entry> entries;
+  std::unordered_map<uint32_t, uint32_t> addr_index;    // addr -> slot in entries
+};
+
+// slot of `addr` in `table`, -1 if it is not a member
+int member_slot(const member_table& table, uint32_t addr) {
+  auto it = table.addr_index.find(addr);
+  return it == table.addr_index.end() ? -1 : (int) it->second;
+}
+
+// append a new member, return its slot
+int member_add(member_table& table, const member_entry& e) {
+  table.addr_index[e.addr] = table.entries.size();
+  table.entries.push_back(e);
+  return table.entries.size() - 1;
+}
+
+/**
+ * Merge `n` received entries into `table`
+ * An entry is only taken if it overrides ours; a SUSPECT or FAILED report about
+ * `self_addr` is refuted by bumping our incarnation instead
+ * Every changed entry gets the next list `version`
+ * Changed entries are copied to `changes` (room for `n` entries), return number of changes
+ */
+int merge_update(member_table& table, const member_entry* received, size_t n, uint32_t self_addr,
+                 uint64_t now, uint64_t& version, member_entry* changes) {
+  int change_count = 0;
+
+  for (size_t i = 0; i < n; ++i) {
+    int slot = member_slot(table, received[i].addr);
+
+    if (slot < 0) {
+      // new member
+      slot = member_add(table, received[i]);
+      table.entries[slot].version = ++version;
+      changes[change_count++] = table.entries[slot];
+      continue;
+    }
+
+    member_entry& e = table.entries[slot];
+    if (!entry_overrides(received[i], e))
+      continue;
+
+    // be suspected or marked as FAILED while current machine still alive
+    if (received[i].addr == self_addr && (received[i].status == SUSPECT || received[i].status == FAILED)) {
+      e.incarnation = received[i].incarnation + 1;
+      e.heartbeat = now;
+      e.status = JOIN;
+      e.version = ++version;
+      changes[change_count++] = e;
+      continue;
+    }
+
+    // the received entry is newer, update our membership list
+    e = received[i];
+    e.version = ++version;
+    changes[change_count++] = e;
+  }
+
+  return change_count;
+}
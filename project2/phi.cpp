@@ -0,0 +1,85 @@
+/*
+** phi.cpp -- phi accrual suspicion levels over a sliding window of samples
+**
+** Instead of a fixed timeout, a deadline is where the suspicion level phi of a
+** wait crosses a threshold: phi = -log10(P(a sample is longer than the wait)),
+** with samples assumed normally distributed around the window's mean. phi 1
+** means a 10% chance of being wrong, phi 8 one in 10^8. The normal tail uses the
+** logistic approximation of the Akka/Cassandra detectors.
+*/
+
+#include <math.h>
+
+#include <algorithm>
+
+#define PHI_WINDOW_SIZE 64      // samples kept, older ones are dropped
+#define PHI_MIN_SAMPLES 4       // fewer than this and the window has no opinion
+#define PHI_MIN_STDDEV_MS 2.0   // a perfectly regular peer still gets some slack
+
+struct phi_window {
+  double samples[PHI_WINDOW_SIZE];
+  int count;
+  int next;
+  double sum;
+  double sum_sq;
+};
+
+void phi_init(phi_window* w) {
+  w->count = 0;
+  w->next = 0;
+  w->sum = 0;
+  w->sum_sq = 0;
+}
+
+void phi_add(phi_window* w, double sample) {
+  if (w->count == PHI_WINDOW_SIZE) {
+    double old = w->samples[w->next];
+    w->sum -= old;
+    w->sum_sq -= old * old;
+  } else {
+    ++w->count;
+  }
+  w->samples[w->next] = sample;
+  w->next = (w->next + 1) % PHI_WINDOW_SIZE;
+  w->sum += sample;
+  w->sum_sq += sample * sample;
+}
+
+bool phi_ready(const phi_window* w) {
+  return w->count >= PHI_MIN_SAMPLES;
+}
+
+double phi_mean(const phi_window* w) {
+  return w->count == 0 ? 0 : w->sum / w->count;
+}
+
+double phi_stddev(const phi_window* w) {
+  double mean = phi_mean(w);
+  double var = w->count == 0 ? 0 : w->sum_sq / w->count - mean * mean;
+  return std::max(sqrt(std::max(var, 0.0)), PHI_MIN_STDDEV_MS);
+}
+
+// suspicion level after waiting `elapsed` for the next sample, infinite far out in the tail
+double phi_level(const phi_window* w, double elapsed) {
+  double mean = phi_mean(w);
+  double y = (elapsed - mean) / phi_stddev(w);
+  double e = exp(-y * (1.5976 + 0.070566 * y * y));
+  if (elapsed > mean)
+    return -log10(e / (1.0 + e));
+  return -log10(1.0 - 1.0 / (1.0 + e));
+}
+
+// shortest wait whose suspicion level reaches `threshold`
+double phi_deadline(const phi_window* w, double threshold) {
+  double lo = phi_mean(w), hi = lo + 64 * phi_stddev(w);
+  if (phi_level(w, lo) >= threshold)
+    return lo;
+  for (int i = 0; i < 40; ++i) {
+    double mid = (lo + hi) / 2;
+    if (phi_level(w, mid) >= threshold)
+      hi = mid;
+    else
+      lo = mid;
+  }
+  return hi;
+}
@@ -1,4 +1,10 @@
 #include "common.cpp"
+#include "swim.cpp"
+#include "hyparview.cpp"
+#include "snapshot.cpp"
+#include "stats.cpp"
+#include "transport.cpp"
+#include "async_log.cpp"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -11,459 +17,321 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #include <vector>
 #include <utility>
-#include <tuple>
 #include <string>
-#include <set>
 #include <algorithm>
+#include <atomic>
 #include <iostream>
-#include <chrono>
-#include <ctime>
-#include <locale>
-#include <iomanip>
-#include <sstream>
 
-using std::chrono::system_clock;
 using std::vector;
 using std::pair;
-using std::tuple;
 using std::string;
-using std::set;
 using std::cout;
 using std::cerr;
 using std::endl;
 
-#define BUFSIZE 1024
+#define BUFSIZE SWIM_BUFSIZE
 #define COMMUNICATION_PORT "8080"
 #define INTRODUCER_PORT "8888"
 #define INTRODUCER_IP "172.22.94.58" // TODO: CHANGE THIS TO YOUR VM ADDRESS
 #define BUFFER_SIZE 4096
-#define MONITOR_COUNT 3
-#define PING_ACK_TIMEOUT 2
-#define BROADCAST_UPDATE_INTERVAL 2
+#define LEAVE_TIMEOUT_MS 2000     // `leave` exits after this even without a majority of ACKs
+#define LEAVE_POLL_MS 50          // how soon the event loop notices a `leave`
+#define JOIN_REPLY_MAX 65507      // largest UDP payload, the snapshot of the list is one datagram
+#define COLLECT_WAIT_MS 1000      // how long `list_mem` collects answers with partial views
+#define STATS_PORT "8081"         // TCP, a connection gets the `stats` report and is closed
 
 
-enum actions { LEAVE, JOIN, FAILED };
 static string machine_ip;         // ip of the current machine
-static vector<tuple<string, string, actions>> membership_list;    // list of <ip, timestamp, actions>
-static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t list_cv = PTHREAD_COND_INITIALIZER;
-static set<string> ack_set;       // used to keep track of acknowledged machine ip
-static pthread_mutex_t ack_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t ack_cv = PTHREAD_COND_INITIALIZER;
-static int sockfd;                // current process socket fd
-static FILE* log_file;
-static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t file_cv = PTHREAD_COND_INITIALIZER;
-
-
-
-actions string_to_actions(const char* action) {
-  if (strcmp(action, "JOIN") == 0)
-    return JOIN;
-  else if (strcmp(action, "LEAVE") == 0)
-    return LEAVE;
-  else  // "FAILED"
-    return FAILED;
-}
-
-string actions_to_string(actions act) {
-  if (act == JOIN)
-    return "JOIN";
-  else if (act == LEAVE)
-    return "LEAVE";
-  else  // FAILED
-    return "FAILED";
-}
-
-// assume list lock already aquired
-int find_machine_ip_index() {
-  // find self location
-  int machine_ip_idx = -1;
-  for (int i = 0; i < membership_list.size(); ++i) {
-    if (std::get<0>(membership_list[i]) == machine_ip) {
-      machine_ip_idx = i;
-      break;
+static uint32_t machine_addr;     // same, network byte order
+static swim_node node;            // membership list and failure detector state, event loop only
+static timer_wheel timers;        // SWIM probe, ack, suspicion and sync timers
+static transport net;             // UDP datagrams to and from other members
+static int net_fd;                // its socket, also answers the introducer
+static async_log* log_file;       // vm.log, written by its own flusher thread
+static std::atomic<bool> leave_requested;   // set by `leave`, the event loop starts leaving
+static std::atomic<bool> leave_acked;       // set by the event loop once a majority has our LEAVE
+static std::atomic<int> leave_acks;
+
+// with -v: partial views (hyparview.cpp) instead of SWIM and a full list
+static bool partial_views;
+static hpv_node hpv;              // event loop only
+static std::atomic<bool> collect_requested; // set by `list_mem`, the event loop starts a collect
+static pthread_mutex_t views_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<uint32_t> shown_active;       // copies for the command reader, under views_lock
+static vector<uint32_t> shown_passive;
+static vector<uint32_t> shown_collected;
+
+// instrumentation (stats.cpp), recorded by the event loop and the command reader
+static stats_counter sent_stats[STATS_TYPES];
+static stats_counter received_stats[STATS_TYPES];
+static stats_histogram suspect_time;      // last message from a member until we held it SUSPECT, ms
+static stats_histogram detect_time;       // same until FAILED, ms
+static stats_histogram converge_time;     // a change observed elsewhere until it reached us, ms, plus the clock offset
+static std::atomic<uint64_t> converge_ahead;  // changes stamped ahead of our clock, which converge_time cannot hold
+static stats_histogram read_hold;         // snapshot read sections of the command reader, us
+static stats_histogram views_hold;        // views_lock holds, us
+static std::atomic<uint64_t> gossip_rounds;
+static std::atomic<uint64_t> probe_periods;
+static std::atomic<uint64_t> dropped_datagrams;  // truncated or unknown datagrams, ignored
+static uint64_t started_at;
+
+// event loop only: when we last heard from each member, and whether its SUSPECT and FAILED were timed since
+struct heard {
+  uint64_t at;
+  bool suspected;
+  bool failed;
+};
+static std::unordered_map<uint32_t, heard> last_heard;
+static bool in_message;                   // the event loop is handling a datagram
+
+
+
+// time detections and how long changes took to arrive
+void time_member_change(const member_entry& e) {
+  uint64_t now = now_ms();
+  auto it = last_heard.find(e.addr);
+  if (it != last_heard.end()) {
+    if (e.status == SUSPECT && !it->second.suspected) {
+      stats_record(&suspect_time, now - it->second.at);
+      it->second.suspected = true;
+    } else if (e.status == FAILED && !it->second.failed) {
+      stats_record(&detect_time, now - it->second.at);
+      it->second.failed = true;
     }
   }
-  return machine_ip_idx;
-}
-
-// assume list lock aquired
-// find the ip address of the p-th ALIVE neighbor
-string find_alive_target_ip(int p) {
-  // find self location
-  int n = membership_list.size();
-  int machine_ip_idx = find_machine_ip_index();
-
-  if (machine_ip_idx == -1 || p > n - 1)
-    return "";
-
-  for (int i = 1; i <= n - 1; ++i) {
-    if (std::get<2>(membership_list[(machine_ip_idx + i) % n]) == JOIN) {
-      p -= 1;
-      if (p == 0)
-        return std::get<0>(membership_list[(machine_ip_idx + i) % n]);
-    }
+  // the heartbeat is the observer's clock, so this includes the clock offset between the VMs,
+  // and a change from a VM whose clock is ahead can arrive before it was made
+  if (in_message && e.addr != machine_addr) {
+    if (e.heartbeat <= now)
+      stats_record(&converge_time, now - e.heartbeat);
+    else
+      converge_ahead.fetch_add(1, std::memory_order_relaxed);
   }
-
-  return "";
 }
 
-// /**
-//  * Return p-th neighbour target ip address (1-indexed) or empty string if index out of bound
-//  * - assume mutex lock for the list is already aquired
-//  */
-// string find_target_ip(int p) {
-//   int n = membership_list.size();
-//   if (p > n - 1)
-//     return "";
-  
-//   // find self location
-//   int machine_ip_idx = find_machine_ip_index();
-
-//   if (machine_ip_idx == -1)
-//     return "";
-
-//   if (machine_ip_idx + p < n) {
-//     assert(machine_ip_idx + p >= 0);
-//     assert(std::get<0>(membership_list[machine_ip_idx + p]) != machine_ip);
-//     return std::get<0>(membership_list[machine_ip_idx + p]);
-//   }
-//   else if (machine_ip_idx + p - n < n) {
-//     assert(machine_ip_idx + p - n >= 0);
-//     assert(std::get<0>(membership_list[machine_ip_idx + p - n]) != machine_ip);
-//     return std::get<0>(membership_list[machine_ip_idx + p - n]);
-//   } else {
-//     return ""; 
-//   }
-// }
-
-// assume list lock already obtained
-void send_all_neighbor_msg(string msg) {
-  for (int i = 1; i <= std::min((int) membership_list.size() - 1, MONITOR_COUNT); ++i) {
-    string target_ip = find_alive_target_ip(i);
-
-    if (target_ip == "")
-      continue;
-
-    struct sockaddr_in serveraddr;
-    memset((char *) &serveraddr, 0, sizeof(serveraddr));
-
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(std::stoi(COMMUNICATION_PORT));
-    serveraddr.sin_addr.s_addr = inet_addr(target_ip.c_str());
-
-    sendto(sockfd, msg.c_str(), msg.size(), 0, (struct sockaddr *) &serveraddr, sizeof(serveraddr));
-    // cout << msg << " --> " << std::get<0>(membership_list[tmp_ip_idx + i]) << endl;
-  }
-  return;
+// queue every membership change for the log file, never waits for the disk
+void log_member_change(const member_entry& e) {
+  time_member_change(e);
+  string log_info = actions_to_string((actions) e.status) + " " + addr_to_string(e.addr) + " " + heartbeat_to_string(e.heartbeat) + "\n";
+  async_log_write(log_file, log_info.c_str(), log_info.size());
 }
 
-/**
- * update ip status, log to file if action change, otherwise only update timestamp
- */ 
-void update_ip_status(string target_ip, actions act) {
-  // get current timestamp
-  std::time_t t = system_clock::to_time_t(system_clock::now());
-  string time_str = std::ctime(&t); // this includes a '\n' at the end
-  time_str.pop_back();
-
-  // find the target_ip and remove from membership list
-  pthread_mutex_lock(&list_lock);
-  for (int i = 0; i < membership_list.size(); ++i) {
-    actions original_act = std::get<2>(membership_list[i]);
-
-    if (std::get<0>(membership_list[i]) == target_ip) {
-      // change status
-      membership_list[i] = {target_ip, time_str, act};
-
-      if (act != original_act) {
-        // write to log file
-        string log_info = "FAILED " + target_ip + " " + time_str + "\n";
-        pthread_mutex_lock(&file_lock);
-        write(fileno(log_file), log_info.c_str(), log_info.size());
-        pthread_mutex_unlock(&file_lock);
-      }
-
-      break;
-    }
-  }
-  pthread_mutex_unlock(&list_lock);
-
-  return;
+// publish the membership list for readers outside the event loop if it changed
+void publish_snapshot() {
+  const member_snapshot* current = current_snapshot.load();
+  size_t pending = node.probe_order.size() - std::min(node.probe_next, node.probe_order.size());
+  if (current->version == node.list_version && current->probe_pending.size() == pending)
+    return;
+
+  member_snapshot* snapshot = new member_snapshot();
+  snapshot->members = node.members;
+  snapshot->version = node.list_version;
+  snapshot->probe_pending.assign(node.probe_order.end() - pending, node.probe_order.end());
+  snapshot_publish(snapshot);
 }
 
-/**
- * Remove old entry if found, push back the new one
- * Only invoked in vm1 (introducer)
- */
-void new_process_join(string ip_address, string timestamp) {
-  bool found = false;
-  bool status_change = false;
-  pthread_mutex_lock(&list_lock);
-  for (int i = 0; i < membership_list.size(); ++i) {
-    if (std::get<0>(membership_list[i]) == ip_address) {
-      found = true;
-      if (std::get<2>(membership_list[i]) != JOIN) {  // target ip rejoined after 20s
-        status_change = true;
-        membership_list[i] = {ip_address, timestamp, JOIN}; // update status
-      }
-      break;
-    }
-  }
-  
-  if (!found) {
-    // push the new member to membership list
-    membership_list.push_back({ip_address, timestamp, JOIN});
-    // wake up other waiting thread
-    pthread_cond_broadcast(&list_cv);
-  }
-  pthread_mutex_unlock(&list_lock);
-
-  if (!found || status_change) {
-    // write to log file
-    string log_info = "JOIN " + ip_address + " " + timestamp + "\n";
-    pthread_mutex_lock(&file_lock);
-    write(fileno(log_file), log_info.c_str(), log_info.size());
-    pthread_mutex_unlock(&file_lock);
+// copy the views for the command reader if they changed
+void publish_views() {
+  pthread_mutex_lock(&views_lock);
+  uint64_t locked_at = monotonic_us();
+  if (shown_active != hpv.active || shown_passive != hpv.passive || shown_collected.size() != hpv.collected.size()) {
+    shown_active = hpv.active;
+    shown_passive = hpv.passive;
+    shown_collected.assign(hpv.collected.begin(), hpv.collected.end());
   }
+  stats_record(&views_hold, monotonic_us() - locked_at);
+  pthread_mutex_unlock(&views_lock);
 }
 
-/** 
- * update membership list when needed
- */
-void compare_and_update_memlist(const vector<tuple<string, string, actions>>& received_list) {
-  pthread_mutex_lock(&list_lock);
-  
-  for (int i = 0; i < std::min(received_list.size(), membership_list.size()); ++i) {
-    assert(std::get<0>(received_list[i]) == std::get<0>(membership_list[i]));
-
-    // timestamp equal, expect two tuple to be totally the same
-    if (std::get<1>(received_list[i]) == std::get<1>(membership_list[i])) {
-      continue;
-    }
-
-    std::time_t t1, t2;
-    struct std::tm tm1 = {0}, tm2 = {0};
-    std::istringstream ss1(std::get<1>(received_list[i]));
-    std::istringstream ss2(std::get<1>(membership_list[i]));
-
-    ss1 >> std::get_time(&tm1, "%a %b %d %H:%M:%S %Y");
-    ss2 >> std::get_time(&tm2, "%a %b %d %H:%M:%S %Y");
-    t1 = mktime(&tm1);
-    t2 = mktime(&tm2);
-
-    if (t1 > t2) {
-      // only update if action is different
-      if (std::get<2>(received_list[i]) == std::get<2>(membership_list[i])) {
-        continue;
-      }
+// ===========================
+// JOINED\n
+// [u32 sequence number]
+// [entries as in membership.cpp]
+// ===========================
+// send the introducer at `addr`:`port` the whole list, for the processes of its JOIN `seq`
+void answer_introducer(uint32_t addr, uint16_t port, uint32_t seq) {
+  static char msg[JOIN_REPLY_MAX];
+  // with partial views the joiner only needs a contact, which is us
+  const vector<member_entry>& entries = node.members.entries;
+  size_t n = partial_views ? 0 : std::min(entries.size(), (size_t) (JOIN_REPLY_MAX - 13) / ENTRY_WIRE_SIZE);  // the rest comes with the next sync
+  memcpy(msg, "JOINED\n", 7);
+  put_u32(msg + 7, seq);
+  size_t len = 11 + encode_entries(msg + 11, entries.data(), n);
+
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_port = htons(port);
+  to.sin_addr.s_addr = addr;
+  sendto(net_fd, msg, len, 0, (struct sockaddr *) &to, sizeof(to));
+  stats_count(sent_stats, msg, len);
+}
 
-      // be marked as FAILED or LEAVE while current machine still alive
-      if (std::get<0>(received_list[i]) == machine_ip && std::get<2>(received_list[i]) == FAILED) {
-        // get current timestamp
-        std::time_t t = system_clock::to_time_t(system_clock::now());
-        string time_str = std::ctime(&t); // this includes a '\n' at the end
-        time_str.pop_back();
-        membership_list[i] = {machine_ip, time_str, JOIN};
-        continue;
-      }
-      // the received_list[i] is newer, update our membership list
-      membership_list[i] = {std::get<0>(received_list[i]), std::get<1>(received_list[i]), std::get<2>(received_list[i])};
-      // write to log file
-      string log_info = actions_to_string(std::get<2>(received_list[i])) + " " + std::get<0>(received_list[i]) + " " + std::get<1>(received_list[i]) + "\n";
-      pthread_mutex_lock(&file_lock);
-      write(fileno(log_file), log_info.c_str(), log_info.size());
-      pthread_mutex_unlock(&file_lock);
-    }
+// handle one datagram
+void handle_datagram(uint32_t from, char* buf, size_t len) {
+  // PING, PING_REQ, ACK and UPDATE are handled by the SWIM node, or the H* messages by the partial views
+  if (partial_views ? hpv_receive(&hpv, from, buf, len, now_ms()) : swim_receive(&node, from, buf, len, now_ms()))
+    return;
+
+  if (strncmp(buf, "JOIN\n", 5) == 0) {  // only vm1 (introducer) will entire this block
+    // ===========
+    // JOIN\n
+    // [reply port]\n
+    // [sequence number]\n
+    // [ip]\n
+    // ...
+    // ===========
+    // every process in the batch is added before the reply, and their changes go out
+    // together in the next gossip rounds
+    char* save;
+    char* port = strtok_r(buf + 5, "\n", &save);
+    char* seq = port == NULL ? NULL : strtok_r(NULL, "\n", &save);
+    if (seq == NULL)
+      return;
+    for (char* ip = strtok_r(NULL, "\n", &save); ip != NULL && !partial_views; ip = strtok_r(NULL, "\n", &save))
+      swim_join(&node, inet_addr(ip), now_ms());  // only introducer will send JOIN message
+    answer_introducer(from, atoi(port), strtoul(seq, NULL, 10));
+
+  } else {
+    // a truncated or stray datagram must not take the member down
+    dropped_datagrams.fetch_add(1, std::memory_order_relaxed);
   }
+}
 
-  if (membership_list.size() < received_list.size()) {
-    for (int i = membership_list.size(); i < received_list.size(); ++i) {
-      membership_list.push_back({std::get<0>(received_list[i]), std::get<1>(received_list[i]), std::get<2>(received_list[i])});
-      // write to log file
-      string log_info = actions_to_string(std::get<2>(received_list[i])) + " " + std::get<0>(received_list[i]) + " " + std::get<1>(received_list[i]) + "\n";
-      pthread_mutex_lock(&file_lock);
-      write(fileno(log_file), log_info.c_str(), log_info.size());
-      pthread_mutex_unlock(&file_lock);
-    }
-    pthread_cond_broadcast(&list_cv);
-  }
+// count one datagram and what it tells about its sender, then handle it
+void handle_message(uint32_t from, char* buf, size_t len) {
+  stats_count(received_stats, buf, len);
+  last_heard[from] = {now_ms(), false, false};
+  in_message = true;
+  handle_datagram(from, buf, len);
+  in_message = false;
+}
 
-  pthread_mutex_unlock(&list_lock);
+// count one datagram and queue it on the transport
+void send_message(uint32_t to, const char* msg, size_t len) {
+  stats_count(sent_stats, msg, len);
+  net.send(to, msg, len);
 }
 
-/**
- * Ping neighbours, detect failure and notify the `broadcast_list_change` thread
- * - each monitor process takes care of the p-th neighbour clockwise (1-indexed, RHS in the list or wrap around)
- */
-void* failure_monitor(void* assigned_pos) {
-  int p = *((int*) assigned_pos);
-  free(assigned_pos);
+// everything stats.cpp collected, as text
+string stats_report() {
+  char line[256];
+  const member_snapshot* snapshot = snapshot_read_lock();
+  uint64_t locked_at = monotonic_us();
+  int live = 0;
+  for (const member_entry& e : snapshot->members.entries)
+    live += e.status == JOIN || e.status == SUSPECT;
+  stats_record(&read_hold, monotonic_us() - locked_at);
+  snapshot_read_unlock();
+
+  string report = "===== Stats of " + machine_ip + " =====\n";
+  snprintf(line, sizeof(line), "up %llu s, %d live members, %llu probe periods, %llu gossip rounds, %llu log lines dropped, "
+    "%llu datagrams dropped\n", (unsigned long long) (now_ms() - started_at) / 1000, live,
+    (unsigned long long) probe_periods.load(), (unsigned long long) gossip_rounds.load(),
+    (unsigned long long) async_log_dropped(log_file), (unsigned long long) dropped_datagrams.load());
+  report += line;
+  report += stats_counters_table(sent_stats, received_stats);
+  report += stats_histogram_line("time to suspect", &suspect_time, "ms");
+  report += stats_histogram_line("time to detect", &detect_time, "ms");
+  // across VMs there is no common clock, the report says so rather than hide the offset
+  report += stats_histogram_line("converge + clock skew", &converge_time, "ms");
+  snprintf(line, sizeof(line), "%-22s %8llu  changes stamped ahead of our clock, not in the line above\n",
+    "converge, skew ahead", (unsigned long long) converge_ahead.load());
+  report += line;
+  report += stats_histogram_line("snapshot read hold", &read_hold, "us");
+  if (partial_views)
+    report += stats_histogram_line("views_lock hold", &views_hold, "us");
+  return report;
+}
 
-  // ping ack here
+// answer every connection to STATS_PORT with the report
+void* stats_server(void*) {
+  int server_fd = setup_server(STATS_PORT, 8);
   while (1) {
-    // fprintf(stderr, "call in %d\n", p);
-
-    // get target ip
-    // maybe avoid PINGing failed machine
-    pthread_mutex_lock(&list_lock);
-    string target_ip = find_alive_target_ip(p);
-    while (target_ip == "") {
-      pthread_cond_wait(&list_cv, &list_lock);
-      target_ip = find_alive_target_ip(p);
-    }
-    pthread_mutex_unlock(&list_lock);
-
-    // fprintf(stderr, "target ip %s\n", target_ip.c_str());
-
-    // ping target ip
-    struct sockaddr_in serveraddr;
-    memset((char *) &serveraddr, 0, sizeof(serveraddr));
-
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_port = htons(std::stoi(COMMUNICATION_PORT));
-    serveraddr.sin_addr.s_addr = inet_addr(target_ip.c_str());
-
-    sendto(sockfd, "PING", 4, 0, (struct sockaddr *) &serveraddr, sizeof(serveraddr));
-
-    // sleep for a while to wait for response
-    sleep(PING_ACK_TIMEOUT);
-
-    // alive responded ip will be add to `ack_set` (handled by `ping_ack_update_listener`)
-    // check if ack comes back
-    pthread_mutex_lock(&ack_lock);
-    int is_alive = (ack_set.find(target_ip) != ack_set.end());
-    if (is_alive) {
-      ack_set.erase(target_ip);
-      update_ip_status(target_ip, JOIN);
-    } else {
-      update_ip_status(target_ip, FAILED);
-    }
-    pthread_mutex_unlock(&ack_lock);
+    int fd = accept(server_fd, NULL, NULL);
+    if (fd < 0)
+      continue;
+    string report = stats_report();
+    write_all_to_socket(fd, report.c_str(), report.size());
+    close(fd);
   }
+  return NULL;
 }
 
 /**
- * Listen and respond to other machines' pings, acks, and membership list updates
+ * The only protocol thread: waits for datagrams until the next timer is due,
+ * then handles every pending datagram and every expired timer
+ * what they send is queued and goes out in one batch before the next wait
  */
-void* ping_ack_update_listener(void*) {
-  while (1) {
-    struct sockaddr_in clientaddr;
-    unsigned int clientlen = sizeof(clientaddr);
-
-    // fprintf(stderr, "listening to ping or updates\n");
-
-    char buf[BUFSIZE] = {0};
-    // expecting format: [action]\n[ip]\n[time]\n
-    recvfrom(sockfd, buf, BUFSIZE, 0, (struct sockaddr *) &clientaddr, &clientlen);
-
-    // check the request type: PING, ACK, JOIN or UPDATE, behave coorespondingly
-    // if PING, send ACK
-    // if ACK, add client ip to `ack_set`
-    // if JOIN, add <ip, timestamp, "JOIN"> to membership list if ip is new 
-    //    otherwise delete old one and pushback new one
-    // if UPDATE, compare and update local membership list, notify `broadcast_list_change`
-    //    thread by adding element to `updates`
-
-    if (strstr(buf, "PING") - buf == 0) {
-      // ====
-      // PING
-      // ====
-      string message = "ACK\n" + machine_ip + "\n";
-      sendto(sockfd, message.c_str(), message.size(), 0, (struct sockaddr *) &clientaddr, clientlen);
-
-    } else if (strstr(buf, "ACK\n") - buf == 0) {
-      // =====
-      // ACK\n
-      // IP\n
-      // =====
-      char* newline = strchr(buf + 4, '\n');
-      *newline = '\0';
-      pthread_mutex_lock(&ack_lock);
-      ack_set.insert(string(buf + 4));
-      pthread_mutex_unlock(&ack_lock);
-
-    } else if (strstr(buf, "JOIN\n") - buf == 0) {  // only vm1 (introducer) will entire this block
-      // ===========
-      // JOIN\n
-      // IP\n
-      // timestamp\n
-      // ===========
-      char* newline1 = strchr(buf + 5, '\n');
-      *newline1 = '\0';
-      char* newline2 = strchr(newline1 + 1, '\n');
-      *newline2 = '\0';
-      char *ip = buf + 5, *time = newline1 + 1;
-      new_process_join(string(ip), string(time));  // only introducer will send JOIN message
-
-    } else if (strstr(buf, "UPDATE\n") - buf == 0) {
-      // ====================
-      // UPDATE\n
-      // <ip1,t1,ACTION1>\n
-      // <ip2,t2,ACTION2>\n
-      // ...
-      // ====================
-      vector<tuple<string, string, actions>> received;
-      string s = string(buf + 7);
-      string delimiter = "\n";
-
-      size_t pos = 0;
-      while ((pos = s.find(delimiter)) != string::npos) {
-        string tmp = s.substr(0, pos);
-        char line[tmp.size() + 1];
-        strcpy(line, tmp.c_str());
-        char* comma1 = strchr(line, ',');
-        *comma1 = '\0';
-        char* comma2 = strchr(comma1 + 1, ',');
-        *comma2 = '\0';
-
-        char *ip = line, *timestamp = comma1 + 1, *action = comma2 + 1;
-        actions act = string_to_actions(action);
-        received.push_back({string(ip), string(timestamp), act});
-        s.erase(0, pos + delimiter.length());
-      }
-
-      compare_and_update_memlist(received);
-
-    } else {
-      error("ERROR! action not found!\n");
+void* event_loop(void*) {
+  while (partial_views) {
+    timer_advance(&timers, now_ms());
+    if (collect_requested.exchange(false))
+      hpv_collect(&hpv);
+    if (leave_requested.load() && !leave_acked.load()) {
+      // nobody ACKs a DISCONNECT, the neighbors replace us from their passive views
+      leave_acks.store(hpv.active.size());
+      hpv_leave(&hpv);
+      net.flush();
+      leave_acked.store(true);
     }
+    net.flush();
+
+    int timeout = timer_next_timeout(&timers);
+    if (timeout < 0 || timeout > LEAVE_POLL_MS)
+      timeout = LEAVE_POLL_MS;
+    net.poll(timeout, handle_message);
+    net.flush();
+    publish_views();
   }
 
-  return NULL;
-}
-
-/**
- * Gossip full membership list to neighbors in at fixed period
- */
-void* broadcast_list_updates(void*) {
   while (1) {
-    pthread_mutex_lock(&list_lock);
-
-    // send the full membership list to neighors
-    string msg = "UPDATE\n";
-    for (auto& tup : membership_list) {
-      msg += (std::get<0>(tup) + "," + std::get<1>(tup) + "," + actions_to_string(std::get<2>(tup)) + "\n");
+    timer_advance(&timers, now_ms());
+    if (leave_requested.load()) {
+      swim_leave(&node, now_ms());
+      leave_acks.store(node.leave_acks.size());
+      leave_acked.store(swim_leave_quorum(&node));
     }
-    send_all_neighbor_msg(msg);
-
-    pthread_mutex_unlock(&list_lock);
-
-    sleep(BROADCAST_UPDATE_INTERVAL);
+    net.flush();
+    publish_snapshot();
+
+    int timeout = timer_next_timeout(&timers);
+    if (timeout < 0 || timeout > LEAVE_POLL_MS)
+      timeout = LEAVE_POLL_MS;
+    net.poll(timeout, handle_message);
+    net.flush();
+    publish_snapshot();
+    gossip_rounds.store(node.gossip_rounds, std::memory_order_relaxed);
+    probe_periods.store(node.periods, std::memory_order_relaxed);
   }
 
   return NULL;
 }
 
 int main(int argc, char **argv) {
-  if (argc != 1) {
-    error("Usage: ./process");
+  if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+    partial_views = true;
+    --argc;
+    ++argv;
   }
 
+  // gossip fanout, round length and phi threshold, the rest of the protocol keeps its defaults
+  swim_config config;
+  if (argc > 4 || (argc > 1 && atoi(argv[1]) < 0) || (argc > 2 && atoi(argv[2]) <= 0) || (argc > 3 && atof(argv[3]) < 0)) {
+    error("Usage: ./process [-v] [FANOUT] [GOSSIP_MS] [PHI_THRESHOLD]");
+  }
+  if (argc > 1)
+    config.gossip_fanout = atoi(argv[1]);
+  if (argc > 2)
+    config.gossip_interval_ms = atoi(argv[2]);
+  if (argc > 3)
+    config.phi_threshold = atof(argv[3]);
+
   bool havejoin = false;
   for (string line; std::getline(std::cin, line);) { 
     if (!havejoin) {
@@ -477,43 +345,66 @@ int main(int argc, char **argv) {
           error("ERROR connecting to introducer");
         }
 
-        // read ip address of the new process and time from introducer
+        // read ip address of the new process, time and the membership list from introducer
+        // expecting format: [ip]\n[time]\n[snapshot length]\n[snapshot]
         char buffer[BUFFER_SIZE] = {0};
-        // expecting format: [ip]\n[time]\n
-        recv(introducer_fd, buffer, BUFFER_SIZE, 0);
+        size_t header_len = 0;
+        for (int lines = 0; lines < 3 && header_len < BUFFER_SIZE - 1; ) {
+          if (read_all_from_socket(introducer_fd, buffer + header_len, 1) != 1)
+            error("ERROR reading from introducer");
+          if (buffer[header_len++] == '\n')
+            ++lines;
+        }
         char* newline = strchr(buffer, '\n');
         *newline = '\0';
+        size_t snapshot_len = strtoul(strchr(newline + 1, '\n') + 1, NULL, 10);
+        vector<char> snapshot(snapshot_len);
+        if (read_all_from_socket(introducer_fd, snapshot.data(), snapshot_len) != (ssize_t) snapshot_len)
+          error("ERROR reading from introducer");
         // use the response from introducer to set self machine_ip
         machine_ip = string(buffer);
+        machine_addr = inet_addr(buffer);
 
         /**
          * create the log file
          */
-        log_file = fopen("vm.log", "w");
+        log_file = async_log_open("vm.log");
+        if (log_file == NULL) {
+          error("ERROR opening vm.log");
+        }
 
         /**
          * Open Communication
          */
         // open socket for furthur ping ack and failure detection
-        sockfd = UDP_server(COMMUNICATION_PORT);
-
-        // detect neighbor failure by periodically pinging neighbours
-        for (size_t i = 1; i <= MONITOR_COUNT; ++i) {
-          int* idx = (int*) malloc(sizeof(int));
-          *idx = i;
-          pthread_t tid;
-          pthread_create(&tid, NULL, failure_monitor, (void*) idx);
-          pthread_detach(tid);
+        net_fd = UDP_server(COMMUNICATION_PORT);
+        net = udp_transport(net_fd, atoi(COMMUNICATION_PORT));
+
+        timer_wheel_init(&timers, now_ms());
+        started_at = now_ms();
+        if (partial_views) {
+          // join through the member on the introducer's VM, the views fill in from there
+          hpv_init(&hpv, machine_addr, hpv_config(), &timers, now_ms() ^ machine_addr, send_message, NULL);
+          hpv_start(&hpv, inet_addr(INTRODUCER_IP), now_ms());
+        } else {
+          swim_init(&node, machine_addr, config, &timers, now_ms() ^ machine_addr, send_message, log_member_change, now_ms());
+          log_member_change(node.members.entries[0]);
+          // start with the whole list, not just what gossip brings later
+          if (snapshot_len > 0) {
+            vector<member_entry> entries(snapshot_len / ENTRY_WIRE_SIZE + 1);
+            int n = decode_entries(snapshot.data(), snapshot_len, entries.data(), entries.size());
+            if (n > 0)
+              swim_load_state(&node, entries.data(), n, now_ms());
+          }
+          swim_start(&node, now_ms());
         }
 
-        pthread_t threads[2];
-        // listen and respond to ping, ack, and membership updates
-        pthread_create(&threads[0], NULL, ping_ack_update_listener, NULL);
-        pthread_detach(threads[0]);
-        // broadcast membership list updates when possible
-        // share updates obtained by `failure_monitor` and `ping_ack_update_listener`
-        pthread_create(&threads[1], NULL, broadcast_list_updates, NULL);
-        pthread_detach(threads[1]);
+        // listen and respond to ping, ack, and membership updates, probe members and expire suspicions
+        pthread_t tid;
+        pthread_create(&tid, NULL, event_loop, NULL);
+        pthread_detach(tid);
+        pthread_create(&tid, NULL, stats_server, NULL);
+        pthread_detach(tid);
 
 
         /**
@@ -531,27 +422,76 @@ int main(int argc, char **argv) {
         fprintf(stderr, "===== Self ID is %s =====\n", machine_ip.c_str());
       } 
       
+      else if (line == "list_mem" && partial_views) {
+        // nobody holds the full list: ask every member and list who answered
+        collect_requested.store(true);
+        usleep(COLLECT_WAIT_MS * 1000);
+        fprintf(stderr, "===== The membership list is as follows =====\n");
+        pthread_mutex_lock(&views_lock);
+        uint64_t locked_at = monotonic_us();
+        for (size_t i = 0; i < shown_collected.size(); ++i)
+          fprintf(stderr, "%zu. %s\n", i + 1, addr_to_string(shown_collected[i]).c_str());
+        stats_record(&views_hold, monotonic_us() - locked_at);
+        pthread_mutex_unlock(&views_lock);
+      }
+
       else if (line == "list_mem") {
         fprintf(stderr, "===== The membership list is as follows =====\n");
-        pthread_mutex_lock(&list_lock);
-        for (int i = 0; i < membership_list.size(); ++i) {
-          if (std::get<2>(membership_list[i]) == JOIN) {
-            fprintf(stderr, "%d. %s\n", i + 1, std::get<0>(membership_list[i]).c_str());
+        const member_snapshot* snapshot = snapshot_read_lock();
+        uint64_t locked_at = monotonic_us();
+        const vector<member_entry>& entries = snapshot->members.entries;
+        for (int i = 0; i < entries.size(); ++i) {
+          if (entries[i].status == JOIN || entries[i].status == SUSPECT) {
+            fprintf(stderr, "%d. %s%s\n", i + 1, addr_to_string(entries[i].addr).c_str(),
+              entries[i].status == SUSPECT ? " (suspected)" : "");
           }
         }
-        pthread_mutex_unlock(&list_lock);
+        stats_record(&read_hold, monotonic_us() - locked_at);
+        snapshot_read_unlock();
       } 
 
+      else if (line == "neighbor" && partial_views) {
+        cerr << "======== active view =========" << endl;
+        pthread_mutex_lock(&views_lock);
+        uint64_t locked_at = monotonic_us();
+        for (uint32_t addr : shown_active)
+          cerr << addr_to_string(addr) << endl;
+        cerr << "======== passive view ========" << endl;
+        for (uint32_t addr : shown_passive)
+          cerr << addr_to_string(addr) << endl;
+        stats_record(&views_hold, monotonic_us() - locked_at);
+        pthread_mutex_unlock(&views_lock);
+      }
+
       else if (line == "neighbor") {
+        // members still to be probed in this round
         cerr << "======== neighbors =========" << endl;
-        pthread_mutex_lock(&list_lock);
-        for (int i = 1; i <= MONITOR_COUNT; i++) {
-          cerr << find_alive_target_ip(i) << endl;
+        const member_snapshot* snapshot = snapshot_read_lock();
+        uint64_t locked_at = monotonic_us();
+        for (uint32_t addr : snapshot->probe_pending) {
+          cerr << addr_to_string(addr) << endl;
         }
-        pthread_mutex_unlock(&list_lock);
+        stats_record(&read_hold, monotonic_us() - locked_at);
+        snapshot_read_unlock();
       }
       
+      else if (line == "stats") {
+        // also served on STATS_PORT
+        fprintf(stderr, "%s", stats_report().c_str());
+      }
+
       else if (line == "leave") {
+        // tell the group we are leaving and give a majority a bounded time to ACK it
+        leave_requested.store(true);
+        uint64_t deadline = now_ms() + LEAVE_TIMEOUT_MS;
+        while (!leave_acked.load() && now_ms() < deadline)
+          usleep(LEAVE_POLL_MS * 1000 / 5);
+        if (partial_views)
+          fprintf(stderr, "===== Left, told %d neighbors =====\n", leave_acks.load());
+        else
+          fprintf(stderr, "===== Left, %d members acknowledged%s =====\n", leave_acks.load(),
+            leave_acked.load() ? "" : " (no majority, timed out)");
+        async_log_flush(log_file);   // the event loop may still be logging, keep the ring alive
         exit(0);
       }
     }
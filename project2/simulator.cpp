@@ -0,0 +1,829 @@
+/*
+** simulator.cpp -- run many SWIM members in one process over a lossy virtual network
+**
+** Every member talks through its own transport (transport.cpp) into a virtual
+** network that loses, delays and partitions datagrams, and members can crash.
+** Everything, faults included, is driven by one seed, so a run can be repeated
+** exactly. Time is virtual: one step is one millisecond.
+**
+** ./simulator detect: all members join through member 0, run for a while, then
+** some of them crash. For each packet loss rate the run is repeated with and
+** without indirect probes (k = 0 is the old detector: one PING, then FAILED) and
+** reports how long the crash takes to be detected, how often live members were
+** suspected or failed and how long until every view is right again.
+**
+** ./simulator partition: the cluster is cut in two halves for a while and then
+** healed, reporting how long the views take to agree again after the heal.
+**
+** ./simulator phi: like detect, with members stalling now and then as a busy
+** VM would, for several phi accrual thresholds against the fixed deadlines.
+**
+** ./simulator leave: one member leaves with `leave` (LEAVE to everyone, exit
+** after a majority ACKed or 2 s) or just exits, and the time until every other
+** member stopped counting it as live is reported, for several loss rates.
+**
+** ./simulator hyparview: thousands of members with partial views (hyparview.cpp)
+** join one after another, then some crash. Reports how many members broadcasts
+** reach right after the crash and once the views are repaired, bytes per member
+** per second and the view sizes.
+**
+** ./simulator converge: for growing cluster sizes, one new member joins a
+** settled cluster and the time until every member knows it is reported in
+** gossip rounds, next to log2(n).
+*/
+
+#include "common.cpp"
+#include "swim.cpp"
+#include "hyparview.cpp"
+#include "transport.cpp"
+
+#include <queue>
+
+using std::priority_queue;
+using std::pair;
+
+#define SIM_WARMUP_MS 30000
+#define SIM_ALL_SIDES -1
+
+struct sim_packet {
+  uint64_t deliver_at;
+  uint64_t seq;               // keeps delivery order deterministic for equal times
+  uint32_t from;
+  string data;
+
+  bool operator>(const sim_packet& other) const {
+    return deliver_at != other.deliver_at ? deliver_at > other.deliver_at : seq > other.seq;
+  }
+};
+
+struct sim_faults {
+  double loss = 0;            // fraction of datagrams dropped
+  uint64_t min_delay_ms = 1;
+  uint64_t max_delay_ms = 5;
+  double stalls_per_s = 0;    // chance per second that a random member stalls
+  uint64_t max_stall_ms = 0;  // stalls last up to this long
+};
+
+// called with the index of the member that saw the change
+typedef std::function<void(int, const member_entry&)> sim_change_fn;
+
+struct sim_world {
+  vector<swim_node> nodes;
+  vector<transport> transports;
+  vector<transport_recv_fn> receivers;
+  vector<priority_queue<sim_packet, vector<sim_packet>, std::greater<sim_packet>>> inboxes;
+  vector<bool> started;
+  vector<bool> crashed;
+  vector<int> side;           // datagrams only pass between members on the same side
+  vector<uint64_t> stalled_until;
+  timer_wheel timers;
+  sim_faults faults;
+  uint64_t now;
+  uint64_t packet_seq;
+  uint64_t bytes;             // sent, lost ones included
+  uint64_t rng;
+  sim_change_fn on_change;
+
+  // wrong_view[i][j]: live member i does not see member j as it really is (alive or crashed)
+  vector<vector<char>> wrong_view;
+  long long wrong_views;
+  uint64_t watch_since;
+  int64_t agreed_at;          // first time since watch_since that every view was right, -1 if not yet
+};
+
+struct detect_result {
+  double first_detect_ms;     // crash until the first live member marks a crashed one FAILED, -1 if never
+  double full_detect_ms;      // crash until every live member marks every crashed one FAILED, -1 if never
+  double converge_ms;         // crash until every view was right, -1 if never
+  long long false_suspects;   // SUSPECT marks of live members
+  long long false_failures;   // FAILED marks of live members
+  double bytes_per_node_s;
+};
+
+uint32_t sim_addr(int i) {
+  return htonl(0x0a000000 + i + 1);   // 10.0.0.1, 10.0.0.2, ...
+}
+
+int sim_index(uint32_t addr) {
+  return (int) ntohl(addr) - 0x0a000001;
+}
+
+uint64_t sim_random(sim_world* world) {
+  world->rng ^= world->rng << 13;
+  world->rng ^= world->rng >> 7;
+  world->rng ^= world->rng << 17;
+  return world->rng;
+}
+
+// recheck whether member i sees member j right
+void sim_check_view(sim_world* world, int i, int j) {
+  bool wrong = false;
+  if (i != j && world->started[i] && !world->crashed[i] && world->started[j]) {
+    const member_table& members = world->nodes[i].members;
+    int slot = member_slot(members, sim_addr(j));
+    if (world->crashed[j])
+      wrong = slot >= 0 && (members.entries[slot].status == JOIN || members.entries[slot].status == SUSPECT);
+    else
+      wrong = slot < 0 || members.entries[slot].status != JOIN;
+  }
+
+  if (wrong != (bool) world->wrong_view[i][j]) {
+    world->wrong_view[i][j] = wrong;
+    world->wrong_views += wrong ? 1 : -1;
+    if (world->wrong_views == 0 && world->agreed_at < 0 && world->now >= world->watch_since)
+      world->agreed_at = world->now;
+  }
+}
+
+// member i started or crashed: every view of it and all of its own views may have changed
+void sim_check_member(sim_world* world, int i) {
+  for (int j = 0; j < (int) world->nodes.size(); ++j) {
+    sim_check_view(world, i, j);
+    sim_check_view(world, j, i);
+  }
+}
+
+// the virtual network as member i sees it
+transport sim_transport(sim_world* world, int i) {
+  transport t;
+  t.send = [world, i](uint32_t to, const char* msg, size_t len) {
+    world->bytes += len;
+    if ((sim_random(world) % 1000000) < world->faults.loss * 1000000)
+      return;
+    int dest = sim_index(to);
+    if (dest < 0 || dest >= (int) world->nodes.size() || world->side[dest] != world->side[i])
+      return;
+    uint64_t spread = world->faults.max_delay_ms - world->faults.min_delay_ms + 1;
+    uint64_t delay = world->faults.min_delay_ms + sim_random(world) % spread;
+    // a stalled member's timers still run, but nothing it sends leaves before the stall ends
+    uint64_t leaves = std::max(world->now, world->stalled_until[i]);
+    world->inboxes[dest].push({leaves + delay, world->packet_seq++, sim_addr(i), string(msg, len)});
+  };
+  // datagrams enter the virtual network as they are sent
+  t.flush = []() {};
+  // virtual time does not pass while polling, only datagrams already due are handed over
+  t.poll = [world, i](int, const transport_recv_fn& recv) {
+    auto& inbox = world->inboxes[i];
+    while (!inbox.empty() && inbox.top().deliver_at <= world->now) {
+      sim_packet p = inbox.top();
+      inbox.pop();
+      recv(p.from, &p.data[0], p.data.size());
+    }
+  };
+  return t;
+}
+
+// create `n` members at time 0, none of them started
+void sim_init(sim_world* world, int n, const swim_config& config, const sim_faults& faults, uint64_t seed) {
+  world->nodes.resize(n);
+  world->transports.resize(n);
+  world->receivers.resize(n);
+  world->inboxes.resize(n);
+  world->started.assign(n, false);
+  world->crashed.assign(n, false);
+  world->side.assign(n, 0);
+  world->stalled_until.assign(n, 0);
+  world->faults = faults;
+  world->now = 0;
+  world->packet_seq = 0;
+  world->bytes = 0;
+  world->rng = seed * 2654435761ULL + 1;
+  world->wrong_view.assign(n, vector<char>(n, 0));
+  world->wrong_views = 0;
+  world->watch_since = 0;
+  world->agreed_at = -1;
+  timer_wheel_init(&world->timers, 0);
+
+  for (int i = 0; i < n; ++i) {
+    world->transports[i] = sim_transport(world, i);
+    world->receivers[i] = [world, i](uint32_t from, char* msg, size_t len) {
+      swim_receive(&world->nodes[i], from, msg, len, world->now);
+    };
+    swim_change_fn on_change = [world, i](const member_entry& e) {
+      int j = sim_index(e.addr);
+      if (j >= 0 && j < (int) world->nodes.size())
+        sim_check_view(world, i, j);
+      if (world->on_change)
+        world->on_change(i, e);
+    };
+    swim_init(&world->nodes[i], sim_addr(i), config, &world->timers, seed * 1000003 + i,
+              world->transports[i].send, on_change, 0);
+  }
+}
+
+void sim_start(sim_world* world, int i) {
+  world->started[i] = true;
+  swim_start(&world->nodes[i], world->now);
+  sim_check_member(world, i);
+}
+
+void sim_crash(sim_world* world, int i) {
+  world->crashed[i] = true;
+  swim_stop(&world->nodes[i]);
+  world->inboxes[i] = {};
+  sim_check_member(world, i);
+}
+
+// cut the network: members [0, split) on one side, the rest on the other, SIM_ALL_SIDES heals it
+void sim_partition(sim_world* world, int split) {
+  for (int i = 0; i < (int) world->nodes.size(); ++i)
+    world->side[i] = split != SIM_ALL_SIDES && i >= split;
+}
+
+// deliver the datagrams and fire the timers of the current millisecond, then move to the next one
+void sim_step(sim_world* world) {
+  int n = world->nodes.size();
+  if (world->faults.stalls_per_s > 0 && world->now % 1000 == 0 &&
+      (sim_random(world) % 1000000) < world->faults.stalls_per_s * 1000000) {
+    int i = sim_random(world) % n;
+    world->stalled_until[i] = world->now + 1 + sim_random(world) % world->faults.max_stall_ms;
+  }
+
+  for (int i = 0; i < n; ++i) {
+    if (world->started[i] && !world->crashed[i] && world->stalled_until[i] <= world->now)
+      world->transports[i].poll(0, world->receivers[i]);
+  }
+  timer_advance(&world->timers, world->now);
+  ++world->now;
+}
+
+// measure convergence from now on, call after injecting a fault
+void sim_watch(sim_world* world) {
+  world->watch_since = world->now;
+  world->agreed_at = world->wrong_views == 0 ? world->now : -1;
+}
+
+// ms from sim_watch until every view was right, -1 if that never happened
+double sim_converge_ms(const sim_world* world) {
+  if (world->agreed_at < 0)
+    return -1;
+  return (double) (world->agreed_at - (int64_t) world->watch_since);
+}
+
+// member i joins through member 0 and starts with a copy of its list, as the introducer's join response
+void sim_introduce(sim_world* world, int i) {
+  swim_join(&world->nodes[0], sim_addr(i), world->now);
+  vector<member_entry> snapshot = world->nodes[0].members.entries;
+  swim_load_state(&world->nodes[i], snapshot.data(), snapshot.size(), world->now);
+}
+
+// everyone joins through member 0, a few milliseconds apart
+void sim_join_all(sim_world* world) {
+  sim_start(world, 0);
+  for (int i = 1; i < (int) world->nodes.size(); ++i) {
+    while (world->now < (uint64_t) i * 5)
+      sim_step(world);
+    sim_start(world, i);
+    sim_introduce(world, i);
+  }
+}
+
+detect_result simulate_detection(int n, int crashes, const swim_config& config, const sim_faults& faults,
+                                 uint64_t run_ms, uint64_t seed) {
+  sim_world world;
+  int first_victim = n - crashes;
+  uint64_t crash_at = SIM_WARMUP_MS;
+  vector<vector<bool>> detected(n, vector<bool>(n, false));
+  long long detected_count = 0;
+  detect_result result = {-1, -1, -1, 0, 0, 0};
+
+  sim_init(&world, n, config, faults, seed);
+  world.on_change = [&](int i, const member_entry& e) {
+    int who = sim_index(e.addr);
+    if (!world.crashed[who]) {
+      if (e.status == SUSPECT && who != i)
+        ++result.false_suspects;
+      else if (e.status == FAILED)
+        ++result.false_failures;
+    } else if (e.status == FAILED && !detected[i][who]) {
+      detected[i][who] = true;
+      if (++detected_count == 1)
+        result.first_detect_ms = world.now - crash_at;
+      if (detected_count == (long long) first_victim * crashes)
+        result.full_detect_ms = world.now - crash_at;
+    }
+  };
+
+  sim_join_all(&world);
+  uint64_t bytes_at_crash = 0;
+  while (world.now < run_ms) {
+    if (world.now == crash_at) {
+      for (int i = first_victim; i < n; ++i)
+        sim_crash(&world, i);
+      sim_watch(&world);
+      bytes_at_crash = world.bytes;
+    }
+    sim_step(&world);
+  }
+
+  result.converge_ms = sim_converge_ms(&world);
+  result.bytes_per_node_s = (double) (world.bytes - bytes_at_crash) / first_victim / ((run_ms - crash_at) / 1000.0);
+  return result;
+}
+
+struct partition_result {
+  long long failures;         // FAILED marks while the network was cut
+  long long late_failures;    // FAILED marks after the heal
+  double converge_ms;         // heal until every view was right, -1 if never
+  double bytes_per_node_s;
+};
+
+partition_result simulate_partition(int n, uint64_t cut_ms, const swim_config& config, const sim_faults& faults,
+                                    uint64_t run_ms, uint64_t seed) {
+  sim_world world;
+  uint64_t cut_at = SIM_WARMUP_MS;
+  uint64_t heal_at = cut_at + cut_ms;
+  partition_result result = {0, 0, -1, 0};
+
+  sim_init(&world, n, config, faults, seed);
+  world.on_change = [&](int, const member_entry& e) {
+    if (e.status == FAILED)
+      ++(world.now < heal_at ? result.failures : result.late_failures);
+  };
+
+  sim_join_all(&world);
+  uint64_t bytes_at_cut = 0;
+  while (world.now < run_ms) {
+    if (world.now == cut_at) {
+      sim_partition(&world, n / 2);
+      bytes_at_cut = world.bytes;
+    } else if (world.now == heal_at) {
+      sim_partition(&world, SIM_ALL_SIDES);
+      sim_watch(&world);
+    }
+    sim_step(&world);
+  }
+
+  result.converge_ms = sim_converge_ms(&world);
+  result.bytes_per_node_s = (double) (world.bytes - bytes_at_cut) / n / ((run_ms - cut_at) / 1000.0);
+  return result;
+}
+
+// ms until all `n` members of a settled cluster know a member joining through member 0, -1 if not within `limit_ms`
+double simulate_convergence(int n, const swim_config& config, uint64_t limit_ms, uint64_t seed) {
+  sim_world world;
+  int newcomer = n;
+  uint64_t join_at = 1000;
+  vector<bool> knows(n, false);
+  int know_count = 0;
+  double converged_ms = -1;
+
+  sim_init(&world, n + 1, config, sim_faults(), seed);
+  world.on_change = [&](int i, const member_entry& e) {
+    if (i < n && sim_index(e.addr) == newcomer && !knows[i]) {
+      knows[i] = true;
+      if (++know_count == n)
+        converged_ms = world.now - join_at;
+    }
+  };
+
+  // the first n members already know each other, with nothing left to gossip
+  for (int i = 0; i < n; ++i) {
+    for (int j = 0; j < n; ++j) {
+      if (j != i)
+        member_add(world.nodes[i].members, world.nodes[j].members.entries[0]);
+    }
+  }
+  for (int i = 0; i < n; ++i)
+    sim_start(&world, i);
+
+  while (world.now < join_at + limit_ms && converged_ms < 0) {
+    if (world.now == join_at) {
+      sim_start(&world, newcomer);
+      sim_introduce(&world, newcomer);
+    }
+    sim_step(&world);
+  }
+  return converged_ms;
+}
+
+string ms_string(double ms) {
+  return ms < 0 ? "never" : std::to_string((long long) ms) + "ms";
+}
+
+struct leave_result {
+  double quorum_ms;           // leave until a majority ACKed, -1 if it did not in time (or just exited)
+  double first_ms;            // leave until the first member no longer counts it as live
+  double all_ms;              // leave until no member counts it as live, -1 if never
+};
+
+// member n - 1 leaves after the warmup, with `leave` if `graceful`, else it just exits
+leave_result simulate_leave(int n, bool graceful, const swim_config& config, const sim_faults& faults,
+                            uint64_t timeout_ms, uint64_t run_ms, uint64_t seed) {
+  sim_world world;
+  int victim = n - 1;
+  uint64_t leave_at = SIM_WARMUP_MS;
+  vector<bool> gone(n, false);
+  int gone_count = 0;
+  leave_result result = {-1, -1, -1};
+
+  sim_init(&world, n, config, faults, seed);
+  world.on_change = [&](int i, const member_entry& e) {
+    if (world.now < leave_at || i == victim || sim_index(e.addr) != victim || gone[i])
+      return;
+    if (e.status == LEAVE || e.status == FAILED) {
+      gone[i] = true;
+      if (++gone_count == 1)
+        result.first_ms = world.now - leave_at;
+      if (gone_count == n - 1)
+        result.all_ms = world.now - leave_at;
+    }
+  };
+
+  sim_join_all(&world);
+  while (world.now < run_ms && (result.all_ms < 0 || !world.crashed[victim])) {
+    if (world.now == leave_at) {
+      if (graceful)
+        swim_leave(&world.nodes[victim], world.now);
+      else
+        sim_crash(&world, victim);
+    }
+    // the process exits once a majority has the LEAVE, or when it gives up waiting
+    if (graceful && world.now > leave_at && !world.crashed[victim]) {
+      if (swim_leave_quorum(&world.nodes[victim])) {
+        result.quorum_ms = world.now - leave_at;
+        sim_crash(&world, victim);
+      } else if (world.now >= leave_at + timeout_ms) {
+        sim_crash(&world, victim);
+      }
+    }
+    sim_step(&world);
+  }
+  return result;
+}
+
+// ./simulator detect [NODES] [SECONDS] [SEED] [CRASHES]
+void run_detect(int argc, char *argv[], sim_faults faults) {
+  int n = argc > 2 ? atoi(argv[2]) : 50;
+  int seconds = argc > 3 ? atoi(argv[3]) : 60;
+  uint64_t seed = argc > 4 ? atoll(argv[4]) : 1;
+  int crashes = argc > 5 ? atoi(argv[5]) : 1;
+  if (n < 3 || seconds * 1000 <= SIM_WARMUP_MS || crashes < 1 || crashes > n - 2) {
+    fprintf(stderr, "usage: ./simulator detect [NODES >= 3] [SECONDS > %d] [SEED] [CRASHES < NODES - 1]\n", SIM_WARMUP_MS / 1000);
+    exit(1);
+  }
+
+  printf("%d members, %d crash after %d s, %d s total, delay %llu-%llu ms, seed %llu\n", n, crashes, SIM_WARMUP_MS / 1000, seconds,
+    (unsigned long long) faults.min_delay_ms, (unsigned long long) faults.max_delay_ms, (unsigned long long) seed);
+  printf("%6s %3s %13s %13s %13s %14s %13s %12s\n", "loss", "k", "first FAILED", "all FAILED", "converged",
+    "false SUSPECT", "false FAILED", "bytes/node/s");
+  double losses[] = {0, 0.01, 0.05, 0.10, 0.20};
+  for (double loss : losses) {
+    for (int k : {0, 3}) {
+      swim_config config;
+      config.indirect_probes = k;
+      if (k == 0)
+        config.suspect_multiplier = 0;   // the old detector: no suspicion, FAILED right away
+      faults.loss = loss;
+      detect_result r = simulate_detection(n, crashes, config, faults, seconds * 1000, seed);
+      printf("%5.0f%% %3d %13s %13s %13s %14lld %13lld %12.0f\n", loss * 100, k,
+        ms_string(r.first_detect_ms).c_str(), ms_string(r.full_detect_ms).c_str(), ms_string(r.converge_ms).c_str(),
+        r.false_suspects, r.false_failures, r.bytes_per_node_s);
+    }
+  }
+}
+
+// ./simulator partition [NODES] [SECONDS] [SEED]
+void run_partition(int argc, char *argv[], sim_faults faults) {
+  int n = argc > 2 ? atoi(argv[2]) : 50;
+  int seconds = argc > 3 ? atoi(argv[3]) : 120;
+  uint64_t seed = argc > 4 ? atoll(argv[4]) : 1;
+  uint64_t cuts[] = {2000, 10000, 30000};
+  if (n < 4 || seconds * 1000 <= SIM_WARMUP_MS + 30000) {
+    fprintf(stderr, "usage: ./simulator partition [NODES >= 4] [SECONDS > %d] [SEED]\n", SIM_WARMUP_MS / 1000 + 30);
+    exit(1);
+  }
+
+  printf("%d members cut in halves after %d s, %d s total, delay %llu-%llu ms, seed %llu\n", n, SIM_WARMUP_MS / 1000, seconds,
+    (unsigned long long) faults.min_delay_ms, (unsigned long long) faults.max_delay_ms, (unsigned long long) seed);
+  printf("%6s %8s %14s %14s %16s %12s\n", "loss", "cut", "FAILED in cut", "FAILED after", "converged after", "bytes/node/s");
+  double losses[] = {0, 0.05};
+  for (double loss : losses) {
+    for (uint64_t cut : cuts) {
+      faults.loss = loss;
+      partition_result r = simulate_partition(n, cut, swim_config(), faults, seconds * 1000, seed);
+      printf("%5.0f%% %7llus %14lld %14lld %16s %12.0f\n", loss * 100, (unsigned long long) cut / 1000,
+        r.failures, r.late_failures, ms_string(r.converge_ms).c_str(), r.bytes_per_node_s);
+    }
+  }
+}
+
+// ./simulator phi [NODES] [SECONDS] [SEED]
+void run_phi(int argc, char *argv[], sim_faults faults) {
+  int n = argc > 2 ? atoi(argv[2]) : 50;
+  int seconds = argc > 3 ? atoi(argv[3]) : 90;
+  uint64_t seed = argc > 4 ? atoll(argv[4]) : 1;
+  if (n < 3 || seconds * 1000 <= SIM_WARMUP_MS) {
+    fprintf(stderr, "usage: ./simulator phi [NODES >= 3] [SECONDS > %d] [SEED]\n", SIM_WARMUP_MS / 1000);
+    exit(1);
+  }
+
+  faults.stalls_per_s = 0.5;
+  faults.max_stall_ms = 3000;
+  printf("%d members, 1 crash after %d s, %d s total, delay %llu-%llu ms, a stall of up to %llu ms every %.0f s, seed %llu\n",
+    n, SIM_WARMUP_MS / 1000, seconds, (unsigned long long) faults.min_delay_ms, (unsigned long long) faults.max_delay_ms,
+    (unsigned long long) faults.max_stall_ms, 1 / faults.stalls_per_s, (unsigned long long) seed);
+  printf("%6s %6s %13s %13s %14s %13s %12s\n", "loss", "phi", "first FAILED", "all FAILED", "false SUSPECT", "false FAILED", "bytes/node/s");
+  double losses[] = {0, 0.05};
+  double thresholds[] = {0, 1, 3, 8, 16};
+  for (double loss : losses) {
+    for (double threshold : thresholds) {
+      swim_config config;
+      config.phi_threshold = threshold;
+      faults.loss = loss;
+      detect_result r = simulate_detection(n, 1, config, faults, seconds * 1000, seed);
+      printf("%5.0f%% %6s %13s %13s %14lld %13lld %12.0f\n", loss * 100,
+        threshold > 0 ? std::to_string((int) threshold).c_str() : "fixed",
+        ms_string(r.first_detect_ms).c_str(), ms_string(r.full_detect_ms).c_str(),
+        r.false_suspects, r.false_failures, r.bytes_per_node_s);
+    }
+  }
+}
+
+// ./simulator leave [NODES] [SEED]
+void run_leave(int argc, char *argv[], sim_faults faults) {
+  int n = argc > 2 ? atoi(argv[2]) : 50;
+  uint64_t seed = argc > 3 ? atoll(argv[3]) : 1;
+  if (n < 3) {
+    fprintf(stderr, "usage: ./simulator leave [NODES >= 3] [SEED]\n");
+    exit(1);
+  }
+
+  swim_config config;
+  printf("%d members, one leaves after %d s, delay %llu-%llu ms, gossip round %llu ms, seed %llu\n", n, SIM_WARMUP_MS / 1000,
+    (unsigned long long) faults.min_delay_ms, (unsigned long long) faults.max_delay_ms,
+    (unsigned long long) config.gossip_interval_ms, (unsigned long long) seed);
+  printf("%6s %8s %13s %13s %13s\n", "loss", "how", "majority ACK", "first gone", "all gone");
+  double losses[] = {0, 0.01, 0.05, 0.10};
+  for (double loss : losses) {
+    for (bool graceful : {false, true}) {
+      faults.loss = loss;
+      leave_result r = simulate_leave(n, graceful, config, faults, 2000, SIM_WARMUP_MS + 60000, seed);
+      printf("%5.0f%% %8s %13s %13s %13s\n", loss * 100, graceful ? "leave" : "exit",
+        graceful ? ms_string(r.quorum_ms).c_str() : "-", ms_string(r.first_ms).c_str(), ms_string(r.all_ms).c_str());
+    }
+  }
+}
+
+// members with partial views on the same kind of virtual network as sim_world
+struct hpv_world {
+  vector<hpv_node> nodes;
+  vector<priority_queue<sim_packet, vector<sim_packet>, std::greater<sim_packet>>> inboxes;
+  vector<bool> crashed;
+  timer_wheel timers;
+  sim_faults faults;
+  uint64_t now;
+  uint64_t packet_seq;
+  uint64_t bytes;
+  uint64_t rng;
+  vector<int> reached;        // members each of our broadcasts reached, by broadcast number
+};
+
+struct hpv_result {
+  double reach_after_crash;   // average fraction of live members a broadcast reached, right after the crash
+  double all_after_crash;     // fraction of broadcasts that reached every live member
+  double reach_repaired;      // the same once the views were repaired
+  double all_repaired;
+  double bytes_per_node_s;    // before the crash, broadcasts excluded
+  double active_size;         // average view sizes of live members at the end
+  double passive_size;
+};
+
+uint64_t hpv_world_random(hpv_world* world) {
+  world->rng ^= world->rng << 13;
+  world->rng ^= world->rng >> 7;
+  world->rng ^= world->rng << 17;
+  return world->rng;
+}
+
+void hpv_world_init(hpv_world* world, int n, const hpv_config& config, const sim_faults& faults, uint64_t seed) {
+  world->nodes.resize(n);
+  world->inboxes.resize(n);
+  world->crashed.assign(n, false);
+  world->faults = faults;
+  world->now = 0;
+  world->packet_seq = 0;
+  world->bytes = 0;
+  world->rng = seed * 2654435761ULL + 1;
+  timer_wheel_init(&world->timers, 0);
+
+  for (int i = 0; i < n; ++i) {
+    swim_send_fn send = [world, i](uint32_t to, const char* msg, size_t len) {
+      world->bytes += len;
+      if ((hpv_world_random(world) % 1000000) < world->faults.loss * 1000000)
+        return;
+      int dest = sim_index(to);
+      if (dest < 0 || dest >= (int) world->nodes.size() || world->crashed[dest])
+        return;
+      uint64_t spread = world->faults.max_delay_ms - world->faults.min_delay_ms + 1;
+      uint64_t delay = world->faults.min_delay_ms + hpv_world_random(world) % spread;
+      world->inboxes[dest].push({world->now + delay, world->packet_seq++, sim_addr(i), string(msg, len)});
+    };
+    hpv_deliver_fn deliver = [world](uint32_t, const char* data, size_t len) {
+      if (len >= 4)
+        ++world->reached[get_u32(data)];
+    };
+    hpv_init(&world->nodes[i], sim_addr(i), config, &world->timers, seed * 1000003 + i, send, deliver);
+  }
+}
+
+void hpv_world_step(hpv_world* world) {
+  for (int i = 0; i < (int) world->nodes.size(); ++i) {
+    auto& inbox = world->inboxes[i];
+    while (!inbox.empty() && inbox.top().deliver_at <= world->now) {
+      sim_packet p = inbox.top();
+      inbox.pop();
+      if (!world->crashed[i])
+        hpv_receive(&world->nodes[i], p.from, &p.data[0], p.data.size(), world->now);
+    }
+  }
+  timer_advance(&world->timers, world->now);
+  ++world->now;
+}
+
+// `count` broadcasts from random live members, `gap_ms` apart, then time for them to arrive
+// return (average fraction of live members reached, fraction that reached all of them)
+pair<double, double> hpv_world_broadcasts(hpv_world* world, int count, uint64_t gap_ms) {
+  int n = world->nodes.size();
+  int live = std::count(world->crashed.begin(), world->crashed.end(), false);
+  size_t first = world->reached.size();
+  for (int b = 0; b < count; ++b) {
+    int from;
+    do {
+      from = hpv_world_random(world) % n;
+    } while (world->crashed[from]);
+    char data[4];
+    put_u32(data, world->reached.size());
+    world->reached.push_back(1);
+    hpv_broadcast(&world->nodes[from], HPV_KIND_DATA, data, 4);
+    for (uint64_t t = 0; t < gap_ms; ++t)
+      hpv_world_step(world);
+  }
+  for (int t = 0; t < 2000; ++t)
+    hpv_world_step(world);
+
+  double reach = 0, all = 0;
+  for (size_t b = first; b < world->reached.size(); ++b) {
+    reach += (double) world->reached[b] / live;
+    all += world->reached[b] >= live;
+  }
+  return {reach / count, all / count};
+}
+
+hpv_result simulate_hyparview(int n, double crash_fraction, const hpv_config& config, const sim_faults& faults, uint64_t seed) {
+  hpv_world world;
+  hpv_result result;
+  hpv_world_init(&world, n, config, faults, seed);
+
+  // everyone joins through a random earlier member, 2 ms apart, then the views settle
+  hpv_start(&world.nodes[0], 0, 0);
+  for (int i = 1; i < n; ++i) {
+    while (world.now < (uint64_t) i * 2)
+      hpv_world_step(&world);
+    hpv_start(&world.nodes[i], sim_addr(hpv_world_random(&world) % i), world.now);
+  }
+  uint64_t settled = std::max(world.now + 20000, (uint64_t) SIM_WARMUP_MS);
+  while (world.now < settled)
+    hpv_world_step(&world);
+
+  // background traffic only: probes, shuffles and repairs
+  uint64_t bytes_before = world.bytes;
+  for (int t = 0; t < 10000; ++t)
+    hpv_world_step(&world);
+  result.bytes_per_node_s = (double) (world.bytes - bytes_before) / n / 10.0;
+
+  vector<int> order(n);
+  for (int i = 0; i < n; ++i)
+    order[i] = i;
+  for (int i = n - 1; i > 0; --i)
+    std::swap(order[i], order[hpv_world_random(&world) % (i + 1)]);
+  for (int i = 0; i < (int) (n * crash_fraction); ++i) {
+    world.crashed[order[i]] = true;
+    hpv_stop(&world.nodes[order[i]]);
+  }
+
+  pair<double, double> r = hpv_world_broadcasts(&world, 20, 50);
+  result.reach_after_crash = r.first;
+  result.all_after_crash = r.second;
+  for (int t = 0; t < 20000; ++t)
+    hpv_world_step(&world);
+  r = hpv_world_broadcasts(&world, 20, 50);
+  result.reach_repaired = r.first;
+  result.all_repaired = r.second;
+
+  double active = 0, passive = 0;
+  int live = 0;
+  for (int i = 0; i < n; ++i) {
+    if (!world.crashed[i]) {
+      active += world.nodes[i].active.size();
+      passive += world.nodes[i].passive.size();
+      ++live;
+    }
+  }
+  result.active_size = active / live;
+  result.passive_size = passive / live;
+  return result;
+}
+
+// ./simulator hyparview [NODES] [SEED]
+void run_hyparview(int argc, char *argv[], sim_faults faults) {
+  int n = argc > 2 ? atoi(argv[2]) : 5000;
+  uint64_t seed = argc > 3 ? atoll(argv[3]) : 1;
+  if (n < 10) {
+    fprintf(stderr, "usage: ./simulator hyparview [NODES >= 10] [SEED]\n");
+    exit(1);
+  }
+
+  hpv_config config;
+  swim_config full;
+  printf("%d members, active view %d, passive view %d, delay %llu-%llu ms, seed %llu\n", n, config.active_size,
+    config.passive_size, (unsigned long long) faults.min_delay_ms, (unsigned long long) faults.max_delay_ms,
+    (unsigned long long) seed);
+  printf("a full list would be %d bytes on the wire per member and its sync alone %.0f bytes/s\n",
+    n * ENTRY_WIRE_SIZE, (double) n * ENTRY_WIRE_SIZE / (full.sync_periods * full.period_ms / 1000.0));
+  printf("%6s %8s %13s %13s %13s %13s %12s %7s %8s\n", "loss", "crashed", "reach", "all reached",
+    "reach later", "all later", "bytes/node/s", "active", "passive");
+  double losses[] = {0, 0.05};
+  double crashes[] = {0, 0.1, 0.3, 0.5};
+  for (double loss : losses) {
+    for (double crash : crashes) {
+      faults.loss = loss;
+      hpv_result r = simulate_hyparview(n, crash, config, faults, seed);
+      printf("%5.0f%% %7.0f%% %12.2f%% %12.0f%% %12.2f%% %12.0f%% %12.0f %7.1f %8.1f\n", loss * 100, crash * 100,
+        r.reach_after_crash * 100, r.all_after_crash * 100, r.reach_repaired * 100, r.all_repaired * 100,
+        r.bytes_per_node_s, r.active_size, r.passive_size);
+    }
+  }
+}
+
+// ./simulator converge [MAX_NODES] [SEED]
+void run_converge(int argc, char *argv[]) {
+  int max_n = argc > 2 ? atoi(argv[2]) : 1024;
+  uint64_t seed = argc > 3 ? atoll(argv[3]) : 1;
+  if (max_n < 4) {
+    fprintf(stderr, "usage: ./simulator converge [MAX_NODES >= 4] [SEED]\n");
+    exit(1);
+  }
+
+  swim_config config;
+  int fanouts[] = {1, 2, 4};
+  printf("gossip rounds (%llu ms) until a join reaches every member, seed %llu\n",
+    (unsigned long long) config.gossip_interval_ms, (unsigned long long) seed);
+  printf("%6s %8s", "n", "log2(n)");
+  for (int f : fanouts)
+    printf(" %9s%-3d", "fanout ", f);
+  printf("\n");
+
+  for (int n = 4; n <= max_n; n *= 2) {
+    printf("%6d %8.1f", n, log2((double) n));
+    for (int f : fanouts) {
+      config.gossip_fanout = f;
+      double ms = simulate_convergence(n, config, 60000, seed);
+      if (ms < 0)
+        printf(" %12s", "never");
+      else
+        printf(" %12.1f", ms / config.gossip_interval_ms);
+    }
+    printf("\n");
+  }
+}
+
+// ./simulator [-d MIN_MS-MAX_MS] detect|partition|phi|leave|hyparview|converge ...
+int main(int argc, char *argv[]) {
+  sim_faults faults;
+  if (argc > 2 && strcmp(argv[1], "-d") == 0) {
+    unsigned long long min_delay = 0, max_delay = 0;
+    if (sscanf(argv[2], "%llu-%llu", &min_delay, &max_delay) != 2 || min_delay > max_delay) {
+      fprintf(stderr, "delay must be MIN_MS-MAX_MS\n");
+      exit(1);
+    }
+    faults.min_delay_ms = min_delay;
+    faults.max_delay_ms = max_delay;
+    argc -= 2;
+    argv += 2;
+  }
+
+  string mode = argc > 1 ? argv[1] : "detect";
+  if (mode == "detect") {
+    run_detect(argc, argv, faults);
+  } else if (mode == "partition") {
+    run_partition(argc, argv, faults);
+  } else if (mode == "phi") {
+    run_phi(argc, argv, faults);
+  } else if (mode == "leave") {
+    run_leave(argc, argv, faults);
+  } else if (mode == "hyparview") {
+    run_hyparview(argc, argv, faults);
+  } else if (mode == "converge") {
+    run_converge(argc, argv);
+  } else {
+    fprintf(stderr, "usage: ./simulator [-d MIN_MS-MAX_MS] detect [NODES] [SECONDS] [SEED] [CRASHES]\n"
+                    "       ./simulator [-d MIN_MS-MAX_MS] partition [NODES] [SECONDS] [SEED]\n"
+                    "       ./simulator [-d MIN_MS-MAX_MS] phi [NODES] [SECONDS] [SEED]\n"
+                    "       ./simulator [-d MIN_MS-MAX_MS] leave [NODES] [SEED]\n"
+                    "       ./simulator [-d MIN_MS-MAX_MS] hyparview [NODES] [SEED]\n"
+                    "       ./simulator converge [MAX_NODES] [SEED]\n");
+    exit(1);
+  }
+  return 0;
+}
@@ -0,0 +1,92 @@
+/*
+** snapshot.cpp -- read-mostly membership snapshots published RCU style
+**
+** The protocol thread is the only writer. After changing the list it publishes
+** a new immutable member_snapshot with one atomic pointer swap. Readers never
+** lock: they announce the epoch they started in, use whatever snapshot is
+** current, and the writer frees a replaced snapshot once every reader that
+** could still hold it has finished.
+**
+** Include after membership.cpp.
+*/
+
+#include <atomic>
+
+#define SNAPSHOT_MAX_READERS 64     // threads that may ever call snapshot_read_lock
+
+// immutable once published
+struct member_snapshot {
+  member_table members;
+  uint64_t version;                 // list version it was taken at
+  vector<uint32_t> probe_pending;   // members still to be probed in the current round
+};
+
+// one per reader thread, on its own cache line
+struct alignas(64) snapshot_reader {
+  std::atomic<uint64_t> epoch;      // epoch the current read started in, 0 if not reading
+};
+
+struct retired_snapshot {
+  const member_snapshot* snapshot;
+  uint64_t epoch;                   // readers from this epoch on can not see it
+};
+
+static std::atomic<const member_snapshot*> current_snapshot(new member_snapshot());
+static std::atomic<uint64_t> snapshot_epoch(1);
+static snapshot_reader snapshot_readers[SNAPSHOT_MAX_READERS];
+static std::atomic<int> snapshot_reader_count(0);
+static vector<retired_snapshot> retired_snapshots;   // writer only
+
+snapshot_reader* this_snapshot_reader() {
+  static thread_local snapshot_reader* reader = NULL;
+  if (reader == NULL) {
+    int slot = snapshot_reader_count.fetch_add(1);
+    if (slot >= SNAPSHOT_MAX_READERS) {
+      fprintf(stderr, "too many snapshot reader threads\n");
+      exit(1);
+    }
+    reader = &snapshot_readers[slot];
+  }
+  return reader;
+}
+
+// the current snapshot, valid until snapshot_read_unlock, calls must not nest
+const member_snapshot* snapshot_read_lock() {
+  snapshot_reader* reader = this_snapshot_reader();
+  reader->epoch.store(snapshot_epoch.load());
+  return current_snapshot.load();
+}
+
+void snapshot_read_unlock() {
+  this_snapshot_reader()->epoch.store(0, std::memory_order_release);
+}
+
+// oldest epoch a reader is still in, UINT64_MAX if nobody is reading
+uint64_t oldest_reader_epoch() {
+  uint64_t oldest = UINT64_MAX;
+  int readers = std::min(snapshot_reader_count.load(), SNAPSHOT_MAX_READERS);
+  for (int i = 0; i < readers; ++i) {
+    uint64_t epoch = snapshot_readers[i].epoch.load();
+    if (epoch != 0)
+      oldest = std::min(oldest, epoch);
+  }
+  return oldest;
+}
+
+// writer: replace the current snapshot, free the replaced ones no reader can hold anymore
+void snapshot_publish(const member_snapshot* snapshot) {
+  const member_snapshot* old = current_snapshot.exchange(snapshot);
+  // a reader that announces an epoch after this increment loads the new pointer
+  uint64_t epoch = snapshot_epoch.fetch_add(1) + 1;
+  retired_snapshots.push_back({old, epoch});
+
+  uint64_t oldest = oldest_reader_epoch();
+  size_t kept = 0;
+  for (const retired_snapshot& r : retired_snapshots) {
+    if (r.epoch <= oldest)
+      delete r.snapshot;
+    else
+      retired_snapshots[kept++] = r;
+  }
+  retired_snapshots.resize(kept);
+}
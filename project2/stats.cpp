@@ -0,0 +1,127 @@
+/*
+** stats.cpp -- counters and histograms of a running member, for tuning its intervals
+**
+** Messages and bytes are counted per type in both directions, and durations go
+** into histograms with power of two buckets. Everything is a relaxed atomic: the
+** event loop and the command reader record, and any thread can print a report
+** while they do (`stats` on stdin, or the TCP stats port). A report is a set of
+** independent readings, not one consistent cut.
+**
+** Include after membership.cpp.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+
+#define STATS_BUCKETS 24            // bucket i counts values in [2^(i-1), 2^i), bucket 0 the zeros
+
+enum stats_type { STATS_PING, STATS_PING_REQ, STATS_ACK, STATS_LEAVE, STATS_UPDATE, STATS_JOIN, STATS_JOINED,
+                  STATS_HYPARVIEW, STATS_OTHER, STATS_TYPES };
+
+static const char* stats_type_names[STATS_TYPES] = {"PING", "PING_REQ", "ACK", "LEAVE", "UPDATE", "JOIN", "JOINED",
+                                                    "HYPARVIEW", "other"};
+
+struct stats_counter {
+  std::atomic<uint64_t> messages;
+  std::atomic<uint64_t> bytes;
+};
+
+struct stats_histogram {
+  std::atomic<uint64_t> buckets[STATS_BUCKETS];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> max;
+};
+
+// microseconds on a clock that does not jump, for hold times
+uint64_t monotonic_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// the type of a message from its header
+stats_type stats_classify(const char* msg, size_t len) {
+  if (len >= 9 && memcmp(msg, "PING_REQ\n", 9) == 0)
+    return STATS_PING_REQ;
+  if (len >= 5 && memcmp(msg, "PING\n", 5) == 0)
+    return STATS_PING;
+  if (len >= 4 && memcmp(msg, "ACK\n", 4) == 0)
+    return STATS_ACK;
+  if (len >= 6 && memcmp(msg, "LEAVE\n", 6) == 0)
+    return STATS_LEAVE;
+  if (len >= UPDATE_HEADER_SIZE && memcmp(msg, UPDATE_HEADER, UPDATE_HEADER_SIZE) == 0)
+    return STATS_UPDATE;
+  if (len >= 5 && memcmp(msg, "JOIN\n", 5) == 0)
+    return STATS_JOIN;
+  if (len >= 7 && memcmp(msg, "JOINED\n", 7) == 0)
+    return STATS_JOINED;
+  if (len >= 1 && msg[0] == 'H')
+    return STATS_HYPARVIEW;
+  return STATS_OTHER;
+}
+
+void stats_count(stats_counter* counters, const char* msg, size_t len) {
+  stats_counter& c = counters[stats_classify(msg, len)];
+  c.messages.fetch_add(1, std::memory_order_relaxed);
+  c.bytes.fetch_add(len, std::memory_order_relaxed);
+}
+
+void stats_record(stats_histogram* h, uint64_t value) {
+  int bucket = 0;
+  while (bucket < STATS_BUCKETS - 1 && value >= (1ULL << bucket))
+    ++bucket;
+  h->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  h->count.fetch_add(1, std::memory_order_relaxed);
+  h->sum.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = h->max.load(std::memory_order_relaxed);
+  while (value > max && !h->max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+// upper bound of the bucket the `fraction` quantile falls in
+uint64_t stats_quantile(const stats_histogram* h, double fraction) {
+  uint64_t count = h->count.load(std::memory_order_relaxed);
+  uint64_t rank = (uint64_t) (count * fraction), seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; ++i) {
+    seen += h->buckets[i].load(std::memory_order_relaxed);
+    if (seen > rank)
+      return i == 0 ? 0 : (1ULL << i) - 1;
+  }
+  return h->max.load(std::memory_order_relaxed);
+}
+
+// one line: count, mean, quantiles and max
+string stats_histogram_line(const char* name, const stats_histogram* h, const char* unit) {
+  char line[256];
+  uint64_t count = h->count.load(std::memory_order_relaxed);
+  double mean = count ? (double) h->sum.load(std::memory_order_relaxed) / count : 0;
+  snprintf(line, sizeof(line), "%-22s %8llu  mean %9.1f  p50 <%7llu  p90 <%7llu  p99 <%7llu  max %7llu %s\n", name,
+    (unsigned long long) count, mean, (unsigned long long) stats_quantile(h, 0.5) + 1,
+    (unsigned long long) stats_quantile(h, 0.9) + 1, (unsigned long long) stats_quantile(h, 0.99) + 1,
+    (unsigned long long) h->max.load(std::memory_order_relaxed), unit);
+  return string(line);
+}
+
+// messages and bytes per type, sent and received
+string stats_counters_table(const stats_counter* sent, const stats_counter* received) {
+  string report;
+  char line[256];
+  snprintf(line, sizeof(line), "%-10s %12s %14s %12s %14s\n", "type", "sent", "sent bytes", "received",
+    "received bytes");
+  report += line;
+  for (int t = 0; t < STATS_TYPES; ++t) {
+    snprintf(line, sizeof(line), "%-10s %12llu %14llu %12llu %14llu\n", stats_type_names[t],
+      (unsigned long long) sent[t].messages.load(std::memory_order_relaxed),
+      (unsigned long long) sent[t].bytes.load(std::memory_order_relaxed),
+      (unsigned long long) received[t].messages.load(std::memory_order_relaxed),
+      (unsigned long long) received[t].bytes.load(std::memory_order_relaxed));
+    report += line;
+  }
+  return report;
+}
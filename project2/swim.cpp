@@ -0,0 +1,699 @@
+/*
+** swim.cpp -- SWIM failure detection with piggybacked dissemination
+**
+** Every protocol period a member PINGs the next member of a shuffled round robin
+** order. Without an ACK after `ping_timeout_ms` it asks `indirect_probes` other
+** members to PING the target on its behalf (PING_REQ). Without any ACK by the end
+** of the period the target becomes SUSPECT, and FAILED after the suspicion timeout
+** unless it refutes with a higher incarnation. Membership changes ride on the
+** PING, PING_REQ and ACK messages, and every `gossip_interval_ms` they are also
+** pushed to `gossip_fanout` random members, which answer with their own recent
+** changes (push-pull), so a change reaches everyone in O(log n) rounds. A full
+** push-pull UPDATE every `sync_periods` periods repairs whatever gossip missed.
+**
+** A member that leaves on purpose marks itself LEAVE with a higher incarnation
+** and sends that entry straight to every live member, which ACK it and gossip it
+** on, so nobody has to time it out.
+**
+** With a `phi_threshold` the ACK deadlines adapt to the network (phi.cpp): PING_REQs
+** go out when the ACK is later than the target's round trips make plausible, and
+** the target becomes SUSPECT as soon as the relayed ACK is overdue by the same
+** measure instead of at the end of the period. A member that answers slowly
+** (a busy VM) keeps adding long round trips to its own window, and so gets more
+** time before it is suspected.
+**
+** A swim_node does no I/O and reads no clock: messages go out through `send`,
+** incoming ones are handed to swim_receive, and its probe, ack and suspicion
+** deadlines are timers on a timer_wheel the caller advances. process.cpp drives
+** it with a UDP socket, simulator.cpp with a virtual network.
+*/
+
+#include "membership.cpp"
+#include "timer_wheel.cpp"
+#include "phi.cpp"
+
+#include <math.h>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+using std::map;
+
+#define PING_HEADER "PING\n"
+#define PING_HEADER_SIZE 5
+#define PING_REQ_HEADER "PING_REQ\n"
+#define PING_REQ_HEADER_SIZE 9
+#define ACK_HEADER "ACK\n"
+#define ACK_HEADER_SIZE 4
+#define LEAVE_HEADER "LEAVE\n"
+#define LEAVE_HEADER_SIZE 6
+#define SWIM_BUFSIZE 1024
+#define MAX_PIGGYBACK_ENTRIES 6
+#define MAX_UPDATE_ENTRIES ((SWIM_BUFSIZE - UPDATE_PREFIX_SIZE) / ENTRY_WIRE_SIZE)
+#define SWIM_MIN_DEADLINE_MS 5      // adaptive deadlines never get shorter than this
+#define SWIM_LATE_ACK_PERIODS 4     // ACKs of older probes still count as round trips this long
+
+struct swim_config {
+  uint64_t period_ms = 1000;        // one probe per period
+  uint64_t ping_timeout_ms = 300;   // direct PING deadline before PING_REQs go out, until round trips are known
+  double phi_threshold = 8;         // suspicion level of the adaptive ACK deadlines, 0 for the fixed ones
+  int indirect_probes = 3;          // k members asked to PING_REQ
+  int suspect_multiplier = 4;       // suspicion timeout: multiplier * log10(n) periods, at least one
+  int gossip_multiplier = 3;        // each change is sent multiplier * log2(n + 1) times
+  int gossip_fanout = 3;            // random members a gossip round pushes changes to, 0 to only piggyback
+  uint64_t gossip_interval_ms = 200;
+  int sync_periods = 10;            // full push-pull with a random member every this many periods
+};
+
+// (destination, message, length)
+typedef std::function<void(uint32_t, const char*, size_t)> swim_send_fn;
+// called with the new entry after every change of the membership list
+typedef std::function<void(const member_entry&)> swim_change_fn;
+
+// a PING sent on behalf of another member's PING_REQ
+struct swim_relay {
+  uint32_t seq;                 // sequence number of our PING
+  uint32_t requester;
+  uint32_t requester_seq;
+  uint64_t expires;
+};
+
+// a probe whose period ended without an ACK, a late ACK still tells its round trip
+struct swim_probe {
+  uint32_t seq;
+  uint32_t target;
+  uint64_t start;
+};
+
+// a member we suspect, FAILED when the timer fires
+struct swim_suspicion {
+  uint64_t timer;
+  uint64_t since;
+};
+
+// a change still being piggybacked
+struct swim_gossip {
+  uint32_t addr;
+  int transmits;
+};
+
+struct swim_node {
+  uint32_t self;
+  swim_config config;
+  member_table members;                   // self included
+  uint64_t list_version;
+  vector<swim_gossip> gossip;
+  timer_wheel* timers;
+  map<uint32_t, swim_suspicion> suspicions;
+
+  vector<uint32_t> probe_order;           // shuffled members of the current round
+  size_t probe_next;
+  uint32_t probe_target;                  // 0 if no probe in flight
+  uint32_t probe_seq;
+  uint64_t probe_start;
+  bool probe_acked;
+  uint64_t probe_timer;                   // direct, then relayed ACK deadline of the current probe
+  uint64_t probe_indirect_at;             // when its PING_REQs went out, 0 if they did not yet
+  vector<swim_probe> late_probes;
+  uint64_t period_timer;
+  uint64_t gossip_timer;
+  int periods;
+  uint64_t gossip_rounds;                 // rounds that pushed changes, for stats
+  uint32_t next_seq;
+  vector<swim_relay> relays;
+
+  uint32_t leave_seq;                     // sequence number of our LEAVE, 0 while we are a member
+  int leave_peers;                        // live members when we left
+  std::unordered_set<uint32_t> leave_acks;  // members that ACKed our LEAVE
+  uint64_t leave_timer;                   // resends the LEAVE to the others
+
+  phi_window rtt;                         // PING until direct ACK, any member
+  phi_window indirect_rtt;                // PING_REQ until ACK of the current probe
+  phi_window refute_time;                 // SUSPECT until refuted, of members that turned out alive
+  std::unordered_map<uint32_t, phi_window> peer_rtt;   // PING until direct ACK, per member
+
+  uint64_t rng;
+  swim_send_fn send;
+  swim_change_fn on_change;
+};
+
+uint64_t swim_random(swim_node* node) {
+  // xorshift64
+  node->rng ^= node->rng << 13;
+  node->rng ^= node->rng >> 7;
+  node->rng ^= node->rng << 17;
+  return node->rng;
+}
+
+void swim_init(swim_node* node, uint32_t self, const swim_config& config, timer_wheel* timers, uint64_t seed,
+               swim_send_fn send, swim_change_fn on_change, uint64_t now) {
+  node->self = self;
+  node->config = config;
+  node->members.entries.clear();
+  node->members.addr_index.clear();
+  node->list_version = 0;
+  node->gossip.clear();
+  node->timers = timers;
+  node->suspicions.clear();
+  node->probe_order.clear();
+  node->probe_next = 0;
+  node->probe_target = 0;
+  node->probe_seq = 0;
+  node->probe_start = 0;
+  node->probe_acked = false;
+  node->probe_timer = 0;
+  node->probe_indirect_at = 0;
+  node->late_probes.clear();
+  node->period_timer = 0;
+  node->gossip_timer = 0;
+  node->periods = 0;
+  node->gossip_rounds = 0;
+  node->next_seq = 0;
+  node->relays.clear();
+  node->leave_seq = 0;
+  node->leave_peers = 0;
+  node->leave_acks.clear();
+  node->leave_timer = 0;
+  phi_init(&node->rtt);
+  phi_init(&node->indirect_rtt);
+  phi_init(&node->refute_time);
+  node->peer_rtt.clear();
+  node->rng = seed ? seed : 88172645463325252ULL;
+  node->send = send;
+  node->on_change = on_change;
+
+  member_entry e;
+  e.addr = self;
+  e.heartbeat = now;
+  e.incarnation = 0;
+  e.status = JOIN;
+  e.version = ++node->list_version;
+  member_add(node->members, e);
+}
+
+// number of members not known to be FAILED or LEAVE, self included
+int swim_live_count(const swim_node* node) {
+  int n = 0;
+  for (const member_entry& e : node->members.entries) {
+    if (e.status == JOIN || e.status == SUSPECT)
+      ++n;
+  }
+  return n;
+}
+
+// how long a suspect has to refute before it is FAILED
+uint64_t swim_suspect_timeout(const swim_node* node) {
+  double scale = std::max(1.0, log10((double) swim_live_count(node)));
+  uint64_t fixed = (uint64_t) (node->config.suspect_multiplier * scale * node->config.period_ms);
+  if (fixed == 0 || node->config.phi_threshold <= 0 || !phi_ready(&node->refute_time))
+    return fixed;
+
+  // as long as refutations plausibly take here, between half and twice the fixed timeout
+  double deadline = phi_deadline(&node->refute_time, node->config.phi_threshold);
+  return (uint64_t) std::min(std::max(deadline, fixed / 2.0), 2.0 * fixed);
+}
+
+int swim_retransmit_limit(const swim_node* node) {
+  return node->config.gossip_multiplier * (int) ceil(log2((double) node->members.entries.size() + 1));
+}
+
+// bookkeeping after the member in `slot` changed: disseminate it, track suspicion, report it
+void swim_changed(swim_node* node, int slot, uint64_t now) {
+  const member_entry& e = node->members.entries[slot];
+
+  bool queued = false;
+  for (swim_gossip& g : node->gossip) {
+    if (g.addr == e.addr) {
+      g.transmits = 0;
+      queued = true;
+    }
+  }
+  if (!queued)
+    node->gossip.push_back({e.addr, 0});
+
+  uint32_t addr = e.addr;
+  auto it = node->suspicions.find(addr);
+  if (e.status == SUSPECT && it == node->suspicions.end()) {
+    // a suspect that does not refute in time is FAILED
+    uint64_t timer = timer_add(node->timers, now + swim_suspect_timeout(node), [node, addr](uint64_t now) {
+      node->suspicions.erase(addr);
+      int slot = member_slot(node->members, addr);
+      if (slot >= 0 && node->members.entries[slot].status == SUSPECT) {
+        node->members.entries[slot].status = FAILED;
+        node->members.entries[slot].heartbeat = now;
+        node->members.entries[slot].version = ++node->list_version;
+        swim_changed(node, slot, now);
+      }
+    });
+    node->suspicions[addr] = {timer, now};
+  } else if (e.status != SUSPECT && it != node->suspicions.end()) {
+    if (e.status == JOIN)
+      phi_add(&node->refute_time, now - it->second.since);
+    timer_cancel(node->timers, it->second.timer);
+    node->suspicions.erase(it);
+  }
+
+  if (node->on_change)
+    node->on_change(e);
+}
+
+// local observation: `addr` has `status` within its current incarnation, ignored unless worse than what we hold
+void swim_set_status(swim_node* node, uint32_t addr, actions status, uint64_t now) {
+  int slot = member_slot(node->members, addr);
+  if (slot < 0 || status_rank(status) <= status_rank(node->members.entries[slot].status))
+    return;
+  node->members.entries[slot].status = status;
+  node->members.entries[slot].heartbeat = now;
+  node->members.entries[slot].version = ++node->list_version;
+  swim_changed(node, slot, now);
+}
+
+void swim_merge(swim_node* node, const member_entry* received, int n, uint64_t now) {
+  if (n <= 0)
+    return;
+  member_entry changes[MAX_UPDATE_ENTRIES];
+  int change_count = merge_update(node->members, received, n, node->self, now, node->list_version, changes);
+  for (int i = 0; i < change_count; ++i)
+    swim_changed(node, member_slot(node->members, changes[i].addr), now);
+}
+
+// copy up to `max` of the least transmitted changes for `to` into `entries`, return how many
+// if we hold the receiver `to` as SUSPECT or FAILED, that entry goes first so it can refute
+size_t swim_pick_gossip(swim_node* node, member_entry* entries, size_t max, uint32_t to) {
+  std::stable_sort(node->gossip.begin(), node->gossip.end(),
+    [](const swim_gossip& a, const swim_gossip& b) { return a.transmits < b.transmits; });
+
+  size_t n = 0;
+  int to_slot = member_slot(node->members, to);
+  bool refutable = to_slot >= 0 &&
+    (node->members.entries[to_slot].status == SUSPECT || node->members.entries[to_slot].status == FAILED);
+  if (refutable)
+    entries[n++] = node->members.entries[to_slot];
+
+  int limit = swim_retransmit_limit(node);
+  for (size_t i = 0; i < node->gossip.size() && n < max; ++i) {
+    if (refutable && node->gossip[i].addr == to)
+      continue;
+    entries[n++] = node->members.entries[member_slot(node->members, node->gossip[i].addr)];
+    ++node->gossip[i].transmits;
+  }
+  node->gossip.erase(std::remove_if(node->gossip.begin(), node->gossip.end(),
+    [limit](const swim_gossip& g) { return g.transmits >= limit; }), node->gossip.end());
+  return n;
+}
+
+// piggyback changes for `to` at `p`, return bytes written
+size_t swim_piggyback(swim_node* node, char* p, uint32_t to) {
+  member_entry entries[MAX_PIGGYBACK_ENTRIES];
+  size_t n = swim_pick_gossip(node, entries, MAX_PIGGYBACK_ENTRIES, to);
+  return encode_entries(p, entries, n);
+}
+
+// send `to` our least transmitted changes as a gossip UPDATE, return false if there are none
+bool swim_send_gossip(swim_node* node, uint32_t to, uint8_t flags) {
+  member_entry entries[MAX_UPDATE_ENTRIES];
+  size_t n = swim_pick_gossip(node, entries, MAX_UPDATE_ENTRIES, to);
+  if (n == 0)
+    return false;
+  char msg[SWIM_BUFSIZE];
+  size_t len = encode_update(UPDATE_GOSSIP | flags, entries, n, msg, SWIM_BUFSIZE);
+  node->send(to, msg, len);
+  return true;
+}
+
+// =========================
+// PING\n | ACK\n
+// [u32 seq]
+// [piggybacked entries]
+// =========================
+void swim_send_probe(swim_node* node, const char* header, size_t header_size, uint32_t addr, uint32_t seq) {
+  char msg[SWIM_BUFSIZE];
+  memcpy(msg, header, header_size);
+  put_u32(msg + header_size, seq);
+  size_t len = header_size + 4;
+  len += swim_piggyback(node, msg + len, addr);
+  node->send(addr, msg, len);
+}
+
+// =========================
+// PING_REQ\n
+// [u32 seq][u32 target]
+// [piggybacked entries]
+// =========================
+void swim_send_ping_req(swim_node* node, uint32_t addr, uint32_t seq, uint32_t target) {
+  char msg[SWIM_BUFSIZE];
+  memcpy(msg, PING_REQ_HEADER, PING_REQ_HEADER_SIZE);
+  put_u32(msg + PING_REQ_HEADER_SIZE, seq);
+  memcpy(msg + PING_REQ_HEADER_SIZE + 4, &target, 4);
+  size_t len = PING_REQ_HEADER_SIZE + 8;
+  len += swim_piggyback(node, msg + len, addr);
+  node->send(addr, msg, len);
+}
+
+// send the whole membership list to `addr` in as many UPDATE datagrams as needed
+void swim_send_state(swim_node* node, uint32_t addr, uint8_t flags) {
+  char msg[SWIM_BUFSIZE];
+  const vector<member_entry>& entries = node->members.entries;
+  for (size_t i = 0; i < entries.size(); i += MAX_UPDATE_ENTRIES) {
+    size_t n = std::min(entries.size() - i, (size_t) MAX_UPDATE_ENTRIES);
+    size_t len = encode_update(flags, &entries[i], n, msg, SWIM_BUFSIZE);
+    node->send(addr, msg, len);
+  }
+}
+
+// up to `k` random members other than self and `exclude`, only JOIN ones if `live_only`
+vector<uint32_t> swim_random_members(swim_node* node, int k, uint32_t exclude, bool live_only) {
+  vector<uint32_t> candidates;
+  for (const member_entry& e : node->members.entries) {
+    if ((e.status == JOIN || !live_only) && e.addr != node->self && e.addr != exclude)
+      candidates.push_back(e.addr);
+  }
+  // partial Fisher-Yates
+  size_t n = std::min(candidates.size(), (size_t) std::max(k, 0));
+  for (size_t i = 0; i < n; ++i)
+    std::swap(candidates[i], candidates[i + swim_random(node) % (candidates.size() - i)]);
+  candidates.resize(n);
+  return candidates;
+}
+
+// next member to probe, 0 if there is none
+uint32_t swim_next_probe_target(swim_node* node) {
+  for (int pass = 0; pass < 2; ++pass) {
+    while (node->probe_next < node->probe_order.size()) {
+      uint32_t addr = node->probe_order[node->probe_next++];
+      int slot = member_slot(node->members, addr);
+      if (slot >= 0 && (node->members.entries[slot].status == JOIN || node->members.entries[slot].status == SUSPECT))
+        return addr;
+    }
+
+    // start a new round in a new random order, members joined since are included now
+    node->probe_order.clear();
+    for (const member_entry& e : node->members.entries) {
+      if (e.addr != node->self && (e.status == JOIN || e.status == SUSPECT))
+        node->probe_order.push_back(e.addr);
+    }
+    for (size_t i = node->probe_order.size(); i > 1; --i)
+      std::swap(node->probe_order[i - 1], node->probe_order[swim_random(node) % i]);
+    node->probe_next = 0;
+  }
+  return 0;
+}
+
+// how long to wait for the direct ACK of `target` before PING_REQs go out
+uint64_t swim_ping_deadline(swim_node* node, uint32_t target) {
+  const phi_window* w = &node->rtt;
+  auto it = node->peer_rtt.find(target);
+  if (it != node->peer_rtt.end() && phi_ready(&it->second))
+    w = &it->second;
+  if (node->config.phi_threshold <= 0 || !phi_ready(w))
+    return node->config.ping_timeout_ms;
+  double deadline = phi_deadline(w, node->config.phi_threshold);
+  return (uint64_t) std::min(std::max(deadline, (double) SWIM_MIN_DEADLINE_MS), node->config.period_ms / 2.0);
+}
+
+// how long after the PING_REQs to wait before suspecting the target, 0 for the end of the period
+uint64_t swim_suspect_deadline(swim_node* node) {
+  if (node->config.phi_threshold <= 0 || !phi_ready(&node->indirect_rtt))
+    return 0;
+  double deadline = phi_deadline(&node->indirect_rtt, node->config.phi_threshold);
+  return (uint64_t) std::max(deadline, (double) SWIM_MIN_DEADLINE_MS);
+}
+
+// the relayed ACK is overdue too
+void swim_probe_expired(swim_node* node, uint64_t now) {
+  node->probe_timer = 0;
+  if (node->probe_target != 0 && !node->probe_acked)
+    swim_set_status(node, node->probe_target, SUSPECT, now);
+}
+
+// no direct ACK in time, probe through k other members
+void swim_probe_timeout(swim_node* node, uint64_t now) {
+  node->probe_timer = 0;
+  if (node->probe_target == 0 || node->probe_acked)
+    return;
+  for (uint32_t addr : swim_random_members(node, node->config.indirect_probes, node->probe_target, true))
+    swim_send_ping_req(node, addr, node->probe_seq, node->probe_target);
+  node->probe_indirect_at = now;
+
+  uint64_t deadline = swim_suspect_deadline(node);
+  if (deadline > 0 && now + deadline < node->probe_start + node->config.period_ms) {
+    node->probe_timer = timer_add(node->timers, now + deadline,
+      [node](uint64_t now) { swim_probe_expired(node, now); });
+  }
+}
+
+// a direct ACK from `target` came `rtt` ms after its PING
+void swim_add_rtt(swim_node* node, uint32_t target, uint64_t rtt) {
+  phi_add(&node->rtt, rtt);
+  auto it = node->peer_rtt.find(target);
+  if (it == node->peer_rtt.end()) {
+    it = node->peer_rtt.emplace(target, phi_window()).first;
+    phi_init(&it->second);
+  }
+  phi_add(&it->second, rtt);
+}
+
+// end the probe of the last period and start the next one
+void swim_period(swim_node* node, uint64_t now) {
+  if (node->probe_target != 0 && !node->probe_acked) {
+    swim_set_status(node, node->probe_target, SUSPECT, now);
+    node->late_probes.push_back({node->probe_seq, node->probe_target, node->probe_start});
+  }
+  node->late_probes.erase(std::remove_if(node->late_probes.begin(), node->late_probes.end(),
+    [node, now](const swim_probe& p) { return p.start + SWIM_LATE_ACK_PERIODS * node->config.period_ms <= now; }),
+    node->late_probes.end());
+  node->probe_target = 0;
+  if (node->probe_timer != 0) {
+    timer_cancel(node->timers, node->probe_timer);
+    node->probe_timer = 0;
+  }
+
+  // failed members are included, so a falsely failed member or a healed partition catches up
+  if (++node->periods % node->config.sync_periods == 0) {
+    vector<uint32_t> peer = swim_random_members(node, 1, 0, false);
+    if (!peer.empty())
+      swim_send_state(node, peer[0], 0);
+  }
+
+  uint32_t target = swim_next_probe_target(node);
+  if (target != 0) {
+    node->probe_target = target;
+    node->probe_seq = ++node->next_seq;
+    node->probe_start = now;
+    node->probe_acked = false;
+    node->probe_indirect_at = 0;
+    swim_send_probe(node, PING_HEADER, PING_HEADER_SIZE, target, node->probe_seq);
+    node->probe_timer = timer_add(node->timers, now + swim_ping_deadline(node, target),
+      [node](uint64_t now) { swim_probe_timeout(node, now); });
+  }
+
+  node->relays.erase(std::remove_if(node->relays.begin(), node->relays.end(),
+    [now](const swim_relay& r) { return r.expires <= now; }), node->relays.end());
+
+  node->period_timer = timer_add(node->timers, now + node->config.period_ms,
+    [node](uint64_t now) { swim_period(node, now); });
+}
+
+// push recent changes to `gossip_fanout` random members, nothing if there are none
+void swim_gossip_round(swim_node* node, uint64_t now) {
+  if (!node->gossip.empty()) {
+    ++node->gossip_rounds;
+    for (uint32_t addr : swim_random_members(node, node->config.gossip_fanout, 0, true))
+      swim_send_gossip(node, addr, 0);
+  }
+
+  node->gossip_timer = timer_add(node->timers, now + node->config.gossip_interval_ms,
+    [node](uint64_t now) { swim_gossip_round(node, now); });
+}
+
+// start probing and gossiping, the first period begins at the next timer_advance
+void swim_start(swim_node* node, uint64_t now) {
+  node->period_timer = timer_add(node->timers, now, [node](uint64_t now) { swim_period(node, now); });
+  if (node->config.gossip_fanout > 0) {
+    node->gossip_timer = timer_add(node->timers, now + node->config.gossip_interval_ms,
+      [node](uint64_t now) { swim_gossip_round(node, now); });
+  }
+}
+
+// cancel every timer of `node`, it sends nothing afterwards unless a message comes in
+void swim_stop(swim_node* node) {
+  timer_cancel(node->timers, node->period_timer);
+  timer_cancel(node->timers, node->probe_timer);
+  timer_cancel(node->timers, node->gossip_timer);
+  timer_cancel(node->timers, node->leave_timer);
+  for (auto& kv : node->suspicions)
+    timer_cancel(node->timers, kv.second.timer);
+  node->period_timer = node->probe_timer = node->gossip_timer = node->leave_timer = 0;
+  node->suspicions.clear();
+}
+
+/**
+ * Handle one message from `from`, return false if it is not a SWIM message
+ */
+bool swim_receive(swim_node* node, uint32_t from, const char* buf, size_t len, uint64_t now) {
+  member_entry received[MAX_UPDATE_ENTRIES];
+
+  if (len >= PING_HEADER_SIZE + 4 && memcmp(buf, PING_HEADER, PING_HEADER_SIZE) == 0) {
+    uint32_t seq = get_u32(buf + PING_HEADER_SIZE);
+    swim_merge(node, received, decode_entries(buf + PING_HEADER_SIZE + 4, len - PING_HEADER_SIZE - 4, received, MAX_PIGGYBACK_ENTRIES), now);
+    swim_send_probe(node, ACK_HEADER, ACK_HEADER_SIZE, from, seq);
+
+  } else if (len >= PING_REQ_HEADER_SIZE + 8 && memcmp(buf, PING_REQ_HEADER, PING_REQ_HEADER_SIZE) == 0) {
+    uint32_t requester_seq = get_u32(buf + PING_REQ_HEADER_SIZE);
+    uint32_t target;
+    memcpy(&target, buf + PING_REQ_HEADER_SIZE + 4, 4);
+    swim_merge(node, received, decode_entries(buf + PING_REQ_HEADER_SIZE + 8, len - PING_REQ_HEADER_SIZE - 8, received, MAX_PIGGYBACK_ENTRIES), now);
+
+    swim_relay relay = {++node->next_seq, from, requester_seq, now + node->config.period_ms};
+    node->relays.push_back(relay);
+    swim_send_probe(node, PING_HEADER, PING_HEADER_SIZE, target, relay.seq);
+
+  } else if (len >= ACK_HEADER_SIZE + 4 && memcmp(buf, ACK_HEADER, ACK_HEADER_SIZE) == 0) {
+    uint32_t seq = get_u32(buf + ACK_HEADER_SIZE);
+    swim_merge(node, received, decode_entries(buf + ACK_HEADER_SIZE + 4, len - ACK_HEADER_SIZE - 4, received, MAX_PIGGYBACK_ENTRIES), now);
+
+    auto late = std::find_if(node->late_probes.begin(), node->late_probes.end(),
+      [seq](const swim_probe& p) { return p.seq == seq; });
+    if (node->leave_seq != 0 && seq == node->leave_seq) {
+      node->leave_acks.insert(from);
+    } else if (node->probe_target != 0 && seq == node->probe_seq) {
+      if (!node->probe_acked) {
+        if (from == node->probe_target)
+          swim_add_rtt(node, from, now - node->probe_start);
+        if (node->probe_indirect_at != 0)
+          phi_add(&node->indirect_rtt, now - node->probe_indirect_at);
+      }
+      node->probe_acked = true;
+      if (node->probe_timer != 0) {
+        timer_cancel(node->timers, node->probe_timer);
+        node->probe_timer = 0;
+      }
+    } else if (late != node->late_probes.end()) {
+      // too late for its period, but how slow the target answers still counts
+      if (from == late->target)
+        swim_add_rtt(node, from, now - late->start);
+      node->late_probes.erase(late);
+    } else {
+      // ACK of a PING sent for a PING_REQ, pass it back
+      for (size_t i = 0; i < node->relays.size(); ++i) {
+        if (node->relays[i].seq == seq) {
+          swim_send_probe(node, ACK_HEADER, ACK_HEADER_SIZE, node->relays[i].requester, node->relays[i].requester_seq);
+          node->relays.erase(node->relays.begin() + i);
+          break;
+        }
+      }
+    }
+
+  } else if (len >= LEAVE_HEADER_SIZE + 4 && memcmp(buf, LEAVE_HEADER, LEAVE_HEADER_SIZE) == 0) {
+    uint32_t seq = get_u32(buf + LEAVE_HEADER_SIZE);
+    swim_merge(node, received, decode_entries(buf + LEAVE_HEADER_SIZE + 4, len - LEAVE_HEADER_SIZE - 4, received, MAX_PIGGYBACK_ENTRIES), now);
+    swim_send_probe(node, ACK_HEADER, ACK_HEADER_SIZE, from, seq);
+
+  } else if (len >= UPDATE_PREFIX_SIZE && memcmp(buf, UPDATE_HEADER, UPDATE_HEADER_SIZE) == 0) {
+    uint8_t flags;
+    int n = decode_update(buf, len, &flags, received, MAX_UPDATE_ENTRIES);
+    if (n < 0)
+      return true;
+
+    // push-pull: answer a push with our own changes or state, gossip replies are
+    // picked before merging so they do not echo the pushed changes back
+    if ((flags & UPDATE_GOSSIP) && !(flags & UPDATE_REPLY))
+      swim_send_gossip(node, from, UPDATE_REPLY);
+    swim_merge(node, received, n, now);
+    if (!(flags & UPDATE_GOSSIP) && !(flags & UPDATE_REPLY))
+      swim_send_state(node, from, UPDATE_REPLY);
+
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Introducer: `addr` joined (or rejoined) the group, the caller sends it the list
+ */
+void swim_join(swim_node* node, uint32_t addr, uint64_t now) {
+  int slot = member_slot(node->members, addr);
+  if (slot >= 0) {
+    member_entry& e = node->members.entries[slot];
+    if (e.status != JOIN) {
+      // a restarted process starts over from incarnation 0, stay ahead of the FAILED entry
+      e.incarnation += 1;
+      e.heartbeat = now;
+      e.status = JOIN;
+      e.version = ++node->list_version;
+      swim_changed(node, slot, now);
+    }
+  } else {
+    member_entry e;
+    e.addr = addr;
+    e.heartbeat = now;
+    e.incarnation = 0;
+    e.status = JOIN;
+    e.version = ++node->list_version;
+    swim_changed(node, member_add(node->members, e), now);
+  }
+}
+
+/**
+ * Joiner: take the whole list the introducer sent, any number of entries
+ */
+void swim_load_state(swim_node* node, const member_entry* entries, size_t n, uint64_t now) {
+  for (size_t i = 0; i < n; i += MAX_UPDATE_ENTRIES)
+    swim_merge(node, entries + i, std::min(n - i, (size_t) MAX_UPDATE_ENTRIES), now);
+}
+
+// a majority of the members live when we left have our LEAVE
+bool swim_leave_quorum(const swim_node* node) {
+  return (int) node->leave_acks.size() >= node->leave_peers / 2 + 1 || node->leave_peers == 0;
+}
+
+// ==============================
+// LEAVE\n
+// [u32 sequence number]
+// [entries: our own LEAVE entry]
+// ==============================
+// send our LEAVE to every member that was live when we left and has not ACKed it yet, again
+// every `ping_timeout_ms` until a majority did
+void swim_send_leave(swim_node* node, uint64_t now) {
+  node->leave_timer = 0;
+  if (swim_leave_quorum(node))
+    return;
+
+  char msg[SWIM_BUFSIZE];
+  memcpy(msg, LEAVE_HEADER, LEAVE_HEADER_SIZE);
+  put_u32(msg + LEAVE_HEADER_SIZE, node->leave_seq);
+  size_t len = LEAVE_HEADER_SIZE + 4;
+  len += encode_entries(msg + len, &node->members.entries[member_slot(node->members, node->self)], 1);
+  for (const member_entry& e : node->members.entries) {
+    if (e.addr != node->self && (e.status == JOIN || e.status == SUSPECT) && !node->leave_acks.count(e.addr))
+      node->send(e.addr, msg, len);
+  }
+
+  node->leave_timer = timer_add(node->timers, now + node->config.ping_timeout_ms,
+    [node](uint64_t now) { swim_send_leave(node, now); });
+}
+
+/**
+ * Leave the group: stop probing, mark ourselves LEAVE with a higher incarnation so it
+ * overrides every entry about us, and send that to all live members. Poll
+ * swim_leave_quorum until a majority ACKed it or the caller gives up.
+ */
+void swim_leave(swim_node* node, uint64_t now) {
+  if (node->leave_seq != 0)
+    return;
+  swim_stop(node);
+
+  int slot = member_slot(node->members, node->self);
+  member_entry& e = node->members.entries[slot];
+  e.incarnation += 1;
+  e.status = LEAVE;
+  e.heartbeat = now;
+  e.version = ++node->list_version;
+  swim_changed(node, slot, now);
+
+  node->leave_seq = ++node->next_seq;
+  node->leave_peers = swim_live_count(node);   // we no longer count ourselves
+  swim_send_leave(node, now);
+}
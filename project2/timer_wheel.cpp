@@ -0,0 +1,134 @@
+/*
+** timer_wheel.cpp -- hierarchical timer wheel with millisecond resolution
+**
+** Level 0 has one slot per millisecond for the next 64 ms, level 1 one slot per
+** 64 ms, and so on. A timer sits in the level matching how far away it is, and
+** moves down a level each time the level below wraps around, so adding,
+** cancelling and expiring a timer is O(1) however many are pending.
+*/
+
+#include <stdint.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4     // 64^4 ms, about 4.6 hours ahead
+
+// called with the current time when the timer expires
+typedef std::function<void(uint64_t)> timer_fn;
+
+struct timer_record {
+  uint64_t expires;
+  timer_fn fn;
+  int level;
+  int slot;
+};
+
+struct timer_wheel {
+  uint64_t now;                   // every timer up to here has fired
+  uint64_t next_id;
+  std::unordered_map<uint64_t, timer_record> timers;
+  std::vector<uint64_t> slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+void timer_wheel_init(timer_wheel* wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->next_id = 1;
+  wheel->timers.clear();
+  for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+    for (int s = 0; s < TIMER_WHEEL_SLOTS; ++s)
+      wheel->slots[l][s].clear();
+  }
+}
+
+// put timer `id` in the slot for its expiry as seen from wheel->now, but not before `earliest`
+void timer_place(timer_wheel* wheel, uint64_t id, uint64_t earliest) {
+  timer_record& t = wheel->timers[id];
+  uint64_t expires = std::max(t.expires, earliest);
+  uint64_t delta = expires - wheel->now;
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1))))
+    ++level;
+  if (level == TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+    expires = wheel->now + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;   // re-placed when reached
+
+  t.level = level;
+  t.slot = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  wheel->slots[t.level][t.slot].push_back(id);
+}
+
+// run `fn` at `expires` (or at the next advance if that is already past), return the timer id
+uint64_t timer_add(timer_wheel* wheel, uint64_t expires, timer_fn fn) {
+  uint64_t id = wheel->next_id++;
+  timer_record& t = wheel->timers[id];
+  t.expires = expires;
+  t.fn = fn;
+  timer_place(wheel, id, wheel->now + 1);
+  return id;
+}
+
+// cancel a pending timer, ignore ids that fired or were cancelled already
+void timer_cancel(timer_wheel* wheel, uint64_t id) {
+  auto it = wheel->timers.find(id);
+  if (it == wheel->timers.end())
+    return;
+  std::vector<uint64_t>& slot = wheel->slots[it->second.level][it->second.slot];
+  slot.erase(std::find(slot.begin(), slot.end(), id));
+  wheel->timers.erase(it);
+}
+
+// fire every timer that expires up to `now`, in expiry order
+void timer_advance(timer_wheel* wheel, uint64_t now) {
+  while (wheel->now < now) {
+    ++wheel->now;
+
+    // when a level wraps around, spread the next slot of the level above over the levels below
+    for (int l = 1; l < TIMER_WHEEL_LEVELS; ++l) {
+      if ((wheel->now & ((1ULL << (TIMER_WHEEL_BITS * l)) - 1)) != 0)
+        break;
+      std::vector<uint64_t> cascade;
+      cascade.swap(wheel->slots[l][(wheel->now >> (TIMER_WHEEL_BITS * l)) & (TIMER_WHEEL_SLOTS - 1)]);
+      for (uint64_t id : cascade)
+        timer_place(wheel, id, wheel->now);   // due now lands in the slot handled below
+    }
+
+    std::vector<uint64_t> due;
+    due.swap(wheel->slots[0][wheel->now & (TIMER_WHEEL_SLOTS - 1)]);
+    for (uint64_t id : due) {
+      auto it = wheel->timers.find(id);
+      if (it == wheel->timers.end())
+        continue;   // cancelled by an earlier callback
+      if (it->second.expires > wheel->now) {
+        timer_place(wheel, id, wheel->now + 1);   // beyond the wheel's range when added
+        continue;
+      }
+      timer_fn fn = it->second.fn;
+      wheel->timers.erase(it);
+      fn(wheel->now);
+    }
+  }
+}
+
+// milliseconds from wheel->now until timer_advance may have work to do, -1 if no timer is pending
+int timer_next_timeout(const timer_wheel* wheel) {
+  if (wheel->timers.empty())
+    return -1;
+
+  uint64_t best = UINT64_MAX;
+  for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+    uint64_t base = wheel->now >> (TIMER_WHEEL_BITS * l);
+    for (uint64_t i = 1; i <= TIMER_WHEEL_SLOTS; ++i) {
+      if (!wheel->slots[l][(base + i) & (TIMER_WHEEL_SLOTS - 1)].empty()) {
+        // level 0 slots are exact, higher ones are the time they cascade down
+        best = std::min(best, ((base + i) << (TIMER_WHEEL_BITS * l)) - wheel->now);
+        break;
+      }
+    }
+  }
+  return (int) std::min(best, (uint64_t) INT32_MAX);
+}
@@ -0,0 +1,157 @@
+/*
+** transport.cpp -- how a member's datagrams reach other members
+**
+** The protocol code only sees a transport: `send` puts one datagram on the way
+** to a member, `flush` makes sure the queued ones left, `poll` waits for
+** datagrams addressed to this member and hands each one over. The UDP transport
+** queues sends and moves whole batches with sendmmsg/recvmmsg, one syscall for
+** what used to take one sendto or recvfrom per datagram. process.cpp uses the UDP transport below, simulator.cpp a
+** virtual network that runs many members in one process.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#define TRANSPORT_MAX_DATAGRAM 65536
+#define TRANSPORT_BATCH 32            // datagrams per sendmmsg/recvmmsg
+
+// called for every received datagram, `msg` is writable and NUL terminated after `len` bytes
+typedef std::function<void(uint32_t from, char* msg, size_t len)> transport_recv_fn;
+
+struct transport {
+  // queue one datagram to the member at `to` (network byte order), best effort
+  std::function<void(uint32_t to, const char* msg, size_t len)> send;
+  // put every queued datagram on the wire
+  std::function<void()> flush;
+  // wait up to `timeout_ms` (-1 forever) for datagrams, hand every one that arrived to `recv`
+  std::function<void(int timeout_ms, const transport_recv_fn& recv)> poll;
+};
+
+// UDP socket state, one syscall moves up to TRANSPORT_BATCH datagrams each way
+struct udp_batch {
+  int fd;
+  int epoll_fd;
+  uint16_t port;
+
+  // outgoing: payloads back to back in `out_data`, `out_len[i]` bytes each
+  size_t out_count;
+  std::vector<char> out_data;
+  size_t out_len[TRANSPORT_BATCH];
+  struct sockaddr_in out_addr[TRANSPORT_BATCH];
+
+  // incoming: one buffer of TRANSPORT_MAX_DATAGRAM + 1 bytes per datagram
+  std::vector<char> in_data;
+  struct sockaddr_in in_addr[TRANSPORT_BATCH];
+  struct iovec in_iov[TRANSPORT_BATCH];
+  struct mmsghdr in_msgs[TRANSPORT_BATCH];
+};
+
+void udp_batch_flush(udp_batch* b) {
+  struct iovec iov[TRANSPORT_BATCH];
+  struct mmsghdr msgs[TRANSPORT_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  size_t offset = 0;
+  for (size_t i = 0; i < b->out_count; ++i) {
+    iov[i].iov_base = &b->out_data[offset];
+    iov[i].iov_len = b->out_len[i];
+    offset += b->out_len[i];
+    msgs[i].msg_hdr.msg_name = &b->out_addr[i];
+    msgs[i].msg_hdr.msg_namelen = sizeof(b->out_addr[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // sendmmsg stops at the first datagram that fails, skip it and send the rest
+  size_t sent = 0;
+  while (sent < b->out_count) {
+    int n = sendmmsg(b->fd, msgs + sent, b->out_count - sent, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    sent += n > 0 ? n : 1;
+  }
+  b->out_count = 0;
+  b->out_data.clear();
+}
+
+void udp_batch_send(udp_batch* b, uint32_t to, const char* msg, size_t len) {
+  if (b->out_count == TRANSPORT_BATCH)
+    udp_batch_flush(b);
+  struct sockaddr_in& addr = b->out_addr[b->out_count];
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(b->port);
+  addr.sin_addr.s_addr = to;
+  b->out_len[b->out_count++] = len;
+  b->out_data.insert(b->out_data.end(), msg, msg + len);
+}
+
+void udp_batch_poll(udp_batch* b, int timeout_ms, const transport_recv_fn& recv) {
+  struct epoll_event ready;
+  if (epoll_wait(b->epoll_fd, &ready, 1, timeout_ms) <= 0)
+    return;
+
+  // drain the socket, a full batch means there may be more
+  while (1) {
+    for (int i = 0; i < TRANSPORT_BATCH; ++i)
+      b->in_msgs[i].msg_hdr.msg_namelen = sizeof(b->in_addr[i]);
+    int n = recvmmsg(b->fd, b->in_msgs, TRANSPORT_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0)
+      break;
+    for (int i = 0; i < n; ++i) {
+      size_t len = b->in_msgs[i].msg_len;
+      if (len == 0)
+        continue;
+      char* buf = (char*) b->in_iov[i].iov_base;
+      buf[len] = '\0';
+      recv(b->in_addr[i].sin_addr.s_addr, buf, len);
+    }
+    if (n < TRANSPORT_BATCH)
+      break;
+  }
+}
+
+// datagrams over the UDP socket `fd`, every member listening on `port` (host byte order)
+// sends are queued until `flush`, or until a batch is full
+transport udp_transport(int fd, uint16_t port) {
+  std::shared_ptr<udp_batch> b = std::make_shared<udp_batch>();
+  b->fd = fd;
+  b->port = port;
+  b->epoll_fd = epoll_create1(0);
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(b->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+  b->out_count = 0;
+  b->in_data.resize((size_t) TRANSPORT_BATCH * (TRANSPORT_MAX_DATAGRAM + 1));
+  memset(b->in_msgs, 0, sizeof(b->in_msgs));
+  for (int i = 0; i < TRANSPORT_BATCH; ++i) {
+    b->in_iov[i].iov_base = &b->in_data[(size_t) i * (TRANSPORT_MAX_DATAGRAM + 1)];
+    b->in_iov[i].iov_len = TRANSPORT_MAX_DATAGRAM;
+    b->in_msgs[i].msg_hdr.msg_name = &b->in_addr[i];
+    b->in_msgs[i].msg_hdr.msg_iov = &b->in_iov[i];
+    b->in_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  transport t;
+  t.send = [b](uint32_t to, const char* msg, size_t len) {
+    udp_batch_send(b.get(), to, msg, len);
+  };
+  t.flush = [b]() {
+    udp_batch_flush(b.get());
+  };
+  t.poll = [b](int timeout_ms, const transport_recv_fn& recv) {
+    udp_batch_poll(b.get(), timeout_ms, recv);
+  };
+  return t;
+}
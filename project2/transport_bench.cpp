@@ -0,0 +1,182 @@
+/*
+** transport_bench.cpp -- datagrams per second per core, one syscall each vs batched
+**
+** A sender thread pushes BYTES byte datagrams over loopback to a receiver thread
+** for SECONDS seconds, either with one sendto/recvfrom per datagram (the
+** transport before batching) or through udp_transport with a flush every FLUSH datagrams, like a
+** gossip round or a burst of probes and acks. Each side reports datagrams per
+** second of its own CPU time, so the numbers do not depend on how many cores the
+** machine has.
+*/
+
+#include "common.cpp"
+#include "transport.cpp"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+#define BENCH_PORT 18080
+
+static int seconds;
+static size_t bytes;
+static int flush_every;                 // 0: sendto/recvfrom per datagram
+static std::atomic<bool> sending;
+static uint64_t sent, received;
+static double send_cpu, recv_cpu;
+
+double thread_cpu_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double wall_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the transport before batching: one sendto per datagram, epoll then one recvfrom per datagram
+transport single_transport(int fd, uint16_t port) {
+  int epoll_fd = epoll_create1(0);
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+
+  transport t;
+  t.send = [fd, port](uint32_t to, const char* msg, size_t len) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = to;
+    sendto(fd, msg, len, 0, (struct sockaddr *) &addr, sizeof(addr));
+  };
+  t.flush = []() {};
+  std::shared_ptr<vector<char>> buffer = std::make_shared<vector<char>>(TRANSPORT_MAX_DATAGRAM + 1);
+  t.poll = [fd, epoll_fd, buffer](int timeout_ms, const transport_recv_fn& recv) {
+    struct epoll_event ready;
+    if (epoll_wait(epoll_fd, &ready, 1, timeout_ms) <= 0)
+      return;
+    char* buf = buffer->data();
+    while (1) {
+      struct sockaddr_in from;
+      socklen_t fromlen = sizeof(from);
+      ssize_t len = recvfrom(fd, buf, TRANSPORT_MAX_DATAGRAM, MSG_DONTWAIT, (struct sockaddr *) &from, &fromlen);
+      if (len < 0)
+        break;
+      buf[len] = '\0';
+      recv(from.sin_addr.s_addr, buf, len);
+    }
+  };
+  return t;
+}
+
+transport bench_transport(int fd, uint16_t port) {
+  return flush_every == 0 ? single_transport(fd, port) : udp_transport(fd, port);
+}
+
+int bench_socket(uint16_t port) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int size = 8 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+    error("ERROR binding bench socket");
+  return fd;
+}
+
+void* sender_loop(void*) {
+  int fd = bench_socket(BENCH_PORT + 1);
+  uint32_t to = inet_addr("127.0.0.1");
+  vector<char> msg(bytes, 'x');
+  transport t = bench_transport(fd, BENCH_PORT);
+
+  double cpu = thread_cpu_seconds();
+  double end = wall_seconds() + seconds;
+  uint64_t n = 0;
+  while (wall_seconds() < end) {
+    for (int i = 0; i < 256; ++i, ++n) {
+      t.send(to, msg.data(), bytes);
+      if (flush_every > 0 && (n + 1) % flush_every == 0)
+        t.flush();
+    }
+  }
+  t.flush();
+  send_cpu = thread_cpu_seconds() - cpu;
+  sent = n;
+  sending.store(false);
+  close(fd);
+  return NULL;
+}
+
+void* receiver_loop(void* arg) {
+  int fd = *(int*) arg;
+  transport t = bench_transport(fd, BENCH_PORT + 1);
+  uint64_t n = 0;
+  transport_recv_fn count = [&n](uint32_t, char*, size_t) { ++n; };
+
+  double cpu = thread_cpu_seconds();
+  double idle_since = 0;
+  while (1) {
+    uint64_t before = n;
+    t.poll(1, count);
+
+    // stop once the sender is done and the socket stayed empty for a while
+    if (n != before || sending.load()) {
+      idle_since = 0;
+    } else if (idle_since == 0) {
+      idle_since = wall_seconds();
+    } else if (wall_seconds() - idle_since > 0.2) {
+      break;
+    }
+  }
+  recv_cpu = thread_cpu_seconds() - cpu;
+  received = n;
+  return NULL;
+}
+
+// ./transport_bench [SECONDS] [BYTES]
+int main(int argc, char *argv[]) {
+  seconds = argc > 1 ? atoi(argv[1]) : 2;
+  bytes = argc > 2 ? atoi(argv[2]) : 128;
+  if (seconds <= 0 || bytes == 0 || bytes > 1400) {
+    fprintf(stderr, "usage: ./transport_bench [SECONDS] [BYTES <= 1400]\n");
+    exit(1);
+  }
+
+  printf("%d s per mode, %zu byte datagrams over loopback\n", seconds, bytes);
+  printf("%-16s %12s %14s %14s %8s\n", "mode", "sent/s", "send/s/core", "recv/s/core", "lost");
+  for (int mode : {0, 1, 4, 16, TRANSPORT_BATCH}) {
+    flush_every = mode;
+    sending.store(true);
+    int recv_fd = bench_socket(BENCH_PORT);
+
+    pthread_t sender, receiver;
+    pthread_create(&receiver, NULL, receiver_loop, &recv_fd);
+    pthread_create(&sender, NULL, sender_loop, NULL);
+    pthread_join(sender, NULL);
+    pthread_join(receiver, NULL);
+    close(recv_fd);
+
+    // the idle receiver sleeps in epoll_wait, so its CPU time is only the receiving
+    string name = mode == 0 ? "sendto/recvfrom" : "mmsg flush " + std::to_string(mode);
+    printf("%-16s %12.0f %14.0f %14.0f %7.1f%%\n", name.c_str(), sent / (double) seconds,
+      sent / send_cpu, received / recv_cpu, sent ? 100.0 * (sent - received) / sent : 0.0);
+  }
+  return 0;
+}
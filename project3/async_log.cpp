@@ -0,0 +1,157 @@
+/*
+** async_log.cpp -- log lines without ever blocking the writer
+**
+** Writers copy a line into a fixed ring of slots (a bounded lock-free queue,
+** any number of writers, one reader) and return. A flusher thread collects
+** whatever is queued and writes it out in one write() per batch. When the ring
+** is full the line is dropped and counted, and the flusher notes how many were
+** lost in the log itself.
+*/
+
+#include "node.h"
+
+#include <fcntl.h>
+
+#include <atomic>
+#include <new>
+
+#define ASYNC_LOG_SLOTS 4096          // power of two
+#define ASYNC_LOG_LINE_MAX 248        // longer lines are cut
+#define ASYNC_LOG_BATCH 65536         // bytes per write()
+#define ASYNC_LOG_IDLE_US 5000        // flusher sleep when the ring is empty
+
+struct async_log_slot {
+  std::atomic<uint64_t> seq;          // == position when free for it, position + 1 once filled
+  uint32_t len;
+  char line[ASYNC_LOG_LINE_MAX];
+};
+
+struct async_log {
+  int fd;
+  async_log_slot slots[ASYNC_LOG_SLOTS];
+  alignas(64) std::atomic<uint64_t> head;     // next position a writer claims
+  alignas(64) std::atomic<uint64_t> tail;     // next position the flusher reads
+  std::atomic<uint64_t> dropped;
+  uint64_t dropped_reported;                  // flusher only
+  std::atomic<bool> running;
+  pthread_t flusher;
+};
+
+// move every filled slot into `batch` and out to the file, return whether anything was written
+static bool async_log_drain(async_log* log, char* batch) {
+  size_t used = 0;
+  bool wrote = false;
+  uint64_t pos = log->tail.load(std::memory_order_relaxed);
+  while (1) {
+    async_log_slot& slot = log->slots[pos & (ASYNC_LOG_SLOTS - 1)];
+    if (slot.seq.load(std::memory_order_acquire) != pos + 1)
+      break;
+    if (used + slot.len > ASYNC_LOG_BATCH) {
+      write(log->fd, batch, used);
+      used = 0;
+    }
+    memcpy(batch + used, slot.line, slot.len);
+    used += slot.len;
+    slot.seq.store(pos + ASYNC_LOG_SLOTS, std::memory_order_release);
+    ++pos;
+    wrote = true;
+  }
+  log->tail.store(pos, std::memory_order_release);
+
+  uint64_t dropped = log->dropped.load(std::memory_order_relaxed);
+  if (dropped != log->dropped_reported && used + 64 <= ASYNC_LOG_BATCH) {
+    used += snprintf(batch + used, 64, "LOG dropped %llu lines\n", (unsigned long long) (dropped - log->dropped_reported));
+    log->dropped_reported = dropped;
+  }
+  if (used > 0)
+    write(log->fd, batch, used);
+  return wrote;
+}
+
+static void* async_log_flusher(void* arg) {
+  async_log* log = (async_log*) arg;
+  char* batch = new char[ASYNC_LOG_BATCH];
+  while (log->running.load()) {
+    if (!async_log_drain(log, batch))
+      usleep(ASYNC_LOG_IDLE_US);
+  }
+  async_log_drain(log, batch);
+  delete[] batch;
+  return NULL;
+}
+
+// open `path` (truncated) and start its flusher, NULL if the file can not be opened
+async_log* async_log_open(const char* path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0)
+    return NULL;
+
+  // plain new only promises 16 byte alignment before C++17, and head and tail must sit
+  // on cache lines of their own
+  void* mem;
+  if (posix_memalign(&mem, 64, sizeof(async_log)) != 0) {
+    close(fd);
+    return NULL;
+  }
+  async_log* log = new (mem) async_log();
+  log->fd = fd;
+  for (uint64_t i = 0; i < ASYNC_LOG_SLOTS; ++i)
+    log->slots[i].seq.store(i);
+  log->head.store(0);
+  log->tail.store(0);
+  log->dropped.store(0);
+  log->dropped_reported = 0;
+  log->running.store(true);
+  pthread_create(&log->flusher, NULL, async_log_flusher, log);
+  return log;
+}
+
+// queue one line (the caller ends it with '\n'), false if the ring was full and it was dropped
+bool async_log_write(async_log* log, const char* line, size_t len) {
+  uint64_t pos = log->head.load(std::memory_order_relaxed);
+  async_log_slot* slot;
+  while (1) {
+    slot = &log->slots[pos & (ASYNC_LOG_SLOTS - 1)];
+    int64_t diff = (int64_t) (slot->seq.load(std::memory_order_acquire) - pos);
+    if (diff == 0) {
+      if (log->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      log->dropped.fetch_add(1, std::memory_order_relaxed);   // full, the flusher is a whole ring behind
+      return false;
+    } else {
+      pos = log->head.load(std::memory_order_relaxed);       // another writer took this slot
+    }
+  }
+
+  if (len <= ASYNC_LOG_LINE_MAX) {
+    memcpy(slot->line, line, len);
+    slot->len = len;
+  } else {
+    memcpy(slot->line, line, ASYNC_LOG_LINE_MAX - 1);
+    slot->line[ASYNC_LOG_LINE_MAX - 1] = '\n';
+    slot->len = ASYNC_LOG_LINE_MAX;
+  }
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+uint64_t async_log_dropped(const async_log* log) {
+  return log->dropped.load(std::memory_order_relaxed);
+}
+
+// wait until every line queued before the call is in the file
+void async_log_flush(async_log* log) {
+  uint64_t head = log->head.load();
+  while (log->tail.load(std::memory_order_acquire) < head)
+    usleep(ASYNC_LOG_IDLE_US / 5);
+}
+
+// write out what is queued, stop the flusher and close the file
+void async_log_close(async_log* log) {
+  log->running.store(false);
+  pthread_join(log->flusher, NULL);
+  close(log->fd);
+  log->~async_log();
+  free(log);
+}
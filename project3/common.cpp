@@ -16,13 +16,6 @@ string currentTimeString() {
   return string(buffer);
 }
 
-time_t stringToTime(string t) {
-  struct tm tm;
-  strptime(t.c_str(), "%Y/%m/%d %H:%M:%S", &tm);
-  time_t res = mktime(&tm);
-  return res;
-}
-
 // create UPD server, return socket fd
 int UDP_server(const char* port) {
   int sockfd = socket(AF_INET, SOCK_DGRAM, 0);  // UDP, IPv4
@@ -122,24 +115,47 @@ void UDP_send(int sockfd, int port, const char* ip, const char* msg) {
   sendto(sockfd, msg, strlen(msg), 0, (struct sockaddr *)&s, sizeof(s));
 }
 
-// TCP send all content in file to destfd
-// caller should take care of closing file and shutdown write to destfd
-void sendFileContent(FILE* file, int destfd) {
-  char buf[1024];
-  int ret;
-  //read(fileno(file), buf, 1024)
-  while ((ret = fread(buf, 1, 1024, file)) > 0) {
-    send(destfd, buf, ret, 0);
+// whether users may name an SDFS file `name`, '#' is kept for chunk names
+bool validSdfsName(const string& name) {
+  return !name.empty() && name.find('#') == string::npos;
+}
+
+// name chunk `chunk` of `filename` is stored under, the first one is the file itself
+string chunkName(const string& filename, int chunk) {
+  return chunk == 0 ? filename : filename + "#" + to_string(chunk);
+}
+
+// number of chunks a file of `size` bytes is split into, at least one
+int chunkCount(long size) {
+  return size <= SDFS_CHUNK_SIZE ? 1 : (int) ((size + SDFS_CHUNK_SIZE - 1) / SDFS_CHUNK_SIZE);
+}
+
+// TCP send all `len` bytes of `buf` to destfd, return false if the connection broke
+bool sendAll(int destfd, const char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t ret = send(destfd, buf, len, MSG_NOSIGNAL);  // a dead peer is an error, not SIGPIPE
+    if (ret <= 0)
+      return false;
+    buf += ret;
+    len -= ret;
   }
+  return true;
 }
 
-// TCP receive all content from destfd to file
-// caller should take care of closing file and shutdown read to destfd
-void receiveFileContent(FILE* file, int destfd) {
-  char buf[1024];
-  int ret;
-  while ((ret = recv(destfd, buf, 1024, 0)) > 0) {
-    // write(fileno(file), buf, ret);
-    fwrite(buf, 1, ret, file);
+// next '\n' terminated line from `in.fd`, reading in small pieces so little content
+// that follows the line is taken along; false if the connection ended first
+bool readLine(lineReader& in, string& line) {
+  size_t nl;
+  while ((nl = in.pending.find('\n')) == string::npos) {
+    char buf[4096];
+    ssize_t ret = recv(in.fd, buf, sizeof(buf), 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    in.pending.append(buf, ret);
   }
-}
\ No newline at end of file
+  line = in.pending.substr(0, nl);
+  in.pending.erase(0, nl + 1);
+  return true;
+}
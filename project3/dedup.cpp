@@ -0,0 +1,305 @@
+/*
+** dedup.cpp -- content-defined blocks, and the block store versions are made of
+**
+** A file (or 64 MB chunk) is cut into blocks where a gear rolling hash of the
+** content hits a boundary pattern, so an edit only changes the blocks around it
+** and every later boundary stays where it was. Blocks are named by their SHA-256
+** and stored once per node in SDFS_BLOCK_FOLDER; a version on disk is a manifest,
+** one "hash size" line per block. Each block counts the manifests (and PUTs in
+** flight) that reference it and is removed when that drops to zero.
+**
+** The client hashes blocks as it cuts them. A replica splices a block it receives
+** to disk and hashes it there once it is complete, and drops it if the content does
+** not match the name, so one bad transfer cannot corrupt every version sharing it.
+*/
+
+#include "node.h"
+
+#include <fcntl.h>
+
+#define BLOCK_READ (4 * 1024 * 1024)  // bytes read at once while cutting a file into blocks
+
+//=========
+// SHA-256
+//=========
+struct sha256_ctx {
+  uint32_t state[8];
+  uint64_t length;
+  unsigned char buf[64];
+  size_t used;
+};
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+static void sha256_block(sha256_ctx* c, const unsigned char* p) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; ++i)
+    w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 | (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+  for (int i = 16; i < 64; ++i) {
+    uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  uint32_t a = c->state[0], b = c->state[1], d = c->state[3], e = c->state[4], f = c->state[5], g = c->state[6];
+  uint32_t cc = c->state[2], h = c->state[7];
+  for (int i = 0; i < 64; ++i) {
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & cc) ^ (b & cc));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = cc;
+    cc = b;
+    b = a;
+    a = t1 + t2;
+  }
+  c->state[0] += a;
+  c->state[1] += b;
+  c->state[2] += cc;
+  c->state[3] += d;
+  c->state[4] += e;
+  c->state[5] += f;
+  c->state[6] += g;
+  c->state[7] += h;
+}
+
+static void sha256_init(sha256_ctx* c) {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  memcpy(c->state, init, sizeof(init));
+  c->length = 0;
+  c->used = 0;
+}
+
+static void sha256_update(sha256_ctx* c, const unsigned char* p, size_t len) {
+  c->length += len;
+  if (c->used > 0) {
+    size_t take = std::min(len, 64 - c->used);
+    memcpy(c->buf + c->used, p, take);
+    c->used += take;
+    p += take;
+    len -= take;
+    if (c->used < 64)
+      return;
+    sha256_block(c, c->buf);
+    c->used = 0;
+  }
+  for (; len >= 64; p += 64, len -= 64)
+    sha256_block(c, p);
+  memcpy(c->buf, p, len);
+  c->used = len;
+}
+
+static string sha256_final(sha256_ctx* c) {
+  uint64_t bits = c->length * 8;
+  unsigned char pad[72] = {0x80};
+  size_t padLen = (c->used < 56 ? 56 : 120) - c->used;
+  for (int i = 0; i < 8; ++i)
+    pad[padLen + i] = (unsigned char) (bits >> (56 - 8 * i));
+  sha256_update(c, pad, padLen + 8);
+  char hex[65];
+  for (int i = 0; i < 8; ++i)
+    sprintf(hex + 8 * i, "%08x", c->state[i]);
+  return string(hex, 64);
+}
+
+string sha256Hex(const unsigned char* data, size_t len) {
+  sha256_ctx c;
+  sha256_init(&c);
+  sha256_update(&c, data, len);
+  return sha256_final(&c);
+}
+
+bool blockMatches(int fd, const string& hash, long size) {
+  sha256_ctx c;
+  sha256_init(&c);
+  vector<unsigned char> buf(256 * 1024);
+  long done = 0;
+  while (done < size) {
+    ssize_t ret = pread(fd, buf.data(), std::min((long) buf.size(), size - done), done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    sha256_update(&c, buf.data(), ret);
+    done += ret;
+  }
+  struct stat st;
+  return fstat(fd, &st) == 0 && st.st_size == size && sha256_final(&c) == hash;
+}
+
+//====================
+// content-defined cut
+//====================
+// gear table: a fixed pseudo random 64 bit value per byte (splitmix64), the same on every node
+struct gear_table {
+  uint64_t values[256];
+
+  gear_table() {
+    uint64_t x = 0x5344465342303530ULL;
+    for (int i = 0; i < 256; ++i) {
+      uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      values[i] = z ^ (z >> 31);
+    }
+  }
+};
+
+// several putChunks threads cut blocks at once, a local static is built exactly once
+static const uint64_t* gearTable() {
+  static const gear_table table;
+  return table.values;
+}
+
+// length of the block that starts at `data`, given `len` bytes of which all that is left
+// of the file if fewer than BLOCK_MAX_SIZE
+size_t blockBoundary(const unsigned char* data, size_t len) {
+  if (len <= BLOCK_MIN_SIZE)
+    return len;
+  const uint64_t* gear = gearTable();
+  size_t end = std::min(len, (size_t) BLOCK_MAX_SIZE);
+  uint64_t h = 0;
+  for (size_t i = BLOCK_MIN_SIZE; i < end; ++i) {
+    h = (h << 1) + gear[data[i]];
+    if ((h & BLOCK_MASK) == 0)
+      return i + 1;
+  }
+  return end;
+}
+
+vector<blockRef> splitBlocks(const unsigned char* data, size_t len) {
+  vector<blockRef> blocks;
+  for (size_t at = 0; at < len;) {
+    size_t cut = blockBoundary(data + at, len - at);
+    blocks.push_back({sha256Hex(data + at, cut), (long) at, (long) cut});
+    at += cut;
+  }
+  return blocks;
+}
+
+vector<blockRef> splitFileBlocks(int fd, off_t offset, long len) {
+  vector<blockRef> blocks;
+  vector<unsigned char> buf;
+  size_t start = 0;     // where the next block starts in buf
+  long base = 0;        // offset in the range of buf[0]
+  long read = 0;        // bytes of the range read so far
+  while (1) {
+    // keep a whole BLOCK_MAX_SIZE ahead of the cut, unless the range ends first
+    if (buf.size() - start < BLOCK_MAX_SIZE && read < len) {
+      buf.erase(buf.begin(), buf.begin() + start);
+      base += start;
+      start = 0;
+      size_t have = buf.size();
+      size_t want = std::min((long) BLOCK_READ, len - read);
+      buf.resize(have + want);
+      ssize_t ret = pread(fd, buf.data() + have, want, offset + read);
+      if (ret <= 0) {
+        buf.resize(have);
+        len = read;     // the file is shorter than the range
+      } else {
+        buf.resize(have + ret);
+        read += ret;
+      }
+      continue;
+    }
+    if (start == buf.size())
+      return blocks;
+    size_t cut = blockBoundary(buf.data() + start, buf.size() - start);
+    blocks.push_back({sha256Hex(buf.data() + start, cut), base + (long) start, (long) cut});
+    start += cut;
+  }
+}
+
+//=============
+// block store
+//=============
+static map<string, int> block_refs;     // hash -> manifests and PUTs in flight that use the block
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+string blockPath(const string& hash) {
+  return string(SDFS_BLOCK_FOLDER) + "/" + hash;
+}
+
+vector<string> pinBlocks(const vector<blockRef>& blocks) {
+  vector<string> missing;
+  set<string> listed;
+  pthread_mutex_lock(&blocks_lock);
+  for (const blockRef& b : blocks) {
+    ++block_refs[b.hash];
+    if (listed.insert(b.hash).second && access(blockPath(b.hash).c_str(), F_OK) != 0)
+      missing.push_back(b.hash);
+  }
+  pthread_mutex_unlock(&blocks_lock);
+  return missing;
+}
+
+void unpinBlocks(const vector<blockRef>& blocks) {
+  pthread_mutex_lock(&blocks_lock);
+  for (const blockRef& b : blocks) {
+    auto it = block_refs.find(b.hash);
+    if (it != block_refs.end() && --it->second <= 0) {
+      unlink(blockPath(b.hash).c_str());
+      block_refs.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&blocks_lock);
+}
+
+bool writeManifest(const string& path, const vector<blockRef>& blocks) {
+  FILE* f = fopen(path.c_str(), "w");
+  if (f == NULL)
+    return false;
+  for (const blockRef& b : blocks)
+    fprintf(f, "%s %ld\n", b.hash.c_str(), b.size);
+  return fclose(f) == 0;
+}
+
+bool readManifest(const string& path, vector<blockRef>& blocks) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == NULL)
+    return false;
+  char hash[65];
+  long size, offset = 0;
+  blocks.clear();
+  while (fscanf(f, "%64s %ld", hash, &size) == 2) {
+    blocks.push_back({string(hash), offset, size});
+    offset += size;
+  }
+  fclose(f);
+  return true;
+}
+
+long blocksSize(const vector<blockRef>& blocks) {
+  return blocks.empty() ? 0 : blocks.back().offset + blocks.back().size;
+}
+
+long sendBlocks(int sockfd, const vector<blockRef>& blocks, long offset) {
+  long sent = 0;
+  for (const blockRef& b : blocks) {
+    if (b.offset + b.size <= offset)
+      continue;
+    long from = std::max(0L, offset - b.offset);
+    int fd = open(blockPath(b.hash).c_str(), O_RDONLY);
+    long ret = fd < 0 ? 0 : sendFileRange(sockfd, fd, from, b.size - from);
+    if (fd >= 0)
+      close(fd);
+    sent += ret;
+    if (ret != b.size - from)
+      break;
+  }
+  return sent;
+}
@@ -0,0 +1,191 @@
+/*
+** dedup_bench.cpp -- disk and network saved by storing versions as blocks
+**
+** Builds VERSIONS versions of a SIZE MB file (or of FILE), each from the previous one
+** with EDITS small edits at random places (insert, delete or overwrite 1 to 100 bytes),
+** and cuts every version the way a PUT does: into SDFS_CHUNK_SIZE chunks, each into
+** blocks. For three ways of cutting it reports what one replica stores for all the
+** versions and what a PUT of each later version sends, the blocks not stored yet:
+**   chunk    each 64 MB chunk is one piece, as before blocks (sent and stored in full)
+**   fixed    fixed 64 KB blocks, which an insert or delete shifts out of step
+**   cdc      content-defined blocks (dedup.cpp)
+** The file blocks are also cut through splitFileBlocks and checked against splitBlocks.
+*/
+
+#include "node.h"
+
+#include <fcntl.h>
+
+#define BENCH_FILE "dedup_bench.tmp"
+#define FIXED_BLOCK (64 * 1024)
+
+static uint64_t rng = 88172645463325252ULL;
+
+uint64_t next_random() {
+  rng ^= rng << 13;
+  rng ^= rng >> 7;
+  rng ^= rng << 17;
+  return rng;
+}
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// text-like content: random words from a small vocabulary
+vector<unsigned char> make_base(long size) {
+  vector<string> words;
+  for (int i = 0; i < 4096; ++i) {
+    string w;
+    for (int n = 2 + next_random() % 9; n > 0; --n)
+      w += (char) ('a' + next_random() % 26);
+    words.push_back(w);
+  }
+  vector<unsigned char> data;
+  data.reserve(size + 16);
+  while ((long) data.size() < size) {
+    const string& w = words[next_random() % words.size()];
+    data.insert(data.end(), w.begin(), w.end());
+    data.push_back(next_random() % 12 == 0 ? '\n' : ' ');
+  }
+  data.resize(size);
+  return data;
+}
+
+void edit(vector<unsigned char>& data, int edits) {
+  for (int e = 0; e < edits; ++e) {
+    size_t at = next_random() % (data.size() + 1);
+    size_t n = 1 + next_random() % 100;
+    vector<unsigned char> bytes(n);
+    for (unsigned char& c : bytes)
+      c = 'A' + next_random() % 26;
+    switch (next_random() % 3) {
+      case 0:
+        data.insert(data.begin() + at, bytes.begin(), bytes.end());
+        break;
+      case 1:
+        data.erase(data.begin() + at, data.begin() + std::min(data.size(), at + n));
+        break;
+      default:
+        for (size_t i = 0; i < n && at + i < data.size(); ++i)
+          data[at + i] = bytes[i];
+    }
+  }
+}
+
+enum scheme { CHUNK, FIXED, CDC };
+
+// the blocks a PUT of `data` is cut into, chunk by chunk
+vector<blockRef> cut(const vector<unsigned char>& data, scheme how) {
+  vector<blockRef> blocks;
+  for (long start = 0; start < (long) data.size() || start == 0; start += SDFS_CHUNK_SIZE) {
+    long len = std::min((long) SDFS_CHUNK_SIZE, (long) data.size() - start);
+    const unsigned char* p = data.data() + start;
+    vector<blockRef> chunk;
+    if (how == CDC) {
+      chunk = splitBlocks(p, len);
+    } else {
+      long step = how == FIXED ? FIXED_BLOCK : len;
+      for (long at = 0; at < len; at += step) {
+        long n = std::min(step, len - at);
+        chunk.push_back({sha256Hex(p + at, n), at, n});
+      }
+    }
+    for (blockRef& b : chunk) {
+      b.offset += start;
+      blocks.push_back(b);
+    }
+    if (len <= 0)
+      break;
+  }
+  return blocks;
+}
+
+// what cutting the file through splitFileBlocks gives, chunk by chunk
+bool file_cut_matches(const vector<unsigned char>& data, const vector<blockRef>& expected) {
+  FILE* f = fopen(BENCH_FILE, "w");
+  fwrite(data.data(), 1, data.size(), f);
+  fclose(f);
+  int fd = open(BENCH_FILE, O_RDONLY);
+  vector<blockRef> blocks;
+  for (long start = 0; start < (long) data.size(); start += SDFS_CHUNK_SIZE) {
+    for (blockRef& b : splitFileBlocks(fd, start, SDFS_CHUNK_SIZE)) {
+      b.offset += start;
+      blocks.push_back(b);
+    }
+  }
+  close(fd);
+  unlink(BENCH_FILE);
+  if (blocks.size() != expected.size())
+    return false;
+  for (size_t i = 0; i < blocks.size(); ++i)
+    if (blocks[i].hash != expected[i].hash || blocks[i].offset != expected[i].offset ||
+        blocks[i].size != expected[i].size)
+      return false;
+  return true;
+}
+
+// ./dedup_bench [SIZE_MB|FILE] [VERSIONS] [EDITS]
+int main(int argc, char *argv[]) {
+  vector<unsigned char> data;
+  if (argc > 1 && atol(argv[1]) <= 0) {
+    FILE* f = fopen(argv[1], "r");
+    if (f == NULL)
+      error("cannot open the base file");
+    unsigned char buf[1 << 16];
+    size_t ret;
+    while ((ret = fread(buf, 1, sizeof(buf), f)) > 0)
+      data.insert(data.end(), buf, buf + ret);
+    fclose(f);
+  } else {
+    data = make_base((argc > 1 ? atol(argv[1]) : 96) << 20);
+  }
+  int versions = argc > 2 ? atoi(argv[2]) : 8;
+  int edits = argc > 3 ? atoi(argv[3]) : 20;
+  if (data.empty() || versions <= 0 || edits < 0) {
+    fprintf(stderr, "usage: ./dedup_bench [SIZE_MB|FILE] [VERSIONS] [EDITS]\n");
+    exit(1);
+  }
+
+  printf("%d versions of a %.1f MB file, %d edits each\n", versions, data.size() / 1048576.0, edits);
+  const char* names[] = {"chunk", "fixed", "cdc"};
+  set<string> stored[3];
+  long storedBytes[3] = {0}, laterSent[3] = {0}, logical = 0, laterLogical = 0;
+  double cdcSeconds = 0;
+  bool matches = true;
+  for (int v = 1; v <= versions; ++v) {
+    if (v > 1)
+      edit(data, edits);
+    logical += data.size();
+    if (v > 1)
+      laterLogical += data.size();
+    for (scheme how : {CHUNK, FIXED, CDC}) {
+      double start = now_s();
+      vector<blockRef> blocks = cut(data, how);
+      if (how == CDC) {
+        cdcSeconds += now_s() - start;
+        matches = matches && file_cut_matches(data, blocks);
+      }
+      long sent = 0;
+      for (const blockRef& b : blocks)
+        if (stored[how].insert(b.hash).second)
+          sent += b.size;
+      storedBytes[how] += sent;
+      if (v > 1)
+        laterSent[how] += sent;
+    }
+  }
+
+  printf("%-6s %14s %10s %18s %12s\n", "blocks", "stored MB", "of logical", "sent per later PUT", "of the file");
+  for (scheme how : {CHUNK, FIXED, CDC}) {
+    double perPut = versions > 1 ? (double) laterSent[how] / (versions - 1) : 0;
+    printf("%-6s %14.1f %9.1f%% %15.2f MB %11.2f%%\n", names[how], storedBytes[how] / 1048576.0,
+      100.0 * storedBytes[how] / logical, perPut / 1048576.0,
+      versions > 1 ? 100.0 * laterSent[how] / laterLogical : 0.0);
+  }
+  printf("cdc cut and hash %.0f MB/s, %zu distinct blocks, file cut %s\n", logical / 1048576.0 / cdcSeconds,
+    stored[CDC].size(), matches ? "matches" : "DIFFERS");
+  return matches ? 0 : 1;
+}
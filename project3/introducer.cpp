@@ -33,8 +33,8 @@ void* introducerDriver(void*) {
       servaddr.sin_port = htons(std::stoi(COMMUNICATION_PORT));
       servaddr.sin_addr.s_addr = inet_addr(buffer);
 
-      // JOIN\n<IP>\n<timestamp>\n
-      string join_broadcast = "JOIN\n" + string(clientIp) + "\n" + currentTimeString() + "\n";
+      // JOIN\n<IP>\n
+      string join_broadcast = "JOIN\n" + string(clientIp) + "\n";
       sendto(sockfd, join_broadcast.c_str(), join_broadcast.size(), 0, (const struct sockaddr *) &servaddr, sizeof(servaddr));
     }
   }
@@ -1,16 +1,163 @@
 #include "node.h"
 #include <functional>
+#include <atomic>
+#include <deque>
 
 #define BUFFER_SIZE 1024
-#define VM_COUNT 10
+#define MASTER_WORKERS 8            // requests the master serves at once
+#define PEEK_TIMEOUT 3              // seconds to wait for a replica's PEEK answer, the file's lock is held meanwhile
+#define PLACEMENT_TIMEOUT 300       // seconds a PUT has to commit before its placement is dropped
 
 extern map<string, set<string>> replica_map;        // map of filename to set of machines' ip addresses
-extern vector<tuple<string, string, actions>> membership_list;    // list of <ip, timestamp, actions>
+extern pthread_mutex_t replica_lock;
+extern vector<tuple<string, member_version, actions>> membership_list;    // list of <ip, version, actions>
 extern pthread_mutex_t list_lock;
 
-static int currentRequestId = 0;
+static std::atomic<int> currentRequestId(0);
 int masterSocket = -1;
 
+// the version the master gave the last PUT of each file, guarded by replica_lock; kept
+// across a DELETE so a deleted version number is never handed out again
+static map<string, int> file_versions;
+
+// chunk map: where each chunk of each version of a file was placed, guarded by
+// replica_lock. A version is only served once its client committed it, that is once
+// every chunk reached a write quorum.
+struct versionChunks {
+  bool committed;
+  time_t placed;                    // when the master placed it, for PLACEMENT_TIMEOUT
+  vector<vector<string>> replicas;  // replicas of chunk i, in chain order
+};
+static map<string, map<int, versionChunks>> chunk_map;
+
+// drop the placements of `filename` that will never be served: uncommitted ones older
+// than its newest committed version, or placed over PLACEMENT_TIMEOUT ago. Its replica_map
+// entry is rebuilt from what is left, so replicas only a failed PUT used are forgotten.
+// assume replica_lock acquired
+void dropStalePlacements(const string& filename, time_t now) {
+  auto file = chunk_map.find(filename);
+  if (file == chunk_map.end())
+    return;
+
+  int newestCommitted = -1;
+  for (auto& version : file->second) {
+    if (version.second.committed)
+      newestCommitted = version.first;
+  }
+
+  bool dropped = false;
+  for (auto it = file->second.begin(); it != file->second.end();) {
+    if (!it->second.committed && (it->first < newestCommitted || now - it->second.placed >= PLACEMENT_TIMEOUT)) {
+      it = file->second.erase(it);
+      dropped = true;
+    } else {
+      ++it;
+    }
+  }
+  if (!dropped)
+    return;
+
+  if (file->second.empty()) {
+    chunk_map.erase(file);
+    replica_map.erase(filename);
+    return;
+  }
+  set<string>& replicas = replica_map[filename];
+  replicas.clear();
+  for (auto& version : file->second) {
+    for (auto& chain : version.second.replicas)
+      replicas.insert(chain.begin(), chain.end());
+  }
+}
+
+// a PUT that fails or whose client dies never commits, and nothing else would drop its
+// placement of a file that is not written again
+void* placementReaper(void*) {
+  while (1) {
+    sleep(PLACEMENT_TIMEOUT / 10);
+    pthread_mutex_lock(&replica_lock);
+    vector<string> files;
+    for (auto& file : chunk_map)
+      files.push_back(file.first);
+    for (const string& filename : files)
+      dropStalePlacements(filename, time(NULL));
+    pthread_mutex_unlock(&replica_lock);
+  }
+  return NULL;
+}
+
+// the newest committed version of `filename` and its chunks, false if there is none
+bool latestCommitted(const string& filename, int& version, versionChunks& chunks) {
+  pthread_mutex_lock(&replica_lock);
+  bool found = false;
+  auto file = chunk_map.find(filename);
+  if (file != chunk_map.end()) {
+    for (auto it = file->second.rbegin(); it != file->second.rend() && !found; ++it) {
+      if (it->second.committed) {
+        version = it->first;
+        chunks = it->second;
+        found = true;
+      }
+    }
+  }
+  pthread_mutex_unlock(&replica_lock);
+  return found;
+}
+
+// accepted clients waiting for a worker
+static std::deque<int> pending_clients;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cv = PTHREAD_COND_INITIALIZER;
+
+// per-file read/write locks: requests on different files never wait for each other,
+// LOOKUP/LS/GET-VERSIONS of one file share it, PUT and DELETE of it are exclusive
+struct fileLock {
+  pthread_rwlock_t rwlock;
+  int users;            // holders and waiters, the lock is dropped when none are left
+};
+static map<string, fileLock*> file_locks;
+static pthread_mutex_t file_locks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lockFile(const string& filename, bool exclusive) {
+  pthread_mutex_lock(&file_locks_lock);
+  fileLock*& lock = file_locks[filename];
+  if (lock == NULL) {
+    lock = new fileLock();
+    pthread_rwlock_init(&lock->rwlock, NULL);
+  }
+  ++lock->users;
+  fileLock* held = lock;
+  pthread_mutex_unlock(&file_locks_lock);
+
+  if (exclusive)
+    pthread_rwlock_wrlock(&held->rwlock);
+  else
+    pthread_rwlock_rdlock(&held->rwlock);
+}
+
+void unlockFile(const string& filename) {
+  pthread_mutex_lock(&file_locks_lock);
+  fileLock* lock = file_locks[filename];
+  pthread_rwlock_unlock(&lock->rwlock);
+  if (--lock->users == 0) {
+    pthread_rwlock_destroy(&lock->rwlock);
+    delete lock;
+    file_locks.erase(filename);
+  }
+  pthread_mutex_unlock(&file_locks_lock);
+}
+
+// the replicas of `filename`, copied so no lock is held across network round trips
+set<string> replicasOf(const string& filename, bool* known = NULL) {
+  pthread_mutex_lock(&replica_lock);
+  auto it = replica_map.find(filename);
+  set<string> replicas = it == replica_map.end() ? set<string>() : it->second;
+  if (known != NULL)
+    *known = it != replica_map.end();
+  pthread_mutex_unlock(&replica_lock);
+  return replicas;
+}
+
 int numberOfAliveMachines() {
   pthread_mutex_lock(&list_lock);
   int res = 0;
@@ -38,38 +185,29 @@ void setSocketToBlocking(int sockfd) {
 
 // listen to host in `currHostsSet`, wait a subset of response
 // then move on and close all opened servers connections
-void waitWriteAck(int masterSocket, int aliveMachineCount, const set<int>& currHostsSet) {
+void waitWriteAck(int aliveMachineCount, const set<int>& currHostsSet) {
   int writeAckCount = 0;
-  // // temporarily set to non-blocking mode
-  // setSocketToNonBlocking(masterSocket, 1, 0);
-  while (writeAckCount < std::min(W, aliveMachineCount)) {
-    for (int hostfd : currHostsSet) {
-      char responseBuf[BUFFER_SIZE] = {0};
-      int ret = recv(hostfd, responseBuf, BUFFER_SIZE, 0);
-      if (ret > 0) {
-        // should check requestId
-        close(hostfd);
-        ++writeAckCount;
-        if (writeAckCount >= std::min(W, aliveMachineCount))
-          break;
-      }
-    }
+  for (int hostfd : currHostsSet) {
+    if (writeAckCount >= std::min(W, aliveMachineCount))
+      break;
+    char responseBuf[BUFFER_SIZE] = {0};
+    // a host that hangs up without an ack is not waited for again
+    if (recv(hostfd, responseBuf, BUFFER_SIZE, 0) > 0)
+      ++writeAckCount;
   }
-  cout << "all acks back" << endl;
-  // // reset back to blocking mode
-  // setSocketToBlocking(masterSocket);
+  cout << "acks back: " << writeAckCount << endl;
   // don't need to wait for the rest of ack
   for (int hostfd : currHostsSet)
     close(hostfd);
 }
 
 
-// find list of ip that the file should store in based on filename
+// find list of ip that the file (or chunk) should store in based on its name, so the
+// chunks of one file start at different members and spread over all of them
 vector<string> findReplicaTargets(string filename) {
   vector<string> res;
-  int stored_idx = std::hash<string>{}(filename) % VM_COUNT;
   pthread_mutex_lock(&list_lock);
-  int startIdx = stored_idx < membership_list.size() ? stored_idx : 0;
+  int startIdx = membership_list.empty() ? 0 : std::hash<string>{}(filename) % membership_list.size();
   for (int i = 0; i < std::min(REPLICA_COUNT, (int) membership_list.size()); i++) {
     res.push_back(std::get<0>(membership_list[(startIdx + i) % membership_list.size()]));
   }
@@ -77,427 +215,445 @@ vector<string> findReplicaTargets(string filename) {
   return res;
 }
 
-// peek to see which machine has the most recent file version, return its ip
-string peekFileVersion(string sdfsfilename, int masterSocket, int aliveMachineCount) {
-  map<int, string> fdHostMap;  // mapping hostfd to hostIp
+// peek the replicas of `sdfsfilename` for their latest version until a read quorum
+// answered; returns <version, ip> of the ones that did, newest first. A replica that
+// cannot be reached, hangs up or does not answer within PEEK_TIMEOUT counts as no answer
+// rather than blocking the quorum.
+vector<pair<int, string>> peekReplicaVersions(string sdfsfilename, int requestId, int aliveMachineCount) {
+  vector<pair<int, string>> hostFds;  // <hostfd, hostIp>
+  struct timeval tv;
+  tv.tv_sec = PEEK_TIMEOUT;
+  tv.tv_usec = 0;
 
   // send PEEK request to all replicates
-  for (string hostIp : replica_map[sdfsfilename]) {
+  for (string hostIp : replicasOf(sdfsfilename)) {
     // connect to the given ip adress using node port
     int hostfd = TCP_connect(hostIp.c_str(), std::stoi(SDFS_NODE_PORT));
-    fdHostMap.insert({hostfd, hostIp});
+    if (hostfd < 0)
+      continue;
+    setsockopt(hostfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    hostFds.push_back({hostfd, hostIp});
 
     // send the request in the format:
     // [requestId]\n
     // PEEK\n
     // [remote file name]
-    string msg = std::to_string(currentRequestId) + "\nPEEK\n" + sdfsfilename;
+    string msg = std::to_string(requestId) + "\nPEEK\n" + sdfsfilename;
     send(hostfd, msg.c_str(), msg.size(), 0);
     shutdown(hostfd, SHUT_WR);
   }
 
-  int readAckCount = 0;
-  int fileLatestVersion = -1;
-  string upToDateHostIp;
-  // // temporarily set to non-blocking mode
-  // setSocketToNonBlocking(masterSocket, 1, 0);
-  while (readAckCount < std::min(R, aliveMachineCount)) {
-    for (auto tup : fdHostMap) {
-      int hostfd = tup.first;
-      char responseBuf[BUFFER_SIZE] = {0};
-      // [requestId]\n
-      // OK\n
-      // [latest-version-number]
-      int ret = recv(hostfd, responseBuf, BUFFER_SIZE, 0);
-      if (ret > 0) {
-        close(hostfd);
-        // should check requestId
-        ++readAckCount;
-        char* responseVersion = strchr(strchr(responseBuf, '\n') + 1, '\n') + 1;
-        int v = atoi(responseVersion);
-        if (v > fileLatestVersion) {
-          fileLatestVersion = v;
-          upToDateHostIp = tup.second;
-        }
-        if (readAckCount >= std::min(R, aliveMachineCount))
-          break;
-      }
-    }
+  vector<pair<int, string>> versions;
+  int quorum = std::min(R, aliveMachineCount);
+  for (auto tup : hostFds) {
+    if ((int) versions.size() >= quorum)
+      break;
+    char responseBuf[BUFFER_SIZE] = {0};
+    // [requestId]\n
+    // OK\n
+    // [latest-version-number]
+    int ret = recv(tup.first, responseBuf, BUFFER_SIZE - 1, 0);
+    char* status = strchr(responseBuf, '\n');
+    char* responseVersion = status == NULL ? NULL : strchr(status + 1, '\n');
+    if (ret <= 0 || responseVersion == NULL)
+      continue;
+    versions.push_back({atoi(responseVersion + 1), tup.second});
   }
-  // // reset back to blocking mode
-  // setSocketToBlocking(masterSocket);
 
   // close all un-closed fd
-  for (auto tup: fdHostMap)
+  for (auto tup : hostFds)
     close(tup.first);
 
-  return upToDateHostIp;
+  std::stable_sort(versions.begin(), versions.end(),
+    [](const pair<int, string>& a, const pair<int, string>& b) { return a.first > b.first; });
+  return versions;
 }
 
-void* masterDriver(void*) {
-  masterSocket = TCP_server(MASTER_PORT);
-
-  while (1) {
-    fprintf(stderr, "waiting for client requests...\n");
+// comma separated, the way a chain travels in a PUT header
+string joinReplicas(const vector<string>& replicas) {
+  string res;
+  for (string hostIp : replicas)
+    res += (res.empty() ? "" : ",") + hostIp;
+  return res;
+}
 
-    setSocketToBlocking(masterSocket);
+// send File Not Found to the client in the format:
+// NOTFOUND\n
+// [remote file name]
+void replyNotFound(int clientfd, const string& sdfsfilename) {
+  fprintf(stderr, "[master] File not found\n");
+  string msg = "NOTFOUND\n" + sdfsfilename;
+  send(clientfd, msg.c_str(), msg.size(), 0);
+}
 
-    struct sockaddr_storage clientaddr;
-    socklen_t clientaddrsize = sizeof(clientaddr);
+// serve one client request, holding the lock of the file it names for as long as it
+// talks to that file's replicas; closes clientfd
+void serveMasterRequest(int clientfd) {
+  char buffer[BUFFER_SIZE] = {0};
+  ssize_t recv_value = recv(clientfd, buffer, BUFFER_SIZE - 1, 0);
+  if (recv_value <= 0) {
+    close(clientfd);
+    return;
+  }
 
-    int clientfd = accept(masterSocket, (struct sockaddr *) &clientaddr, &clientaddrsize);
-    if (clientfd == -1) {
-      continue;
+  cout << "recv " << recv_value << " from client " << clientfd << endl;
+
+  string line = string(buffer);
+  string sdfsfilename;
+  int requestId = ++currentRequestId;
+
+  int aliveMachineCount = numberOfAliveMachines();
+
+  //=====================
+  // PUT\n
+  // [remote file name]\n
+  // [number of chunks]\n
+  //=====================
+  // the client streams every chunk down its replica chain itself (openPutChain), the
+  // master only places the chunks and numbers the version, so every replica stores
+  // concurrent PUTs of one file in the order the master saw them
+  if (line.substr(0, 4) == "PUT\n") {
+    std::istringstream request(line.substr(4));
+    string chunksLine;
+    getline(request, sdfsfilename);
+    getline(request, chunksLine);
+    int chunks = std::max(1, atoi(chunksLine.c_str()));
+    shutdown(clientfd, SHUT_RD);
+
+    cout << "[master] PUT " << sdfsfilename << " (" << chunks << " chunks)" << endl;
+
+    // INVALID\n[remote file name], for a name that could be taken for another file's chunk
+    if (!validSdfsName(sdfsfilename)) {
+      string msg = "INVALID\n" + sdfsfilename;
+      sendAll(clientfd, msg.c_str(), msg.size());
+      shutdown(clientfd, SHUT_WR);
+      close(clientfd);
+      return;
     }
 
-    setSocketToNonBlocking(masterSocket, 1, 0);
+    lockFile(sdfsfilename, true);
+    bool known;
+    replicasOf(sdfsfilename, &known);
+    pthread_mutex_lock(&replica_lock);
+    auto numbered = file_versions.find(sdfsfilename);
+    int latest = numbered == file_versions.end() ? -1 : numbered->second;
+    pthread_mutex_unlock(&replica_lock);
+    if (latest < 0) {
+      // first PUT this master places, the replicas know how far the file got
+      vector<pair<int, string>> versions;
+      if (known)
+        versions = peekReplicaVersions(sdfsfilename, requestId, aliveMachineCount);
+      latest = versions.empty() ? 0 : versions.front().first;
+    }
 
-    cout << "[master] accepted client " << clientfd << endl;
+    // OK\n
+    // [requestId]\n
+    // [version]\n
+    // [replica chain of chunk 0, comma separated]\n
+    // [replica chain of chunk 1, comma separated]\n
+    // ...
+    versionChunks placement = {false, time(NULL), vector<vector<string>>()};
+    string msg = "OK\n" + to_string(requestId) + "\n" + to_string(latest + 1) + "\n";
+    for (int i = 0; i < chunks; ++i) {
+      placement.replicas.push_back(findReplicaTargets(chunkName(sdfsfilename, i)));
+      msg += joinReplicas(placement.replicas.back()) + "\n";
+    }
+    pthread_mutex_lock(&replica_lock);
+    file_versions[sdfsfilename] = latest + 1;
+    chunk_map[sdfsfilename][latest + 1] = placement;
+    for (auto& chain : placement.replicas)
+      replica_map[sdfsfilename].insert(chain.begin(), chain.end());
+    pthread_mutex_unlock(&replica_lock);
+    unlockFile(sdfsfilename);
+
+    sendAll(clientfd, msg.c_str(), msg.size());
+    shutdown(clientfd, SHUT_WR);
+  }
 
-    char buffer[BUFFER_SIZE] = {0};
-    ssize_t recv_value = recv(clientfd, buffer, BUFFER_SIZE, 0);
-    if (recv_value <= 0) {
-      close(clientfd);
-      continue;
+  //=====================
+  // COMMIT\n
+  // [remote file name]\n
+  // [version]
+  //=====================
+  // every chunk of the version reached a write quorum, it can be read from now on
+  else if (line.substr(0, 7) == "COMMIT\n") {
+    shutdown(clientfd, SHUT_RD);
+    std::istringstream request(line.substr(7));
+    string versionLine;
+    getline(request, sdfsfilename);
+    getline(request, versionLine);
+    int version = atoi(versionLine.c_str());
+
+    cout << "[master] COMMIT " << sdfsfilename << " v" << version << endl;
+
+    lockFile(sdfsfilename, true);
+    pthread_mutex_lock(&replica_lock);
+    bool placed = chunk_map.count(sdfsfilename) > 0 && chunk_map[sdfsfilename].count(version) > 0;
+    if (placed) {
+      chunk_map[sdfsfilename][version].committed = true;
+      dropStalePlacements(sdfsfilename, time(NULL));
     }
+    pthread_mutex_unlock(&replica_lock);
+    unlockFile(sdfsfilename);
 
-    cout << "recv " << recv_value << " from client " << clientfd << endl;
-    
-    string line = string(buffer);
-    string sdfsfilename;
-    ++currentRequestId;
-
-    int aliveMachineCount = numberOfAliveMachines();
-    
-    //=====================
-    // PUT\n
-    // [remote file name]\n
-    // [file content]
-    //=====================
-    if (line.substr(0, 4) == "PUT\n") {
-      string restOfRequest = line.substr(4);
-      sdfsfilename = restOfRequest.substr(0, restOfRequest.find("\n"));
-
-      cout << "[master] PUT " << sdfsfilename << endl;
-
-      // open a temp file to store the incoming file to be put
-      FILE * fp = fopen("tempfile", "w+");
-      // write id of the request
-      string firstline = to_string(currentRequestId) + "\n";
-      fwrite(firstline.c_str(), 1, firstline.size(), fp);
-      // write the request
-      fwrite(buffer, 1, recv_value, fp);
-      // receive the rest of the request store all in a temp file
-      receiveFileContent(fp, clientfd);
-      rewind(fp);
+    if (placed)
+      send(clientfd, "OK\n", 3, 0);
+    else
+      replyNotFound(clientfd, sdfsfilename);
+  }
 
-      shutdown(clientfd, SHUT_RD);
+  //=====================
+  // LOOKUP\n
+  // [remote file name]
+  //=====================
+  // Metadata only: the client reads the chunks straight from their replicas.
+  else if (line.substr(0, 7) == "LOOKUP\n") {
+    shutdown(clientfd, SHUT_RD);
+
+    // get file name
+    sdfsfilename = line.substr(7);
+    cout << "[master] LOOKUP " << sdfsfilename << endl;
+
+    lockFile(sdfsfilename, false);
+    int latest;
+    versionChunks chunks;
+    bool found = latestCommitted(sdfsfilename, latest, chunks);
+    unlockFile(sdfsfilename);
+
+    if (!found) {
+      replyNotFound(clientfd, sdfsfilename);
+      close(clientfd);
+      return;
+    }
 
-      // set of host that master send to
-      set<int> currHostsSet;
-      vector<string> replicaHosts = findReplicaTargets(sdfsfilename);
+    // reply to the client in the format:
+    // OK\n
+    // [latest version]\n
+    // [number of chunks]\n
+    // [replicas of chunk 0, comma separated]\n
+    // ...
+    // all of a chunk's replicas are listed so the client has somewhere to fail over to
+    string msg = "OK\n" + to_string(latest) + "\n" + to_string(chunks.replicas.size()) + "\n";
+    for (auto& replicas : chunks.replicas)
+      msg += joinReplicas(replicas) + "\n";
+    send(clientfd, msg.c_str(), msg.size(), 0);
+  }
 
-      // send PUT request and file content to all replicates
-      for (string hostIp : replicaHosts) {
-        // connect to the ip address at hashed index and its clockwised neighbors
-        int hostfd = TCP_connect(hostIp.c_str(), std::stoi(SDFS_NODE_PORT));
+  //============
+  // DELETE\n
+  // [filename]
+  //============
+  else if (line.substr(0, 7) == "DELETE\n") {
+    shutdown(clientfd, SHUT_RD);
 
-        // [requst Id]\n
-        // PUT\n
-        // [remote file name]\n
-        // [file content]
-        sendFileContent(fp, hostfd);
-        shutdown(hostfd, SHUT_WR);
-        rewind(fp);
+    // get file name
+    sdfsfilename = line.substr(7);
 
-        currHostsSet.insert(hostfd);
-        replica_map[sdfsfilename].insert(hostIp);
-      }
-      fclose(fp);
+    cout << "[master] DELETE " << sdfsfilename << endl;
 
-      // wait a subset of write ack
-      waitWriteAck(masterSocket, aliveMachineCount, currHostsSet);
+    lockFile(sdfsfilename, true);
 
-      // OK\n
-      send(clientfd, "OK\n", 3, 0);
-      shutdown(clientfd, SHUT_WR);
+    // first find if file exists
+    bool known;
+    set<string> replicas = replicasOf(sdfsfilename, &known);
+    if (!known) {
+      unlockFile(sdfsfilename);
+      replyNotFound(clientfd, sdfsfilename);
       close(clientfd);
+      return;
     }
 
-    //=====================
-    // GET\n
-    // [remote file name]
-    //=====================
-    else if (line.substr(0, 4) == "GET\n") {
-      shutdown(clientfd, SHUT_RD);
-
-      // get file name
-      sdfsfilename = line.substr(4);
-      cout << "[master] GET " << sdfsfilename << endl;
-
-      if (replica_map.find(sdfsfilename) == replica_map.end()) {
-        fprintf(stderr, "[master] File not found\n");
-
-        // send File Not Found to the client in the format:
-        // NOTFOUND\n
-        // [remote file name]
-        string msg = "NOTFOUND\n" + sdfsfilename;
-        send(clientfd, msg.c_str(), msg.size(), 0);
-        close(clientfd);
-        continue;
-      }
-
-      string upToDateHostIp = peekFileVersion(sdfsfilename, masterSocket, aliveMachineCount);
-
-      // send get request to upToDateHostIp
-      // [requestId]
-      // GET\n
-      // [filename]
-      int upToDateHost = TCP_connect(upToDateHostIp.c_str(), std::stoi(SDFS_NODE_PORT));
-      string msg = std::to_string(currentRequestId) + "\nGET\n" + sdfsfilename;
-      send(upToDateHost, msg.c_str(), msg.size(), 0);
-      shutdown(upToDateHost, SHUT_WR);
-
-      // 1. [requestId]\n
-      //    OK\n
-      //    [content]
-      // 2. [requestId]\n
-      //    NOTFOUND\n
-      char recv_buffer[BUFFER_SIZE] = {0};
-      int ret = recv(upToDateHost, recv_buffer, BUFFER_SIZE, 0);
-
-      char* status = strchr(recv_buffer, '\n') + 1;
-      if (strncmp(status, "OK\n", 3) == 0) {
-        // open a temp file to store the incoming file to send back to client
-        // OK\n
-        // [content]
-        FILE* fp = fopen("tempfile", "w+");
-        fwrite(status, 1, ret - (status - recv_buffer), fp);
-        receiveFileContent(fp, upToDateHost);
-
-        // send response back to client
-        rewind(fp);
-        sendFileContent(fp, clientfd);
-        close(clientfd);
-        fclose(fp);
-      } else {
-        // NOTFOUND\n
-        // [remote file name]
-        string response = "NOTFOUND\n" + sdfsfilename;
-        send(clientfd, response.c_str(), response.size(), 0);
-        close(clientfd);
-      }
-
-      close(upToDateHost);
+    // every version handed out so far, including PUTs still on their way down their
+    // chains: the replicas refuse those when they arrive after the DELETE
+    pthread_mutex_lock(&replica_lock);
+    auto numbered = file_versions.find(sdfsfilename);
+    int through = numbered == file_versions.end() ? 0 : numbered->second;
+    pthread_mutex_unlock(&replica_lock);
+    if (through == 0) {
+      // not numbered by this master, the replicas know how far the file got
+      vector<pair<int, string>> versions = peekReplicaVersions(sdfsfilename, requestId, aliveMachineCount);
+      through = versions.empty() ? 0 : versions.front().first;
     }
 
-    //============
-    // DELETE\n
-    // [filename]
-    //============
-    else if (line.substr(0, 7) == "DELETE\n") {
-      shutdown(clientfd, SHUT_RD);
+    set<int> currHostsSet;
 
-      // get file name
-      sdfsfilename = line.substr(7);
+    // send DELETE request to all replicates
+    for (string hostIp : replicas) {
+      // connect to the ip address at hashed index and its clockwised neighbors
+      int hostfd = TCP_connect(hostIp.c_str(), std::stoi(SDFS_NODE_PORT));
+      if (hostfd < 0)
+        continue;
 
-      cout << "[master] DELETE " << sdfsfilename << endl;
+      // send the request in the format
+      // [requestId]\n
+      // DELETE\n
+      // [remote file name]\n
+      // [highest version to delete]
+      string msg = std::to_string(requestId) + "\nDELETE\n" + sdfsfilename + "\n" + to_string(through);
+      send(hostfd, msg.c_str(), msg.size(), 0);
+      shutdown(hostfd, SHUT_WR);
+      currHostsSet.insert(hostfd);
+    }
 
-      // first find if file exists
-      if (replica_map.find(sdfsfilename) == replica_map.end()) {
-        fprintf(stderr, "[master] File not found\n");
+    // wait a subset of write ack
+    waitWriteAck(aliveMachineCount, currHostsSet);
+
+    // eraze the file record in replica_map; the version count stays, so the next PUT
+    // is numbered above every deleted version and the replicas take it
+    pthread_mutex_lock(&replica_lock);
+    replica_map.erase(sdfsfilename);
+    file_versions[sdfsfilename] = std::max(file_versions[sdfsfilename], through);
+    chunk_map.erase(sdfsfilename);
+    pthread_mutex_unlock(&replica_lock);
+    unlockFile(sdfsfilename);
+
+    // respond to client
+    string msg = "OK\n";
+    send(clientfd, msg.c_str(), msg.size(), 0);
+  }
 
-        // send File Not Found to the client in the format
-        // NOTFOUND\n
-        // [remote file name]
-        string msg = "NOTFOUND\n" + sdfsfilename;
-        send(clientfd, msg.c_str(), msg.size(), 0);
-        close(clientfd);
-        continue;
+  //====================
+  // LS\n
+  // [remote file names]
+  //====================
+  else if (line.substr(0, 3) == "LS\n") {
+    shutdown(clientfd, SHUT_RD);
+
+    // get file name
+    sdfsfilename = line.substr(3);
+
+    cout << "[master] LS " << sdfsfilename << endl;
+
+    // first find if file exists
+    bool known;
+    set<string> replicas = replicasOf(sdfsfilename, &known);
+    if (!known) {
+      replyNotFound(clientfd, sdfsfilename);
+    } else {
+      // send OK to the client in the format - OK\n<list of all ip addresses who has the file>
+      string msg = "OK\n";
+      for (string hostIp : replicas) {
+        msg += hostIp;
+        msg += "\n";
       }
+      send(clientfd, msg.c_str(), msg.size(), 0);
+    }
+  }
 
-      set<int> currHostsSet;
-
-      // send DELETE request to all replicates
-      for (string hostIp : replica_map[sdfsfilename]) {
-        // connect to the ip address at hashed index and its clockwised neighbors
-        int hostfd = TCP_connect(hostIp.c_str(), std::stoi(SDFS_NODE_PORT));
-
-        // send the request in the format
-        // [requestId]\n
-        // DELETE\n
-        // [remote file name]
-        string msg = std::to_string(currentRequestId) + "\nDELETE\n" + sdfsfilename;
-        send(hostfd, msg.c_str(), msg.size(), 0);
-        shutdown(hostfd, SHUT_WR);
-        currHostsSet.insert(hostfd);
+  //=====================
+  // GET-VERSIONS\n
+  // [remote file name]\n
+  // [num of versions]
+  //=====================
+  else if (line.substr(0, 13) == "GET-VERSIONS\n") {
+    // get file name
+    string restOfRequest = line.substr(13);
+    sdfsfilename = restOfRequest.substr(0, restOfRequest.find("\n"));
+    string numVersions = restOfRequest.substr(restOfRequest.find("\n") + 1, 1); // assume numVersions <= 5
+
+    cout << "[master] GET-VERSIONS " << sdfsfilename << " (" << numVersions << ")" << endl;
+
+    // the newest committed versions, newest first
+    lockFile(sdfsfilename, false);
+    vector<pair<int, versionChunks>> versions;
+    pthread_mutex_lock(&replica_lock);
+    auto file = chunk_map.find(sdfsfilename);
+    if (file != chunk_map.end()) {
+      for (auto it = file->second.rbegin(); it != file->second.rend() && versions.size() < atoi(numVersions.c_str());
+           ++it) {
+        if (it->second.committed)
+          versions.push_back(*it);
       }
+    }
+    pthread_mutex_unlock(&replica_lock);
 
-      // wait a subset of write ack
-      waitWriteAck(masterSocket, aliveMachineCount, currHostsSet);
-
-      // eraze the file record in replica_map
-      replica_map.erase(sdfsfilename);
+    if (versions.empty()) {
+      unlockFile(sdfsfilename);
+      fprintf(stderr, "[master] File not found\n");
 
-      // respond to client
-      string msg = "OK\n";
+      // send File Not Found to the client in the format - NOTFOUND\n<remote file name>
+      string msg = "OK\nFILE NOT FOUND";
       send(clientfd, msg.c_str(), msg.size(), 0);
       close(clientfd);
+      return;
     }
 
-    //====================
-    // LS\n
-    // [remote file names]
-    //====================
-    else if (line.substr(0, 3) == "LS\n") {
-      shutdown(clientfd, SHUT_RD);
-
-      // get file name
-      sdfsfilename = line.substr(3);
-
-      cout << "[master] LS " << sdfsfilename << endl;
-
-      // first find if file exists
-      if (replica_map.find(sdfsfilename) == replica_map.end()) {
-        fprintf(stderr, "[master] File not found\n");
-
-        // send File Not Found to the client in the format
-        // NOTFOUND\n
-        // [remote file name]
-        string msg = "NOTFOUND\n" + sdfsfilename;
-        send(clientfd, msg.c_str(), msg.size(), 0);
-        close(clientfd);
-
-      } else {
-        // send OK to the client in the format - OK\n<list of all ip addresses who has the file>
-        string msg = "OK\n";
-        for (string hostIp : replica_map[sdfsfilename]) {
-          msg += hostIp;
-          msg += "\n";
-        }
-        send(clientfd, msg.c_str(), msg.size(), 0);
-        close(clientfd);
+    fprintf(stderr, "[master] File found\n");
+
+    // assemble the versions chunk by chunk from their replicas, in an anonymous temp
+    // file per request, concurrent requests must not share one
+    FILE * fp = tmpfile();
+    for (size_t i = 0; fp != NULL && i < versions.size(); ++i) {
+      char versionDelimiters[128] = {0};
+      sprintf(versionDelimiters, "----------------------------\n-----%zust Latest Version-----\n----------------------------\n\n", i + 1);
+      fputs(versionDelimiters, fp);
+      vector<vector<string>>& chunks = versions[i].second.replicas;
+      for (size_t c = 0; c < chunks.size(); ++c) {
+        if (!fetchChunk(chunks[c], chunkName(sdfsfilename, c), versions[i].first, fp))
+          fprintf(stderr, "[master] chunk %zu of %s v%d could not be read\n", c, sdfsfilename.c_str(), versions[i].first);
       }
     }
+    unlockFile(sdfsfilename);
 
-    //=====================  
-    // GET-VERSIONS\n
-    // [remote file name]\n
-    // [num of versions]
-    //=====================
-    else if (line.substr(0, 13) == "GET-VERSIONS\n") {
-      // get file name
-      string restOfRequest = line.substr(13);
-      sdfsfilename = restOfRequest.substr(0, restOfRequest.find("\n"));
-      string numVersions = restOfRequest.substr(restOfRequest.find("\n") + 1, 1); // assume numVersions <= 5
-
-      cout << "[master] GET-VERSIONS " << sdfsfilename << " (" << numVersions << ")" << endl;
-
-      if (replica_map.find(sdfsfilename) == replica_map.end()) {
-        fprintf(stderr, "[master] File not found\n");
-
-        // send File Not Found to the client in the format - NOTFOUND\n<remote file name>
-        string msg = "OK\nFILE NOT FOUND";
-        send(clientfd, msg.c_str(), msg.size(), 0);
-        close(clientfd);
-        continue;
-      }
-
-      fprintf(stderr, "[master] File found\n");
-
-      string upToDateHostIp = peekFileVersion(sdfsfilename, masterSocket, aliveMachineCount);
-
-      int hostfd = TCP_connect(upToDateHostIp.c_str(), std::stoi(SDFS_NODE_PORT));
-      // GET-VERSIONS\n
-      // [filename]\n
-      // [num-versions]
-      string msg = to_string(currentRequestId) + "\nGET-VERSIONS\n" + sdfsfilename + "\n" + numVersions;
-      send(hostfd, msg.c_str(), msg.size(), 0);
-      shutdown(hostfd, SHUT_WR);
-
-      // [requestId]\n
-      // OK\n
-      // [content]
-      char recv_buffer[BUFFER_SIZE] = {0};
-      int ret = recv(hostfd, recv_buffer, BUFFER_SIZE, 0);
-
-      char* content = strchr(strchr(recv_buffer, '\n') + 1, '\n') + 1;
-
-      // open a temp file to store the incoming file to be get
-      FILE * fp = fopen("tempfile", "w+");
-      fwrite(content, 1, ret - (content - recv_buffer), fp);
-      receiveFileContent(fp, hostfd);
-      close(hostfd);
-
-      // send file back to client
+    // send file back to client
+    send(clientfd, "OK\n", 3, 0);
+    if (fp != NULL) {
       rewind(fp);
-      send(clientfd, "OK\n", 3, 0);
       sendFileContent(fp, clientfd);
-      close(clientfd);
-
       fclose(fp);
     }
-
-    close(clientfd);
   }
 
+  close(clientfd);
+}
+
+void* masterWorker(void*) {
+  while (1) {
+    pthread_mutex_lock(&pending_lock);
+    while (pending_clients.empty())
+      pthread_cond_wait(&pending_cv, &pending_lock);
+    int clientfd = pending_clients.front();
+    pending_clients.pop_front();
+    pthread_mutex_unlock(&pending_lock);
+
+    serveMasterRequest(clientfd);
+  }
   return NULL;
 }
 
-#define FAILURE_DETECTION_INTERVAL 2
-void* replicateFileDuringFailureMonitor(void*) {
-  pthread_mutex_lock(&list_lock);
-  vector<tuple<string, string, actions>> prev_membership_list = membership_list; // previous membership list
-  pthread_mutex_unlock(&list_lock);
+// the pool outlives masterDriver, which is cancelled when this node stops being master
+void startMasterWorkers() {
+  for (int i = 0; i < MASTER_WORKERS; ++i) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, masterWorker, NULL);
+    pthread_detach(tid);
+  }
+  pthread_t reaper;
+  pthread_create(&reaper, NULL, placementReaper, NULL);
+  pthread_detach(reaper);
+}
 
-  while (1) {
-    bool flag_membership_list_change = false;
-
-    pthread_mutex_lock(&list_lock);
-
-    for (int i = 0; i < membership_list.size(); ++i) {
-      // if we detect some member fails
-      if (std::get<2>(prev_membership_list[i]) == JOIN && std::get<2>(membership_list[i]) != JOIN) {
-        string hostIp = std::get<0>(membership_list[i]);
-        int hostfd = TCP_connect(hostIp.c_str(), std::stoi(SDFS_NODE_PORT));
-
-        // find all the files on the failed machine
-        set<string> files_set; // set of files on failed machine to be replicated
-        for (auto & map_iter : replica_map) {
-          set<string> ip_address_set = map_iter.second;
-          if (ip_address_set.find(hostIp) != ip_address_set.end()) {
-            files_set.insert(map_iter.first);
-          }
-        }
-
-        for (auto & file : files_set) {
-          // replicate the file content of the failed machine into calculated alive ones
-          // first send GET request to one of the alive machine that has the file
-          
-          FILE *fp;
-          
-          
-          // then send the PUT request
-          // [requst Id]\n
-          // PUT\n
-          // [remote file name]\n
-          // [file content]
-          sendFileContent(fp, hostfd);
-          shutdown(hostfd, SHUT_WR);
-          rewind(fp);
-        }
-
-        // TODO: deal with adding and removing info on replica_map
-        replica_map["somename"].insert(hostIp);
-        
-        close(hostfd);
-      }
-    }
-    pthread_mutex_unlock(&list_lock);
+// accept clients and hand them to the worker pool, so a request waiting on replicas
+// does not hold up the ones behind it
+void* masterDriver(void*) {
+  static pthread_once_t workers_started = PTHREAD_ONCE_INIT;
+  pthread_once(&workers_started, startMasterWorkers);
 
+  masterSocket = TCP_server(MASTER_PORT);
 
+  while (1) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientaddrsize = sizeof(clientaddr);
+
+    int clientfd = accept(masterSocket, (struct sockaddr *) &clientaddr, &clientaddrsize);
+    if (clientfd == -1) {
+      continue;
+    }
 
-    sleep(FAILURE_DETECTION_INTERVAL);
+    pthread_mutex_lock(&pending_lock);
+    pending_clients.push_back(clientfd);
+    pthread_cond_signal(&pending_cv);
+    pthread_mutex_unlock(&pending_lock);
   }
 
   return NULL;
@@ -0,0 +1,203 @@
+/*
+** master_bench.cpp -- master request throughput with many clients at once
+**
+** First every one of FILES files is PUT through its replica chain and COMMITted,
+** as node.cpp does, so the requests below find committed versions on live replicas.
+** Then CLIENTS threads each open a connection per request to the master, send it and
+** read the reply to the end for SECONDS; the client count doubles from 1 up to
+** CLIENTS. Three kinds of request:
+**   lookup    LOOKUP of one of FILES files, answered from the chunk map
+**   put       PUT placement of one of FILES files (no data is sent, only numbered)
+**   versions  GET-VERSIONS of the latest version, read from the replicas while the
+**             master holds the file's lock shared, so puts of it wait on replicas
+** With put and FILES = 1 every request contends for the same file lock, and the
+** versions handed out are checked to be all distinct.
+**
+** Placements made by the put mode never commit, the master drops them after
+** PLACEMENT_TIMEOUT.
+*/
+
+#include "node.h"
+
+#define BENCH_FILE_SIZE (16 * 1024)  // content stored per file before the run
+
+enum bench_mode { BENCH_LOOKUP, BENCH_PUT, BENCH_VERSIONS };
+
+static const char* master_ip;
+static volatile bool bench_running;
+static bench_mode mode;
+static int files;
+
+struct client_result {
+  long long requests;
+  long long failed;
+  double latency_ms;
+  vector<int> versions;  // put only
+};
+
+double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// send `msg` to the master and read its reply to the end, "" if it could not be reached
+string master_request(const string& msg) {
+  int fd = TCP_connect(master_ip, std::stoi(MASTER_PORT));
+  if (fd < 0)
+    return "";
+  send(fd, msg.c_str(), msg.size(), 0);
+  shutdown(fd, SHUT_WR);
+  string reply;
+  char buf[1024];
+  ssize_t ret;
+  while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0)
+    reply.append(buf, ret);
+  close(fd);
+  return reply;
+}
+
+// PUT `filename` as one chunk of random content down the chain the master places it on,
+// and COMMIT it once a write quorum stored it
+bool store_file(const string& filename, uint64_t seed) {
+  // OK\n[requestId]\n[version]\n[chain]\n
+  std::istringstream lines(master_request("PUT\n" + filename + "\n1\n"));
+  string status, requestId, version, chain;
+  getline(lines, status);
+  getline(lines, requestId);
+  getline(lines, version);
+  getline(lines, chain);
+  if (status != "OK")
+    return false;
+  vector<string> replicas;
+  std::istringstream ips(chain);
+  for (string ip; getline(ips, ip, ',');)
+    replicas.push_back(ip);
+
+  vector<unsigned char> data(BENCH_FILE_SIZE);
+  for (size_t i = 0; i < data.size(); ++i) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    data[i] = (unsigned char) seed;
+  }
+  vector<blockRef> blocks = splitBlocks(data.data(), data.size());
+
+  int chainfd = openPutChain(requestId, chunkName(filename, 0), atoi(version.c_str()), replicas);
+  if (chainfd == -1)
+    return false;
+  struct timeval tv = {30, 0};
+  setsockopt(chainfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  set<string> wanted;
+  bool sent = offerBlocks(chainfd, blocks, wanted);
+  for (size_t b = 0; sent && b < blocks.size(); ++b) {
+    if (wanted.erase(blocks[b].hash) == 0)
+      continue;
+    string frame = blocks[b].hash + " " + to_string(blocks[b].size) + "\n";
+    sent = sendAll(chainfd, frame.c_str(), frame.size()) &&
+           sendAll(chainfd, (const char*) data.data() + blocks[b].offset, blocks[b].size);
+  }
+  shutdown(chainfd, SHUT_WR);
+  int stored = sent ? waitPutChainAck(chainfd) : 0;
+  close(chainfd);
+  if (stored < std::min(W, (int) replicas.size()))
+    return false;
+
+  return master_request("COMMIT\n" + filename + "\n" + version) == "OK\n";
+}
+
+void* client_loop(void* arg) {
+  client_result* result = (client_result*) arg;
+  uint64_t rng = (uint64_t) arg | 1;
+  while (bench_running) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    string filename = "bench" + to_string(rng % files);
+    string msg = mode == BENCH_PUT ? "PUT\n" + filename + "\n1\n"
+               : mode == BENCH_LOOKUP ? "LOOKUP\n" + filename
+               : "GET-VERSIONS\n" + filename + "\n1";
+
+    double start = now_ms();
+    string reply = master_request(msg);
+
+    // PUT:          OK\n[requestId]\n[version]\n[chain]\n
+    // LOOKUP:       OK\n[version]\n... for a stored file
+    // GET-VERSIONS: OK\n[delimiter][content]
+    if (reply.compare(0, 3, "OK\n") != 0) {
+      ++result->failed;
+      continue;
+    }
+    if (mode == BENCH_PUT) {
+      std::istringstream lines(reply);
+      string status, requestId, version;
+      getline(lines, status);
+      getline(lines, requestId);
+      getline(lines, version);
+      result->versions.push_back(atoi(version.c_str()));
+    }
+    ++result->requests;
+    result->latency_ms += now_ms() - start;
+  }
+  return NULL;
+}
+
+// ./master_bench MASTER_IP [lookup|put|versions] [CLIENTS] [SECONDS] [FILES]
+int main(int argc, char *argv[]) {
+  static const char* mode_names[] = {"lookup", "put", "versions"};
+  master_ip = argc > 1 ? argv[1] : NULL;
+  int named = argc > 2 ? -1 : BENCH_LOOKUP;
+  for (int m = BENCH_LOOKUP; argc > 2 && m <= BENCH_VERSIONS; ++m) {
+    if (strcmp(argv[2], mode_names[m]) == 0)
+      named = m;
+  }
+  int clients = argc > 3 ? atoi(argv[3]) : 16;
+  int seconds = argc > 4 ? atoi(argv[4]) : 3;
+  files = argc > 5 ? atoi(argv[5]) : 100;
+  if (master_ip == NULL || named < 0 || clients <= 0 || seconds <= 0 || files <= 0) {
+    fprintf(stderr, "usage: ./master_bench MASTER_IP [lookup|put|versions] [CLIENTS] [SECONDS] [FILES]\n");
+    exit(1);
+  }
+  mode = (bench_mode) named;
+
+  int stored = 0;
+  double start = now_ms();
+  for (int i = 0; i < files; ++i)
+    stored += store_file("bench" + to_string(i), (uint64_t) time(NULL) * 2654435761ULL + i + 1);
+  printf("stored %d of %d files of %d KB in %.0f ms\n", stored, files, BENCH_FILE_SIZE / 1024, now_ms() - start);
+  if (stored < files) {
+    fprintf(stderr, "could not store every file, is %s the master and are its replicas up?\n", master_ip);
+    exit(1);
+  }
+
+  printf("%s requests on %d files, %d s per client count\n", mode_names[mode], files, seconds);
+  printf("%8s %12s %12s %8s\n", "clients", "requests/s", "latency ms", "failed");
+  for (int n = 1; n <= clients; n *= 2) {
+    bench_running = true;
+    vector<pthread_t> tids(n);
+    vector<client_result> results(n);
+    for (int i = 0; i < n; ++i)
+      pthread_create(&tids[i], NULL, client_loop, &results[i]);
+    sleep(seconds);
+    bench_running = false;
+
+    long long requests = 0, failed = 0;
+    double latency = 0;
+    vector<int> versions;
+    for (int i = 0; i < n; ++i) {
+      pthread_join(tids[i], NULL);
+      requests += results[i].requests;
+      failed += results[i].failed;
+      latency += results[i].latency_ms;
+      versions.insert(versions.end(), results[i].versions.begin(), results[i].versions.end());
+    }
+    printf("%8d %12.0f %12.3f %8lld\n", n, (double) requests / seconds, requests ? latency / requests : 0.0, failed);
+
+    if (mode == BENCH_PUT && files == 1) {
+      std::sort(versions.begin(), versions.end());
+      bool distinct = std::adjacent_find(versions.begin(), versions.end()) == versions.end();
+      printf("%8s %zu versions handed out, %s\n", "", versions.size(), distinct ? "all distinct" : "DUPLICATES");
+    }
+  }
+  return 0;
+}
@@ -9,6 +9,7 @@ pthread_t masterProgramThreads[2];  // threads to run master programs if I am th
 bool masterProgramRunning = false;
 
 extern map<string, set<int>> localFileVersions;
+extern pthread_mutex_t versions_lock;
 
 
 string getMyIpAddress() {
@@ -58,6 +59,8 @@ void clearFolder(const char* folderName) {
 void initSdfsNode() {
   // initialize the SDFS folder first
   mkdir(SDFS_FOLDER, 0700);
+  mkdir(SDFS_BLOCK_FOLDER, 0700);
+  clearFolder(SDFS_BLOCK_FOLDER);
   clearFolder(SDFS_FOLDER);
 
   // 1. get self ip
@@ -128,6 +131,101 @@ vector<string> split_command_line_argument(string line, int arg_count) {
   return commands;
 }
 
+// a comma separated replica chain, as the master sends it
+vector<string> splitReplicas(const string& line) {
+  vector<string> replicas;
+  std::istringstream chain(line);
+  for (string hop; getline(chain, hop, ',');) {
+    if (!hop.empty())
+      replicas.push_back(hop);
+  }
+  return replicas;
+}
+
+// the chunks of one client PUT or GET, moved by PARALLEL_CHUNKS threads at once
+struct chunkTransfer {
+  string localfilename;
+  string sdfsfilename;
+  string requestId;
+  int version;
+  vector<vector<string>> replicas;  // replicas of chunk i
+  std::atomic<int> next;            // next chunk a thread takes
+  vector<int> done;                 // PUT: replicas that stored chunk i, GET: 1 once chunk i is in
+  std::atomic<long> sentBytes;      // PUT: content sent, the blocks replicas lacked
+};
+
+// offer the blocks of each chunk of the local file to its replica chain and stream down
+// the ones some replica lacks
+void* putChunks(void* arg) {
+  chunkTransfer* t = (chunkTransfer*) arg;
+  FILE* fp = fopen(t->localfilename.c_str(), "r");
+  struct stat st;
+  if (fp == NULL || fstat(fileno(fp), &st) != 0)
+    st.st_size = 0;
+  for (int i; fp != NULL && (i = t->next++) < (int) t->replicas.size();) {
+    long offset = (long) i * SDFS_CHUNK_SIZE;
+    long len = std::max(0L, std::min((long) SDFS_CHUNK_SIZE, (long) st.st_size - offset));
+    vector<blockRef> blocks = splitFileBlocks(fileno(fp), offset, len);
+
+    int chainfd = openPutChain(t->requestId, chunkName(t->sdfsfilename, i), t->version, t->replicas[i]);
+    if (chainfd == -1)
+      continue;
+    struct timeval tv = {30, 0};
+    setsockopt(chainfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // [hash] [size]\n
+    // [content]
+    // per wanted block, sendfile'd from the local file with no copy through this process
+    set<string> wanted;
+    bool sent = offerBlocks(chainfd, blocks, wanted);
+    for (size_t b = 0; sent && b < blocks.size(); ++b) {
+      if (wanted.erase(blocks[b].hash) == 0)
+        continue;
+      string frame = blocks[b].hash + " " + to_string(blocks[b].size) + "\n";
+      sent = sendAll(chainfd, frame.c_str(), frame.size()) &&
+             sendFileRange(chainfd, fileno(fp), offset + blocks[b].offset, blocks[b].size) == blocks[b].size;
+      if (sent)
+        t->sentBytes += blocks[b].size;
+    }
+    shutdown(chainfd, SHUT_WR);
+    t->done[i] = sent ? waitPutChainAck(chainfd) : 0;
+    close(chainfd);
+  }
+  if (fp != NULL)
+    fclose(fp);
+  return NULL;
+}
+
+// read chunks from their replicas into their place in the local file
+void* getChunks(void* arg) {
+  chunkTransfer* t = (chunkTransfer*) arg;
+  FILE* fp = fopen(t->localfilename.c_str(), "r+");
+  for (int i; fp != NULL && (i = t->next++) < (int) t->replicas.size();) {
+    // start each chunk at a different replica, so neighbouring chunks that share
+    // replicas are still read from different nodes
+    vector<string> replicas = t->replicas[i];
+    if (!replicas.empty())
+      std::rotate(replicas.begin(), replicas.begin() + i % replicas.size(), replicas.end());
+    fseek(fp, (long) i * SDFS_CHUNK_SIZE, SEEK_SET);
+    t->done[i] = fetchChunk(replicas, chunkName(t->sdfsfilename, i), t->version, fp);
+  }
+  if (fp != NULL)
+    fclose(fp);
+  return NULL;
+}
+
+// run `transfer` on every chunk of `t`, a few chunks (on different replicas) at a time
+void moveChunks(chunkTransfer& t, void* (*transfer)(void*)) {
+  t.next = 0;
+  t.sentBytes = 0;
+  t.done.assign(t.replicas.size(), 0);
+  vector<pthread_t> tids(std::min((int) t.replicas.size(), PARALLEL_CHUNKS));
+  for (pthread_t& tid : tids)
+    pthread_create(&tid, NULL, transfer, &t);
+  for (pthread_t tid : tids)
+    pthread_join(tid, NULL);
+}
+
 void sdfsClientRequestHandler(string line) {
   if (line == "")
     return;
@@ -155,37 +253,96 @@ void sdfsClientRequestHandler(string line) {
     string localfilename = commands[1];
     string sdfsfilename = commands[2];
     fprintf(stderr, "===== PUT %s to %s =====\n", localfilename.c_str(), sdfsfilename.c_str());
+    if (!validSdfsName(sdfsfilename)) {
+      fprintf(stdout, "SDFS file names cannot contain '#'\n");
+      close(masterSocket);
+      return;
+    }
 
-    // open the file to be put
-    FILE* fp = fopen(localfilename.c_str(), "r");
-    if (fp == NULL) {
+    // the file to be put
+    struct stat st;
+    if (stat(localfilename.c_str(), &st) != 0) {
       fprintf(stderr, "%s Not Found\n", localfilename.c_str());
       close(masterSocket);
       return;
     }
+    int chunks = chunkCount(st.st_size);
 
-    // send PUT request to master in the format:
+    // ask master where the chunks go in the format:
     // PUT\n
     // [remote file name]\n
-    // [file content]
-    string msg = "PUT\n" + sdfsfilename + "\n";
+    // [number of chunks]\n
+    string msg = "PUT\n" + sdfsfilename + "\n" + to_string(chunks) + "\n";
     send(masterSocket, msg.c_str(), msg.size(), 0);
-    sendFileContent(fp, masterSocket);
     shutdown(masterSocket, SHUT_WR);
 
-    // receive message and requested file content in the format:
+    // receive the replica chains in the format:
     // OK\n
+    // [requestId]\n
+    // [version]\n
+    // [replica chain of chunk 0, comma separated]\n
+    // ...
+    string reply;
     char recv_buffer[BUFFER_SIZE] = {0};
-    int recvret = recv(masterSocket, recv_buffer, BUFFER_SIZE, 0);
+    int recvret;
+    while ((recvret = recv(masterSocket, recv_buffer, BUFFER_SIZE, 0)) > 0)
+      reply.append(recv_buffer, recvret);
     shutdown(masterSocket, SHUT_RD);
 
-    if (recvret > 0) {
-      fprintf(stdout, "%s PUT Succeeded\n", sdfsfilename.c_str());
-    } else {
+    chunkTransfer put;
+    put.localfilename = localfilename;
+    put.sdfsfilename = sdfsfilename;
+    std::istringstream lines(reply);
+    string status, version;
+    getline(lines, status);
+    getline(lines, put.requestId);
+    getline(lines, version);
+    put.version = atoi(version.c_str());
+    for (string chain; getline(lines, chain);)
+      put.replicas.push_back(splitReplicas(chain));
+
+    if (status != "OK" || (int) put.replicas.size() != chunks) {
       fprintf(stdout, "Request timed out, please try again\n");
+      close(masterSocket);
+      return;
     }
 
-    fclose(fp);
+    // stream every chunk down its chain, each replica stores and forwards it piece by piece
+    moveChunks(put, putChunks);
+    int fewest = REPLICA_COUNT;
+    bool stored = true;
+    for (int i = 0; i < chunks; ++i) {
+      fewest = std::min(fewest, put.done[i]);
+      stored = stored && put.done[i] > 0 && put.done[i] >= std::min(W, (int) put.replicas[i].size());
+    }
+
+    // the version becomes readable once the master hears every chunk is stored:
+    // COMMIT\n
+    // [remote file name]\n
+    // [version]
+    bool committed = false;
+    if (stored) {
+      pthread_mutex_lock(&masterIp_lock);
+      int commitSocket = TCP_connect(g_MasterIp.c_str(), std::stoi(MASTER_PORT));
+      pthread_mutex_unlock(&masterIp_lock);
+      setsockopt(commitSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      string commit = "COMMIT\n" + sdfsfilename + "\n" + version;
+      send(commitSocket, commit.c_str(), commit.size(), 0);
+      shutdown(commitSocket, SHUT_WR);
+      char ok[3] = {0};
+      committed = recv(commitSocket, ok, 3, MSG_WAITALL) == 3 && strncmp(ok, "OK\n", 3) == 0;
+      close(commitSocket);
+    }
+
+    if (committed) {
+      fprintf(stdout, "%s PUT Succeeded (%d chunks, %d+ replicas each, sent %ld of %ld bytes)\n",
+        sdfsfilename.c_str(), chunks, fewest, (long) put.sentBytes, (long) st.st_size);
+    } else if (stored) {
+      fprintf(stdout, "%s PUT stored but not committed, please try again\n", sdfsfilename.c_str());
+    } else {
+      fprintf(stdout, "%s PUT reached only %d replicas for some chunk, please try again\n", sdfsfilename.c_str(),
+        fewest);
+    }
   } 
   
   //===============================
@@ -203,36 +360,63 @@ void sdfsClientRequestHandler(string line) {
     string localfilename = commands[2];
     fprintf(stderr, "===== GET %s to %s =====\n", sdfsfilename.c_str(), localfilename.c_str());
 
-    // send GET request to master in the format:
-    // GET\n
+    // ask master where the file is in the format:
+    // LOOKUP\n
     // [remote file name]
-    string msg = "GET\n" + sdfsfilename;
+    string msg = "LOOKUP\n" + sdfsfilename;
     send(masterSocket, msg.c_str(), msg.size(), 0);
     shutdown(masterSocket, SHUT_WR);
 
-    // receive message and requested file content in the format
+    // receive the latest version and the replicas of its chunks in the format
     // 1. OK\n
-    //    [remote file content]
+    //    [latest version]\n
+    //    [number of chunks]\n
+    //    [replicas of chunk 0, comma separated]\n
+    //    ...
     // 2. NOTFOUND\n
     //    [remote file name]
+    string reply;
     char recv_buffer[BUFFER_SIZE] = {0};
-    int recvret = recv(masterSocket, recv_buffer, 3, 0);
+    int recvret;
+    while ((recvret = recv(masterSocket, recv_buffer, BUFFER_SIZE, 0)) > 0)
+      reply.append(recv_buffer, recvret);
+    shutdown(masterSocket, SHUT_RD);
 
-    if (recvret > 0) {
-      if (string(recv_buffer) == "OK\n") {
-        // receive the file
-        FILE * fp = fopen(localfilename.c_str(), "w+");
-        receiveFileContent(fp, masterSocket);
-        fclose(fp);
-        fprintf(stdout, "%s Get Succeeded\n", sdfsfilename.c_str());
-      } else {
-        fprintf(stdout, "%s Not Found\n", sdfsfilename.c_str());
-      }
-    } else {
+    chunkTransfer get;
+    get.localfilename = localfilename;
+    get.sdfsfilename = sdfsfilename;
+    std::istringstream lines(reply);
+    string status, version, chunks;
+    getline(lines, status);
+    getline(lines, version);
+    getline(lines, chunks);
+    get.version = atoi(version.c_str());
+    for (string replicas; getline(lines, replicas);)
+      get.replicas.push_back(splitReplicas(replicas));
+
+    if (reply.empty()) {
       fprintf(stdout, "Request timed out, please try again\n");
+    } else if (status != "OK" || (int) get.replicas.size() != atoi(chunks.c_str())) {
+      fprintf(stdout, "%s Not Found\n", sdfsfilename.c_str());
+    } else {
+      FILE * fp = fopen(localfilename.c_str(), "w");
+      if (fp == NULL) {
+        fprintf(stderr, "%s cannot be written\n", localfilename.c_str());
+        close(masterSocket);
+        return;
+      }
+      fclose(fp);
+
+      // read the chunks straight from their replicas, several at once; when a replica
+      // breaks off mid-chunk the next picks up from the bytes already written
+      moveChunks(get, getChunks);
+      int missing = std::count(get.done.begin(), get.done.end(), 0);
+      if (missing == 0)
+        fprintf(stdout, "%s Get Succeeded (%zu chunks)\n", sdfsfilename.c_str(), get.replicas.size());
+      else
+        fprintf(stdout, "%s Get failed, no replica could serve %d chunks of version %s\n", sdfsfilename.c_str(),
+          missing, version.c_str());
     }
-  
-    shutdown(masterSocket, SHUT_RD);
   } 
 
   //=====================
@@ -320,9 +504,11 @@ void sdfsClientRequestHandler(string line) {
   //=======================================
   else if (line == "store") {
     fprintf(stdout, "===== STORE =====\n");
+    pthread_mutex_lock(&versions_lock);
     for (auto tup : localFileVersions) {
       cout << tup.first << endl;
     }
+    pthread_mutex_unlock(&versions_lock);
   }
 
   //=======================================================
@@ -397,6 +583,9 @@ void sdfsClientHandler() {
 
 /* entry point of the entire program */
 int main(int argc, char **argv) {
+  // a peer that dies mid-sendfile/splice is an error on that transfer, not the end of the node
+  signal(SIGPIPE, SIG_IGN);
+
   //=================
   // init a SDFS node
   //=================
@@ -18,7 +18,9 @@
 #include <stdbool.h>
 #include <sys/stat.h>
 #include <dirent.h> 
+#include <signal.h>
 
+#include <atomic>
 #include <vector>
 #include <utility>
 #include <tuple>
@@ -40,6 +42,7 @@ using std::pair;
 using std::tuple;
 using std::string;
 using std::set;
+using std::multiset;
 using std::map;
 using std::cout;
 using std::cerr;
@@ -58,9 +61,31 @@ using std::endl;
 #define W 3
 #define R 2
 #define REPLICA_COUNT 4
+#define PIPELINE_CHUNK 65536        // PUT data moves down the replica chain in pieces this big
+#define SDFS_CHUNK_SIZE (64L * 1024 * 1024)  // files are split into chunks this big, each placed on its own
+#define PARALLEL_CHUNKS 4           // chunks a client moves at once
+#define SDFS_BLOCK_FOLDER SDFS_FOLDER "/blocks"  // content blocks, one file each, named by hash
+#define BLOCK_MIN_SIZE (16 * 1024)  // content-defined blocks are at least this big,
+#define BLOCK_MAX_SIZE (256 * 1024) // at most this big,
+#define BLOCK_MASK 0xffff000000000000ULL  // and end where the rolling hash has these bits clear: the top
+                                          // 16, which depend on the last 64 bytes (~80 KB on average)
 
 enum actions { LEAVE, JOIN, FAILED };
 
+// a block of a file or chunk: its SHA-256 in hex, where it starts, and its length
+struct blockRef {
+  string hash;
+  long offset;
+  long size;
+};
+
+// freshness of a membership entry: a member bumps its own heartbeat counter every
+// broadcast, the introducer bumps the incarnation when a failed member rejoins
+struct member_version {
+  uint32_t incarnation;
+  uint64_t heartbeat;
+};
+
 //============
 // process.cpp
 //============
@@ -75,6 +100,7 @@ void processDriver(string myIpAddress);
  * 
  * list_mem -- print full membership list
  * neighbor -- list all neighbors of the current process
+ * leave    -- tell every alive member we leave, wait for a majority to acknowledge, then exit
  */
 bool processDebugger(string line);
 
@@ -84,6 +110,12 @@ bool processDebugger(string line);
  */
 string find_alive_target_ip(int p);
 
+/**
+ * Return true if entry (a, act_a) is newer than (b, act_b): higher incarnation, then at the
+ * same incarnation FAILED or LEAVE over JOIN, then higher heartbeat
+ */
+bool member_newer(const member_version& a, actions act_a, const member_version& b, actions act_b);
+
 
 //===============
 // introducer.cpp
@@ -105,6 +137,23 @@ void* introducerDriver(void*);
 void sdfsProcessDriver();
 
 
+/**
+ * Read version `version` of `filename` from the replica at `ip` into `file`, resuming at
+ * byte `received`. Adds what arrived to `received`, sets `size` to the full length of the
+ * file, and returns true once all of it is in; false leaves `received` where the replica
+ * stopped so the caller can resume from another one.
+ */
+bool getFromReplica(const string& ip, const string& filename, int version, FILE* file, long& received,
+                    long& size);
+
+/**
+ * Read version `version` of chunk `name` into `file` at its current position from the
+ * first of `replicas` that can serve it, resuming on the next one when a replica breaks
+ * off. Return false if none could.
+ */
+bool fetchChunk(const vector<string>& replicas, const string& name, int version, FILE* file);
+
+
 //===========
 // master.cpp
 //===========
@@ -114,6 +163,162 @@ void sdfsProcessDriver();
 void* masterDriver(void*);
 
 
+//==============
+// async_log.cpp
+//==============
+struct async_log;
+
+/**
+ * Open `path` (truncated) and start a thread that writes queued lines to it, NULL on error
+ */
+async_log* async_log_open(const char* path);
+
+/**
+ * Queue one line ending in '\n' without blocking, return false if the ring was full
+ * and the line dropped (counted, and noted in the log by the flusher)
+ */
+bool async_log_write(async_log* log, const char* line, size_t len);
+
+/**
+ * Number of lines dropped so far
+ */
+uint64_t async_log_dropped(const async_log* log);
+
+/**
+ * Wait until every line queued before the call is written
+ */
+void async_log_flush(async_log* log);
+
+/**
+ * Write out what is queued, stop the flusher and close the file
+ */
+void async_log_close(async_log* log);
+
+
+//=============
+// transfer.cpp
+//=============
+/**
+ * Send `len` bytes of `filefd` starting at `offset` to `sockfd` (to the end of the file
+ * if `len` < 0), with sendfile. Return how many were sent, fewer if the peer went away.
+ */
+long sendFileRange(int sockfd, int filefd, off_t offset, long len);
+
+/**
+ * Receive from `sockfd` into `filefd` at `offset` until `len` bytes arrived (until the
+ * peer shuts down if `len` < 0), with splice. Return how many were written; `complete`
+ * (may be NULL) tells whether the transfer ended as it should rather than broke off.
+ */
+long receiveFileRange(int sockfd, int filefd, off_t offset, long len, bool* complete);
+
+/**
+ * Receive `len` bytes from `upstream` (until it shuts down if `len` < 0), storing them
+ * in `filefd` (-1 for nowhere) from `offset` on and forwarding them to `downstream` (-1
+ * for none) as they arrive, with splice and tee. A downstream that breaks is closed and
+ * set to -1, and `written` says whether the file got all of it. Return false if
+ * upstream broke off.
+ */
+bool relayFileContent(int upstream, int filefd, off_t offset, long len, int& downstream, bool& written);
+
+/* TCP send all content in file from its position to destfd, return false if the peer went away
+ * caller should take care of closing file and shutdown write to destfd
+ */
+bool sendFileContent(FILE* file, int destfd);
+
+/* TCP receive all content from destfd to file at its position, return the bytes received
+ * caller should take care of closing file and shutdown read to destfd
+ */
+long receiveFileContent(FILE* file, int destfd);
+
+/**
+ * Connect to the first reachable replica of `chain` and send it the header of a PUT of
+ * `filename` as `version` that it forwards down the rest of the chain, return the socket
+ * or -1 if no replica is reachable. The caller offers the blocks with offerBlocks, sends
+ * the wanted ones, shuts down writing and waits for waitPutChainAck.
+ */
+int openPutChain(const string& requestId, const string& filename, int version, const vector<string>& chain);
+
+/**
+ * Send the block list of a PUT down the chain at `fd` and read back into `wanted` the
+ * blocks some replica of it lacks, each to be sent as "[hash] [size]\n[content]".
+ * Return false if the chain broke off.
+ */
+bool offerBlocks(int fd, const vector<blockRef>& blocks, set<string>& wanted);
+
+/**
+ * Read the ack of a PUT chain from `fd`: the number of replicas that stored the file,
+ * 0 if the ack never came
+ */
+int waitPutChainAck(int fd);
+
+
+//==========
+// dedup.cpp
+//==========
+/**
+ * SHA-256 of `len` bytes at `data`, as 64 hex digits
+ */
+string sha256Hex(const unsigned char* data, size_t len);
+
+/**
+ * Return true if the file `fd` is exactly `size` bytes whose SHA-256 is `hash`
+ */
+bool blockMatches(int fd, const string& hash, long size);
+
+/**
+ * Length of the content-defined block starting at `data`; `len` is what is left of the
+ * content, or at least BLOCK_MAX_SIZE of it
+ */
+size_t blockBoundary(const unsigned char* data, size_t len);
+
+/**
+ * Cut `len` bytes at `data` into content-defined blocks
+ */
+vector<blockRef> splitBlocks(const unsigned char* data, size_t len);
+
+/**
+ * Cut `len` bytes of `fd` from `offset` on into content-defined blocks, offsets relative
+ * to `offset`
+ */
+vector<blockRef> splitFileBlocks(int fd, off_t offset, long len);
+
+/**
+ * Path block `hash` is stored at on this node
+ */
+string blockPath(const string& hash);
+
+/**
+ * Take a reference on every block of `blocks` (one per occurrence) so none is removed,
+ * and return the distinct ones this node does not store yet
+ */
+vector<string> pinBlocks(const vector<blockRef>& blocks);
+
+/**
+ * Drop the references pinBlocks took, removing blocks no manifest or PUT uses any more
+ */
+void unpinBlocks(const vector<blockRef>& blocks);
+
+/**
+ * Write the manifest of a version, one "hash size" line per block, to `path`
+ */
+bool writeManifest(const string& path, const vector<blockRef>& blocks);
+
+/**
+ * Read the manifest at `path` into `blocks`, with offsets, return false if there is none
+ */
+bool readManifest(const string& path, vector<blockRef>& blocks);
+
+/**
+ * Length of the content `blocks` make up
+ */
+long blocksSize(const vector<blockRef>& blocks);
+
+/**
+ * Send the content `blocks` make up from byte `offset` on to `sockfd`, return the bytes sent
+ */
+long sendBlocks(int sockfd, const vector<blockRef>& blocks, long offset);
+
+
 //===========
 // common.cpp
 //===========
@@ -127,11 +332,6 @@ void error(const char *msg);
  */
 string currentTimeString();
 
-/**
- * Convert time string in format `YYYY/MM/DD hh:mm:ss` to time_t
- */
-time_t stringToTime(string t);
-
 /**
  * Create UPD server, return socket fd
  */
@@ -157,12 +357,38 @@ int TCP_connect(const char* host, int port);
  */
 void UDP_send(int sockfd, int port, const char* ip, const char* msg);
 
-/* TCP send all content in file to destfd
- * caller should take care of closing file and shutdown write to destfd
+/**
+ * Whether users may name an SDFS file `name`: it must not contain '#', so no user file
+ * can collide with the chunks of another
  */
-void sendFileContent(FILE* file, int destfd);
+bool validSdfsName(const string& name);
 
-/* TCP receive all content from destfd to file
- * caller should take care of closing file and shutdown read to destfd
+/**
+ * Name chunk `chunk` of `filename` is stored under: the first chunk under the file's own
+ * name, the rest as `filename#chunk`
+ */
+string chunkName(const string& filename, int chunk);
+
+/**
+ * Number of chunks a file of `size` bytes is split into, at least one
+ */
+int chunkCount(long size);
+
+/**
+ * TCP send all `len` bytes of `buf` to destfd, return false if the connection broke
+ */
+bool sendAll(int destfd, const char* buf, size_t len);
+
+/**
+ * Reads lines off a socket that also carries raw content: `pending` holds what was
+ * received past the last line, to be used before reading `fd` again
+ */
+struct lineReader {
+  int fd;
+  string pending;
+};
+
+/**
+ * Read the next line from `in` without its '\n', return false if the connection ended first
  */
-void receiveFileContent(FILE* file, int destfd);
\ No newline at end of file
+bool readLine(lineReader& in, string& line);
@@ -3,21 +3,23 @@
 #define BUFSIZE 1024
 #define PING_ACK_TIMEOUT 2
 #define BROADCAST_UPDATE_INTERVAL 2
+#define LEAVE_RETRY_MS 500        // resend LEAVE to members that have not acknowledged it
+#define LEAVE_TIMEOUT_MS 3000     // exit after this even without a majority of acknowledgements
 
 // global variables that shares between files
-vector<tuple<string, string, actions>> membership_list;    // list of <ip, timestamp, actions>
+vector<tuple<string, member_version, actions>> membership_list;    // list of <ip, version, actions>
 pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t list_cv = PTHREAD_COND_INITIALIZER;
 
 // locally global variables
 static string machine_ip;         // ip of the current machine
-static set<string> ack_set;       // used to keep track of acknowledged machine ip
+static multiset<string> ack_set;  // one ip per ACK received, two monitors may ping the same member
+static set<string> leave_ack_set; // members that acknowledged our LEAVE, under ack_lock
+static bool leaving;              // `leave` was typed, never refute our own LEAVE, under list_lock
 static pthread_mutex_t ack_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t ack_cv = PTHREAD_COND_INITIALIZER;
 static int failureDetectorSocket; // current process socket fd
-static FILE* log_file;
-static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t file_cv = PTHREAD_COND_INITIALIZER;
+static async_log* log_file;       // vm.log, written by its own flusher thread
 
 
 
@@ -39,6 +41,36 @@ string actions_to_string(actions act) {
     return "FAILED";
 }
 
+// within one incarnation a member only goes from JOIN to FAILED or LEAVE, never back, so a
+// stale JOIN with a higher heartbeat cannot undo a failure; only the member can, with a
+// newer incarnation
+bool member_newer(const member_version& a, actions act_a, const member_version& b, actions act_b) {
+  if (a.incarnation != b.incarnation)
+    return a.incarnation > b.incarnation;
+  if ((act_a == JOIN) != (act_b == JOIN))
+    return act_a != JOIN;
+  return a.heartbeat > b.heartbeat;
+}
+
+string version_to_string(const member_version& v) {
+  return to_string(v.incarnation) + "," + to_string(v.heartbeat);
+}
+
+// <ip,incarnation,heartbeat,ACTION>
+string member_to_line(const tuple<string, member_version, actions>& tup) {
+  return std::get<0>(tup) + "," + version_to_string(std::get<1>(tup)) + "," + actions_to_string(std::get<2>(tup));
+}
+
+tuple<string, member_version, actions> line_to_member(char* line) {
+  char* comma1 = strchr(line, ',');
+  *comma1 = '\0';
+  char* end;
+  member_version v;
+  v.incarnation = strtoul(comma1 + 1, &end, 10);
+  v.heartbeat = strtoull(end + 1, &end, 10);
+  return {string(line), v, string_to_actions(end + 1)};
+}
+
 // assume list lock already aquired
 int find_machine_ip_index() {
   // find self location
@@ -73,6 +105,16 @@ string find_alive_target_ip(int p) {
   return "";
 }
 
+// assume list lock already obtained
+// UPDATE message carrying the whole membership list
+string memlist_message() {
+  string msg = "UPDATE\n";
+  for (auto& tup : membership_list) {
+    msg += member_to_line(tup) + "\n";
+  }
+  return msg;
+}
+
 // assume list lock already obtained
 void send_all_neighbor_msg(string msg) {
   for (int i = 1; i <= std::min((int) membership_list.size() - 1, MONITOR_COUNT); ++i) {
@@ -94,27 +136,28 @@ void send_all_neighbor_msg(string msg) {
 }
 
 /**
- * update ip status, log to file if action change, otherwise only update timestamp
+ * update ip status at its current version, log to file if action change
+ * an ack changes nothing: a live member proves itself by bumping its own incarnation
  */ 
 void update_ip_status(string target_ip, actions act) {
-  // get current timestamp
+  if (act == JOIN)
+    return;
+
+  // get current timestamp, for the log only
   string time_str = currentTimeString();
 
-  // find the target_ip and remove from membership list
   pthread_mutex_lock(&list_lock);
   for (int i = 0; i < membership_list.size(); ++i) {
     actions original_act = std::get<2>(membership_list[i]);
 
     if (std::get<0>(membership_list[i]) == target_ip) {
-      // change status
-      membership_list[i] = {target_ip, time_str, act};
+      // change status at the same version, it holds until the member refutes it with a newer incarnation
+      std::get<2>(membership_list[i]) = act;
 
       if (act != original_act) {
         // write to log file
         string log_info = actions_to_string(act) + " " + target_ip + " " + time_str + "\n";
-        pthread_mutex_lock(&file_lock);
-        write(fileno(log_file), log_info.c_str(), log_info.size());
-        pthread_mutex_unlock(&file_lock);
+        async_log_write(log_file, log_info.c_str(), log_info.size());
       }
 
       break;
@@ -127,10 +170,10 @@ void update_ip_status(string target_ip, actions act) {
 }
 
 /**
- * Remove old entry if found, push back the new one
+ * Add the new member, or bump the incarnation of a failed one that rejoined
  * Only invoked in vm1 (introducer)
  */
-void new_process_join(string ip_address, string timestamp) {
+void new_process_join(string ip_address) {
   bool found = false;
   bool status_change = false;
   pthread_mutex_lock(&list_lock);
@@ -139,7 +182,9 @@ void new_process_join(string ip_address, string timestamp) {
       found = true;
       if (std::get<2>(membership_list[i]) != JOIN) {  // target ip rejoined after 20s
         status_change = true;
-        membership_list[i] = {ip_address, timestamp, JOIN}; // update status
+        // a fresh incarnation outranks every heartbeat of the old one
+        member_version v = {std::get<1>(membership_list[i]).incarnation + 1, 0};
+        membership_list[i] = {ip_address, v, JOIN}; // update status
       }
       break;
     }
@@ -147,7 +192,7 @@ void new_process_join(string ip_address, string timestamp) {
   
   if (!found) {
     // push the new member to membership list
-    membership_list.push_back({ip_address, timestamp, JOIN});
+    membership_list.push_back({ip_address, {0, 0}, JOIN});
     // wake up other waiting thread
     pthread_cond_broadcast(&list_cv);
   }
@@ -155,67 +200,161 @@ void new_process_join(string ip_address, string timestamp) {
 
   if (!found || status_change) {
     // write to log file
-    string log_info = "JOIN " + ip_address + " " + timestamp + "\n";
-    pthread_mutex_lock(&file_lock);
-    write(fileno(log_file), log_info.c_str(), log_info.size());
-    pthread_mutex_unlock(&file_lock);
+    string log_info = "JOIN " + ip_address + " " + currentTimeString() + "\n";
+    async_log_write(log_file, log_info.c_str(), log_info.size());
   }
 }
 
 /** 
- * update membership list when needed
+ * update membership list when needed: take every entry the sender has a newer version of,
+ * and refute our own entry by outranking it if someone thinks we are gone
+ * return true if the sender still calls itself JOIN where we hold it FAILED or LEAVE
  */
-void compare_and_update_memlist(const vector<tuple<string, string, actions>>& received_list) {
+bool compare_and_update_memlist(const vector<tuple<string, member_version, actions>>& received_list, const string& sender_ip) {
+  bool sender_behind = false;
   pthread_mutex_lock(&list_lock);
   
   for (int i = 0; i < std::min(received_list.size(), membership_list.size()); ++i) {
     assert(std::get<0>(received_list[i]) == std::get<0>(membership_list[i]));
 
-    // timestamp equal, expect two tuple to be totally the same
-    if (std::get<1>(received_list[i]) == std::get<1>(membership_list[i])) {
+    const member_version& theirs = std::get<1>(received_list[i]);
+    member_version& ours = std::get<1>(membership_list[i]);
+    actions their_act = std::get<2>(received_list[i]);
+    actions our_act = std::get<2>(membership_list[i]);
+
+    // be marked as FAILED or LEAVE while current machine still alive
+    if (std::get<0>(received_list[i]) == machine_ip) {
+      if (!leaving && their_act != JOIN && theirs.incarnation >= ours.incarnation) {
+        // FAILED and LEAVE win within their incarnation, refute with the next one
+        ours.incarnation = theirs.incarnation + 1;
+        ours.heartbeat = std::max(ours.heartbeat, theirs.heartbeat) + 1;
+        std::get<2>(membership_list[i]) = JOIN;
+      } else if (!leaving && their_act == JOIN && member_newer(theirs, their_act, ours, our_act)) {
+        ours.incarnation = theirs.incarnation;
+        ours.heartbeat = theirs.heartbeat + 1;
+      }
       continue;
     }
 
-    std::time_t t1 = stringToTime(std::get<1>(received_list[i]));
-    std::time_t t2 = stringToTime(std::get<1>(membership_list[i]));
-
-    if (t1 > t2) {
-      // only update if action is different
-      if (std::get<2>(received_list[i]) == std::get<2>(membership_list[i])) {
-        continue;
-      }
-
-      // be marked as FAILED or LEAVE while current machine still alive
-      if (std::get<0>(received_list[i]) == machine_ip && std::get<2>(received_list[i]) != JOIN) {
-        // get current timestamp
-        string time_str = currentTimeString();
-        membership_list[i] = {machine_ip, time_str, JOIN};
-        continue;
-      }
+    if (!member_newer(theirs, their_act, ours, our_act)) {
+      if (std::get<0>(received_list[i]) == sender_ip && our_act != JOIN && member_newer(ours, our_act, theirs, their_act))
+        sender_behind = true;
+      continue;
+    }
 
-      // the received_list[i] is newer, update our membership list
-      membership_list[i] = {std::get<0>(received_list[i]), std::get<1>(received_list[i]), std::get<2>(received_list[i])};
+    // the received_list[i] is newer, update our membership list
+    membership_list[i] = received_list[i];
+    if (their_act != our_act) {
       // write to log file
-      string log_info = actions_to_string(std::get<2>(received_list[i])) + " " + std::get<0>(received_list[i]) + " " + std::get<1>(received_list[i]) + "\n";
-      pthread_mutex_lock(&file_lock);
-      write(fileno(log_file), log_info.c_str(), log_info.size());
-      pthread_mutex_unlock(&file_lock);
+      string log_info = actions_to_string(their_act) + " " + std::get<0>(received_list[i]) + " " + currentTimeString() + "\n";
+      async_log_write(log_file, log_info.c_str(), log_info.size());
     }
   }
 
   if (membership_list.size() < received_list.size()) {
     for (int i = membership_list.size(); i < received_list.size(); ++i) {
-      membership_list.push_back({std::get<0>(received_list[i]), std::get<1>(received_list[i]), std::get<2>(received_list[i])});
+      membership_list.push_back(received_list[i]);
       // write to log file
-      string log_info = actions_to_string(std::get<2>(received_list[i])) + " " + std::get<0>(received_list[i]) + " " + std::get<1>(received_list[i]) + "\n";
-      pthread_mutex_lock(&file_lock);
-      write(fileno(log_file), log_info.c_str(), log_info.size());
-      pthread_mutex_unlock(&file_lock);
+      string log_info = actions_to_string(std::get<2>(received_list[i])) + " " + std::get<0>(received_list[i]) + " " + currentTimeString() + "\n";
+      async_log_write(log_file, log_info.c_str(), log_info.size());
+    }
+  }
+  pthread_cond_broadcast(&list_cv);
+
+  pthread_mutex_unlock(&list_lock);
+  return sender_behind;
+}
+
+/**
+ * Take a LEAVE entry sent by the member that is leaving, if it is newer than ours
+ */
+void apply_leave(const tuple<string, member_version, actions>& entry) {
+  pthread_mutex_lock(&list_lock);
+  for (int i = 0; i < membership_list.size(); ++i) {
+    if (std::get<0>(membership_list[i]) != std::get<0>(entry))
+      continue;
+    actions original_act = std::get<2>(membership_list[i]);
+    if (member_newer(std::get<1>(entry), std::get<2>(entry), std::get<1>(membership_list[i]), original_act)) {
+      membership_list[i] = entry;
+      if (original_act != std::get<2>(entry)) {
+        // write to log file
+        string log_info = actions_to_string(std::get<2>(entry)) + " " + std::get<0>(entry) + " " + currentTimeString() + "\n";
+        async_log_write(log_file, log_info.c_str(), log_info.size());
+      }
     }
+    break;
   }
   pthread_cond_broadcast(&list_cv);
+  pthread_mutex_unlock(&list_lock);
+}
 
+/**
+ * Mark ourselves LEAVE with a higher incarnation, send it to every alive member and wait until a
+ * majority acknowledged it (resending every LEAVE_RETRY_MS) or LEAVE_TIMEOUT_MS passed
+ * return how many acknowledged and how many were asked
+ */
+pair<int, int> leave_group() {
+  pthread_mutex_lock(&list_lock);
+  leaving = true;
+  string msg;
+  vector<string> targets;
+  int idx = find_machine_ip_index();
+  if (idx != -1) {
+    member_version& v = std::get<1>(membership_list[idx]);
+    v.incarnation += 1;
+    v.heartbeat += 1;
+    std::get<2>(membership_list[idx]) = LEAVE;
+    msg = "LEAVE\n" + member_to_line(membership_list[idx]) + "\n";
+    for (auto& tup : membership_list) {
+      if (std::get<0>(tup) != machine_ip && std::get<2>(tup) == JOIN)
+        targets.push_back(std::get<0>(tup));
+    }
+  }
   pthread_mutex_unlock(&list_lock);
+
+  string log_info = "LEAVE " + machine_ip + " " + currentTimeString() + "\n";
+  async_log_write(log_file, log_info.c_str(), log_info.size());
+
+  int quorum = targets.size() / 2 + 1;
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += LEAVE_TIMEOUT_MS / 1000;
+  deadline.tv_nsec += (LEAVE_TIMEOUT_MS % 1000) * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+
+  pthread_mutex_lock(&ack_lock);
+  leave_ack_set.clear();
+  while (!targets.empty() && (int) leave_ack_set.size() < quorum) {
+    for (const string& ip : targets) {
+      if (leave_ack_set.count(ip))
+        continue;
+      struct sockaddr_in serveraddr;
+      memset((char *) &serveraddr, 0, sizeof(serveraddr));
+      serveraddr.sin_family = AF_INET;
+      serveraddr.sin_port = htons(std::stoi(COMMUNICATION_PORT));
+      serveraddr.sin_addr.s_addr = inet_addr(ip.c_str());
+      sendto(failureDetectorSocket, msg.c_str(), msg.size(), 0, (struct sockaddr *) &serveraddr, sizeof(serveraddr));
+    }
+
+    struct timespec retry;
+    clock_gettime(CLOCK_REALTIME, &retry);
+    retry.tv_nsec += LEAVE_RETRY_MS * 1000000L;
+    retry.tv_sec += retry.tv_nsec / 1000000000L;
+    retry.tv_nsec %= 1000000000L;
+    if (retry.tv_sec > deadline.tv_sec || (retry.tv_sec == deadline.tv_sec && retry.tv_nsec > deadline.tv_nsec))
+      retry = deadline;
+
+    int rc = 0;
+    size_t acked = leave_ack_set.size();
+    while (rc == 0 && leave_ack_set.size() == acked)
+      rc = pthread_cond_timedwait(&ack_cv, &ack_lock, &retry);
+    if (rc != 0 && retry.tv_sec == deadline.tv_sec && retry.tv_nsec == deadline.tv_nsec)
+      break;
+  }
+  int acked = leave_ack_set.size();
+  pthread_mutex_unlock(&ack_lock);
+  return {acked, (int) targets.size()};
 }
 
 /**
@@ -256,9 +395,10 @@ void* failure_monitor(void* assigned_pos) {
     // alive responded ip will be add to `ack_set` (handled by `ping_ack_update_listener`)
     // check if ack comes back
     pthread_mutex_lock(&ack_lock);
-    int is_alive = (ack_set.find(target_ip) != ack_set.end());
+    auto ack = ack_set.find(target_ip);
+    int is_alive = (ack != ack_set.end());
     if (is_alive) {
-      ack_set.erase(target_ip);
+      ack_set.erase(ack);  // only ours, another monitor may be waiting on the same member
       // cout << target_ip << " alive" << endl;
       update_ip_status(target_ip, JOIN);
     } else {
@@ -286,10 +426,11 @@ void* ping_ack_update_listener(void*) {
     // check the request type: PING, ACK, JOIN or UPDATE, behave coorespondingly
     // if PING, send ACK
     // if ACK, add client ip to `ack_set`
-    // if JOIN, add <ip, timestamp, "JOIN"> to membership list if ip is new 
-    //    otherwise delete old one and pushback new one
+    // if JOIN, add <ip, {0, 0}, "JOIN"> to membership list if ip is new 
+    //    otherwise bump its incarnation
     // if UPDATE, compare and update local membership list, notify `broadcast_list_change`
     //    thread by adding element to `updates`
+    // if LEAVE, take the leaving member's entry and acknowledge it with LEAVE_ACK
 
     if (strstr(buf, "PING") - buf == 0) {
       // ====
@@ -313,23 +454,19 @@ void* ping_ack_update_listener(void*) {
       // ===========
       // JOIN\n
       // IP\n
-      // timestamp\n
       // ===========
-      char* newline1 = strchr(buf + 5, '\n');
-      *newline1 = '\0';
-      char* newline2 = strchr(newline1 + 1, '\n');
-      *newline2 = '\0';
-      char *ip = buf + 5, *time = newline1 + 1;
-      new_process_join(string(ip), string(time));  // only introducer will send JOIN message
+      char* newline = strchr(buf + 5, '\n');
+      *newline = '\0';
+      new_process_join(string(buf + 5));  // only introducer will send JOIN message
 
     } else if (strstr(buf, "UPDATE\n") - buf == 0) {
-      // ====================
+      // ==============================================
       // UPDATE\n
-      // <ip1,t1,ACTION1>\n
-      // <ip2,t2,ACTION2>\n
+      // <ip1,incarnation1,heartbeat1,ACTION1>\n
+      // <ip2,incarnation2,heartbeat2,ACTION2>\n
       // ...
-      // ====================
-      vector<tuple<string, string, actions>> received;
+      // ==============================================
+      vector<tuple<string, member_version, actions>> received;
       string s = string(buf + 7);
       string delimiter = "\n";
 
@@ -338,18 +475,45 @@ void* ping_ack_update_listener(void*) {
         string tmp = s.substr(0, pos);
         char line[tmp.size() + 1];
         strcpy(line, tmp.c_str());
-        char* comma1 = strchr(line, ',');
-        *comma1 = '\0';
-        char* comma2 = strchr(comma1 + 1, ',');
-        *comma2 = '\0';
-
-        char *ip = line, *timestamp = comma1 + 1, *action = comma2 + 1;
-        actions act = string_to_actions(action);
-        received.push_back({string(ip), string(timestamp), act});
+        received.push_back(line_to_member(line));
         s.erase(0, pos + delimiter.length());
       }
 
-      compare_and_update_memlist(received);
+      // nobody gossips to a member marked FAILED, so answer it with our list or it never
+      // learns it has to refute
+      if (compare_and_update_memlist(received, string(inet_ntoa(clientaddr.sin_addr)))) {
+        pthread_mutex_lock(&list_lock);
+        string message = memlist_message();
+        pthread_mutex_unlock(&list_lock);
+        sendto(failureDetectorSocket, message.c_str(), message.size(), 0, (struct sockaddr *) &clientaddr, clientlen);
+      }
+
+    } else if (strstr(buf, "LEAVE\n") - buf == 0) {
+      // =======================================
+      // LEAVE\n
+      // <ip,incarnation,heartbeat,LEAVE>\n
+      // =======================================
+      char* newline = strchr(buf + 6, '\n');
+      if (newline == NULL)
+        continue;
+      *newline = '\0';
+      apply_leave(line_to_member(buf + 6));
+      string message = "LEAVE_ACK\n" + machine_ip + "\n";
+      sendto(failureDetectorSocket, message.c_str(), message.size(), 0, (struct sockaddr *) &clientaddr, clientlen);
+
+    } else if (strstr(buf, "LEAVE_ACK\n") - buf == 0) {
+      // ============
+      // LEAVE_ACK\n
+      // IP\n
+      // ============
+      char* newline = strchr(buf + 10, '\n');
+      if (newline == NULL)
+        continue;
+      *newline = '\0';
+      pthread_mutex_lock(&ack_lock);
+      leave_ack_set.insert(string(buf + 10));
+      pthread_cond_broadcast(&ack_cv);
+      pthread_mutex_unlock(&ack_lock);
 
     } else {
       error("ERROR! action not found!\n");
@@ -366,19 +530,16 @@ void* broadcast_list_updates(void*) {
   while (1) {
     pthread_mutex_lock(&list_lock);
 
-    // update self timestamp before broadcasting memlist to handle edge cases such as
-    // only two vm left in the system and vm2 mark vm1 as failed, and vm1 can proof that it is still alive
+    // bump self heartbeat before broadcasting memlist, so our latest entry replaces the
+    // older JOIN copies others hold
     int idx = find_machine_ip_index();
-    if (idx != -1) {
-      membership_list[idx] = {machine_ip, currentTimeString(), JOIN};
+    if (idx != -1 && !leaving) {
+      ++std::get<1>(membership_list[idx]).heartbeat;
+      std::get<2>(membership_list[idx]) = JOIN;
     }
 
     // send the full membership list to neighors
-    string msg = "UPDATE\n";
-    for (auto& tup : membership_list) {
-      msg += (std::get<0>(tup) + "," + std::get<1>(tup) + "," + actions_to_string(std::get<2>(tup)) + "\n");
-    }
-    send_all_neighbor_msg(msg);
+    send_all_neighbor_msg(memlist_message());
 
     pthread_mutex_unlock(&list_lock);
 
@@ -393,9 +554,10 @@ bool processDebugger(string line) {
     fprintf(stderr, "===== The membership list is as follows =====\n");
     pthread_mutex_lock(&list_lock);
     for (int i = 0; i < membership_list.size(); ++i) {
-      fprintf(stderr, "%d. %s (%s) %s\n", i + 1, 
+      fprintf(stderr, "%d. %s (incarnation %u, heartbeat %llu) %s\n", i + 1, 
         std::get<0>(membership_list[i]).c_str(), 
-        std::get<1>(membership_list[i]).c_str(), 
+        std::get<1>(membership_list[i]).incarnation, 
+        (unsigned long long) std::get<1>(membership_list[i]).heartbeat, 
         actions_to_string(std::get<2>(membership_list[i])).c_str()
       );
     }
@@ -408,6 +570,13 @@ bool processDebugger(string line) {
     return true;
   }
 
+  else if (line == "leave") {
+    pair<int, int> acked = leave_group();
+    fprintf(stderr, "===== Left, %d of %d members acknowledged =====\n", acked.first, acked.second);
+    async_log_flush(log_file);
+    exit(0);
+  }
+
   else if (line == "neighbor") {
     cerr << "======== neighbors =========" << endl;
     pthread_mutex_lock(&list_lock);
@@ -427,7 +596,9 @@ void processDriver(string myIpAddress) {
   machine_ip = myIpAddress;
 
   // create the log file
-  log_file = fopen("vm.log", "w");
+  log_file = async_log_open("vm.log");
+  if (log_file == NULL)
+    error("ERROR opening vm.log");
 
   // Open communication
   // open socket for furthur ping ack and failure detection
@@ -1,14 +1,24 @@
 #include "node.h"
 
+#include <fcntl.h>
+#include <limits.h>
+
 #define BUFFER_SIZE 1024
+#define GET_SEND_TIMEOUT 10   // seconds a reader may stall a GET before the replica gives up
 
 // filename (not including folder) -> set of versions, versions start from 1
 map<string, set<int>> localFileVersions;
+pthread_mutex_t versions_lock = PTHREAD_MUTEX_INITIALIZER;  // PUTs store in their own threads
+
+// filename -> highest version a DELETE removed, guarded by versions_lock: a PUT chain the
+// master placed before the DELETE but that finishes after it is refused, not stored
+map<string, int> deletedVersions;
 
 // map of filename to set of machines' ip addresses
 map<string, set<string>> replica_map;        
+pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;  // the master's workers and the metadata updates share it
 
-extern vector<tuple<string, string, actions>> membership_list;    // list of <ip, timestamp, actions>
+extern vector<tuple<string, member_version, actions>> membership_list;    // list of <ip, version, actions>
 extern pthread_mutex_t list_lock;
 extern pthread_cond_t list_cv;
 extern string g_MyIp;
@@ -38,15 +48,254 @@ int latestVersion(string filename) {
     return *(--localFileVersions[filename].end());
 }
 
+// highest deleted version of `name` or of the file it is a chunk of, 0 if none
+// assume versions_lock aquired
+int deletedThrough(const string& name) {
+  auto it = deletedVersions.find(name);
+  int through = it == deletedVersions.end() ? 0 : it->second;
+  size_t hash = name.rfind('#');
+  if (hash != string::npos && (it = deletedVersions.find(name.substr(0, hash))) != deletedVersions.end())
+    through = std::max(through, it->second);
+  return through;
+}
+
 // return string example: "SDFS_FOLDER/filename_v1"
 string makeFileVersionPath(string filename, int version) {
   return string(SDFS_FOLDER) + "/" + filename + "_v" +  to_string(version);
 }
 
+// parse a "[hash] [size]" line, the hash 64 hex digits as it becomes a file name
+static bool parseBlockLine(const string& line, string& hash, long& size) {
+  char hex[65];
+  if (sscanf(line.c_str(), "%64[0-9a-f] %ld", hex, &size) != 2 || strlen(hex) != 64 || size < 0)
+    return false;
+  hash = hex;
+  return true;
+}
+
+// read `filename` at `version` from the replica at `ip` into `file`, starting at byte
+// `received`; counts what arrives into `received` and learns the full `size`
+bool getFromReplica(const string& ip, const string& filename, int version, FILE* file, long& received,
+                    long& size) {
+  int fd = TCP_connect(ip.c_str(), std::stoi(SDFS_NODE_PORT));
+  if (fd < 0)
+    return false;
+
+  // a replica that stops sending is as gone as one that hangs up
+  struct timeval tv;
+  tv.tv_sec = 10;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // [requestId]\n
+  // GET\n
+  // [filename]\n
+  // [version]\n
+  // [offset]
+  string msg = "0\nGET\n" + filename + "\n" + to_string(version) + "\n" + to_string(received);
+  send(fd, msg.c_str(), msg.size(), 0);
+  shutdown(fd, SHUT_WR);
+
+  // [requestId]\n
+  // OK\n
+  // [size]\n
+  // [content from offset]
+  // read the header a byte at a time so none of the content is taken with it
+  string header;
+  int lines = 0;
+  char c;
+  while (lines < 3 && recv(fd, &c, 1, 0) == 1) {
+    header += c;
+    if (c == '\n')
+      ++lines;
+    if (lines == 2 && header.find("\nOK\n") == string::npos)
+      break;
+  }
+  size_t ok = header.find("\nOK\n");
+  if (lines < 3 || ok == string::npos) {
+    close(fd);
+    return false;
+  }
+  size = atol(header.c_str() + ok + 4);
+
+  // spliced straight into the file at its position, which then moves past the content
+  fflush(file);
+  off_t at = ftell(file);
+  long got = receiveFileRange(fd, fileno(file), at, size - received, NULL);
+  fseek(file, at + got, SEEK_SET);
+  received += got;
+  close(fd);
+  return received == size;
+}
+
+// read chunk `name` at `version` from the first replica that can serve it, resuming on
+// the next one at the byte where the last broke off
+bool fetchChunk(const vector<string>& replicas, const string& name, int version, FILE* file) {
+  long received = 0, size = -1;
+  for (size_t i = 0; i < replicas.size(); ++i) {
+    if (getFromReplica(replicas[i], name, version, file, received, size))
+      return true;
+    fprintf(stderr, "[get] %s stopped at %ld bytes of %s, trying the next replica\n", replicas[i].c_str(), received,
+      name.c_str());
+  }
+  return false;
+}
+
+// a PUT received from upstream, `head` is what came with its header
+struct putChainRequest {
+  int upstream;
+  string requestId;
+  string filename;
+  int version;          // given by the master, so every replica numbers the PUT alike
+  vector<string> chain;
+  string head;
+};
+
+// store one PUT: learn its blocks, ask upstream for the ones missing here and down the
+// chain, store and forward them as they arrive, then ack upstream once the rest of the
+// chain has acked
+void* putChainHandler(void* arg) {
+  putChainRequest* req = (putChainRequest*) arg;
+  lineReader in = {req->upstream, req->head};
+
+  // [number of blocks]\n
+  // [hash] [size]\n  per block
+  vector<blockRef> blocks;
+  string line, h;
+  long size, offset = 0;
+  bool listed = readLine(in, line);
+  for (long count = listed ? atol(line.c_str()) : 0; listed && count > 0; --count) {
+    listed = readLine(in, line) && parseBlockLine(line, h, size);
+    blocks.push_back({h, offset, size});
+    offset += size;
+  }
+  if (!listed) {
+    close(req->upstream);
+    delete req;
+    return NULL;
+  }
+
+  // pinned until the version is stored or given up, so no DELETE takes them meanwhile
+  vector<string> missing = pinBlocks(blocks);
+  set<string> needed(missing.begin(), missing.end());
+  set<string> forwarded;
+  int downstream = openPutChain(req->requestId, req->filename, req->version, req->chain);
+  if (downstream != -1 && !offerBlocks(downstream, blocks, forwarded)) {
+    close(downstream);
+    downstream = -1;
+  }
+
+  // [requestId]\n
+  // WANT\n
+  // [number of blocks]\n
+  // [hash]\n  per block this replica or one after it lacks
+  set<string> wanted(needed);
+  wanted.insert(forwarded.begin(), forwarded.end());
+  string msg = req->requestId + "\nWANT\n" + to_string(wanted.size()) + "\n";
+  for (const string& h : wanted)
+    msg += h + "\n";
+  bool stored = sendAll(req->upstream, msg.c_str(), msg.size());
+
+  // [hash] [size]\n
+  // [content]
+  // per wanted block until upstream shuts down: spliced into the block store if this
+  // replica lacks it, tee'd on if the next one does; a next replica that dies drops out
+  long newBytes = 0;
+  int newBlocks = 0;
+  while (stored && readLine(in, line)) {
+    if (!parseBlockLine(line, h, size)) {
+      stored = false;
+      break;
+    }
+    int none = -1;
+    bool forward = downstream != -1 && forwarded.count(h) > 0;
+    int& next = forward ? downstream : none;
+    line += "\n";
+    if (forward && !sendAll(next, line.c_str(), line.size())) {
+      close(next);
+      next = -1;
+    }
+    string tempPath = blockPath(h) + ".put" + req->requestId;
+    int f = needed.count(h) > 0 ? open(tempPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+
+    // what readLine took past the frame header, then the rest straight from the socket
+    size_t early = std::min(in.pending.size(), (size_t) size);
+    bool ok = true;
+    if (early > 0) {
+      ok = f == -1 || pwrite(f, in.pending.data(), early, 0) == (ssize_t) early;
+      if (next != -1 && !sendAll(next, in.pending.data(), early)) {
+        close(next);
+        next = -1;
+      }
+      in.pending.erase(0, early);
+    }
+    bool written;
+    stored = relayFileContent(in.fd, f, early, size - early, next, written);
+    if (f != -1) {
+      // named by hash only once whole and hashed again here, so a GET never reads half a
+      // block and bytes garbled on the way (or changed under the client) never take the
+      // name of a block other versions share
+      bool matches = ok && stored && (written || size == early) && blockMatches(f, h, size);
+      if (!matches && ok && stored)
+        cerr << "[put] block " << h << " of " << req->filename << " does not match its hash, dropped" << endl;
+      if (close(f) == 0 && matches && rename(tempPath.c_str(), blockPath(h).c_str()) == 0) {
+        needed.erase(h);
+        newBytes += size;
+        ++newBlocks;
+      } else {
+        unlink(tempPath.c_str());
+      }
+    }
+  }
+  shutdown(req->upstream, SHUT_RD);
+
+  // the version is the list of its blocks, stored once every block is here
+  int count = 0;
+  string tempPath = string(SDFS_FOLDER) + "/" + req->filename + ".put" + req->requestId;
+  if (needed.empty() && writeManifest(tempPath, blocks)) {
+    pthread_mutex_lock(&versions_lock);
+    int version = req->version > 0 ? req->version : latestVersion(req->filename) + 1;
+    string versionPath = makeFileVersionPath(req->filename, version);
+    bool deleted = version <= deletedThrough(req->filename);
+    // a retried PUT, or a new master numbering the file again, replaces the manifest
+    // stored under this version; its blocks are released with it
+    vector<blockRef> replaced;
+    bool replacing = localFileVersions[req->filename].count(version) > 0 && readManifest(versionPath, replaced);
+    if (!deleted && rename(tempPath.c_str(), versionPath.c_str()) == 0) {
+      localFileVersions[req->filename].insert(version);
+      if (replacing)
+        unpinBlocks(replaced);
+      count = 1;
+    }
+    pthread_mutex_unlock(&versions_lock);
+  }
+  if (count == 0) {
+    unlink(tempPath.c_str());
+    unpinBlocks(blocks);
+  }
+  cout << "[put] " << req->filename << " v" << req->version << (count ? " stored, " : " not stored, ") << newBlocks
+       << " of " << blocks.size() << " blocks new (" << newBytes << " of " << blocksSize(blocks) << " bytes)" << endl;
+
+  if (downstream != -1) {
+    shutdown(downstream, SHUT_WR);
+    count += waitPutChainAck(downstream);
+    close(downstream);
+  }
+
+  // [requestId]\n
+  // OK\n
+  // [replicas that stored the file, this one and the rest of the chain]\n
+  msg = req->requestId + "\nOK\n" + to_string(count) + "\n";
+  sendAll(req->upstream, msg.c_str(), msg.size());
+  close(req->upstream);
+  delete req;
+  return NULL;
+}
+
 bool checkMasterHasFailed(string masterIp) {
   bool res = false;
   pthread_mutex_lock(&list_lock);
-  for (tuple<string, string, actions>& tup : membership_list) {
+  for (tuple<string, member_version, actions>& tup : membership_list) {
     if (std::get<0>(tup) == masterIp && std::get<2>(tup) != JOIN) {
       res = true;
       break;
@@ -260,6 +509,134 @@ void* leaderElection(void*) {
   }
 }
 
+// GET\n
+// [filename]\n
+// [version]\n
+// [offset]
+// version and offset are optional: without them the latest version is sent
+// whole, with them a client resumes a transfer another replica broke off
+void serveGet(int client_fd, const string& requestId, const string& request) {
+  vector<string> fields;
+  std::istringstream lines(request);
+  for (string field; getline(lines, field);)
+    fields.push_back(field);
+  if (fields.empty())
+    return;
+
+  string filename = fields[0];
+  int version = fields.size() > 1 ? atoi(fields[1].c_str()) : 0;
+  long offset = fields.size() > 2 ? atol(fields[2].c_str()) : 0;
+
+  // the version's blocks are pinned while they are sent, so a DELETE meanwhile
+  // does not pull them from under the GET
+  vector<blockRef> blocks;
+  pthread_mutex_lock(&versions_lock);
+  if (version <= 0)
+    version = latestVersion(filename);
+  bool stored = localFileVersions.find(filename) != localFileVersions.end() &&
+                localFileVersions[filename].count(version) > 0 &&
+                readManifest(makeFileVersionPath(filename, version), blocks);
+  if (stored)
+    pinBlocks(blocks);
+  pthread_mutex_unlock(&versions_lock);
+
+  long size = blocksSize(blocks);
+  if (!stored || offset > size) {
+    // [requestId]\n
+    // NOTFOUND\n
+    string msg = requestId + "\nNOTFOUND\n";
+    send(client_fd, msg.c_str(), msg.size(), 0);
+  } else {
+    // [requestId]\n
+    // OK\n
+    // [size]\n
+    // [content from offset]
+    string msg = requestId + "\nOK\n" + to_string(size) + "\n";
+    send(client_fd, msg.c_str(), msg.size(), 0);
+    sendBlocks(client_fd, blocks, offset);
+  }
+  if (stored)
+    unpinBlocks(blocks);
+}
+
+// GET-VERSIONS\n
+// [filename]\n
+// [num-versions]
+void serveGetVersions(int client_fd, const string& requestId, const string& request) {
+  size_t newline = request.find('\n');
+  if (newline == string::npos)
+    return;
+  string filename = request.substr(0, newline);
+  int numVersions = atoi(request.c_str() + newline + 1);
+
+  // the manifests of the latest `numVersions`, their blocks pinned while sent
+  vector<vector<blockRef>> versions;
+  pthread_mutex_lock(&versions_lock);
+  if (localFileVersions.find(filename) != localFileVersions.end()) {
+    set<int>& stored = localFileVersions[filename];
+    for (auto it = stored.rbegin(); it != stored.rend() && (int) versions.size() < numVersions; ++it) {
+      vector<blockRef> blocks;
+      if (readManifest(makeFileVersionPath(filename, *it), blocks)) {
+        pinBlocks(blocks);
+        versions.push_back(blocks);
+      }
+    }
+  }
+  pthread_mutex_unlock(&versions_lock);
+
+  if (versions.empty()) {
+    // [requestId]\n
+    // OK\n
+    // FILE NOT FOUND
+    string msg = requestId + "\nOK\n" + "FILE NOT FOUND";
+    send(client_fd, msg.c_str(), msg.size(), 0);
+  } else {
+    // [requestId]\n
+    // OK\n
+    // [content]
+    string msg = requestId + "\nOK\n";
+    send(client_fd, msg.c_str(), msg.size(), 0);
+
+    for (size_t i = 1; i <= versions.size(); ++i) {
+      char versionDelimiters[128] = {0};
+      sprintf(versionDelimiters, "----------------------------\n-----%zust Latest Version-----\n----------------------------\n\n", i);
+      if (!sendAll(client_fd, versionDelimiters, strlen(versionDelimiters)))
+        break;
+      sendBlocks(client_fd, versions[i - 1], 0);
+    }
+  }
+  for (const vector<blockRef>& blocks : versions)
+    unpinBlocks(blocks);
+}
+
+// a GET or GET-VERSIONS, `request` is what follows its command line
+struct getRequest {
+  int client;
+  string requestId;
+  bool versions;        // GET-VERSIONS
+  string request;
+};
+
+// serve one GET or GET-VERSIONS on its own thread: the reader sets the pace, so a slow one
+// must not hold up the PEEKs, PUTs and DELETEs behind it, and one that stalls for
+// GET_SEND_TIMEOUT seconds is given up on
+void* getHandler(void* arg) {
+  getRequest* req = (getRequest*) arg;
+  struct timeval tv;
+  tv.tv_sec = GET_SEND_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(req->client, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if (req->versions)
+    serveGetVersions(req->client, req->requestId, req->request);
+  else
+    serveGet(req->client, req->requestId, req->request);
+
+  close(req->client);
+  delete req;
+  return NULL;
+}
+
 void* sdfsCommandHandler(void*) {
   int serverSocket = TCP_server(SDFS_NODE_PORT);
 
@@ -286,31 +663,19 @@ void* sdfsCommandHandler(void*) {
     string requestId = string(buffer);
     char* fullRequest = IdLinebreak + 1;
     
-    // GET\n
-    // [filename]
-    if (strncmp(fullRequest, "GET\n", 4) == 0) {
+    // GET\n or GET-VERSIONS\n, served by getHandler
+    if (strncmp(fullRequest, "GET\n", 4) == 0 || strncmp(fullRequest, "GET-VERSIONS\n", 13) == 0) {
       shutdown(client_fd, SHUT_RD);
-
-      string filename = string(fullRequest + 4);
-      string fileWithVersionPath = makeFileVersionPath(filename, latestVersion(filename));
-
-      FILE* f = fopen(fileWithVersionPath.c_str(), "r");
-      if (!f) {
-        // [requestId]\n
-        // NOTFOUND\n
-        string msg = requestId + "\nNOTFOUND\n";
-        send(client_fd, msg.c_str(), msg.size(), 0);
-      } else {
-        // [requestId]\n
-        // OK\n
-        // [content]
-        string msg = requestId + "\nOK\n";
-        send(client_fd, msg.c_str(), msg.size(), 0);
-        sendFileContent(f, client_fd);
-        fclose(f);
-      }
-      
-      close(client_fd);
+      getRequest* req = new getRequest();
+      req->client = client_fd;
+      req->requestId = requestId;
+      req->versions = fullRequest[3] == '-';
+      const char* body = fullRequest + (req->versions ? 13 : 4);
+      req->request = string(body, buffer + ret - body);
+
+      pthread_t tid;
+      pthread_create(&tid, NULL, getHandler, req);
+      pthread_detach(tid);
     }
 
     // PEEK\n
@@ -322,55 +687,75 @@ void* sdfsCommandHandler(void*) {
       // [requestId]\n
       // OK\n
       // [latest-version-number]
-      string msg = requestId + "\nOK\n" + to_string(latestVersion(filename));
+      // deleted versions count, so a new master never numbers a PUT as one of them
+      pthread_mutex_lock(&versions_lock);
+      string msg = requestId + "\nOK\n" + to_string(std::max(latestVersion(filename), deletedThrough(filename)));
+      pthread_mutex_unlock(&versions_lock);
       send(client_fd, msg.c_str(), msg.size(), 0);
       close(client_fd);
     }
 
     // PUT\n
-    // filename\n
-    // [content]
+    // [filename]\n
+    // [version]\n
+    // [rest of the chain, comma separated]\n
+    // [block list, then the blocks asked for]
     else if (strncmp(fullRequest, "PUT\n", 4) == 0) {
-      char* newline = strchr(fullRequest + 4, '\n');
-      *newline = '\0';
-      string filename = string(fullRequest + 4);
-
-      int version = latestVersion(filename);
-      if (version == 0)
-        version = 1;
-      else
-        version++;
-
-      string fileWithVersionPath = makeFileVersionPath(filename, version);
-
-      localFileVersions[filename].insert(version);
-
-      FILE* f = fopen(fileWithVersionPath.c_str(), "w+");
-      write(fileno(f), newline + 1, ret - (newline + 1 - buffer));
-      while ((ret = recv(client_fd, buffer, BUFFER_SIZE, 0)) > 0) {
-        write(fileno(f), buffer, ret);
+      char* filenameEnd = strchr(fullRequest + 4, '\n');
+      char* versionEnd = filenameEnd == NULL ? NULL : strchr(filenameEnd + 1, '\n');
+      char* chainEnd = versionEnd == NULL ? NULL : strchr(versionEnd + 1, '\n');
+      if (chainEnd == NULL) {
+        close(client_fd);
+        continue;
       }
-      shutdown(client_fd, SHUT_RD);
-
-      // [requestId]\n
-      // OK\n
-      string msg = requestId + "\nOK\n";
-      send(client_fd, msg.c_str(), msg.size(), 0);
-      close(client_fd);
-
-      fclose(f);
+      putChainRequest* req = new putChainRequest();
+      req->upstream = client_fd;
+      req->requestId = requestId;
+      req->filename = string(fullRequest + 4, filenameEnd);
+      req->version = atoi(filenameEnd + 1);
+      std::istringstream chain(string(versionEnd + 1, chainEnd));
+      for (string hop; getline(chain, hop, ',');)
+        req->chain.push_back(hop);
+      req->head = string(chainEnd + 1, ret - (chainEnd + 1 - buffer));
+
+      // the transfer takes as long as the slowest replica after us, keep accepting meanwhile
+      pthread_t tid;
+      pthread_create(&tid, NULL, putChainHandler, req);
+      pthread_detach(tid);
     }
 
     // DELETE\n
-    // [filename]
+    // [filename]\n
+    // [highest version to delete]
     else if (strncmp(fullRequest, "DELETE\n", 7) == 0) {
-      string filename = string(fullRequest + 7);
-
-      for (int version : localFileVersions[filename]) {
-        string fileWithVersionPath = makeFileVersionPath(filename, version);
-        unlink(fileWithVersionPath.c_str());
+      char* newline = strchr(fullRequest + 7, '\n');
+      string filename = newline == NULL ? string(fullRequest + 7) : string(fullRequest + 7, newline);
+      int through = newline == NULL ? INT_MAX : atoi(newline + 1);
+
+      // versions up to `through` of the file and every chunk of it stored here,
+      // `filename#1`, `filename#2`, ...; a newer PUT placed after the DELETE stays
+      pthread_mutex_lock(&versions_lock);
+      if (through != INT_MAX)
+        deletedVersions[filename] = std::max(deletedVersions[filename], through);
+      string chunkPrefix = filename + "#";
+      for (auto it = localFileVersions.begin(); it != localFileVersions.end();) {
+        if (it->first != filename && it->first.compare(0, chunkPrefix.size(), chunkPrefix) != 0) {
+          ++it;
+          continue;
+        }
+        // a block goes with the last version that uses it
+        set<int>& versions = it->second;
+        for (auto v = versions.begin(); v != versions.end() && *v <= through;) {
+          string fileWithVersionPath = makeFileVersionPath(it->first, *v);
+          vector<blockRef> blocks;
+          if (readManifest(fileWithVersionPath, blocks))
+            unpinBlocks(blocks);
+          unlink(fileWithVersionPath.c_str());
+          v = versions.erase(v);
+        }
+        it = versions.empty() ? localFileVersions.erase(it) : std::next(it);
       }
-      localFileVersions.erase(filename);
+      pthread_mutex_unlock(&versions_lock);
 
       // [requestId]\n
       // OK\n
@@ -379,47 +764,6 @@ void* sdfsCommandHandler(void*) {
       close(client_fd);
     }
 
-    // GET-VERSIONS\n
-    // [filename]\n
-    // [num-versions]
-    else if (strncmp(fullRequest, "GET-VERSIONS\n", 13) == 0) {
-      shutdown(client_fd, SHUT_RD);
-
-      char* newline = strchr(fullRequest + 13, '\n');
-      *newline = '\0';
-      string filename = string(fullRequest + 13);
-      int numVersions = atoi(newline + 1);
-
-      if (localFileVersions.find(filename) == localFileVersions.end()) {
-        // [requestId]\n
-        // OK\n
-        // FILE NOT FOUND
-        string msg = requestId + "\nOK\n" + "FILE NOT FOUND";
-        send(client_fd, msg.c_str(), msg.size(), 0);
-      } else {
-        // [requestId]\n
-        // OK\n
-        // [content]
-        string msg = requestId + "\nOK\n";
-        send(client_fd, msg.c_str(), msg.size(), 0);
-
-        auto versionIter = --localFileVersions[filename].end();
-        for (int i = 1; i <= std::min(numVersions, (int)localFileVersions[filename].size()); ++i) {
-          char versionDelimiters[128] = {0};
-          sprintf(versionDelimiters, "----------------------------\n-----%dst Latest Version-----\n----------------------------\n\n", i);
-          send(client_fd, versionDelimiters, strlen(versionDelimiters), 0);
-
-          string fileWithVersionPath = makeFileVersionPath(filename, *versionIter);
-          FILE* f = fopen(fileWithVersionPath.c_str(), "r");
-          sendFileContent(f, client_fd);
-          fclose(f);
-          --versionIter;
-        }
-      }
-
-      close(client_fd);
-    }
-
     else {
       cout << "Invalid command from master" << endl;
     }
@@ -455,12 +799,14 @@ void* sdfsReplicaMapUpdateHandler(void*) {
     pos = request.find("\n");
     string ipAddress = request.substr(0, pos);
 
+    pthread_mutex_lock(&replica_lock);
     if (action == "PUT") {
       replica_map[filename].insert(ipAddress);
     } else if (action == "DELETE") {
       // assume nothing goes wrong
       replica_map[filename].erase(ipAddress);
     }
+    pthread_mutex_unlock(&replica_lock);
     
     close(client_fd);
   }
@@ -0,0 +1,353 @@
+/*
+** transfer.cpp -- move file content between files and sockets without user space copies
+**
+** File to socket goes through sendfile(), socket to file through splice() into a
+** pipe and from the pipe into the file; a PUT relay additionally tee()s the pipe
+** into a second one that is spliced to the next replica, so a chain hop never
+** copies the data into user space. Where the kernel refuses (EINVAL/ENOSYS, e.g.
+** a file system without splice support) the same loops run over a large buffer.
+** Every write loops until all of it is out, so a partial write is never lost.
+**
+** sendfile() and splice() have no MSG_NOSIGNAL: a process using this must ignore
+** SIGPIPE, or a replica dying mid-transfer kills it.
+**
+** The sending end of a PUT chain (header, block offer, ack) is here as well, so a
+** client can write to replicas without the rest of the node.
+*/
+
+#include "node.h"
+
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#define TRANSFER_BUFFER (256 * 1024)  // bytes per syscall on the buffered path and per splice
+
+static bool unsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+// write all `len` bytes of `buf` to `filefd` at `offset`
+static bool pwriteAll(int filefd, const char* buf, size_t len, off_t offset) {
+  while (len > 0) {
+    ssize_t ret = pwrite(filefd, buf, len, offset);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    buf += ret;
+    len -= ret;
+    offset += ret;
+  }
+  return true;
+}
+
+static long sendFileRangeBuffered(int sockfd, int filefd, off_t offset, long len) {
+  vector<char> buf(TRANSFER_BUFFER);
+  long sent = 0;
+  while (len < 0 || sent < len) {
+    size_t want = len < 0 ? TRANSFER_BUFFER : std::min((long) TRANSFER_BUFFER, len - sent);
+    ssize_t ret = pread(filefd, buf.data(), want, offset + sent);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0 || !sendAll(sockfd, buf.data(), ret))
+      break;
+    sent += ret;
+  }
+  return sent;
+}
+
+long sendFileRange(int sockfd, int filefd, off_t offset, long len) {
+#ifdef __linux__
+  long sent = 0;
+  while (len < 0 || sent < len) {
+    off_t from = offset + sent;
+    size_t want = len < 0 ? TRANSFER_BUFFER * 16 : len - sent;
+    ssize_t ret = sendfile(sockfd, filefd, &from, want);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && sent == 0 && unsupported(errno))
+      return sendFileRangeBuffered(sockfd, filefd, offset, len);
+    if (ret <= 0)
+      break;    // end of file, or the peer is gone
+    sent += ret;
+  }
+  return sent;
+#else
+  return sendFileRangeBuffered(sockfd, filefd, offset, len);
+#endif
+}
+
+static long receiveFileRangeBuffered(int sockfd, int filefd, off_t offset, long len, bool* complete) {
+  vector<char> buf(TRANSFER_BUFFER);
+  long received = 0;
+  *complete = false;
+  while (len < 0 || received < len) {
+    size_t want = len < 0 ? TRANSFER_BUFFER : std::min((long) TRANSFER_BUFFER, len - received);
+    ssize_t ret = recv(sockfd, buf.data(), want, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret == 0)
+      *complete = len < 0;
+    if (ret <= 0 || !pwriteAll(filefd, buf.data(), ret, offset + received))
+      return received;
+    received += ret;
+  }
+  *complete = true;
+  return received;
+}
+
+#ifdef __linux__
+// move `len` bytes waiting in the pipe `from` into `tofd`, at `*offset` if given; return
+// how many moved, all of them unless `tofd` failed
+static size_t spliceAll(int from, int tofd, loff_t* offset, size_t len) {
+  size_t moved = 0;
+  while (moved < len) {
+    ssize_t ret = splice(from, NULL, tofd, offset, len - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      break;
+    moved += ret;
+  }
+  return moved;
+}
+
+// throw away `len` bytes waiting in the pipe `from`
+static bool drainPipe(int from, size_t len) {
+  char sink[4096];
+  while (len > 0) {
+    ssize_t ret = read(from, sink, std::min(len, sizeof(sink)));
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    len -= ret;
+  }
+  return true;
+}
+
+// a pipe that holds a whole TRANSFER_BUFFER, so one splice moves that much (the
+// default 64 KB would take four times the syscalls)
+static bool openPipe(int p[2]) {
+  if (pipe(p) != 0)
+    return false;
+  fcntl(p[1], F_SETPIPE_SZ, TRANSFER_BUFFER);
+  return true;
+}
+
+static void closePipe(int p[2]) {
+  if (p[0] != -1)
+    close(p[0]);
+  if (p[1] != -1)
+    close(p[1]);
+  p[0] = p[1] = -1;
+}
+#endif
+
+long receiveFileRange(int sockfd, int filefd, off_t offset, long len, bool* complete) {
+  bool ignored;
+  if (complete == NULL)
+    complete = &ignored;
+#ifdef __linux__
+  int p[2];
+  if (!openPipe(p))
+    return receiveFileRangeBuffered(sockfd, filefd, offset, len, complete);
+  long received = 0;
+  loff_t at = offset;
+  *complete = false;
+  while (len < 0 || received < len) {
+    size_t want = len < 0 ? TRANSFER_BUFFER : std::min((long) TRANSFER_BUFFER, len - received);
+    ssize_t ret = splice(sockfd, NULL, p[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && received == 0 && unsupported(errno)) {
+      closePipe(p);
+      return receiveFileRangeBuffered(sockfd, filefd, offset, len, complete);
+    }
+    if (ret == 0)
+      *complete = len < 0;
+    if (ret <= 0 || spliceAll(p[0], filefd, &at, ret) != (size_t) ret)
+      break;
+    received += ret;
+  }
+  if (len >= 0 && received == len)
+    *complete = true;
+  closePipe(p);
+  return received;
+#else
+  return receiveFileRangeBuffered(sockfd, filefd, offset, len, complete);
+#endif
+}
+
+// relay over a buffer, for when splice and tee are not available
+static bool relayFileContentBuffered(int upstream, int filefd, off_t offset, long len, int& downstream,
+                                     bool& written) {
+  vector<char> buf(TRANSFER_BUFFER);
+  long relayed = 0;
+  while (len < 0 || relayed < len) {
+    size_t want = len < 0 ? TRANSFER_BUFFER : std::min((long) TRANSFER_BUFFER, len - relayed);
+    ssize_t ret = recv(upstream, buf.data(), want, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return ret == 0 && len < 0;
+    if (written && !pwriteAll(filefd, buf.data(), ret, offset + relayed))
+      written = false;
+    relayed += ret;
+    if (downstream != -1 && !sendAll(downstream, buf.data(), ret)) {
+      close(downstream);
+      downstream = -1;
+    }
+  }
+  return true;
+}
+
+bool relayFileContent(int upstream, int filefd, off_t offset, long len, int& downstream, bool& written) {
+  written = filefd != -1;
+#ifdef __linux__
+  int toFile[2], toNext[2] = {-1, -1};
+  if (!openPipe(toFile) || (downstream != -1 && !openPipe(toNext))) {
+    closePipe(toFile);
+    return relayFileContentBuffered(upstream, filefd, offset, len, downstream, written);
+  }
+  long relayed = 0;
+  loff_t at = offset;
+  while (len < 0 || relayed < len) {
+    size_t want = len < 0 ? TRANSFER_BUFFER : std::min((long) TRANSFER_BUFFER, len - relayed);
+    ssize_t ret = splice(upstream, NULL, toFile[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0 && relayed == 0 && unsupported(errno)) {
+      closePipe(toFile);
+      closePipe(toNext);
+      return relayFileContentBuffered(upstream, filefd, offset, len, downstream, written);
+    }
+    if (ret <= 0) {
+      closePipe(toFile);
+      closePipe(toNext);
+      return ret == 0 && len < 0;
+    }
+    relayed += ret;
+
+    // tee only duplicates what fits in the other pipe, so forward and store in steps
+    size_t left = ret;
+    while (left > 0) {
+      size_t step = left;
+      if (downstream != -1) {
+        ssize_t dup = tee(toFile[0], toNext[1], left, 0);
+        if (dup <= 0 || spliceAll(toNext[0], downstream, NULL, dup) != (size_t) dup) {
+          // the next replica is gone, keep storing without it
+          close(downstream);
+          downstream = -1;
+          closePipe(toNext);
+        } else {
+          step = dup;
+        }
+      }
+      // once the file cannot be written the chain still gets everything
+      size_t stored = written ? spliceAll(toFile[0], filefd, &at, step) : 0;
+      written = written && stored == step;
+      if (!written && !drainPipe(toFile[0], step - stored)) {
+        closePipe(toFile);
+        closePipe(toNext);
+        return false;
+      }
+      left -= step;
+    }
+  }
+  closePipe(toFile);
+  closePipe(toNext);
+  return true;
+#else
+  return relayFileContentBuffered(upstream, filefd, offset, len, downstream, written);
+#endif
+}
+
+// TCP send all content in file to destfd
+// caller should take care of closing file and shutdown write to destfd
+bool sendFileContent(FILE* file, int destfd) {
+  fflush(file);
+  off_t offset = ftell(file);
+  struct stat st;
+  if (offset < 0 || fstat(fileno(file), &st) != 0)
+    return false;
+  long sent = sendFileRange(destfd, fileno(file), offset, st.st_size - offset);
+  fseek(file, offset + sent, SEEK_SET);
+  return sent == st.st_size - offset;
+}
+
+// TCP receive all content from destfd to file
+// caller should take care of closing file and shutdown read to destfd
+long receiveFileContent(FILE* file, int destfd) {
+  fflush(file);
+  off_t offset = ftell(file);
+  if (offset < 0)
+    return 0;
+  long received = receiveFileRange(destfd, fileno(file), offset, -1, NULL);
+  fseek(file, offset + received, SEEK_SET);
+  return received;
+}
+
+// PUT header for the first reachable replica of `chain`, which forwards to the rest
+int openPutChain(const string& requestId, const string& filename, int version, const vector<string>& chain) {
+  for (size_t i = 0; i < chain.size(); ++i) {
+    int fd = TCP_connect(chain[i].c_str(), std::stoi(SDFS_NODE_PORT));
+    if (fd == -1)
+      continue;
+
+    // [requestId]\n
+    // PUT\n
+    // [filename]\n
+    // [version]\n
+    // [rest of the chain, comma separated]\n
+    // then the block list and blocks, see offerBlocks
+    string rest;
+    for (size_t j = i + 1; j < chain.size(); ++j)
+      rest += (rest.empty() ? "" : ",") + chain[j];
+    string header = requestId + "\nPUT\n" + filename + "\n" + to_string(version) + "\n" + rest + "\n";
+    if (sendAll(fd, header.c_str(), header.size()))
+      return fd;
+    close(fd);
+  }
+  return -1;
+}
+
+bool offerBlocks(int fd, const vector<blockRef>& blocks, set<string>& wanted) {
+  // [number of blocks]\n
+  // [hash] [size]\n  per block of the version, in order
+  string msg = to_string(blocks.size()) + "\n";
+  for (const blockRef& b : blocks)
+    msg += b.hash + " " + to_string(b.size) + "\n";
+  if (!sendAll(fd, msg.c_str(), msg.size()))
+    return false;
+
+  // [requestId]\n
+  // WANT\n
+  // [number of blocks]\n
+  // [hash]\n  per block some replica in the chain does not have
+  lineReader in = {fd, ""};
+  string line;
+  if (!readLine(in, line) || !readLine(in, line) || line != "WANT" || !readLine(in, line))
+    return false;
+  for (long count = atol(line.c_str()); count > 0; --count) {
+    if (!readLine(in, line))
+      return false;
+    wanted.insert(line);
+  }
+  return true;
+}
+
+int waitPutChainAck(int fd) {
+  // [requestId]\n
+  // OK\n
+  // [replicas that stored the file]\n
+  char buffer[1024] = {0};
+  size_t len = 0;
+  ssize_t ret;
+  while (len < sizeof(buffer) - 1 && (ret = recv(fd, buffer + len, sizeof(buffer) - 1 - len, 0)) > 0)
+    len += ret;
+  char* ok = strstr(buffer, "\nOK\n");
+  return ok == NULL ? 0 : atoi(ok + 4);
+}
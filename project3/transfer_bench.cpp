@@ -0,0 +1,199 @@
+/*
+** transfer_bench.cpp -- file streaming throughput, old loops against transfer.cpp
+**
+** Moves a SIZE MB file over a loopback TCP connection three ways and reports MB/s
+** and the CPU time of the thread doing the transfer:
+**   send     file to socket, as a replica serves a GET
+**   receive  socket to file, as a client stores a GET
+**   relay    socket to file and on to the next socket, as a replica in a PUT chain
+** "old" is the code these replaced (1024 byte fread/send and recv/fwrite loops,
+** and a 64 KB recv/fwrite/send relay), "new" is sendfile/splice/tee.
+*/
+
+#include "node.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+
+#define BENCH_FILE "transfer_bench.tmp"
+#define BENCH_COPY "transfer_bench.out"
+
+static long bench_size;
+
+double now_s() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double thread_cpu_s() {
+  struct rusage ru;
+  getrusage(RUSAGE_THREAD, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// a connected loopback TCP pair
+void tcp_pair(int fds[2]) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(addr);
+  if (bind(listener, (sockaddr*) &addr, len) != 0 || listen(listener, 1) != 0 ||
+      getsockname(listener, (sockaddr*) &addr, &len) != 0)
+    error("cannot listen on loopback");
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fds[0], (sockaddr*) &addr, len) != 0)
+    error("cannot connect on loopback");
+  fds[1] = accept(listener, NULL, NULL);
+  close(listener);
+}
+
+// read and drop everything until the peer shuts down
+void* sink_loop(void* arg) {
+  int fd = (int) (long) arg;
+  vector<char> buf(1 << 20);
+  while (recv(fd, buf.data(), buf.size(), 0) > 0) {
+  }
+  close(fd);
+  return NULL;
+}
+
+// send bench_size bytes from memory, then shut down
+void* source_loop(void* arg) {
+  int fd = (int) (long) arg;
+  vector<char> buf(1 << 20, 'x');
+  for (long left = bench_size; left > 0; left -= buf.size())
+    sendAll(fd, buf.data(), std::min(left, (long) buf.size()));
+  shutdown(fd, SHUT_WR);
+  close(fd);
+  return NULL;
+}
+
+// the loops transfer.cpp replaced
+void old_send(FILE* file, int destfd) {
+  char buf[1024];
+  int ret;
+  while ((ret = fread(buf, 1, 1024, file)) > 0) {
+    send(destfd, buf, ret, 0);
+  }
+}
+
+void old_receive(FILE* file, int destfd) {
+  char buf[1024];
+  int ret;
+  while ((ret = recv(destfd, buf, 1024, 0)) > 0) {
+    fwrite(buf, 1, ret, file);
+  }
+}
+
+void old_relay(int upstream, FILE* file, int downstream) {
+  vector<char> chunk(PIPELINE_CHUNK);
+  ssize_t ret;
+  while ((ret = recv(upstream, chunk.data(), PIPELINE_CHUNK, 0)) > 0) {
+    fwrite(chunk.data(), 1, ret, file);
+    sendAll(downstream, chunk.data(), ret);
+  }
+}
+
+enum bench_kind { SEND, RECEIVE, RELAY };
+
+// one run, return seconds and the transferring thread's CPU seconds
+void run(bench_kind kind, bool use_new, double& seconds, double& cpu) {
+  int in[2], out[2];
+  pthread_t peer, sink;
+  tcp_pair(out);
+  if (kind == SEND) {
+    pthread_create(&peer, NULL, sink_loop, (void*) (long) out[1]);
+  } else {
+    tcp_pair(in);
+    pthread_create(&peer, NULL, source_loop, (void*) (long) in[0]);
+    if (kind == RELAY)
+      pthread_create(&sink, NULL, sink_loop, (void*) (long) out[1]);
+    else
+      close(out[1]);
+  }
+
+  double start = now_s(), start_cpu = thread_cpu_s();
+  if (kind == SEND) {
+    FILE* f = fopen(BENCH_FILE, "r");
+    if (use_new)
+      sendFileContent(f, out[0]);
+    else
+      old_send(f, out[0]);
+    fclose(f);
+    shutdown(out[0], SHUT_WR);
+  } else if (kind == RECEIVE) {
+    FILE* f = fopen(BENCH_COPY, "w");
+    if (use_new)
+      receiveFileContent(f, in[1]);
+    else
+      old_receive(f, in[1]);
+    fclose(f);
+  } else {
+    if (use_new) {
+      int f = open(BENCH_COPY, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      bool written;
+      relayFileContent(in[1], f, 0, -1, out[0], written);
+      close(f);
+    } else {
+      FILE* f = fopen(BENCH_COPY, "w");
+      old_relay(in[1], f, out[0]);
+      fclose(f);
+    }
+    if (out[0] != -1)
+      shutdown(out[0], SHUT_WR);
+  }
+  seconds = now_s() - start;
+  cpu = thread_cpu_s() - start_cpu;
+
+  pthread_join(peer, NULL);
+  if (kind == RELAY)
+    pthread_join(sink, NULL);
+  if (kind != SEND)
+    close(in[1]);
+  if (out[0] != -1)
+    close(out[0]);
+}
+
+// ./transfer_bench [SIZE_MB] [ROUNDS]
+int main(int argc, char *argv[]) {
+  long mb = argc > 1 ? atol(argv[1]) : 256;
+  int rounds = argc > 2 ? atoi(argv[2]) : 3;
+  if (mb <= 0 || rounds <= 0) {
+    fprintf(stderr, "usage: ./transfer_bench [SIZE_MB] [ROUNDS]\n");
+    exit(1);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  bench_size = mb << 20;
+
+  FILE* f = fopen(BENCH_FILE, "w");
+  vector<char> buf(1 << 20);
+  for (size_t i = 0; i < buf.size(); ++i)
+    buf[i] = (char) (i * 2654435761u >> 13);
+  for (long i = 0; i < mb; ++i)
+    fwrite(buf.data(), 1, buf.size(), f);
+  fclose(f);
+
+  printf("%ld MB over loopback TCP, best of %d\n", mb, rounds);
+  printf("%-8s %-4s %10s %10s\n", "path", "impl", "MB/s", "CPU s");
+  const char* names[] = {"send", "receive", "relay"};
+  for (bench_kind kind : {SEND, RECEIVE, RELAY}) {
+    for (bool use_new : {false, true}) {
+      double best = 1e9, best_cpu = 0;
+      for (int r = 0; r < rounds; ++r) {
+        double seconds, cpu;
+        run(kind, use_new, seconds, cpu);
+        if (seconds < best) {
+          best = seconds;
+          best_cpu = cpu;
+        }
+      }
+      printf("%-8s %-4s %10.0f %10.3f\n", names[kind], use_new ? "new" : "old", mb / best, best_cpu);
+    }
+  }
+  unlink(BENCH_FILE);
+  unlink(BENCH_COPY);
+  return 0;
+}